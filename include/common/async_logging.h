@@ -0,0 +1,152 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_ASYNC_LOGGING_H_
+#define VTZ_COMMON_ASYNC_LOGGING_H_
+
+#include <stddef.h>
+#include "integral_type.h"
+#include "logging.h"
+
+namespace vtz {
+
+// What a producer does when its ring has no room for a record.
+enum AsyncFullPolicy {
+  // Wait for the writer thread to make room.
+  kAsyncBlock = 0,
+  // Discard the record and count it (see AsyncLoggingDroppedCount()).
+  kAsyncDrop = 1,
+  // Write the record synchronously on the calling thread.
+  kAsyncSyncFallback = 2,
+};
+
+struct AsyncLoggingOptions {
+  AsyncLoggingOptions()
+      : ring_bytes_per_thread(256 * 1024),
+        full_policy(kAsyncBlock),
+        idle_wait_micros(1000),
+        batch_bytes(64 * 1024),
+        batch_delay_micros(1000),
+        batch_flush_severity(ERROR) {}
+
+  // Capacity of each producer thread's ring. Rounded up to a power of two.
+  // Rings are allocated on a thread's first LOG and reused across
+  // StopAsyncLogging()/StartAsyncLogging(), so this only affects threads
+  // that have not logged yet.
+  size_t ring_bytes_per_thread;
+  AsyncFullPolicy full_policy;
+  // How long the writer sleeps when every ring is empty. Producers wake it
+  // early once their ring is half full.
+  int64 idle_wait_micros;
+
+  // The writer thread sends stderr output as batches of records, each with
+  // a single writev(). A batch is written once it holds batch_bytes, once
+  // its oldest record has waited batch_delay_micros, as soon as it gets a
+  // record at or above batch_flush_severity, and whenever the writer runs
+  // out of records or FlushLogs() is called. Records stay in their rings
+  // until written, so no copy is made. batch_bytes = 0 turns batching off.
+  size_t batch_bytes;
+  int64 batch_delay_micros;
+  int batch_flush_severity;
+};
+
+// Why the writer thread wrote out a batch.
+enum AsyncBatchFlushReason {
+  kBatchFlushSize = 0,      // reached batch_bytes or the iovec limit
+  kBatchFlushDeadline = 1,  // oldest record waited batch_delay_micros
+  kBatchFlushSeverity = 2,  // record at or above batch_flush_severity
+  kBatchFlushIdle = 3,      // no more records queued
+  kBatchFlushRequested = 4, // FlushLogs(), StopAsyncLogging() or LOG(FATAL)
+  kBatchFlushRingSpace = 5, // a ring needed its space back
+  kBatchFlushPayload = 6,   // a record with a Payload is written next
+  kNumBatchFlushReasons = 7,
+};
+
+struct AsyncBatchStats {
+  uint64 batches;
+  uint64 records;
+  uint64 bytes;
+  uint64 max_batch_records;
+  uint64 flushes_by_reason[kNumBatchFlushReasons];
+};
+
+// Moves the output of LOG() off the calling thread. Each producer thread
+// copies its finished record into a private single-producer ring and a
+// background writer thread drains all rings to the output. Records from one
+// thread keep their order; records from different threads are interleaved
+// in drain order. LOG(FATAL) always drains the rings and writes
+// synchronously before aborting.
+//
+// Records the writer thread logs itself, as a LogSink it calls may, are
+// written synchronously; FlushLogs() and StopAsyncLogging() return at once
+// on it.
+//
+// Returns false if async logging is already running.
+bool StartAsyncLogging(const AsyncLoggingOptions& options);
+
+// Drains every ring, stops and joins the writer thread. Subsequent records
+// are written synchronously. Records that are being appended concurrently
+// with this call may stay queued until the next StartAsyncLogging(), so
+// quiesce logging threads first if that matters.
+void StopAsyncLogging();
+
+// Blocks until every record queued before the call has been written.
+// Also writes the summaries log_coalescing.h is holding back. Otherwise a
+// no-op when async logging is not running.
+void FlushLogs();
+
+bool AsyncLoggingEnabled();
+
+// Number of records discarded under kAsyncDrop since process start.
+uint64 AsyncLoggingDroppedCount();
+
+// Batch counters since process start. Records per batch on average is
+// records / batches.
+AsyncBatchStats GetAsyncBatchStats();
+
+namespace internal {
+
+// What an async ring record carries.
+enum LogRecordKind {
+  kTextLogRecord = 0,    // a finished text line
+  kBinaryLogRecord = 1,  // a framed LOG_BIN entry (see binary_logging.h)
+  // A LogPayload, holding a reference to its owner, and then the finished
+  // text line it goes into.
+  kPayloadLogRecord = 2,
+};
+
+// Queues a finished record on the calling thread's ring. Returns true if the
+// record was consumed (queued, or dropped under kAsyncDrop); false means the
+// caller must write it synchronously.
+bool AsyncLogAppend(int severity, const char* data, size_t size);
+
+// AsyncLogAppend() for a record with "payload" to go in at payload.offset.
+// A payload with an owner is queued by reference and written from its own
+// memory by the writer thread; one without is copied into the ring.
+bool AsyncLogAppendPayload(int severity, const char* data, size_t size,
+                           const LogPayload& payload);
+
+// Lower-level form of AsyncLogAppend() for callers that serialize in place.
+// Returns "size" bytes of ring space for a record of the given
+// LogRecordKind, to be published with AsyncLogCommit() before the calling
+// thread reserves again. Returns nullptr when the caller must write the
+// record synchronously, or when it was dropped (then *dropped is true).
+char* AsyncLogReserve(int kind, int severity, size_t size, bool* dropped);
+void AsyncLogCommit();
+
+}  // namespace internal
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_ASYNC_LOGGING_H_
@@ -0,0 +1,266 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_BINARY_LOGGING_H_
+#define VTZ_COMMON_BINARY_LOGGING_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <type_traits>
+#include "async_logging.h"
+#include "integral_type.h"
+#include "logf.h"
+#include "logging.h"
+#include "macros.h"
+
+// Deferred-formatting log statements:
+//
+//   LOG_BIN(INFO, "user {} took {} us", user_id, micros);
+//
+// The format string and argument types are registered once per call site.
+// Each call then writes only the site id, a timestamp and the raw argument
+// bytes to the binary log opened with OpenBinaryLog(). Text is produced
+// offline by vtz_logdecode. "{}" is replaced by the next argument; "{{" and
+// "}}" are literal braces. The format must be a string literal.
+//
+// Supported arguments are integers, bool, char, floating point, pointers,
+// C strings and std::string. With StartAsyncLogging() running, entries are
+// serialized straight into the calling thread's ring; otherwise each call
+// does a buffered fwrite().
+//
+// On-disk format, host byte order:
+//   file   := "VTZBLOG" '\1' record*
+//   record := kind:u8 length:u32 payload[length]
+//   kind 'S' (call site) payload := id:u32 severity:u8 line:u32
+//       file_len:u16 file fmt_len:u16 fmt nargs:u8 type[nargs]
+//   kind 'L' (log entry) payload := id:u32 nanos_since_epoch:u64 arg*
+//   arg by type: 'i' int64, 'u' uint64, 'b' u8, 'c' char, 'f' float,
+//       'd' double, 'p' uint64, 's' len:u32 bytes[len]
+//
+// LOG_BIN(FATAL, ...) is LOGF(FATAL, ...): it writes a text record, never
+// filtered, and aborts, as LOG(FATAL) does. LOGF takes the same "{}"
+// formats and argument types.
+#define LOG_BIN(severity, ...) _VTZ_LOG_BIN_##severity(__VA_ARGS__)
+
+#define _VTZ_LOG_BIN_SEVERITY(severity, ...)                             \
+  do {                                                                   \
+    if (::vtz::internal::LogSeverityIsOn(::vtz::severity) &&             \
+        ::vtz::internal::BinaryLogIsOpen()) {                            \
+      static ::vtz::internal::BinaryLogSite _vtz_bin_site;               \
+      ::vtz::internal::BinaryLog(&_vtz_bin_site, __FILE__, __LINE__,     \
+                                 ::vtz::severity, __VA_ARGS__);          \
+    }                                                                    \
+  } while (0)
+
+#define _VTZ_LOG_BIN_INFO(...) _VTZ_LOG_BIN_SEVERITY(INFO, __VA_ARGS__)
+#define _VTZ_LOG_BIN_WARNING(...) _VTZ_LOG_BIN_SEVERITY(WARNING, __VA_ARGS__)
+#define _VTZ_LOG_BIN_ERROR(...) _VTZ_LOG_BIN_SEVERITY(ERROR, __VA_ARGS__)
+#define _VTZ_LOG_BIN_FATAL(...) LOGF(FATAL, __VA_ARGS__)
+
+namespace vtz {
+
+// Starts writing LOG_BIN entries to "path", truncating it. Returns false if
+// the file cannot be opened or a binary log is already open.
+bool OpenBinaryLog(const char* path);
+
+// Writes out queued entries and closes the binary log.
+void CloseBinaryLog();
+
+namespace internal {
+
+const char kBinaryLogMagic[8] = {'V', 'T', 'Z', 'B', 'L', 'O', 'G', '\1'};
+const char kBinaryLogSiteKind = 'S';
+const char kBinaryLogEntryKind = 'L';
+// kind + length + id + timestamp
+const size_t kBinaryLogEntryHeaderBytes = 1 + 4 + 4 + 8;
+
+extern std::atomic<bool> binary_log_open;
+
+inline bool BinaryLogIsOpen() {
+  return binary_log_open.load(std::memory_order_relaxed);
+}
+
+// Per-call-site state. Static storage, so it is zero-initialized without a
+// guard; id 0 means "not registered yet".
+struct BinaryLogSite {
+  std::atomic<uint32> id;
+};
+
+// Registers a call site and writes its definition to the binary log.
+// Returns the site id. Safe to race on the same site.
+uint32 RegisterBinaryLogSite(BinaryLogSite* site, const char* file, int line,
+                             int severity, const char* fmt,
+                             const char* types, int nargs);
+
+// Writes a framed entry when async logging is not running.
+void WriteBinaryLogEntrySync(const char* data, size_t size);
+
+template <typename T, typename Enable = void>
+struct BinaryArg;  // unsupported argument type
+
+template <typename T>
+inline char* PutRaw(char* p, const T& v) {
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+template <typename T>
+struct BinaryArg<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               !std::is_same<T, bool>::value &&
+                               !std::is_same<T, char>::value>::type> {
+  static const char kType = std::is_signed<T>::value ? 'i' : 'u';
+  static size_t Size(T) { return 8; }
+  static char* Encode(char* p, T v) {
+    return std::is_signed<T>::value ? PutRaw(p, static_cast<int64>(v))
+                                    : PutRaw(p, static_cast<uint64>(v));
+  }
+};
+
+template <>
+struct BinaryArg<bool> {
+  static const char kType = 'b';
+  static size_t Size(bool) { return 1; }
+  static char* Encode(char* p, bool v) { return PutRaw(p, uint8(v ? 1 : 0)); }
+};
+
+template <>
+struct BinaryArg<char> {
+  static const char kType = 'c';
+  static size_t Size(char) { return 1; }
+  static char* Encode(char* p, char v) { return PutRaw(p, v); }
+};
+
+// Kept as a float so that vtz_logdecode prints it the way LOG() would.
+template <>
+struct BinaryArg<float> {
+  static const char kType = 'f';
+  static size_t Size(float) { return 4; }
+  static char* Encode(char* p, float v) { return PutRaw(p, v); }
+};
+
+template <typename T>
+struct BinaryArg<
+    T, typename std::enable_if<std::is_floating_point<T>::value &&
+                               !std::is_same<T, float>::value>::type> {
+  static const char kType = 'd';
+  static size_t Size(T) { return 8; }
+  static char* Encode(char* p, T v) {
+    return PutRaw(p, static_cast<double>(v));
+  }
+};
+
+struct BinaryStringArg {
+  static const char kType = 's';
+  static size_t Size(const char* v) {
+    return 4 + (v == nullptr ? 6 : strlen(v));
+  }
+  static size_t Size(const std::string& v) { return 4 + v.size(); }
+  static char* Encode(char* p, const char* v) {
+    if (v == nullptr) v = "(null)";
+    return EncodeBytes(p, v, strlen(v));
+  }
+  static char* Encode(char* p, const std::string& v) {
+    return EncodeBytes(p, v.data(), v.size());
+  }
+  static char* EncodeBytes(char* p, const char* v, size_t n) {
+    p = PutRaw(p, static_cast<uint32>(n));
+    memcpy(p, v, n);
+    return p + n;
+  }
+};
+
+template <>
+struct BinaryArg<const char*> : BinaryStringArg {};
+template <>
+struct BinaryArg<char*> : BinaryStringArg {};
+template <>
+struct BinaryArg<std::string> : BinaryStringArg {};
+
+template <typename T>
+struct BinaryArg<T*, typename std::enable_if<
+                         !std::is_same<typename std::remove_cv<T>::type,
+                                       char>::value>::type> {
+  static const char kType = 'p';
+  static size_t Size(const T*) { return 8; }
+  static char* Encode(char* p, const T* v) {
+    return PutRaw(p, static_cast<uint64>(reinterpret_cast<uintptr_t>(v)));
+  }
+};
+
+template <typename T>
+struct BinaryArgFor : BinaryArg<typename std::decay<T>::type> {};
+
+inline size_t BinaryArgsSize() { return 0; }
+
+template <typename T, typename... Rest>
+inline size_t BinaryArgsSize(const T& v, const Rest&... rest) {
+  return BinaryArgFor<T>::Size(v) + BinaryArgsSize(rest...);
+}
+
+inline char* EncodeBinaryArgs(char* p) { return p; }
+
+template <typename T, typename... Rest>
+inline char* EncodeBinaryArgs(char* p, const T& v, const Rest&... rest) {
+  return EncodeBinaryArgs(BinaryArgFor<T>::Encode(p, v), rest...);
+}
+
+inline uint64 BinaryLogNowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<uint64>(ts.tv_sec) * 1000000000ull +
+         static_cast<uint64>(ts.tv_nsec);
+}
+
+inline char* EncodeBinaryEntryHeader(char* p, size_t size, uint32 id) {
+  *p++ = kBinaryLogEntryKind;
+  p = PutRaw(p, static_cast<uint32>(size - 5));
+  p = PutRaw(p, id);
+  return PutRaw(p, BinaryLogNowNanos());
+}
+
+template <typename... Args>
+void BinaryLog(BinaryLogSite* site, const char* file, int line, int severity,
+               const char* fmt, const Args&... args) {
+  uint32 id = site->id.load(std::memory_order_acquire);
+  if (VTZ_PREDICT_FALSE(id == 0)) {
+    static const char kTypes[] = {BinaryArgFor<Args>::kType..., '\0'};
+    id = RegisterBinaryLogSite(site, file, line, severity, fmt, kTypes,
+                               static_cast<int>(sizeof...(Args)));
+  }
+  const size_t size = kBinaryLogEntryHeaderBytes + BinaryArgsSize(args...);
+  bool dropped;
+  char* p = AsyncLogReserve(kBinaryLogRecord, severity, size, &dropped);
+  if (VTZ_PREDICT_TRUE(p != nullptr)) {
+    EncodeBinaryArgs(EncodeBinaryEntryHeader(p, size, id), args...);
+    AsyncLogCommit();
+    return;
+  }
+  if (dropped) return;
+  char stack_buf[512];
+  std::string heap_buf;
+  if (size > sizeof(stack_buf)) heap_buf.resize(size);
+  char* buf = size > sizeof(stack_buf) ? &heap_buf[0] : stack_buf;
+  EncodeBinaryArgs(EncodeBinaryEntryHeader(buf, size, id), args...);
+  WriteBinaryLogEntrySync(buf, size);
+}
+
+}  // namespace internal
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_BINARY_LOGGING_H_
@@ -0,0 +1,123 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_COMPRESSED_LOG_SINK_H_
+#define VTZ_COMMON_COMPRESSED_LOG_SINK_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "integral_type.h"
+#include "log_sink.h"
+#include "macros.h"
+
+namespace vtz {
+
+enum LogCompression {
+  // Built in; LZ4's block format.
+  kLogCompressionLz4 = 1,
+  // Smaller and slower; only if zstd was found when the library was built.
+  kLogCompressionZstd = 2,
+};
+
+// Whether kLogCompressionZstd is available.
+bool ZstdLogCompressionAvailable();
+
+struct CompressedLogSinkOptions {
+  CompressedLogSinkOptions()
+      : compression(kLogCompressionLz4),
+        zstd_level(3),
+        block_bytes(256 * 1024),
+        max_pending_blocks(4),
+        flush_interval_millis(1000) {}
+
+  // Appended to; created if missing.
+  std::string path;
+  // Falls back to LZ4 when zstd is not available.
+  LogCompression compression;
+  int zstd_level;
+  // Text collected into each block. Larger blocks compress better, and a
+  // crash loses at most the block being filled.
+  size_t block_bytes;
+  // Full blocks waiting for the background thread. When they are all
+  // taken, Send() waits.
+  int max_pending_blocks;
+  // A partly filled block is written after this long.
+  int64 flush_interval_millis;
+};
+
+// LogSink that writes records compressed, in blocks that decode on their
+// own and carry checksums, so a file cut off anywhere is readable up to its
+// last complete block; vtz_logcat prints such files. Send() only copies
+// the record into the block being filled; a background thread compresses
+// full blocks and writes them.
+//
+// To write only the compressed log:
+//
+//   vtz::CompressedLogSinkOptions options;
+//   options.path = "/var/log/server.log.vtz";
+//   vtz::CompressedLogSink* sink = vtz::CompressedLogSink::Create(options);
+//   vtz::AddLogSink(sink);
+//   vtz::SetStderrLogSeverity(vtz::NUM_SEVERITIES);
+class CompressedLogSink : public LogSink {
+ public:
+  // Returns nullptr if the file cannot be opened.
+  static CompressedLogSink* Create(const CompressedLogSinkOptions& options);
+
+  // Writes what is buffered. Remove the sink with RemoveLogSink() first.
+  ~CompressedLogSink() override;
+
+  void Send(int severity, const char* data, size_t size) override;
+
+  // Seals the partial block and waits until everything sent so far is
+  // written.
+  void Flush() override;
+
+  // Record bytes received, and block bytes written for them.
+  uint64 raw_bytes();
+  uint64 compressed_bytes();
+
+ private:
+  CompressedLogSink(const CompressedLogSinkOptions& options, int fd);
+
+  // Queues the block being filled, if any, for the background thread.
+  void SealLocked();
+  void BackgroundLoop();
+
+  const CompressedLogSinkOptions options_;
+  const int fd_;
+
+  std::mutex mu_;
+  std::condition_variable work_cv_;    // background thread waits
+  std::condition_variable space_cv_;   // Send() and Flush() wait
+  std::string* filling_;               // guarded by mu_; may be nullptr
+  int64 filling_since_millis_;         // guarded by mu_
+  std::vector<std::string*> free_;     // guarded by mu_
+  std::vector<std::string*> pending_;  // guarded by mu_; oldest first
+  uint64 sealed_;                      // guarded by mu_
+  uint64 written_;                     // guarded by mu_
+  uint64 raw_bytes_;                   // guarded by mu_
+  uint64 compressed_bytes_;            // guarded by mu_
+  bool stop_;                          // guarded by mu_
+  std::thread background_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(CompressedLogSink);
+};
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_COMPRESSED_LOG_SINK_H_
@@ -0,0 +1,154 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_FILE_LOG_SINK_H_
+#define VTZ_COMMON_FILE_LOG_SINK_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "integral_type.h"
+#include "log_index.h"
+#include "log_sink.h"
+#include "logging.h"
+#include "macros.h"
+
+namespace vtz {
+
+// When RotatingFileSink calls fdatasync().
+enum FileSyncPolicy {
+  kFileSyncNever = 0,
+  // The thread logging a record at or above sync_min_severity syncs before
+  // returning, so the record is durable once LOG() completes.
+  kFileSyncInline = 1,
+  // Such a record only schedules a sync on the sink's background thread.
+  kFileSyncBackground = 2,
+};
+
+struct RotatingFileSinkOptions {
+  RotatingFileSinkOptions()
+      : segment_bytes(64 << 20),
+        rotate_interval_seconds(0),
+        sync_policy(kFileSyncInline),
+        sync_min_severity(ERROR),
+        write_index(false) {}
+
+  // Segments are named "<path>.<YYYYmmdd-HHMMSS>.<pid>.<seq>" and "<path>"
+  // is kept as a symlink to the newest one.
+  std::string path;
+  // Size every segment is preallocated to. Raised to at least
+  // 2 * LogStreamBuf::kMaxLogMessageBytes so any record fits a fresh one.
+  size_t segment_bytes;
+  // Also switch segments this often; 0 disables time-based rotation.
+  int64 rotate_interval_seconds;
+  FileSyncPolicy sync_policy;
+  int sync_min_severity;
+  // Also write "<segment>.idx", the side index vtz_logq and IndexedLogFile
+  // query with (see log_index.h). Entries are written by the background
+  // thread as chunks fill and when a segment is retired.
+  bool write_index;
+};
+
+// LogSink that appends through mmap()-ed, preallocated file segments.
+// Send() reserves space under a short lock and copies the record into the
+// mapping outside it, so producers never make a system call on the common
+// path. A background thread prepares the next segment ahead of time; the
+// switch itself only swaps a pointer. Should the live segment fill before
+// the next one is ready, the producer that finds it full opens one outside
+// the sink's lock. Records below sync_min_severity that other producers
+// send meanwhile are dropped and counted in dropped() rather than made to
+// wait; records at or above it, and FATAL ones, wait for the open. Retired
+// segments are unmapped, trimmed to their used length and closed on the
+// background thread once every copy into them has finished.
+//
+// The live segment has its full preallocated size on disk; its unused tail
+// reads as NUL bytes until it is retired. The same holds for the last
+// segment after a crash.
+class RotatingFileSink : public LogSink {
+ public:
+  // Returns nullptr if the first segment cannot be created.
+  static RotatingFileSink* Create(const RotatingFileSinkOptions& options);
+
+  // Retires the live segment. Remove the sink with RemoveLogSink() first.
+  ~RotatingFileSink() override;
+
+  void Send(int severity, const char* data, size_t size) override;
+
+  // Nothing to do: records are in the page cache, and visible to readers,
+  // as soon as Send() returns.
+  void Flush() override {}
+
+  // fdatasync()s the live segment regardless of the sync policy.
+  void Sync();
+
+  // Starts a new segment now. Opens one, outside the sink's lock, if the
+  // background thread has none ready.
+  void Rotate();
+
+  // Records dropped because the live segment was full and the next one was
+  // still being opened, or could not be. Records at or above
+  // sync_min_severity are only dropped in the second case.
+  uint64 dropped();
+
+  // Path of the segment currently being written.
+  std::string current_path();
+
+ private:
+  struct Segment;
+
+  explicit RotatingFileSink(const RotatingFileSinkOptions& options);
+
+  Segment* OpenSegment(uint64 sequence);
+  // Switches to the spare segment, or opens one with "l" released. If
+  // another producer is opening one already, waits for it and returns the
+  // live segment when "wait" is set. Otherwise, or if the segment cannot
+  // be created, returns nullptr with the record counted as dropped.
+  Segment* NextSegmentLocked(std::unique_lock<std::mutex>* l, bool wait);
+  // Makes "next" the live segment and queues the old one for retirement.
+  void SwitchToLocked(Segment* next);
+  // Pins the live segment against retirement; pair with Unpin().
+  Segment* PinCurrent();
+  void Unpin(Segment* segment);
+  void CloseSegment(Segment* segment, bool keep);
+  void BackgroundLoop();
+
+  const RotatingFileSinkOptions options_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  // Signalled when a producer has finished opening a segment.
+  std::condition_variable opened_cv_;
+  Segment* current_;                // guarded by mu_
+  Segment* spare_;                  // guarded by mu_
+  std::vector<Segment*> retired_;   // guarded by mu_
+  // Segments holding records to sync with kFileSyncBackground, each
+  // pinned once.
+  std::vector<Segment*> sync_requested_;  // guarded by mu_
+  bool stop_;                       // guarded by mu_
+  int64 next_rotation_;             // guarded by mu_; monotonic seconds
+  uint64 sequence_;                 // guarded by mu_
+  uint64 linked_sequence_;          // guarded by mu_; symlink target
+  bool opening_;                    // guarded by mu_
+  uint64 dropped_;                  // guarded by mu_
+  std::thread background_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(RotatingFileSink);
+};
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_FILE_LOG_SINK_H_
@@ -0,0 +1,66 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_FLIGHT_RECORDER_H_
+#define VTZ_COMMON_FLIGHT_RECORDER_H_
+
+#include <stddef.h>
+#include <unistd.h>
+#include "logging.h"
+
+namespace vtz {
+
+struct FlightRecorderOptions {
+  FlightRecorderOptions()
+      : bytes_per_thread(64 * 1024),
+        min_severity(INFO),
+        dump_fd(STDERR_FILENO),
+        dump_on_fatal_signals(false) {}
+
+  // Size of each thread's circular buffer. Threads that already recorded
+  // keep their buffer.
+  size_t bytes_per_thread;
+  // Records at or above this severity that VTZ_CPP_MIN_LOG_LEVEL filters
+  // out are kept in memory instead of being dropped.
+  int min_severity;
+  // Where automatic dumps go.
+  int dump_fd;
+  // Also dump on SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT, then let the
+  // signal take its default action.
+  bool dump_on_fatal_signals;
+};
+
+// Keeps the most recent filtered-out LOG records of every thread in a
+// per-thread circular buffer: the records are formatted but never written
+// anywhere, and the buffer is reused, so recording does no I/O and no
+// allocation after a thread's first record. When LOG(FATAL) or a CHECK
+// fires, the buffers are written to dump_fd, oldest record first, just
+// before the fatal message. The dump only uses write(2) and touches no
+// locks or heap, so it is async-signal-safe; records that other threads
+// are writing during the dump may come out torn.
+//
+// Returns false if the recorder is already enabled.
+bool EnableFlightRecorder(const FlightRecorderOptions& options);
+
+// Stops recording. Recorded data stays available to DumpFlightRecorder().
+void DisableFlightRecorder();
+
+// Writes every recorded record to "fd" in timestamp order. Recorded data
+// is kept, so a later dump repeats it. Async-signal-safe.
+void DumpFlightRecorder(int fd);
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_FLIGHT_RECORDER_H_
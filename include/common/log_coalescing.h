@@ -0,0 +1,67 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_LOG_COALESCING_H_
+#define VTZ_COMMON_LOG_COALESCING_H_
+
+#include <stddef.h>
+#include "integral_type.h"
+#include "logging.h"
+
+namespace vtz {
+
+struct LogCoalescingOptions {
+  LogCoalescingOptions()
+      : window_micros(1000000), table_slots(256), max_severity(ERROR) {}
+
+  // How long repeats of a written record are held back.
+  int64 window_micros;
+  // Distinct records tracked at once, rounded up to a power of two and at
+  // least 4. Each slot takes about 300 bytes. When the table is full the
+  // least recently seen record makes room, writing its summary first.
+  size_t table_slots;
+  // Records above this severity are never held back; FATAL never is.
+  int max_severity;
+};
+
+// Collapses bursts of a repeated record. Records are the same when they
+// share file, line, severity and message text; timestamps and LogFields
+// are not compared. The first occurrence is written as usual. Repeats
+// within window_micros of it are only counted, and once the window closes
+// a single summary record goes out at the same file:line and severity:
+// the message (cut to kCoalescedTextBytes) with the fields
+//
+//   repeated=41 first="2018-01-31 12:34:56.123456" last="..."
+//
+// for the held-back occurrences. A summary is written by the first record
+// any thread logs after its window closed, by FlushLogs() (and so before
+// LOG(FATAL) output) and by DisableLogCoalescing(); call one of the latter
+// before exiting to keep the last counts.
+//
+// The table has a fixed size and a lock per set of 4 slots; records that
+// are not repeats cost a hash of their text and one such lock.
+//
+// Returns false if coalescing is already enabled.
+bool EnableLogCoalescing(const LogCoalescingOptions& options);
+
+// Stops holding records back and writes every pending summary.
+void DisableLogCoalescing();
+
+// How much of a message a summary repeats.
+const size_t kCoalescedTextBytes = 200;
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_COALESCING_H_
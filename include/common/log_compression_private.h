@@ -0,0 +1,109 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Block codecs and framing behind CompressedLogSink, shared with
+// vtz_logcat. Not installed.
+//
+// A compressed log is a sequence of blocks, each a LogBlockHeader and its
+// payload, with no file header, so files can be appended to and
+// concatenated. Every block decodes on its own, and the checksums let a
+// reader stop at a torn last block or skip to the next intact one.
+
+#ifndef VTZ_COMMON_LOG_COMPRESSION_PRIVATE_H_
+#define VTZ_COMMON_LOG_COMPRESSION_PRIVATE_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "compressed_log_sink.h"
+#include "integral_type.h"
+#include "macros.h"
+
+namespace vtz {
+namespace internal {
+
+// "VTZB" in file order.
+const uint32 kLogBlockMagic = 0x425a5456;
+// Readers refuse larger blocks rather than allocate for them.
+const uint32 kMaxLogBlockBytes = 1u << 30;
+
+// LogBlockHeader::codec values.
+enum LogBlockCodec {
+  kLogBlockStored = 0,  // incompressible; the payload is the text
+  kLogBlockLz4 = 1,
+  kLogBlockZstd = 2,
+};
+
+// Little-endian on disk; the writer and vtz_logcat only run on
+// little-endian hosts.
+struct LogBlockHeader {
+  uint32 magic;
+  uint8 codec;
+  uint8 reserved[3];
+  uint32 raw_size;
+  uint32 payload_size;
+  uint32 payload_checksum;
+  // Over the fields above, so a reader that scans for the magic after
+  // damage does not take random bytes for a header.
+  uint32 header_checksum;
+};
+
+uint32 LogBlockChecksum(const char* data, size_t size);
+
+// Compresses blocks with scratch state kept between calls. Used by one
+// thread at a time.
+class LogBlockCompressor {
+ public:
+  // Falls back to LZ4 if zstd was not found at build time.
+  LogBlockCompressor(LogCompression compression, int zstd_level);
+  ~LogBlockCompressor();
+
+  // Replaces "out" with the framed block for "size" bytes at "data".
+  void Compress(const char* data, size_t size, std::string* out);
+
+ private:
+  const LogCompression compression_;
+  const int zstd_level_;
+  std::vector<uint32> lz4_table_;
+  void* zstd_context_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(LogBlockCompressor);
+};
+
+// Checks "header" and returns false if it is not a block header.
+bool ValidLogBlockHeader(const LogBlockHeader& header);
+
+// Decodes the payload of a block whose header passed ValidLogBlockHeader()
+// into "out". Returns false, with a reason in "error", if the payload is
+// damaged or the codec is not built in.
+bool DecodeLogBlock(const LogBlockHeader& header, const char* payload,
+                    std::string* out, std::string* error);
+
+// The raw LZ4 block format. Lz4Compress() returns the compressed size, or
+// 0 if it would exceed "capacity"; "table" holds kLz4TableSize entries.
+// Lz4Decompress() checks every length and offset against its buffers and
+// succeeds only if it produces exactly "raw_size" bytes.
+const size_t kLz4TableSize = 1 << 14;
+size_t Lz4Compress(const char* src, size_t size, char* dst, size_t capacity,
+                   uint32* table);
+bool Lz4Decompress(const char* src, size_t size, char* dst, size_t raw_size);
+
+// Worst-case Lz4Compress() output for "size" bytes.
+inline size_t Lz4CompressBound(size_t size) { return size + size / 255 + 16; }
+
+}  // namespace internal
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_COMPRESSION_PRIVATE_H_
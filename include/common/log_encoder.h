@@ -0,0 +1,75 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_LOG_ENCODER_H_
+#define VTZ_COMMON_LOG_ENCODER_H_
+
+#include <stddef.h>
+#include <streambuf>
+#include "integral_type.h"
+#include "logging.h"
+
+namespace vtz {
+
+// A LOG record in structured form, as handed to a LogEncoder.
+struct LogRecord {
+  int severity;
+  const char* file;  // __FILE__ of the LOG statement
+  int line;
+  int64 micros;  // per the log clock; see SetLogClock()
+  // The timestamp as the text format would print it.
+  const char* timestamp;
+  size_t timestamp_size;
+  // What was streamed into the LOG statement, without a trailing newline.
+  const char* message;
+  size_t message_size;
+  const LogFields* fields;  // never null
+};
+
+// Turns records into lines. An installed encoder replaces the default
+// "time S file:line] message" text format for every record: stderr, the
+// LogSinks, the async queue and the flight recorder all see its output.
+class LogEncoder {
+ public:
+  virtual ~LogEncoder() {}
+
+  // Appends "record" to "out" without a trailing newline. Called
+  // concurrently from any thread that logs. Must not LOG() itself.
+  virtual void Encode(const LogRecord& record, std::streambuf* out) = 0;
+};
+
+// One JSON object per line:
+//   {"ts":"...","level":"INFO","file":"a.cc","line":12,"msg":"done",
+//    "req":42,"ms":1.5}
+// Strings are escaped per RFC 8259; bytes >= 0x80 pass through as is.
+// Non-finite doubles are written as the strings "NaN", "Infinity" and
+// "-Infinity".
+LogEncoder* JsonLogEncoder();
+
+// logfmt: ts="..." level=INFO file=a.cc line=12 msg=done req=42 ms=1.5
+// Values with spaces, quotes, '=' or control characters are quoted and
+// escaped. Keys cannot be quoted, so those bytes are replaced with '_'
+// there, as they are in the text format's fields.
+LogEncoder* LogfmtLogEncoder();
+
+// Installs "encoder" for all records; nullptr restores the text format.
+// Overrides VTZ_CPP_LOG_FORMAT, which takes "text" (the default), "json" or
+// "logfmt". The caller keeps ownership and must keep the encoder alive for
+// as long as anything may log.
+void SetLogEncoder(LogEncoder* encoder);
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_ENCODER_H_
@@ -0,0 +1,73 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_LOG_FORMAT_H_
+#define VTZ_COMMON_LOG_FORMAT_H_
+
+#include <stddef.h>
+#include <ostream>
+#include "integral_type.h"
+
+// Number and byte formatting behind LOG() <<, LOGF, CHECK_XX and the
+// encoders. The kernels write into a caller-supplied buffer of at least
+// kFastFormatBufferSize bytes, do not NUL-terminate and return the end of
+// what they wrote. None of them allocates or consults a locale.
+
+namespace vtz {
+
+const size_t kFastFormatBufferSize = 32;
+
+// Decimal, with a "-" for negative values.
+char* FormatUInt64(char* p, uint64 v);
+char* FormatInt64(char* p, int64 v);
+
+// Lowercase hexadecimal without a prefix.
+char* FormatHex64(char* p, uint64 v);
+
+// Text that strtod() (strtof() for FormatFloat) reads back as exactly
+// "v": the shortest fixed notation, such as "0.1" or "1500", from 1e-4 up
+// to 1e15 (2^24 for float), and the shortest of printf's %.15g, %.16g and
+// %.17g (%.6g to %.9g for float) elsewhere or when more digits are
+// needed. Non-finite values print as "nan", "inf" and "-inf".
+char* FormatDouble(char* p, double v);
+char* FormatFloat(char* p, float v);
+
+// Streams "size" bytes at "data" in xxd's layout, each line of 16 bytes
+// starting on a new line, so that it can follow a message:
+//
+//   LOG(INFO) << "request" << vtz::HexDump(buf, n);
+//
+//   ... request
+//   00000000: 4745 5420 2f20 4854 5450 2f31 2e31 0d0a  GET / HTTP/1.1..
+//
+// The bytes are not copied; they must outlive the statement.
+class HexDump {
+ public:
+  HexDump(const void* data, size_t size)
+      : data_(static_cast<const unsigned char*>(data)), size_(size) {}
+
+  const unsigned char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const unsigned char* data_;
+  size_t size_;
+};
+
+std::ostream& operator<<(std::ostream& os, const HexDump& dump);
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_FORMAT_H_
@@ -0,0 +1,182 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Sparse side indexes for text log files, and queries that use them.
+//
+// A log file "<f>" may have an index "<f>.idx": a header and one entry per
+// chunk of about kLogIndexChunkBytes of records, giving the chunk's byte
+// range, its earliest and latest timestamps, the severities in it and a
+// 512-bit Bloom filter of its files and file:line sites. A query reads
+// the entries, maps only the chunks that may hold a match and filters
+// their lines exactly. Entries are appended as chunks fill, so the index
+// of a file being written is complete up to its last full chunk; whatever
+// follows is indexed in memory when the file is opened.
+//
+// Records are in the text format:
+//   "2018-01-31 12:34:56.123456 E foo.cc:42] message"
+// or, with the monotonic log clock, "12345.678901 E foo.cc:42] message".
+// Lines that do not start that way continue the record before them.
+// Encoder formats (JSON, logfmt) are not indexed.
+
+#ifndef VTZ_COMMON_LOG_INDEX_H_
+#define VTZ_COMMON_LOG_INDEX_H_
+
+#include <stddef.h>
+#include <functional>
+#include <string>
+#include "integral_type.h"
+#include "logging.h"
+#include "macros.h"
+
+namespace vtz {
+
+// Chunk size RotatingFileSink and vtz_logq index with.
+const size_t kLogIndexChunkBytes = 64 * 1024;
+
+// What the first line of a record says about it.
+struct LogRecordPrefix {
+  // Local wall-clock time as if it were UTC, so it orders and subtracts
+  // like the timestamp text; or the monotonic clock reading.
+  int64 micros;
+  int severity;
+  const char* file;  // as logged, usually a path; not NUL-terminated
+  size_t file_size;
+  int line;
+  size_t size;  // bytes up to and including "] "
+};
+
+// Parses the prefix of the record at "data". Returns false if the bytes
+// do not start a record.
+bool ParseLogRecordPrefix(const char* data, size_t size,
+                          LogRecordPrefix* prefix);
+
+// Parses a time as a query gives it: "YYYY-MM-DD[ HH:MM[:SS[.ffffff]]]",
+// with ' ' or 'T' before the hour, or "<seconds>[.ffffff]" for files
+// written with the monotonic clock. Returns false if "text" is neither.
+bool ParseLogTime(const std::string& text, int64* micros);
+
+// Builds index entries while a file is written. Used by one thread at a
+// time.
+class LogIndexBuilder {
+ public:
+  explicit LogIndexBuilder(size_t chunk_bytes = kLogIndexChunkBytes);
+  ~LogIndexBuilder();
+
+  // Adds the record of "size" bytes at "offset" in the file. Records are
+  // added in file order, each starting where the last one ended. A chunk
+  // is sealed once it holds chunk_bytes.
+  void Add(uint64 offset, const char* data, size_t size);
+
+  // Seals the chunk being built, if any.
+  void Seal();
+
+  bool has_sealed() const { return !sealed_.empty(); }
+
+  // Appends the entries of the chunks sealed so far to "out", as bytes
+  // for the index file, and forgets them.
+  void TakeSealed(std::string* out);
+
+  // What an index file starts with.
+  static std::string FileHeader();
+
+  // The index file's entry for one chunk.
+  struct Entry;
+
+ private:
+  const size_t chunk_bytes_;
+  Entry* entry_;  // the chunk being built
+  bool building_;
+  std::string sealed_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(LogIndexBuilder);
+};
+
+// Records a query returns. Every condition given must hold.
+struct LogQuery {
+  LogQuery()
+      : begin_micros(-1),
+        end_micros(-1),
+        min_severity(INFO),
+        line(0) {}
+
+  // [begin_micros, end_micros) in LogRecordPrefix::micros; -1 leaves a
+  // side open.
+  int64 begin_micros;
+  int64 end_micros;
+  int min_severity;
+  // The logged file is this or ends in "/" and this; empty for any.
+  std::string file;
+  // With "file"; 0 for any line.
+  int line;
+  // Appears in the record after its prefix; empty for anything.
+  std::string text;
+};
+
+struct LogQueryStats {
+  LogQueryStats()
+      : chunks(0), chunks_read(0), bytes(0), bytes_read(0), records(0) {}
+
+  uint64 chunks;      // in the file
+  uint64 chunks_read; // that the index could not rule out
+  uint64 bytes;
+  uint64 bytes_read;
+  uint64 records;     // returned
+};
+
+// A memory-mapped log file and its index.
+class IndexedLogFile {
+ public:
+  // Maps "path" and loads the index next to the file it resolves to,
+  // unless "use_index" is false or the index does not match the file.
+  // The rest of the file is indexed in memory, up to its last newline or
+  // the NUL bytes at the end of a live RotatingFileSink segment. Returns
+  // nullptr, with a reason in "error", if the file cannot be read.
+  static IndexedLogFile* Open(const std::string& path, bool use_index,
+                              std::string* error);
+
+  ~IndexedLogFile();
+
+  // Calls "fn" with every matching record, newline included, in file
+  // order. Returns the number of records.
+  uint64 Query(const LogQuery& query,
+               const std::function<void(const char* data, size_t size)>& fn,
+               LogQueryStats* stats);
+
+  // Appends to the index file what it does not cover yet, creating it if
+  // needed, so the next Open() does not index those bytes again.
+  bool SaveIndex(std::string* error);
+
+  // Bytes covered by the index file when the file was opened.
+  uint64 indexed_bytes() const { return indexed_bytes_; }
+
+ private:
+  IndexedLogFile();
+
+  std::string index_path_;
+  int fd_;
+  const char* base_;
+  size_t size_;
+  // Entries, as LogIndexBuilder writes them; the first "loaded_" came
+  // from the index file.
+  std::string entries_;
+  size_t loaded_;
+  uint64 indexed_bytes_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(IndexedLogFile);
+};
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_INDEX_H_
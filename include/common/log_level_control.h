@@ -0,0 +1,101 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_LOG_LEVEL_CONTROL_H_
+#define VTZ_COMMON_LOG_LEVEL_CONTROL_H_
+
+#include <string>
+#include "integral_type.h"
+#include "logging.h"
+
+// Ways to change log levels in a running process, besides SetMinLogLevel(),
+// SetMinVLogLevel() and SetVModule().
+
+namespace vtz {
+
+// SIGUSR1 makes logging one notch more verbose, SIGUSR2 one notch less, on
+// the ladder FATAL, ERROR, WARNING, INFO, VLOG(1), VLOG(2), ...: e.g. with
+// VTZ_CPP_MIN_LOG_LEVEL=1, one SIGUSR1 enables LOG(INFO) and a second one
+// VLOG(1). The handlers only touch atomics.
+void InstallLogLevelSignalHandlers();
+
+// Polls "path" every "poll_interval_millis" and applies it whenever it
+// changes. The file holds "key=value" lines; '#' starts a comment:
+//
+//   min_log_level=1
+//   min_vlog_level=2
+//   vmodule=foo=2,bar*=3
+//   trace=1
+//
+// "trace" turns trace.h recording on or off. Keys the file does not
+// mention keep their current value, as do values that do not parse. A
+// missing file is not an error; it is applied once it appears. Returns
+// false if a file is already being watched.
+bool WatchLogControlFile(const std::string& path,
+                         int64 poll_interval_millis = 1000);
+
+void StopWatchingLogControlFile();
+
+struct AdaptiveLogLevelOptions {
+  AdaptiveLogLevelOptions()
+      : high_water_queue_fill(0.75),
+        low_water_queue_fill(0.25),
+        high_water_write_micros(2000),
+        low_water_write_micros(200),
+        max_level(ERROR),
+        check_interval_millis(100),
+        recovery_millis(2000) {}
+
+  // Pressure is high when the fullest async ring is at least
+  // high_water_queue_fill of its capacity, or when writing a record (a
+  // batch, with async logging) took high_water_write_micros on average
+  // over the last check interval. It has cleared once both are at or
+  // below their low-water marks.
+  double high_water_queue_fill;
+  double low_water_queue_fill;
+  int64 high_water_write_micros;
+  int64 low_water_write_micros;
+  // Shedding never drops records at or above this severity.
+  int max_level;
+  // Every check with high pressure raises the threshold one severity.
+  int64 check_interval_millis;
+  // The threshold drops one severity once pressure has stayed clear this
+  // long since the last change.
+  int64 recovery_millis;
+};
+
+struct AdaptiveLogLevelStats {
+  // Records below this severity are currently being shed; INFO when not.
+  int shed_level;
+  uint64 raises;
+  uint64 lowers;
+};
+
+// Sheds low-severity records while output cannot keep up, so that a log
+// storm degrades the logs rather than the latency of the threads that
+// log: shed statements cost what a filtered LOG costs, and neither stderr,
+// the sinks nor the flight recorder see them. The effective threshold is
+// the higher of the configured minimum level and the shedding level.
+// Returns false if adaptive shedding is already enabled.
+bool EnableAdaptiveLogLevel(const AdaptiveLogLevelOptions& options);
+
+// Stops shedding and restores the configured minimum level.
+void DisableAdaptiveLogLevel();
+
+AdaptiveLogLevelStats GetAdaptiveLogLevelStats();
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_LEVEL_CONTROL_H_
@@ -0,0 +1,187 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Output path shared by the synchronous LogMessage path and the async
+// writer thread. Not installed.
+
+#ifndef VTZ_COMMON_LOG_OUTPUT_PRIVATE_H_
+#define VTZ_COMMON_LOG_OUTPUT_PRIVATE_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <atomic>
+#include <streambuf>
+#include "integral_type.h"
+#include "macros.h"
+
+namespace vtz {
+
+class LogEncoder;
+class LogFields;
+
+namespace internal {
+
+class LogStreamBuf;
+struct LogPayload;
+struct LogRecordMeta;
+
+// Appends the fields for the text format, or re-encodes the record with
+// the installed LogEncoder, then finishes it and writes it out, or, if
+// "filtered", hands it to the flight recorder.
+void EncodeLogRecord(LogStreamBuf* buf, const LogRecordMeta& meta,
+                     bool filtered);
+
+// Whether record timestamps come from CLOCK_MONOTONIC rather than the
+// wall clock.
+bool LogClockIsMonotonic();
+
+// Writes "micros", a time read from the configured LogClock, the way the
+// record prefix shows it. Needs room for kFastFormatBufferSize bytes.
+char* FormatLogTimestamp(char* p, int64 micros);
+
+// Writes one finished record (including its trailing newline) to stderr
+// and to the registered LogSinks. Safe to call from any thread.
+void WriteLogRecord(int severity, const char* data, size_t size);
+
+// See SetStderrLogSeverity().
+extern std::atomic<int> stderr_log_severity;
+
+inline bool StderrLogIsOn(int severity) {
+  return severity >= stderr_log_severity.load(std::memory_order_relaxed);
+}
+
+// Writes all of "iov" to stderr, retrying short writes. Modifies "iov".
+void WriteStderrv(struct iovec* iov, int iovcnt);
+
+// Hands a record to every LogSink registered for its severity.
+void SendToLogSinks(int severity, const char* data, size_t size);
+void FlushLogSinks();
+
+// Whether a LogSink is registered for records of "severity".
+bool LogSinksWant(int severity);
+
+// Like WriteLogRecord(), for a finished record "data" with "payload" to go
+// in at payload.offset. Safe to call from any thread.
+void WritePayloadLogRecord(int severity, const char* data, size_t size,
+                           const LogPayload& payload);
+
+// Bytes the text of "payload" adds to its record: the shown bytes once
+// encoded, and the truncation marker.
+size_t LogPayloadTextSize(const LogPayload& payload);
+
+// Writes that text to "out", which has room for LogPayloadTextSize()
+// bytes, and returns the end.
+char* AppendLogPayloadText(const LogPayload& payload, char* out);
+
+// Writes just the truncation marker, if "payload" is cut short, to "out",
+// which has room for kLogPayloadMarkerBytes, and returns the end.
+const size_t kLogPayloadMarkerBytes = 96;
+char* AppendLogPayloadMarker(const LogPayload& payload, char* out);
+
+// Writes that text to "out", encoding it piece by piece.
+void WriteLogPayloadText(const LogPayload& payload, std::streambuf* out);
+
+// Returns the finished record "data" with the text of "payload" put in, in
+// a buffer the calling thread reuses for its next call.
+const char* JoinLogPayload(const char* data, size_t size,
+                           const LogPayload& payload, size_t* joined_size);
+
+// Appends one framed LOG_BIN entry to the open binary log, if any.
+void WriteBinaryLogRecord(const char* data, size_t size);
+void FlushBinaryLog();
+
+// Pushes buffered output, including the binary log, to the OS.
+void FlushLogOutput();
+
+// Recomputes min_log_level_for_macros from the minimum log level, the
+// flight recorder's threshold and shed_log_level. Async-signal-safe.
+void UpdateMinLogLevelForMacros();
+
+// Records below this severity are dropped before they are built, flight
+// recorder included. INFO when adaptive shedding is idle.
+extern std::atomic<int> shed_log_level;
+
+// Makes logging "steps" notches more verbose (negative: less verbose) on
+// the ladder FATAL, ERROR, WARNING, INFO, VLOG(1), VLOG(2), ...
+// Async-signal-safe once the levels have been read from the environment,
+// which the first call does.
+void StepLogVerbosity(int steps);
+
+// Set while adaptive shedding wants to know how long output takes.
+extern std::atomic<bool> log_write_timing;
+
+inline int64 LogWriteClockNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Reports one write to stderr and the sinks, or one async batch.
+void NoteLogWriteNanos(int64 nanos);
+
+// Self-instrumentation; see log_stats.h. Callers check log_stats_on, in
+// logging.h. The per-record hooks are inline, in log_stats_private.h.
+void RecordLogLatency(int phase, int64 nanos);
+void CountSampledLogRecords(uint64 n);
+void CountLogFlush();
+void NoteLogQueueDepth(size_t bytes);
+
+// Fullest async ring, as a fraction of its capacity; 0 when async logging
+// is off.
+double AsyncLogQueueFill();
+
+// Lowest severity the flight recorder keeps; NUM_SEVERITIES when off.
+extern std::atomic<int> flight_recorder_min_severity;
+
+// Stores a finished record that the log level filtered out.
+void FlightRecorderCapture(int severity, int64 micros, const char* data,
+                           size_t size);
+
+// Encoder for new records; nullptr means the text format. The first call
+// reads VTZ_CPP_LOG_FORMAT.
+extern std::atomic<LogEncoder*> log_encoder;
+extern std::atomic<bool> log_encoder_loaded;
+LogEncoder* LoadLogEncoderFromEnv();
+
+inline LogEncoder* CurrentLogEncoder() {
+  if (VTZ_PREDICT_FALSE(!log_encoder_loaded.load(std::memory_order_acquire))) {
+    return LoadLogEncoderFromEnv();
+  }
+  return log_encoder.load(std::memory_order_acquire);
+}
+
+// Appends " key=value ..." for the text format and logfmt.
+void AppendTextLogFields(const LogFields& fields, std::streambuf* out);
+
+// Dumps the flight recorder, if it was ever enabled, the first time it is
+// called. Async-signal-safe.
+void DumpFlightRecorderForFatal();
+
+// See log_coalescing.h. Callers check log_coalescing_on.
+extern std::atomic<bool> log_coalescing_on;
+
+// Returns true if the record is a repeat that was counted instead of being
+// written. "text" is its message, without prefix and fields.
+bool CoalesceLogRecord(const LogRecordMeta& meta, const char* text,
+                       size_t size);
+
+// Writes the summary of every record with held-back repeats.
+void FlushCoalescedLogRecords();
+
+}  // namespace internal
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_OUTPUT_PRIVATE_H_
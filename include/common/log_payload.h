@@ -0,0 +1,125 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_LOG_PAYLOAD_H_
+#define VTZ_COMMON_LOG_PAYLOAD_H_
+
+#include <stddef.h>
+#include <memory>
+#include <ostream>
+#include "logging.h"
+
+namespace vtz {
+
+// A large buffer, such as a request or response body, logged by reference:
+//
+//   LOG(INFO) << "response " << status << " body "
+//             << vtz::Payload(body.data(), body.size());
+//
+// The bytes are not copied into the record. When the record is written
+// they go to stderr from where they are, in one writev() with the rest of
+// the line, and any encoding is done then, into a buffer the thread keeps
+// for it. With async logging (async_logging.h) the writer thread does
+// this, so the bytes must live until it has: give the Payload an "owner"
+// that keeps them alive, and the record holds a reference to it until it
+// is written.
+//
+//   std::shared_ptr<const std::string> body = ...;
+//   LOG(INFO) << vtz::Payload(body->data(), body->size(), body).Base64();
+//
+// A Payload without an owner is pinned by the caller only for the LOG
+// statement, so with async logging it is copied into the queue like any
+// other text. LogSinks always get the record as one copied buffer, as do
+// records that coalescing, the flight recorder or a LogEncoder handles.
+// Streamed into anything other than LOG(), a Payload is written out as
+// text.
+class Payload {
+ public:
+  enum Encoding {
+    kRaw = 0,     // the bytes as they are
+    kHex = 1,     // two lowercase hex digits per byte
+    kBase64 = 2,  // RFC 4648 with padding
+  };
+
+  // Bytes that stay valid and unchanged until the LOG statement ends.
+  Payload(const void* data, size_t size)
+      : data_(static_cast<const char*>(data)),
+        size_(size),
+        limit_(internal::LogStreamBuf::kMaxLogMessageBytes),
+        encoding_(kRaw) {}
+
+  // Bytes that "owner" keeps valid and unchanged.
+  Payload(const void* data, size_t size, std::shared_ptr<const void> owner)
+      : data_(static_cast<const char*>(data)),
+        size_(size),
+        limit_(internal::LogStreamBuf::kMaxLogMessageBytes),
+        encoding_(kRaw),
+        owner_(std::move(owner)) {}
+
+  Payload& Hex() {
+    encoding_ = kHex;
+    return *this;
+  }
+  Payload& Base64() {
+    encoding_ = kBase64;
+    return *this;
+  }
+  // Writes at most "max_bytes" of the payload, before encoding, followed by
+  // " [payload truncated, <max_bytes> of <size> bytes]". Defaults to
+  // LogStreamBuf::kMaxLogMessageBytes.
+  Payload& Truncate(size_t max_bytes) {
+    limit_ = max_bytes;
+    return *this;
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  size_t limit() const { return limit_; }
+  Encoding encoding() const { return encoding_; }
+  const std::shared_ptr<const void>& owner() const { return owner_; }
+
+ private:
+  const char* data_;
+  size_t size_;
+  size_t limit_;
+  Encoding encoding_;
+  std::shared_ptr<const void> owner_;
+};
+
+// Writes the payload's text, encoded and truncated as it says.
+std::ostream& operator<<(std::ostream& os, const Payload& payload);
+
+namespace internal {
+
+inline void LogInsertPayload(std::ostream& os, const Payload& payload) {
+  os << payload;
+}
+
+inline void LogInsertPayload(LogMessage& m, const Payload& payload) {
+  m.AttachPayload(payload);
+}
+
+template <>
+struct LogInserter<Payload> {
+  template <typename Stream>
+  static void Insert(Stream& os, const Payload& payload) {
+    LogInsertPayload(os, payload);
+  }
+};
+
+}  // namespace internal
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_PAYLOAD_H_
@@ -0,0 +1,58 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_LOG_SINK_H_
+#define VTZ_COMMON_LOG_SINK_H_
+
+#include <stddef.h>
+#include "logging.h"
+
+namespace vtz {
+
+// Destination for finished text log records. Every record written by LOG()
+// (and by the async writer thread when StartAsyncLogging() is running) is
+// handed to each registered sink whose severity threshold it meets.
+class LogSink {
+ public:
+  virtual ~LogSink() {}
+
+  // "data" is one complete record, prefix and trailing newline included.
+  // Called concurrently from any thread that logs, so implementations must
+  // be thread-safe. Must not LOG() itself.
+  virtual void Send(int severity, const char* data, size_t size) = 0;
+
+  // Pushes anything the sink buffers to the OS. Called by FlushLogs() and
+  // before LOG(FATAL) aborts.
+  virtual void Flush() {}
+};
+
+// Registers "sink" for records at or above "min_severity". The caller keeps
+// ownership and must remove the sink before destroying it. At most 16 sinks
+// can be registered; returns false if the table is full or "sink" is
+// already registered.
+bool AddLogSink(LogSink* sink, int min_severity = INFO);
+
+// Unregisters "sink". Blocks until no thread is still inside its Send() or
+// Flush(), so the sink may be deleted as soon as this returns. Must not be
+// called from a sink.
+void RemoveLogSink(LogSink* sink);
+
+// Records below "min_severity" are not written to stderr. Defaults to INFO;
+// pass NUM_SEVERITIES to log to the registered sinks only.
+void SetStderrLogSeverity(int min_severity);
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_SINK_H_
@@ -0,0 +1,105 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_LOG_STATS_H_
+#define VTZ_COMMON_LOG_STATS_H_
+
+#include <string>
+#include "integral_type.h"
+#include "logging.h"
+
+namespace vtz {
+
+// Stages of a LOG statement timed by the latency histograms.
+enum LogLatencyPhase {
+  // Timestamp and prefix, in the LogMessage constructor or LOGF.
+  kLogPhaseConstruct = 0,
+  // The statement's own << operators or LOGF formatting.
+  kLogPhaseFormat = 1,
+  // Encoding and handing the record to stderr, the sinks or the async
+  // queue, from the LogMessage destructor.
+  kLogPhaseWrite = 2,
+  kNumLogPhases = 3,
+};
+
+// Log-linear histogram of nanoseconds: exact below 16, then 8 buckets per
+// power of two, so any recorded value is within 12.5% of its bucket.
+struct LogLatencyHistogram {
+  static const int kNumBuckets = 16 + 8 * 37;  // up to ~2^41 ns
+
+  // Smallest value that lands in bucket "i".
+  static uint64 BucketLowerBound(int i);
+
+  // Approximate value at quantile "q" in [0, 1]; 0 when empty.
+  double Percentile(double q) const;
+
+  uint64 count;
+  uint64 sum_nanos;
+  uint64 max_nanos;
+  uint64 buckets[kNumBuckets];
+};
+
+// Totals over the time stats were enabled, summed over all threads.
+struct LogStats {
+  // Records written, and their bytes, by severity. Records go through
+  // LOG(), VLOG() and LOGF().
+  uint64 messages[NUM_SEVERITIES];
+  uint64 bytes[NUM_SEVERITIES];
+  // Statements not written because of the log level or, for VLOG(), the
+  // verbose level: counted at the LOG(), VLOG() and LOGF() guards, and when
+  // a record built anyway is dropped, as those the flight recorder keeps
+  // are. Statements below VTZ_MIN_LOG_LEVEL are compiled out and never
+  // counted.
+  uint64 filtered;
+  // Records discarded by a full async ring (process lifetime).
+  uint64 dropped;
+  // Occurrences skipped by LOG_EVERY_N and friends, counted when their
+  // call site next emits.
+  uint64 sampled;
+  // Times buffered output was pushed to the binary log and the sinks.
+  uint64 flushes;
+  // Most bytes any one async ring has held.
+  uint64 queue_high_water_bytes;
+  // Sampled; see LogStatsOptions::latency_sample_every.
+  LogLatencyHistogram latency[kNumLogPhases];
+};
+
+struct LogStatsOptions {
+  LogStatsOptions() : latency_sample_every(64) {}
+
+  // Time one record in this many on each thread; 0 turns the histograms
+  // off. Each timed record reads the clock four times, so timing every
+  // record costs far more than the counters do.
+  int latency_sample_every;
+};
+
+// Starts counting. Counters live in a cache-line padded block per thread
+// that only its thread writes, with plain stores, and that GetLogStats()
+// sums up; blocks of exited threads are reused, so nothing is lost.
+// Returns false if stats are already enabled.
+bool EnableLogStats(const LogStatsOptions& options);
+
+// Stops counting. The totals so far stay readable.
+void DisableLogStats();
+
+LogStats GetLogStats();
+
+// Human-readable and single-line JSON renderings of "stats".
+std::string LogStatsToText(const LogStats& stats);
+std::string LogStatsToJson(const LogStats& stats);
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_STATS_H_
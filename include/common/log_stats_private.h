@@ -0,0 +1,152 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Per-thread counter blocks behind log_stats.h, and the hooks logging.cc
+// calls on every record while stats are on. Not installed.
+//
+// The hooks are inline so that counting a record is a few plain loads and
+// stores through the thread's block, with no call.
+
+#ifndef VTZ_COMMON_LOG_STATS_PRIVATE_H_
+#define VTZ_COMMON_LOG_STATS_PRIVATE_H_
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include "integral_type.h"
+#include "log_stats.h"
+#include "logging.h"
+#include "macros.h"
+
+namespace vtz {
+namespace internal {
+
+// Written only by the owning thread, with plain load/store pairs rather
+// than atomic read-modify-writes; GetLogStats() reads them concurrently.
+inline void Bump(std::atomic<uint64>* c, uint64 n) {
+  c->store(c->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct ThreadHistogram {
+  void Clear();
+  void Record(uint64 v);
+  void AddTo(LogLatencyHistogram* h) const;
+
+  std::atomic<uint64> count;
+  std::atomic<uint64> sum_nanos;
+  std::atomic<uint64> max_nanos;
+  std::atomic<uint64> buckets[LogLatencyHistogram::kNumBuckets];
+};
+
+// One per thread that has logged with stats on. Never freed: GetLogStats()
+// may walk the list at any time, and a block left by an exited thread is
+// handed, totals and all, to the next new thread.
+class ThreadLogStats {
+ public:
+  ThreadLogStats();
+
+  void CountRecord(int severity, size_t bytes) {
+    Bump(&messages_[severity], 1);
+    Bump(&bytes_[severity], bytes);
+  }
+  void CountFiltered() { Bump(&filtered_, 1); }
+  void CountSampled(uint64 n) { Bump(&sampled_, n); }
+  void NoteQueueDepth(uint64 bytes) {
+    if (bytes > queue_high_water_.load(std::memory_order_relaxed)) {
+      queue_high_water_.store(bytes, std::memory_order_relaxed);
+    }
+  }
+  void RecordLatency(int phase, uint64 nanos) {
+    latency_[phase].Record(nanos);
+  }
+
+  bool SampleNow(int every) {
+    if (--sample_countdown_ > 0) return false;
+    sample_countdown_ = every;
+    return true;
+  }
+
+  void AddTo(LogStats* s) const;
+
+  bool TryClaim() {
+    bool expected = false;
+    return in_use_.compare_exchange_strong(expected, true,
+                                           std::memory_order_acquire);
+  }
+  void Release() { in_use_.store(false, std::memory_order_release); }
+
+  ThreadLogStats* next() const { return next_; }
+  void set_next(ThreadLogStats* next) { next_ = next; }
+
+ private:
+  // Keep other heap objects off this block's first and last cache lines.
+  char pad0_[64];
+  std::atomic<uint64> messages_[NUM_SEVERITIES];
+  std::atomic<uint64> bytes_[NUM_SEVERITIES];
+  std::atomic<uint64> filtered_;
+  std::atomic<uint64> sampled_;
+  std::atomic<uint64> queue_high_water_;
+  ThreadHistogram latency_[kNumLogPhases];
+  int sample_countdown_;        // owner only
+  std::atomic<bool> in_use_;    // owned by a live thread
+  ThreadLogStats* next_;        // immutable once published
+  char pad1_[64];
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(ThreadLogStats);
+};
+
+// The calling thread's block; nullptr until it first counts something.
+// __thread rather than thread_local: other translation units then read it
+// directly instead of through the wrapper call an extern thread_local
+// needs in case it has a dynamic initializer. Initial-exec TLS also saves
+// the __tls_get_addr() call a shared library otherwise makes per access.
+extern __thread ThreadLogStats* thread_stats VTZ_ATTRIBUTE_INITIAL_EXEC;
+
+// Time one record in this many on each thread; 0 when off.
+extern std::atomic<int> latency_sample_every;
+
+// Claims a block for the calling thread and sets thread_stats; nullptr in
+// the thread_local destructors that run after the block was handed back.
+ThreadLogStats* ClaimThisThreadLogStats();
+
+inline ThreadLogStats* ThisThreadLogStats() {
+  ThreadLogStats* stats = thread_stats;
+  if (VTZ_PREDICT_FALSE(stats == nullptr)) stats = ClaimThisThreadLogStats();
+  return stats;
+}
+
+// Whether the calling thread should time its current record.
+inline bool LogStatsSampleNow() {
+  const int every = latency_sample_every.load(std::memory_order_relaxed);
+  if (every <= 0) return false;
+  ThreadLogStats* stats = ThisThreadLogStats();
+  return stats != nullptr && stats->SampleNow(every);
+}
+
+inline void CountLogRecord(int severity, size_t bytes) {
+  ThreadLogStats* stats = ThisThreadLogStats();
+  if (stats == nullptr) return;
+  stats->CountRecord(std::max(INFO, std::min(severity, FATAL)), bytes);
+}
+
+inline void CountFilteredLogRecord() {
+  ThreadLogStats* stats = ThisThreadLogStats();
+  if (stats != nullptr) stats->CountFiltered();
+}
+
+}  // namespace internal
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOG_STATS_PRIVATE_H_
@@ -0,0 +1,309 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_LOGF_H_
+#define VTZ_COMMON_LOGF_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include "integral_type.h"
+#include "logging.h"
+#include "macros.h"
+
+// Format-string log statements that bypass std::ostream:
+//
+//   LOGF(INFO, "user={} latency_us={}", user_id, micros);
+//
+// "{}" formats the next argument the way LOG() would print it, except that
+// bool prints as true/false and signed char and unsigned char print as
+// numbers rather than characters. "{:x}" prints an integer or pointer in
+// hexadecimal, "{:.N}" (N a single digit) a floating point value with N
+// decimals. "{{" and "}}" are literal braces. The format must be a string
+// literal; it is checked against the argument types at compile time, so a
+// missing argument, an extra argument, a malformed placeholder or a spec
+// that does not fit its argument is a build error.
+//
+// Supported arguments are integers, bool, char, floating point, pointers,
+// C strings and std::string. Output is identical in shape to LOG(): same
+// prefix, same filtering, same sinks. LOGF(FATAL, ...) is never filtered
+// and aborts.
+#define LOGF(severity, ...)                                                 \
+  do {                                                                      \
+    constexpr int _vtz_logf_check = ::vtz::internal::CheckLogfFormat(       \
+        _VTZ_LOGF_FORMAT(__VA_ARGS__, 0),                                   \
+        decltype(::vtz::internal::LogfArgTypes(__VA_ARGS__))());            \
+    static_assert(_vtz_logf_check != ::vtz::internal::kLogfTooFewArgs,      \
+                  "LOGF: more {} placeholders than arguments");             \
+    static_assert(_vtz_logf_check != ::vtz::internal::kLogfTooManyArgs,     \
+                  "LOGF: more arguments than {} placeholders");             \
+    static_assert(_vtz_logf_check != ::vtz::internal::kLogfBadSpec,         \
+                  "LOGF: malformed placeholder; use {}, {:x} or {:.N}");    \
+    static_assert(_vtz_logf_check != ::vtz::internal::kLogfSpecMismatch,    \
+                  "LOGF: {:x} needs an integer or pointer, {:.N} a "        \
+                  "floating point argument");                               \
+    static_assert(_vtz_logf_check != ::vtz::internal::kLogfStrayBrace,      \
+                  "LOGF: unmatched '}'; write }} for a literal brace");     \
+    static_assert(_vtz_logf_check != ::vtz::internal::kLogfUnsupportedType, \
+                  "LOGF: unsupported argument type; use LOG() instead");    \
+    if (::vtz::severity >= ::vtz::FATAL ||                                  \
+        ::vtz::internal::LogSeverityIsOn(::vtz::severity)) {                \
+      ::vtz::internal::Logf(__FILE__, __LINE__, ::vtz::severity,            \
+                            __VA_ARGS__);                                   \
+    }                                                                       \
+  } while (0)
+
+// The format argument of LOGF. The extra argument keeps "..." non-empty.
+#define _VTZ_LOGF_FORMAT(fmt, ...) fmt
+
+namespace vtz {
+namespace internal {
+
+// Result of CheckLogfFormat().
+enum LogfFormatCheck {
+  kLogfOk = 0,
+  kLogfTooFewArgs = 1,
+  kLogfTooManyArgs = 2,
+  kLogfBadSpec = 3,
+  kLogfSpecMismatch = 4,
+  kLogfStrayBrace = 5,
+  kLogfUnsupportedType = 6,
+};
+
+// A parsed placeholder: type is '\0' for "{}", 'x' for "{:x}" and 'f' for
+// "{:.N}" with precision N.
+struct LogfSpec {
+  char type;
+  int precision;
+};
+
+// Formatting kernels. They write straight into the record buffer.
+void LogfAppendInt(LogStreamBuf* buf, int64 v);
+void LogfAppendUInt(LogStreamBuf* buf, uint64 v, const LogfSpec& spec);
+void LogfAppendDouble(LogStreamBuf* buf, double v, const LogfSpec& spec);
+void LogfAppendFloat(LogStreamBuf* buf, float v, const LogfSpec& spec);
+void LogfAppendPointer(LogStreamBuf* buf, const void* v);
+
+// Copies literal text up to the next placeholder, unescaping "{{" and "}}".
+// Returns the placeholder's '{' or the terminating NUL.
+const char* LogfAppendLiteral(LogStreamBuf* buf, const char* f);
+
+// Per-type argument traits: a one-letter kind for the compile-time check
+// and the kernel that formats it.
+template <typename T, typename Enable = void>
+struct LogfArg {
+  static const char kKind = '?';  // unsupported
+};
+
+template <typename T>
+struct LogfArg<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               !std::is_same<T, bool>::value &&
+                               !std::is_same<T, char>::value>::type> {
+  static const char kKind = std::is_signed<T>::value ? 'i' : 'u';
+  static void Append(LogStreamBuf* buf, T v, const LogfSpec& spec) {
+    typedef typename std::make_unsigned<T>::type Unsigned;
+    if (std::is_signed<T>::value && spec.type != 'x') {
+      LogfAppendInt(buf, static_cast<int64>(v));
+    } else {
+      LogfAppendUInt(buf, static_cast<Unsigned>(v), spec);
+    }
+  }
+};
+
+template <>
+struct LogfArg<bool> {
+  static const char kKind = 'b';
+  static void Append(LogStreamBuf* buf, bool v, const LogfSpec&) {
+    if (v) {
+      buf->Append("true", 4);
+    } else {
+      buf->Append("false", 5);
+    }
+  }
+};
+
+template <>
+struct LogfArg<char> {
+  static const char kKind = 'c';
+  static void Append(LogStreamBuf* buf, char v, const LogfSpec&) {
+    buf->Append(&v, 1);
+  }
+};
+
+template <typename T>
+struct LogfArg<
+    T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+  static const char kKind = 'd';
+  static void Append(LogStreamBuf* buf, T v, const LogfSpec& spec) {
+    // A float prints as its own shortest text, not as the double's.
+    if (std::is_same<T, float>::value) {
+      LogfAppendFloat(buf, static_cast<float>(v), spec);
+    } else {
+      LogfAppendDouble(buf, static_cast<double>(v), spec);
+    }
+  }
+};
+
+struct LogfStringArg {
+  static const char kKind = 's';
+  static void Append(LogStreamBuf* buf, const char* v, const LogfSpec&) {
+    if (v == nullptr) v = "(null)";
+    buf->Append(v, strlen(v));
+  }
+  static void Append(LogStreamBuf* buf, const std::string& v,
+                     const LogfSpec&) {
+    buf->Append(v.data(), v.size());
+  }
+};
+
+template <>
+struct LogfArg<const char*> : LogfStringArg {};
+template <>
+struct LogfArg<char*> : LogfStringArg {};
+template <>
+struct LogfArg<std::string> : LogfStringArg {};
+
+template <typename T>
+struct LogfArg<T*, typename std::enable_if<
+                       !std::is_same<typename std::remove_cv<T>::type,
+                                     char>::value>::type> {
+  static const char kKind = 'p';
+  static void Append(LogStreamBuf* buf, const T* v, const LogfSpec& spec) {
+    if (spec.type == 'x') {
+      LogfAppendUInt(buf, static_cast<uint64>(reinterpret_cast<uintptr_t>(v)),
+                     spec);
+    } else {
+      LogfAppendPointer(buf, v);
+    }
+  }
+};
+
+template <typename T>
+struct LogfArgFor : LogfArg<typename std::decay<T>::type> {};
+
+// Compile-time side. LogfArgTypes() is only ever named inside decltype().
+template <typename... T>
+struct LogfTypeList {
+  static constexpr int size() { return sizeof...(T); }
+};
+
+template <typename Format, typename... T>
+LogfTypeList<typename std::decay<T>::type...> LogfArgTypes(const Format&,
+                                                           const T&...);
+
+constexpr char LogfKindAt(LogfTypeList<>, int) { return '\0'; }
+
+template <typename Head, typename... Rest>
+constexpr char LogfKindAt(LogfTypeList<Head, Rest...>, int i) {
+  return i == 0 ? LogfArg<Head>::kKind
+                : LogfKindAt(LogfTypeList<Rest...>(), i - 1);
+}
+
+constexpr bool LogfIsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// Length of the placeholder body after '{', '}' included; 0 if malformed.
+constexpr int LogfSpecLength(const char* f) {
+  return f[0] == '}' ? 1
+         : f[0] != ':' ? 0
+         : f[1] == 'x' ? (f[2] == '}' ? 3 : 0)
+         : f[1] == '.' && LogfIsDigit(f[2]) && f[3] == '}' ? 4
+         : 0;
+}
+
+constexpr bool LogfSpecFits(const char* f, char kind) {
+  return f[0] == '}' ||
+         (f[1] == 'x' ? kind == 'i' || kind == 'u' || kind == 'p'
+                      : kind == 'd');
+}
+
+// Walks the format one character per step, so formats are limited to a
+// few hundred characters by the compiler's constexpr depth.
+template <typename Types>
+constexpr int CheckLogfFormatFrom(const char* f, Types types, int arg) {
+  return *f == '\0'
+             ? (arg < Types::size() ? kLogfTooManyArgs : kLogfOk)
+         : (*f == '{' && f[1] == '{') || (*f == '}' && f[1] == '}')
+             ? CheckLogfFormatFrom(f + 2, types, arg)
+         : *f == '}' ? kLogfStrayBrace
+         : *f != '{' ? CheckLogfFormatFrom(f + 1, types, arg)
+         : LogfSpecLength(f + 1) == 0 ? kLogfBadSpec
+         : arg >= Types::size() ? kLogfTooFewArgs
+         : LogfKindAt(types, arg) == '?' ? kLogfUnsupportedType
+         : !LogfSpecFits(f + 1, LogfKindAt(types, arg))
+             ? kLogfSpecMismatch
+             : CheckLogfFormatFrom(f + 1 + LogfSpecLength(f + 1), types,
+                                   arg + 1);
+}
+
+template <typename Types>
+constexpr int CheckLogfFormat(const char* f, Types types) {
+  return CheckLogfFormatFrom(f, types, 0);
+}
+
+// Runtime side; the format has already been checked.
+inline const char* LogfParseSpec(const char* f, LogfSpec* spec) {
+  // f points at '{'.
+  spec->type = '\0';
+  spec->precision = -1;
+  if (f[1] == '}') return f + 2;
+  if (f[2] == 'x') {
+    spec->type = 'x';
+    return f + 4;
+  }
+  spec->type = 'f';
+  spec->precision = f[3] - '0';
+  return f + 5;
+}
+
+inline void LogfFormat(LogStreamBuf* buf, const char* f) {
+  LogfAppendLiteral(buf, f);
+}
+
+template <typename T, typename... Rest>
+inline void LogfFormat(LogStreamBuf* buf, const char* f, const T& v,
+                       const Rest&... rest) {
+  f = LogfAppendLiteral(buf, f);
+  LogfSpec spec;
+  f = LogfParseSpec(f, &spec);
+  LogfArgFor<T>::Append(buf, v, spec);
+  LogfFormat(buf, f, rest...);
+}
+
+template <typename... Args>
+void Logf(const char* file, int line, int severity, const char* fmt,
+          const Args&... args) {
+  LogStreamBuf buf;
+  LogRecordMeta meta;
+  meta.fname = file;
+  meta.line = line;
+  meta.severity = severity;
+  meta.fields = nullptr;
+  BeginLogRecord(&buf, &meta);
+  LogfFormat(&buf, fmt, args...);
+  if (VTZ_PREDICT_FALSE(severity >= FATAL)) {
+    // Unfiltered, like LOG(FATAL): it is the record that explains the crash.
+    EmitFatalLogRecord(&buf, meta);
+    abort();
+  }
+  EmitLogRecord(&buf, meta);
+}
+
+}  // namespace internal
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_LOGF_H_
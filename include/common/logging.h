@@ -16,9 +16,18 @@ limitations under the License.
 #ifndef VTZ_COMMON_LOGGING_H_
 #define VTZ_COMMON_LOGGING_H_
 
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
 #include <limits>
+#include <memory>
+#include <ostream>
 #include <sstream>
+#include <streambuf>
+#include <string>
+#include <type_traits>
 #include "integral_type.h"
+#include "log_format.h"
 #include "macros.h"
 
 #undef ERROR
@@ -31,15 +40,307 @@ const int ERROR = 2;           // base_logging::ERROR;
 const int FATAL = 3;           // base_logging::FATAL;
 const int NUM_SEVERITIES = 4;  // base_logging::NUM_SEVERITIES;
 
+// LOG statements below this severity are compiled out entirely; their
+// arguments are still parsed but never evaluated. FATAL is never removed.
+// E.g. build with -DVTZ_MIN_LOG_LEVEL=1 to drop every LOG(INFO).
+#ifndef VTZ_MIN_LOG_LEVEL
+#define VTZ_MIN_LOG_LEVEL 0
+#endif
+
+// Clock behind the timestamp that starts every log line.
+enum LogClock {
+  // Wall time, "2018-01-31 12:34:56.123456".
+  kLogClockRealtime = 0,
+  // Wall time from CLOCK_REALTIME_COARSE. Cheaper to read, but only
+  // advances once per scheduler tick.
+  kLogClockRealtimeCoarse = 1,
+  // Seconds since boot from CLOCK_MONOTONIC, "12345.123456".
+  kLogClockMonotonic = 2,
+};
+
+// Overrides VTZ_CPP_LOG_CLOCK, which takes "realtime" (the default),
+// "realtime_coarse" or "monotonic".
+void SetLogClock(LogClock clock);
+
+// Replaces the VTZ_CPP_VMODULE setting, a comma separated list of
+// "pattern=level", e.g. "foo=2,bar*=3". A pattern is matched against the
+// source file's base name without extension, or against its path without
+// extension if the pattern contains a '/'. '*' and '?' are wildcards and
+// the first matching pattern wins.
+void SetVModule(const char* spec);
+
+// Replaces the VTZ_CPP_MIN_VLOG_LEVEL setting, which applies to files no
+// VTZ_CPP_VMODULE pattern matches.
+void SetMinVLogLevel(int level);
+int GetMinVLogLevel();
+
+// Replaces the VTZ_CPP_MIN_LOG_LEVEL setting. Takes effect on every thread
+// with the next LOG statement. See log_level_control.h for other ways to
+// change the levels of a running process.
+void SetMinLogLevel(int level);
+int GetMinLogLevel();
+
+// Typed key/value pairs attached to a record with LogMessage::With(). They
+// are stored inline, so a handful of fields costs no allocation. Keys are
+// kept by pointer and must outlive the LOG statement (string literals are
+// the intended use); string values are copied.
+class LogFields {
+ public:
+  enum Type { kInt, kUInt, kDouble, kBool, kString };
+
+  struct Field {
+    const char* key;
+    Type type;
+    union {
+      int64 i;
+      uint64 u;
+      double d;
+      bool b;
+      struct {
+        uint32 offset;  // into the string storage; see string_data()
+        uint32 size;
+      } s;
+    } value;
+  };
+
+  // Fields past this many are counted in dropped() and otherwise ignored.
+  static const int kMaxFields = 16;
+
+  LogFields() : size_(0), dropped_(0), string_bytes_(0) {}
+
+  int size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const Field& field(int i) const { return fields_[i]; }
+  int dropped() const { return dropped_; }
+
+  // The bytes of a kString field.
+  const char* string_data(const Field& f) const {
+    return (spill_.empty() ? inline_strings_ : spill_.data()) +
+           f.value.s.offset;
+  }
+
+  void AddInt(const char* key, int64 v);
+  void AddUInt(const char* key, uint64 v);
+  void AddDouble(const char* key, double v);
+  void AddBool(const char* key, bool v);
+  void AddString(const char* key, const char* data, size_t size);
+
+ private:
+  Field* Add(const char* key, Type type);
+
+  static const size_t kInlineStringBytes = 256;
+
+  Field fields_[kMaxFields];
+  int size_;
+  int dropped_;
+  size_t string_bytes_;
+  char inline_strings_[kInlineStringBytes];
+  std::string spill_;  // all string bytes once they outgrow inline_strings_
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(LogFields);
+};
+
+class LogEncoder;
+class Payload;
+
 namespace internal {
 
 using namespace std;
 
-class LogMessage : public std::basic_ostringstream<char> {
+// Stream buffer behind LogMessage. It writes into one of two fixed
+// per-thread buffers, so a typical message does no heap allocation; the
+// second one is there for re-encoding a finished message with a LogEncoder.
+// A message that outgrows its buffer spills to the heap and is truncated
+// past kMaxLogMessageBytes. A LOG nested inside another LOG's operator<< on
+// the same thread may start out on the heap.
+class LogStreamBuf : public std::streambuf {
+ public:
+  static const size_t kMaxLogMessageBytes = 1 << 20;
+
+  LogStreamBuf();
+  ~LogStreamBuf();
+
+  const char* data() const { return pbase(); }
+  size_t size() const { return static_cast<size_t>(pptr() - pbase()); }
+
+  // Appends without the virtual call behind sputn().
+  void Append(const char* s, size_t n) {
+    if (VTZ_PREDICT_TRUE(n <= static_cast<size_t>(epptr() - pptr()))) {
+      memcpy(pptr(), s, n);
+      pbump(static_cast<int>(n));
+    } else {
+      xsputn(s, static_cast<std::streamsize>(n));
+    }
+  }
+
+  // Appends the truncation marker, if any, and the trailing newline. No
+  // further writes are allowed afterwards.
+  void Finish();
+
+ protected:
+  int_type overflow(int_type c) override;
+  std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+ private:
+  // Makes room for "extra" more bytes and returns how many fit.
+  size_t Reserve(size_t extra);
+
+  int thread_buffer_;  // index of the per-thread buffer in use, or -1
+  bool truncated_;
+  std::string spill_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(LogStreamBuf);
+};
+
+// A Payload attached to a record (see log_payload.h). Its text goes in at
+// "offset" in the record's own text when the record is written; until
+// then only the reference is kept.
+struct LogPayload {
+  LogPayload() : data(nullptr), size(0), limit(0), encoding(0), offset(0) {}
+
+  const char* data;
+  size_t size;
+  size_t limit;  // at most this many bytes of "data" are written
+  int encoding;  // Payload::Encoding
+  size_t offset;
+  std::shared_ptr<const void> owner;  // empty for caller-pinned bytes
+};
+
+// What a record carries besides its text.
+struct LogRecordMeta {
+  const char* fname;
+  int line;
+  int severity;
+  int64 micros;  // filled in by BeginLogRecord()
+  // Filled in by BeginLogRecord(). With an encoder the buffer starts with
+  // just the formatted timestamp, timestamp_size bytes, instead of the
+  // "time S file:line] " text prefix.
+  LogEncoder* encoder;
+  size_t timestamp_size;
+  // Filled in by BeginLogRecord(): bytes in front of the message text.
+  size_t prefix_size;
+  const LogFields* fields;  // may be null
+  // Set to null by BeginLogRecord(); see LogMessage::AttachPayload().
+  const LogPayload* payload;
+  // Filled in by BeginLogRecord(): when the record is being timed for
+  // log_stats.h, the clock at the end of construction, else 0.
+  int64 stats_nanos;
+};
+
+// Starts a record in "buf": the text prefix, or only the timestamp when a
+// LogEncoder is installed.
+void BeginLogRecord(LogStreamBuf* buf, LogRecordMeta* meta);
+
+// Encodes and finishes the record in "buf" and writes it out, or hands it
+// to the flight recorder if VTZ_CPP_MIN_LOG_LEVEL filters it. Does not
+// abort for FATAL.
+void EmitLogRecord(LogStreamBuf* buf, const LogRecordMeta& meta);
+
+// Encodes and writes a FATAL record past every level, shedding and
+// coalescing filter, the way LOG(FATAL) does. Does not abort.
+void EmitFatalLogRecord(LogStreamBuf* buf, const LogRecordMeta& meta);
+
+// Formats one argument of LOG() << or CHECK_XX; defined below LogMessage.
+template <typename T, typename Enable = void>
+struct LogInserter;
+
+class LogMessage : public std::ostream {
  public:
   LogMessage(const char* fname, int line, int severity);
   ~LogMessage();
 
+  // Attaches a typed field to the record:
+  //
+  //   LOG(INFO).With("req", id).With("ms", elapsed) << "done";
+  //
+  // Calls must come before the first <<. The default text format appends
+  // the fields to the message as " req=42 ms=1.5"; a JSON or logfmt
+  // encoder (see log_encoder.h) emits them as separate keys.
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                              !std::is_same<T, bool>::value &&
+                              !std::is_same<T, char>::value,
+                          LogMessage&>::type
+  With(const char* key, T value) {
+    if (std::is_signed<T>::value) {
+      fields_.AddInt(key, static_cast<int64>(value));
+    } else {
+      fields_.AddUInt(key, static_cast<uint64>(value));
+    }
+    return *this;
+  }
+  // Enums, scoped or not, as their underlying integer.
+  template <typename T>
+  typename std::enable_if<std::is_enum<T>::value, LogMessage&>::type With(
+      const char* key, T value) {
+    typedef typename std::underlying_type<T>::type Underlying;
+    if (std::is_signed<Underlying>::value) {
+      fields_.AddInt(key, static_cast<int64>(value));
+    } else {
+      fields_.AddUInt(key, static_cast<uint64>(value));
+    }
+    return *this;
+  }
+  LogMessage& With(const char* key, bool value) {
+    fields_.AddBool(key, value);
+    return *this;
+  }
+  LogMessage& With(const char* key, char value) {
+    fields_.AddString(key, &value, 1);
+    return *this;
+  }
+  LogMessage& With(const char* key, double value) {
+    fields_.AddDouble(key, value);
+    return *this;
+  }
+  LogMessage& With(const char* key, const char* value) {
+    if (value == nullptr) value = "(null)";
+    fields_.AddString(key, value, strlen(value));
+    return *this;
+  }
+  LogMessage& With(const char* key, const std::string& value) {
+    fields_.AddString(key, value.data(), value.size());
+    return *this;
+  }
+
+  // Integers, floating point, bool, char, pointers, C strings and
+  // std::string skip std::ostream's sentry, locale and num_put: the
+  // kernels in log_format.h write them straight into the record buffer.
+  // Floating point prints the shortest text that reads back as the same
+  // value. Once a manipulator changes how a type prints (a width, a
+  // precision, showpos, ...; std::hex is handled for integers), that type
+  // goes through std::ostream as before, as does everything else.
+  template <typename T>
+  LogMessage& operator<<(const T& v) {
+    LogInserter<typename std::decay<T>::type>::Insert(*this, v);
+    return *this;
+  }
+  LogMessage& operator<<(std::ostream& (*manip)(std::ostream&)) {
+    manip(*this);
+    return *this;
+  }
+  LogMessage& operator<<(std::ios& (*manip)(std::ios&)) {
+    manip(*this);
+    return *this;
+  }
+  LogMessage& operator<<(std::ios_base& (*manip)(std::ios_base&)) {
+    manip(*this);
+    return *this;
+  }
+
+  // Appends "n" bytes to the message as they are.
+  void AppendRaw(const char* s, size_t n) { buf_.Append(s, n); }
+
+  // Makes "payload" part of the message at this point without copying it;
+  // LOG() << vtz::Payload(...) calls this. A record takes one payload by
+  // reference; further ones, and any payload while a LogEncoder is
+  // installed, are copied in as text.
+  void AttachPayload(const Payload& payload);
+
+  // The LOG macros insert through this lvalue: on a temporary, the
+  // operator<< above would tie with std::ostream's rvalue operator<<.
+  LogMessage& stream() { return *this; }
+
   // Returns the minimum log level for VLOG statements.
   // E.g., if MinVLogLevel() is 2, then VLOG(2) statements will produce output,
   // but VLOG(3) will not. Defaults to 0.
@@ -49,9 +350,10 @@ class LogMessage : public std::basic_ostringstream<char> {
   void GenerateLogMessage();
 
  private:
-  const char* fname_;
-  int line_;
-  int severity_;
+  LogStreamBuf buf_;
+  LogRecordMeta meta_;
+  LogPayload payload_;
+  LogFields fields_;
 };
 
 // LogMessageFatal ensures the process will exit in failure after
@@ -63,26 +365,414 @@ class LogMessageFatal : public LogMessage {
   __attribute__((noreturn)) /*VTZ_ATTRIBUTE_NORETURN*/ ~LogMessageFatal();
 };
 
-#define _VTZ_LOG_INFO \
-  ::vtz::internal::LogMessage(__FILE__, __LINE__, ::vtz::INFO)
-#define _VTZ_LOG_WARNING \
-  ::vtz::internal::LogMessage(__FILE__, __LINE__, ::vtz::WARNING)
-#define _VTZ_LOG_ERROR \
-  ::vtz::internal::LogMessage(__FILE__, __LINE__, ::vtz::ERROR)
+inline void LogInsertBytes(std::ostream& os, const char* s, size_t n) {
+  os.rdbuf()->sputn(s, static_cast<std::streamsize>(n));
+}
+
+inline void LogInsertBytes(LogMessage& m, const char* s, size_t n) {
+  m.AppendRaw(s, n);
+}
+
+// Types the fast paths of LogInserter leave to std::ostream from the
+// start: bool and the character types print as text, not numbers.
+template <typename T>
+struct IsLogCharType
+    : std::integral_constant<
+          bool, std::is_same<T, char>::value ||
+                    std::is_same<T, signed char>::value ||
+                    std::is_same<T, unsigned char>::value ||
+                    std::is_same<T, wchar_t>::value ||
+                    std::is_same<T, char16_t>::value ||
+                    std::is_same<T, char32_t>::value> {};
+
+// Everything without a fast path.
+template <typename T, typename Enable>
+struct LogInserter {
+  template <typename Stream>
+  static void Insert(Stream& os, const T& v) {
+    static_cast<std::ostream&>(os) << v;
+  }
+};
+
+template <typename T>
+struct LogInserter<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               !std::is_same<T, bool>::value &&
+                               !IsLogCharType<T>::value>::type> {
+  template <typename Stream>
+  static void Insert(Stream& os, T v) {
+    const std::ios_base::fmtflags flags =
+        os.flags() & (std::ios_base::basefield | std::ios_base::showpos |
+                      std::ios_base::showbase | std::ios_base::uppercase);
+    char digits[kFastFormatBufferSize];
+    char* end;
+    if (VTZ_PREDICT_TRUE(flags == std::ios_base::dec && os.width() == 0)) {
+      end = std::is_signed<T>::value
+                ? FormatInt64(digits, static_cast<int64>(v))
+                : FormatUInt64(digits, static_cast<uint64>(v));
+    } else if (flags == std::ios_base::hex && os.width() == 0) {
+      // Like std::ostream, negative values print in their own width.
+      typedef typename std::make_unsigned<T>::type Unsigned;
+      end = FormatHex64(digits, static_cast<Unsigned>(v));
+    } else {
+      static_cast<std::ostream&>(os) << v;
+      return;
+    }
+    LogInsertBytes(os, digits, end - digits);
+  }
+};
+
+template <typename Stream, typename T>
+void LogInsertFloatingPoint(Stream& os, T v, char* (*format)(char*, T)) {
+  if (VTZ_PREDICT_TRUE(
+          (os.flags() & (std::ios_base::floatfield | std::ios_base::showpos |
+                         std::ios_base::showpoint |
+                         std::ios_base::uppercase)) == 0 &&
+          os.precision() == 6 && os.width() == 0)) {
+    char digits[kFastFormatBufferSize];
+    LogInsertBytes(os, digits, format(digits, v) - digits);
+  } else {
+    static_cast<std::ostream&>(os) << v;
+  }
+}
+
+template <>
+struct LogInserter<double> {
+  template <typename Stream>
+  static void Insert(Stream& os, double v) {
+    LogInsertFloatingPoint(os, v, FormatDouble);
+  }
+};
+
+template <>
+struct LogInserter<float> {
+  template <typename Stream>
+  static void Insert(Stream& os, float v) {
+    LogInsertFloatingPoint(os, v, FormatFloat);
+  }
+};
+
+template <>
+struct LogInserter<bool> {
+  template <typename Stream>
+  static void Insert(Stream& os, bool v) {
+    if ((os.flags() & std::ios_base::boolalpha) == 0 && os.width() == 0) {
+      LogInsertBytes(os, v ? "1" : "0", 1);
+    } else {
+      static_cast<std::ostream&>(os) << v;
+    }
+  }
+};
+
+template <>
+struct LogInserter<char> {
+  template <typename Stream>
+  static void Insert(Stream& os, char v) {
+    if (os.width() == 0) {
+      LogInsertBytes(os, &v, 1);
+    } else {
+      static_cast<std::ostream&>(os) << v;
+    }
+  }
+};
+
+struct LogStringInserter {
+  template <typename Stream>
+  static void Insert(Stream& os, const char* v) {
+    // std::ostream would set badbit on a null pointer and drop the rest.
+    if (v == nullptr) v = "(null)";
+    if (os.width() == 0) {
+      LogInsertBytes(os, v, strlen(v));
+    } else {
+      static_cast<std::ostream&>(os) << v;
+    }
+  }
+  template <typename Stream>
+  static void Insert(Stream& os, const std::string& v) {
+    if (os.width() == 0) {
+      LogInsertBytes(os, v.data(), v.size());
+    } else {
+      static_cast<std::ostream&>(os) << v;
+    }
+  }
+};
+
+template <>
+struct LogInserter<const char*> : LogStringInserter {};
+template <>
+struct LogInserter<char*> : LogStringInserter {};
+template <>
+struct LogInserter<std::string> : LogStringInserter {};
+
+// Object pointers, as "0x..." or "0" for null. Pointers to characters are
+// strings, and std::ostream prints volatile and function pointers as bool.
+template <typename T>
+struct LogInserter<
+    T*, typename std::enable_if<
+            !std::is_function<T>::value && !std::is_volatile<T>::value &&
+            !IsLogCharType<typename std::remove_cv<T>::type>::value>::type> {
+  template <typename Stream>
+  static void Insert(Stream& os, const T* v) {
+    if ((os.flags() & std::ios_base::uppercase) != 0 || os.width() != 0) {
+      static_cast<std::ostream&>(os) << static_cast<const void*>(v);
+      return;
+    }
+    char digits[kFastFormatBufferSize];
+    char* end = digits;
+    *end++ = '0';
+    if (v != nullptr) {
+      *end++ = 'x';
+      end = FormatHex64(end, reinterpret_cast<uintptr_t>(v));
+    }
+    LogInsertBytes(os, digits, end - digits);
+  }
+};
+
+// Threshold used by the LOG macros: the minimum log level, lowered while
+// the flight recorder wants filtered records and raised while adaptive
+// shedding is active. It is set at load time from VTZ_CPP_MIN_LOG_LEVEL,
+// so the guard filters from the first statement on, and kept up to date
+// by every change to those inputs.
+extern std::atomic<int> min_log_level_for_macros;
+
+// Set while log_stats.h counters are enabled.
+extern std::atomic<bool> log_stats_on;
+
+// Counts a statement the LOG macros filtered; see LogStats::filtered.
+void CountFilteredLogStatement();
+
+// Returns "on". When it is false and stats are enabled, counts the
+// statement as filtered: a load and a branch the filtered path takes while
+// stats are off.
+inline bool LogStatementIsOn(bool on) {
+  if (VTZ_PREDICT_FALSE(!on) &&
+      VTZ_PREDICT_FALSE(log_stats_on.load(std::memory_order_relaxed))) {
+    CountFilteredLogStatement();
+  }
+  return on;
+}
+
+// Statements below VTZ_MIN_LOG_LEVEL are compiled out, and not counted.
+inline bool LogSeverityIsOn(int severity) {
+  return severity >= VTZ_MIN_LOG_LEVEL &&
+         LogStatementIsOn(severity >= min_log_level_for_macros.load(
+                                          std::memory_order_relaxed));
+}
+
+// Runs "stream" at most once, and only if "cond" holds. Like the while loop
+// in CHECK_OP_LOG, this keeps the macro a single statement, so a filtered
+// LOG neither constructs a LogMessage nor evaluates its << operands.
+#define _VTZ_LOG_IF(cond, stream)                                   \
+  for (bool _vtz_log_on = (cond); _vtz_log_on; _vtz_log_on = false) \
+  stream
+
+#define _VTZ_LOG_SEVERITY(severity)                                      \
+  _VTZ_LOG_IF(::vtz::internal::LogSeverityIsOn(severity),                \
+              ::vtz::internal::LogMessage(__FILE__, __LINE__, severity)  \
+                  .stream())
+
+#define _VTZ_LOG_INFO _VTZ_LOG_SEVERITY(::vtz::INFO)
+#define _VTZ_LOG_WARNING _VTZ_LOG_SEVERITY(::vtz::WARNING)
+#define _VTZ_LOG_ERROR _VTZ_LOG_SEVERITY(::vtz::ERROR)
 #define _VTZ_LOG_FATAL \
-  ::vtz::internal::LogMessageFatal(__FILE__, __LINE__)
+  ::vtz::internal::LogMessageFatal(__FILE__, __LINE__).stream()
 
 #define _VTZ_LOG_QFATAL _VTZ_LOG_FATAL
 
 #define LOG(severity) _VTZ_LOG_##severity
 
+// Per-call-site VLOG state: (generation << 32) | resolved level. Static
+// storage, so it starts zeroed and generation 0 never matches.
+struct VLogSite {
+  std::atomic<uint64> state;
+};
+
+// Bumped by SetVModule()/SetMinVLogLevel() to invalidate every VLogSite.
+extern std::atomic<uint32> vlog_generation;
+
+// Resolves the verbose level for "file", caches it in "site" and returns
+// whether "level" is enabled.
+bool InitVLogSite(VLogSite* site, int level, const char* file);
+
+inline bool VLogIsOn(VLogSite* site, int level, const char* file) {
+  const uint64 state = site->state.load(std::memory_order_relaxed);
+  if (VTZ_PREDICT_TRUE(static_cast<uint32>(state >> 32) ==
+                       vlog_generation.load(std::memory_order_relaxed))) {
+    return level <= static_cast<int32>(static_cast<uint32>(state));
+  }
+  return InitVLogSite(site, level, file);
+}
+
+// True when VLOG(lvl) in this file would produce output. After the first
+// evaluation at a call site this is a load and compare of the cached level
+// (plus a read of vlog_generation, which only changes on reconfiguration);
+// no pattern matching happens until the settings change.
+#define VLOG_IS_ON(lvl)                                                  \
+  ([](int _vtz_vlog_level) {                                             \
+    static ::vtz::internal::VLogSite _vtz_vlog_site;                     \
+    return ::vtz::internal::VLogIsOn(&_vtz_vlog_site, _vtz_vlog_level,   \
+                                     __FILE__);                          \
+  }(lvl))
+
+// VLOG(n) logs at INFO severity when VLOG_IS_ON(n). See SetVModule().
+#define VLOG(lvl)                                                        \
+  _VTZ_LOG_IF(                                                           \
+      ::vtz::internal::LogSeverityIsOn(::vtz::INFO) &&                   \
+          ::vtz::internal::LogStatementIsOn(VLOG_IS_ON(lvl)),            \
+      ::vtz::internal::LogMessage(__FILE__, __LINE__, ::vtz::INFO).stream())
+
+// Rate-limited logging. Suppressed statements skip LogMessage construction
+// and argument evaluation, and the next line a call site emits starts with
+// "[N suppressed] ".
+//
+//   LOG_EVERY_N(WARNING, 1000)     1st, 1001st, ... occurrence per thread
+//   LOG_FIRST_N(ERROR, 10)         first 10 occurrences in the process
+//   LOG_EVERY_N_SEC(WARNING, 2.5)  at most once per 2.5 s per call site
+//   LOG_SAMPLED(INFO, 0.01)        each occurrence with probability 0.01
+//
+// LOG_EVERY_N and LOG_SAMPLED keep their state in thread_local variables so
+// a hot call site never bounces a cache line between cores; with T threads
+// on one site, LOG_EVERY_N emits up to T lines per N occurrences.
+// LOG_FIRST_N only reads its shared counter once the limit is reached.
+// LOG_EVERY_N_SEC claims each interval with one compare-and-swap and
+// batches its per-thread suppressed counts into the shared total.
+#define LOG_EVERY_N(severity, n)                                          \
+  _VTZ_LOG_RATE_LIMITED(                                                  \
+      severity, [](::vtz::int64 _vtz_n) -> ::vtz::uint64 {                \
+        static thread_local ::vtz::internal::LogEveryNState _vtz_state;   \
+        return ::vtz::internal::LogEveryNDecision(&_vtz_state, _vtz_n);   \
+      }(n))
+
+#define LOG_FIRST_N(severity, n)                                          \
+  _VTZ_LOG_RATE_LIMITED(                                                  \
+      severity, [](::vtz::int64 _vtz_n) -> ::vtz::uint64 {                \
+        static std::atomic< ::vtz::uint64> _vtz_count;                    \
+        return ::vtz::internal::LogFirstNDecision(&_vtz_count, _vtz_n);   \
+      }(n))
+
+#define LOG_EVERY_N_SEC(severity, seconds)                                \
+  _VTZ_LOG_RATE_LIMITED(                                                  \
+      severity, [](double _vtz_seconds) -> ::vtz::uint64 {                \
+        static ::vtz::internal::LogEveryNSecSite _vtz_site;               \
+        static thread_local ::vtz::uint64 _vtz_local_suppressed;          \
+        return ::vtz::internal::LogEveryNSecDecision(                     \
+            &_vtz_site, &_vtz_local_suppressed, _vtz_seconds);            \
+      }(seconds))
+
+#define LOG_SAMPLED(severity, probability)                                \
+  _VTZ_LOG_RATE_LIMITED(                                                  \
+      severity, [](double _vtz_p) -> ::vtz::uint64 {                      \
+        static thread_local ::vtz::internal::LogSampledState _vtz_state;  \
+        return ::vtz::internal::LogSampledDecision(&_vtz_state, _vtz_p);  \
+      }(probability))
+
+// "decision" returns 0 to suppress, or 1 + the number of occurrences
+// suppressed since the call site last emitted.
+#define _VTZ_LOG_RATE_LIMITED(severity, decision)                         \
+  for (::vtz::uint64 _vtz_rate =                                          \
+           ::vtz::internal::LogSeverityIsOn(::vtz::severity) ? (decision) \
+                                                             : 0;         \
+       _vtz_rate != 0; _vtz_rate = 0)                                     \
+  LOG(severity) << ::vtz::internal::LogSuppressed(_vtz_rate - 1)
+
+struct LogSuppressed {
+  explicit LogSuppressed(uint64 n) : count(n) {}
+  uint64 count;
+};
+
+// Writes "[N suppressed] " when N > 0.
+std::ostream& operator<<(std::ostream& os, const LogSuppressed& s);
+
+// All state structs are trivial so that static and thread_local instances
+// are zero-initialized without guards or TLS destructors.
+struct LogEveryNState {
+  bool started;
+  uint64 skipped;
+};
+
+inline uint64 LogEveryNDecision(LogEveryNState* s, int64 n) {
+  if (VTZ_PREDICT_TRUE(s->started &&
+                       static_cast<int64>(s->skipped) + 1 < n)) {
+    ++s->skipped;
+    return 0;
+  }
+  const uint64 result = s->skipped + 1;
+  s->skipped = 0;
+  s->started = true;
+  return result;
+}
+
+inline uint64 LogFirstNDecision(std::atomic<uint64>* count, int64 n) {
+  const int64 seen =
+      static_cast<int64>(count->load(std::memory_order_relaxed));
+  if (VTZ_PREDICT_TRUE(seen >= n)) return 0;
+  const int64 mine =
+      static_cast<int64>(count->fetch_add(1, std::memory_order_relaxed));
+  return mine < n ? 1 : 0;
+}
+
+struct LogEveryNSecSite {
+  std::atomic<int64> next_nanos;
+  std::atomic<uint64> suppressed;
+};
+
+int64 LogCoarseMonotonicNanos();
+
+// Slow path of LogEveryNSecDecision(): the interval may have elapsed.
+uint64 LogEveryNSecClaim(LogEveryNSecSite* site, uint64* local_suppressed,
+                         int64 now, double seconds);
+
+inline uint64 LogEveryNSecDecision(LogEveryNSecSite* site,
+                                   uint64* local_suppressed, double seconds) {
+  const int64 now = LogCoarseMonotonicNanos();
+  const int64 next = site->next_nanos.load(std::memory_order_relaxed);
+  if (VTZ_PREDICT_TRUE(now < next)) {
+    // Publish in batches so that contending threads rarely write the
+    // shared counter.
+    if (VTZ_PREDICT_FALSE(++*local_suppressed >= 256)) {
+      site->suppressed.fetch_add(*local_suppressed,
+                                 std::memory_order_relaxed);
+      *local_suppressed = 0;
+    }
+    return 0;
+  }
+  return LogEveryNSecClaim(site, local_suppressed, now, seconds);
+}
+
+struct LogSampledState {
+  uint64 rng;  // xorshift64 state, seeded on first use
+  uint64 skipped;
+};
+
+uint64 LogSampledSeed(LogSampledState* s);
+
+inline uint64 LogSampledDecision(LogSampledState* s, double probability) {
+  uint64 x = s->rng;
+  if (VTZ_PREDICT_FALSE(x == 0)) x = LogSampledSeed(s);
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  s->rng = x;
+  // Compare the top 53 bits against p scaled to the same range.
+  if (static_cast<double>(x >> 11) >=
+      probability * 9007199254740992.0 /* 2^53 */) {
+    ++s->skipped;
+    return 0;
+  }
+  const uint64 result = s->skipped + 1;
+  s->skipped = 0;
+  return result;
+}
+
 // CHECK dies with a fatal error if condition is not true.  It is *not*
 // controlled by NDEBUG, so the check will be executed regardless of
 // compilation mode.  Therefore, it is safe to do things like:
 //    CHECK(fp->Write(x) == 4)
-#define CHECK(condition)              \
-  if (VTZ_PREDICT_FALSE(!(condition))) \
-  LOG(FATAL) << "Check failed: " #condition " "
+#define CHECK(condition)                                                 \
+  if (VTZ_PREDICT_FALSE(!(condition)))                                    \
+  ::vtz::internal::CheckFailure(                                          \
+      ::vtz::internal::CheckFailed(_VTZ_CHECK_SITE(#condition)))          \
+      .stream()
 
 // Function is overloaded for integral types to allow static const
 // integrals declared in classes and not defined to be used as arguments to
@@ -106,10 +796,11 @@ inline unsigned long long GetReferenceableValue(unsigned long long t) {
 }
 
 // This formats a value for a failing CHECK_XX statement.  Ordinarily,
-// it uses the definition for operator<<, with a few special cases below.
+// it prints the value the way LOG() << would, with a few special cases
+// below.
 template <typename T>
 inline void MakeCheckOpValueString(std::ostream* os, const T& v) {
-  (*os) << v;
+  LogInserter<typename std::decay<T>::type>::Insert(*os, v);
 }
 
 // Overrides for char types provide readable values for unprintable
@@ -137,11 +828,65 @@ struct CheckOpString {
   string* str_;
 };
 
+// Where a CHECK statement is. Each statement has one static, constant
+// initialized instance, so its failure path passes a single pointer.
+struct CheckSite {
+  const char* file;
+  int line;
+  const char* exprtext;
+};
+
+// Evaluates to a pointer to the CheckSite of the enclosing statement.
+#define _VTZ_CHECK_SITE(exprtext)                                         \
+  ([]() -> const ::vtz::internal::CheckSite* {                            \
+    static const ::vtz::internal::CheckSite _vtz_check_site = {           \
+        __FILE__, __LINE__, exprtext};                                    \
+    return &_vtz_check_site;                                              \
+  }())
+
 // Build the error message string. Specify no inlining for code size.
 template <typename T1, typename T2>
 string* MakeCheckOpString(const T1& v1, const T2& v2,
                           const char* exprtext) VTZ_ATTRIBUTE_NOINLINE;
 
+// The failure path of CHECK_XX, one instance per pair of operand types:
+// starts the fatal record "Check failed: exprtext (v1 vs. v2)" that the
+// statement's own << operators append to. Kept out of line and cold, so a
+// CHECK_XX that passes costs its caller a compare and a branch.
+// Scalars are passed by value so that the passing path does not have to
+// keep them in memory for the call.
+template <typename T>
+struct CheckOpArg {
+  typedef typename std::conditional<std::is_scalar<T>::value, T,
+                                    const T&>::type type;
+};
+
+template <typename T1, typename T2>
+LogMessageFatal* CheckOpFailed(typename CheckOpArg<T1>::type v1,
+                               typename CheckOpArg<T2>::type v2,
+                               const CheckSite* site)
+    VTZ_ATTRIBUTE_NOINLINE VTZ_ATTRIBUTE_COLD VTZ_ATTRIBUTE_RETURNS_NONNULL;
+
+// The same for CHECK: starts "Check failed: exprtext ".
+LogMessageFatal* CheckFailed(const CheckSite* site)
+    VTZ_ATTRIBUTE_NOINLINE VTZ_ATTRIBUTE_COLD VTZ_ATTRIBUTE_RETURNS_NONNULL;
+
+// Holds the record a failing CHECK started until the end of the
+// statement, then writes it and aborts. Being a single pointer, it keeps
+// the LogMessage out of the caller's stack frame.
+class CheckFailure {
+ public:
+  explicit CheckFailure(LogMessageFatal* message) : message_(message) {}
+  VTZ_ATTRIBUTE_NORETURN VTZ_ATTRIBUTE_COLD ~CheckFailure();
+
+  LogMessage& stream() { return *message_; }
+
+ private:
+  LogMessageFatal* message_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(CheckFailure);
+};
+
 // A helper class for formatting "expr (V1 vs. V2)" in a CHECK_XX
 // statement.  See MakeCheckOpString for sample usage.  Other
 // approaches were considered: use of a template method (e.g.,
@@ -152,17 +897,44 @@ class CheckOpMessageBuilder {
  public:
   // Inserts "exprtext" and " (" to the stream.
   explicit CheckOpMessageBuilder(const char* exprtext);
-  // Deletes "stream_".
-  ~CheckOpMessageBuilder();
   // For inserting the first variable.
-  std::ostream* ForVar1() { return stream_; }
+  std::ostream* ForVar1() { return &stream_; }
   // For inserting the second variable (adds an intermediate " vs. ").
   std::ostream* ForVar2();
   // Get the result (inserts the closing ")").
   string* NewString();
+  // Starts a fatal record at "site" with the result.
+  LogMessageFatal* NewLogMessage(const CheckSite& site);
 
  private:
-  std::ostringstream* stream_;
+  // Formats into a buffer on the stack, and into "spill_" once that is
+  // full, so a short message needs no allocation until the result.
+  class StackStreamBuf : public std::streambuf {
+   public:
+    StackStreamBuf() : spilled_(false) {
+      setp(stack_, stack_ + sizeof(stack_));
+    }
+
+    const char* data() const { return spilled_ ? spill_.data() : stack_; }
+    size_t size() const {
+      return spilled_ ? spill_.size()
+                      : static_cast<size_t>(pptr() - pbase());
+    }
+
+   protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+   private:
+    char stack_[256];
+    bool spilled_;
+    std::string spill_;
+  };
+
+  StackStreamBuf buf_;
+  std::ostream stream_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(CheckOpMessageBuilder);
 };
 
 template <typename T1, typename T2>
@@ -173,7 +945,18 @@ string* MakeCheckOpString(const T1& v1, const T2& v2, const char* exprtext) {
   return comb.NewString();
 }
 
-// Helper functions for CHECK_OP macro.
+template <typename T1, typename T2>
+LogMessageFatal* CheckOpFailed(typename CheckOpArg<T1>::type v1,
+                               typename CheckOpArg<T2>::type v2,
+                               const CheckSite* site) {
+  CheckOpMessageBuilder comb(site->exprtext);
+  MakeCheckOpValueString(comb.ForVar1(), v1);
+  MakeCheckOpValueString(comb.ForVar2(), v2);
+  return comb.NewLogMessage(*site);
+}
+
+// Helper functions for CHECK_OP macro. They return the started fatal
+// record when the check fails and NULL otherwise.
 // The (int, int) specialization works around the issue that the compiler
 // will not instantiate the template version of the function on values of
 // unnamed enum type - see comment below.
@@ -181,31 +964,32 @@ string* MakeCheckOpString(const T1& v1, const T2& v2, const char* exprtext) {
 // comparison errors while still being thorough with the comparison.
 #define VTZ_DEFINE_CHECK_OP_IMPL(name, op)                                 \
   template <typename T1, typename T2>                                     \
-  inline string* name##Impl(const T1& v1, const T2& v2,                   \
-                            const char* exprtext) {                       \
+  inline LogMessageFatal* name##Impl(const T1& v1, const T2& v2,          \
+                                     const CheckSite* site) {             \
     if (VTZ_PREDICT_TRUE(v1 op v2))                                        \
       return NULL;                                                        \
     else                                                                  \
-      return ::vtz::internal::MakeCheckOpString(v1, v2, exprtext); \
+      return ::vtz::internal::CheckOpFailed<T1, T2>(v1, v2, site);        \
   }                                                                       \
-  inline string* name##Impl(int v1, int v2, const char* exprtext) {       \
-    return name##Impl<int, int>(v1, v2, exprtext);                        \
+  inline LogMessageFatal* name##Impl(int v1, int v2,                      \
+                                     const CheckSite* site) {             \
+    return name##Impl<int, int>(v1, v2, site);                            \
   }                                                                       \
-  inline string* name##Impl(const size_t v1, const int v2,                \
-                            const char* exprtext) {                       \
+  inline LogMessageFatal* name##Impl(const size_t v1, const int v2,       \
+                                     const CheckSite* site) {             \
     if (VTZ_PREDICT_FALSE(v2 < 0)) {                                       \
-      return ::vtz::internal::MakeCheckOpString(v1, v2, exprtext); \
+      return ::vtz::internal::CheckOpFailed<size_t, int>(v1, v2, site);   \
     }                                                                     \
     const size_t uval = (size_t)((unsigned)v1);                           \
-    return name##Impl<size_t, size_t>(uval, v2, exprtext);                \
+    return name##Impl<size_t, size_t>(uval, v2, site);                    \
   }                                                                       \
-  inline string* name##Impl(const int v1, const size_t v2,                \
-                            const char* exprtext) {                       \
+  inline LogMessageFatal* name##Impl(const int v1, const size_t v2,       \
+                                     const CheckSite* site) {             \
     if (VTZ_PREDICT_FALSE(v2 >= std::numeric_limits<int>::max())) {        \
-      return ::vtz::internal::MakeCheckOpString(v1, v2, exprtext); \
+      return ::vtz::internal::CheckOpFailed<int, size_t>(v1, v2, site);   \
     }                                                                     \
     const size_t uval = (size_t)((unsigned)v2);                           \
-    return name##Impl<size_t, size_t>(v1, uval, exprtext);                \
+    return name##Impl<size_t, size_t>(v1, uval, site);                    \
   }
 
 // We use the full name Check_EQ, Check_NE, etc. in case the file including
@@ -221,15 +1005,16 @@ VTZ_DEFINE_CHECK_OP_IMPL(Check_GE, >=)
 VTZ_DEFINE_CHECK_OP_IMPL(Check_GT, >)
 #undef VTZ_DEFINE_CHECK_OP_IMPL
 
-// In optimized mode, use CheckOpString to hint to compiler that
-// the while condition is unlikely.
-#define CHECK_OP_LOG(name, op, val1, val2)                            \
-  while (::vtz::internal::CheckOpString _result =              \
-             ::vtz::internal::name##Impl(                      \
-                 ::vtz::internal::GetReferenceableValue(val1), \
-                 ::vtz::internal::GetReferenceableValue(val2), \
-                 #val1 " " #op " " #val2))                            \
-  ::vtz::internal::LogMessageFatal(__FILE__, __LINE__) << *(_result.str_)
+// The loop body runs at most once: CheckFailure's destructor aborts. All a
+// failing check leaves inline is the call to CheckOpFailed, the
+// statement's own << operators and the call to ~CheckFailure.
+#define CHECK_OP_LOG(name, op, val1, val2)                               \
+  while (::vtz::internal::LogMessageFatal* _vtz_check_failed =           \
+             ::vtz::internal::name##Impl(                                \
+                 ::vtz::internal::GetReferenceableValue(val1),           \
+                 ::vtz::internal::GetReferenceableValue(val2),           \
+                 _VTZ_CHECK_SITE(#val1 " " #op " " #val2)))              \
+  ::vtz::internal::CheckFailure(_vtz_check_failed).stream()
 
 #define CHECK_OP(name, op, val1, val2) CHECK_OP_LOG(name, op, val1, val2)
 
@@ -288,7 +1073,7 @@ VTZ_DEFINE_CHECK_OP_IMPL(Check_GT, >)
 template <typename T>
 T&& CheckNotNull(const char* file, int line, const char* exprtext, T&& t) {
   if (t == nullptr) {
-    LogMessageFatal(file, line) << string(exprtext);
+    LogMessageFatal(file, line).stream() << string(exprtext);
   }
   return std::forward<T>(t);
 }
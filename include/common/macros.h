@@ -24,6 +24,8 @@ limitations under the License.
 #define VTZ_ATTRIBUTE_NOINLINE __attribute__((noinline))
 #define VTZ_ATTRIBUTE_UNUSED __attribute__((unused))
 #define VTZ_ATTRIBUTE_COLD __attribute__((cold))
+#define VTZ_ATTRIBUTE_RETURNS_NONNULL __attribute__((returns_nonnull))
+#define VTZ_ATTRIBUTE_INITIAL_EXEC __attribute__((tls_model("initial-exec")))
 #define VTZ_ATTRIBUTE_WEAK __attribute__((weak))
 #define VTZ_PACKED __attribute__((packed))
 #define VTZ_MUST_USE_RESULT __attribute__((warn_unused_result))
@@ -38,6 +40,8 @@ limitations under the License.
 #define VTZ_ATTRIBUTE_NOINLINE
 #define VTZ_ATTRIBUTE_UNUSED
 #define VTZ_ATTRIBUTE_COLD
+#define VTZ_ATTRIBUTE_RETURNS_NONNULL
+#define VTZ_ATTRIBUTE_INITIAL_EXEC
 #define VTZ_ATTRIBUTE_WEAK
 #define VTZ_MUST_USE_RESULT
 #define VTZ_PACKED
@@ -50,6 +54,8 @@ limitations under the License.
 #define VTZ_ATTRIBUTE_NOINLINE
 #define VTZ_ATTRIBUTE_UNUSED
 #define VTZ_ATTRIBUTE_COLD
+#define VTZ_ATTRIBUTE_RETURNS_NONNULL
+#define VTZ_ATTRIBUTE_INITIAL_EXEC
 #define VTZ_ATTRIBUTE_WEAK
 #define VTZ_MUST_USE_RESULT
 #define VTZ_PACKED
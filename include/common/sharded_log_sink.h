@@ -0,0 +1,177 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_SHARDED_LOG_SINK_H_
+#define VTZ_COMMON_SHARDED_LOG_SINK_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "integral_type.h"
+#include "log_sink.h"
+#include "macros.h"
+
+namespace vtz {
+
+// Which shard a record goes to.
+enum LogShardBy {
+  // The CPU the logging thread runs on, from sched_getcpu().
+  kLogShardByCpu = 0,
+  // The logging thread; threads are dealt out to the shards in the order
+  // they first log.
+  kLogShardByThread = 1,
+};
+
+struct ShardedLogSinkOptions {
+  ShardedLogSinkOptions()
+      : shard_by(kLogShardByCpu),
+        num_shards(0),
+        buffer_bytes(64 * 1024),
+        flush_interval_millis(1000) {}
+
+  // Shard i is written to "<path>.shard-<i>". Existing shard files are
+  // replaced.
+  std::string path;
+  LogShardBy shard_by;
+  // 0: one per configured CPU.
+  int num_shards;
+  // Each shard collects this much before it is written.
+  size_t buffer_bytes;
+  // A partly filled buffer is written after this long.
+  int64 flush_interval_millis;
+};
+
+// LogSink that gives each CPU, or each group of threads, an output file of
+// its own, so that threads on different cores never write to the same
+// buffer, lock or descriptor. Send() stamps the record with CLOCK_MONOTONIC
+// and the shard's next sequence number and appends it to the shard's
+// buffer under the shard's lock, which only threads that share the CPU or
+// the group ever contend for; the thread that fills the buffer writes it.
+//
+// Within a shard, records are in time order. ShardedLogReader, and the
+// vtz_logmerge tool built on it, merge the shards back into one stream.
+//
+//   vtz::ShardedLogSinkOptions options;
+//   options.path = "/var/log/server.log";
+//   vtz::ShardedLogSink* sink = vtz::ShardedLogSink::Create(options);
+//   vtz::AddLogSink(sink);
+//   vtz::SetStderrLogSeverity(vtz::NUM_SEVERITIES);
+class ShardedLogSink : public LogSink {
+ public:
+  // Returns nullptr if a shard file cannot be created.
+  static ShardedLogSink* Create(const ShardedLogSinkOptions& options);
+
+  // Writes what is buffered. Remove the sink with RemoveLogSink() first.
+  ~ShardedLogSink() override;
+
+  void Send(int severity, const char* data, size_t size) override;
+
+  // Writes every shard's buffer.
+  void Flush() override;
+
+  int num_shards() const { return num_shards_; }
+  // Records lost to failed writes, over all shards.
+  uint64 dropped();
+
+ private:
+  struct Shard;
+
+  explicit ShardedLogSink(const ShardedLogSinkOptions& options);
+
+  Shard* ShardForThisThread();
+  void BackgroundLoop();
+
+  const ShardedLogSinkOptions options_;
+  const int num_shards_;
+  std::unique_ptr<Shard[]> shards_;
+
+  std::mutex mu_;
+  std::condition_variable stop_cv_;
+  bool stop_;  // guarded by mu_
+  std::thread background_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(ShardedLogSink);
+};
+
+// One record read back from ShardedLogSink output.
+struct ShardedLogRecord {
+  uint64 nanos;     // CLOCK_MONOTONIC when the record reached Send()
+  uint64 sequence;  // per shard, from 0
+  int shard;
+  int severity;
+  // The text record, trailing newline included; valid until the reader is
+  // destroyed.
+  const char* data;
+  size_t size;
+};
+
+// Reads the shard files of a ShardedLogSink and returns their records
+// merged into one stream ordered by time, then shard, then sequence.
+//
+//   std::string error;
+//   vtz::ShardedLogReader* reader =
+//       vtz::ShardedLogReader::Open("/var/log/server.log", &error);
+//   vtz::ShardedLogRecord r;
+//   while (reader->Next(&r)) fwrite(r.data, 1, r.size, stdout);
+//   delete reader;
+//
+// A shard file cut short, as by a crash, is read up to its last complete
+// record.
+class ShardedLogReader {
+ public:
+  // Opens "<path>.shard-<i>" for every shard the sink wrote. Returns
+  // nullptr and sets "error" if one is missing or is not a shard file.
+  static ShardedLogReader* Open(const std::string& path, std::string* error);
+
+  // Opens the given shard files, which need not be all of them.
+  static ShardedLogReader* OpenFiles(const std::vector<std::string>& files,
+                                     std::string* error);
+
+  ~ShardedLogReader();
+
+  // Fills "record" with the next record; false at the end.
+  bool Next(ShardedLogRecord* record);
+
+  // Records missing from what was read so far: sequence numbers a shard
+  // skips, where the sink failed to write a buffer.
+  uint64 missing() const { return missing_; }
+
+ private:
+  struct File;
+
+  ShardedLogReader();
+
+  // Moves "file" to its next record; false at its end.
+  bool Advance(File* file);
+  // Heap order: whether the current record of "a" comes after that of "b".
+  static bool After(const File* a, const File* b);
+
+  std::vector<File*> files_;
+  // Files with records left, as a min-heap on their current record.
+  std::vector<File*> heap_;
+  // The file the last record came from; it goes back on the heap once it
+  // has moved past that record.
+  File* last_;
+  uint64 missing_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(ShardedLogReader);
+};
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_SHARDED_LOG_SINK_H_
@@ -0,0 +1,130 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Layout of the shared-memory segment between SharedMemoryLogSink and
+// vtz_logd. Not installed.
+//
+// The collector creates the segment: a ShmLogHeader followed by num_rings
+// rings, each a ShmLogRing control block and ring_bytes of data. A process
+// claims a ring by swapping its pid into owner_pid, and its threads then
+// reserve space in that ring with a CAS on head. A record starts with a
+// ShmLogRecordHeader whose first word stays 0 until the record is
+// complete, so the collector reads each ring in order up to the first
+// unfinished record. It zeroes what it has consumed before moving tail, so
+// every reservation starts out on zeroes.
+//
+// A process that dies with a record half written leaves a 0 word the
+// collector cannot read past. Since a ring has one owner, only that ring
+// is stuck; the collector notices the owner is gone, counts what it has to
+// discard and frees the ring for the next process.
+
+#ifndef VTZ_COMMON_SHM_LOG_PRIVATE_H_
+#define VTZ_COMMON_SHM_LOG_PRIVATE_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include "integral_type.h"
+
+namespace vtz {
+namespace internal {
+
+const char kShmLogMagic[8] = {'V', 'T', 'Z', 'S', 'H', 'M', '1', '\0'};
+const uint32 kShmLogVersion = 1;
+
+struct ShmLogHeader {
+  // Written last by the collector once the rings are set up.
+  std::atomic<uint64> magic;
+  uint32 version;
+  uint32 num_rings;
+  uint64 ring_bytes;   // a power of two
+  uint64 ring_stride;  // distance between rings, control block included
+  // Records from processes that found every ring taken.
+  std::atomic<uint64> unclaimed_drops;
+  char pad[24];
+};
+
+// ShmLogRing::state values.
+enum ShmLogRingState {
+  kShmRingFree = 0,
+  // owner_pid is set; owner_start_time is being written.
+  kShmRingClaiming = 1,
+  kShmRingActive = 2,
+  // The owner has detached; drain the ring and free it.
+  kShmRingClosed = 3,
+};
+
+struct ShmLogRing {
+  // Producer side. owner_pid goes from 0 to the pid by CAS; the collector
+  // resets the ring and stores 0 again to free it.
+  std::atomic<int32> owner_pid;
+  std::atomic<uint32> state;
+  // From /proc/<pid>/stat, to tell a reused pid from the owner.
+  std::atomic<uint64> owner_start_time;
+  std::atomic<uint64> written;  // records committed
+  std::atomic<uint64> dropped;  // records that found the ring full
+  char pad0[32];
+  std::atomic<uint64> head;  // reserved bytes, ever
+  char pad1[56];
+  std::atomic<uint64> tail;  // consumed bytes, ever; collector only
+  char pad2[56];
+
+  char* data() { return reinterpret_cast<char*>(this + 1); }
+};
+
+// ShmLogRecordHeader::word flags; the rest of the word is the total record
+// size, header and padding included, a multiple of kShmRecordAlign.
+const uint32 kShmRecordCommitted = 1;
+// Filler up to the end of the ring; skip it.
+const uint32 kShmRecordPadding = 2;
+const uint32 kShmRecordAlign = 8;
+
+struct ShmLogRecordHeader {
+  std::atomic<uint32> word;
+  uint32 text_size;
+  // CLOCK_MONOTONIC, which all processes on the host share, for merging.
+  uint64 nanos;
+};
+
+inline uint64 ShmRecordBytes(size_t text_size) {
+  const uint64 n = sizeof(ShmLogRecordHeader) + text_size;
+  return (n + kShmRecordAlign - 1) & ~static_cast<uint64>(kShmRecordAlign - 1);
+}
+
+inline uint64 ShmLogMagicWord() {
+  uint64 v;
+  static_assert(sizeof(v) == sizeof(kShmLogMagic), "magic is one word");
+  memcpy(&v, kShmLogMagic, sizeof(v));
+  return v;
+}
+
+inline ShmLogRing* ShmLogRingAt(ShmLogHeader* header, uint32 i) {
+  return reinterpret_cast<ShmLogRing*>(reinterpret_cast<char*>(header + 1) +
+                                       i * header->ring_stride);
+}
+
+// Size of a segment with "num_rings" rings of "ring_bytes" each.
+inline uint64 ShmLogSegmentBytes(uint32 num_rings, uint64 ring_bytes) {
+  return sizeof(ShmLogHeader) + num_rings * (sizeof(ShmLogRing) + ring_bytes);
+}
+
+// Start time of process "pid" in clock ticks since boot. Returns false if
+// there is no such process or it has exited and is waiting to be reaped.
+bool ReadProcessStartTime(int pid, uint64* start_time);
+
+}  // namespace internal
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_SHM_LOG_PRIVATE_H_
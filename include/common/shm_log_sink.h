@@ -0,0 +1,98 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_SHM_LOG_SINK_H_
+#define VTZ_COMMON_SHM_LOG_SINK_H_
+
+#include <atomic>
+#include <string>
+#include "integral_type.h"
+#include "log_sink.h"
+#include "macros.h"
+
+namespace vtz {
+
+namespace internal {
+struct ShmLogHeader;
+struct ShmLogRing;
+}  // namespace internal
+
+struct SharedMemoryLogSinkOptions {
+  SharedMemoryLogSinkOptions() : name("/vtz_logd") {}
+
+  // shm_open() name of the segment; the one vtz_logd was started with.
+  std::string name;
+};
+
+// LogSink that hands records to a vtz_logd collector running on the same
+// host, for processes that would otherwise all write to one stderr. Each
+// process gets a ring of its own in the collector's shared-memory segment,
+// and Send() copies the record into it after a CAS on the ring's head; no
+// lock is taken and no system call is made. vtz_logd merges the rings by
+// the time records reached Send() and writes the result.
+//
+// A child created by fork() claims a ring of its own on its first record,
+// so a prefork server can create the sink once, before forking:
+//
+//   vtz::SharedMemoryLogSink* sink =
+//       vtz::SharedMemoryLogSink::Create(vtz::SharedMemoryLogSinkOptions());
+//   if (sink != nullptr) {
+//     vtz::AddLogSink(sink);
+//     vtz::SetStderrLogSeverity(vtz::NUM_SEVERITIES);
+//   }
+//
+// Records that find the ring full, or every ring taken, are dropped and
+// counted; vtz_logd reports the counts per process.
+class SharedMemoryLogSink : public LogSink {
+ public:
+  // Returns nullptr if the segment does not exist, which usually means
+  // vtz_logd is not running, or cannot be mapped.
+  static SharedMemoryLogSink* Create(const SharedMemoryLogSinkOptions& options);
+
+  // Gives the ring back to the collector once it has drained it. Remove
+  // the sink with RemoveLogSink() first.
+  ~SharedMemoryLogSink() override;
+
+  void Send(int severity, const char* data, size_t size) override;
+
+  // Records are visible to the collector as soon as Send() returns.
+  void Flush() override {}
+
+  // Records this process dropped because its ring was full or it has none.
+  uint64 dropped() const;
+
+ private:
+  SharedMemoryLogSink(internal::ShmLogHeader* header, size_t mapped_bytes);
+
+  // This process's ring, claiming one if needed; nullptr if none is free.
+  internal::ShmLogRing* Ring();
+  internal::ShmLogRing* ClaimRing();
+
+  internal::ShmLogHeader* const header_;
+  const size_t mapped_bytes_;
+  // The ring and the fork generation it was claimed in; a child process
+  // sees a newer generation and claims its own.
+  std::atomic<internal::ShmLogRing*> ring_;
+  std::atomic<uint64> ring_generation_;
+  std::atomic<uint64> unclaimed_drops_;
+  // When to look for a free ring again after finding none.
+  std::atomic<uint64> next_claim_nanos_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(SharedMemoryLogSink);
+};
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_SHM_LOG_SINK_H_
@@ -0,0 +1,147 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_TRACE_H_
+#define VTZ_COMMON_TRACE_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include "integral_type.h"
+#include "macros.h"
+
+// Scoped latency tracing:
+//
+//   void HandleRequest() {
+//     VTZ_TRACE_SCOPE("HandleRequest");
+//     ...
+//     if (miss) VTZ_TRACE_EVENT("cache miss");
+//   }
+//
+// A scope records one complete event, its begin and end, when it exits; an
+// event records an instant. Names are kept by pointer, so pass string
+// literals. While tracing is off a scope costs a load and a branch; while
+// it is on, two reads of the time stamp counter and a store into the
+// thread's own buffer. Timestamps stay in raw counter ticks until
+// WriteChromeTrace() converts them.
+//
+// Build with -DVTZ_DISABLE_TRACING to compile the macros out.
+
+namespace vtz {
+
+struct TraceOptions {
+  TraceOptions() : events_per_thread(16 * 1024) {}
+
+  // Capacity of each thread's event buffer, rounded up to a power of two;
+  // an event takes 24 bytes. A full buffer overwrites its oldest events.
+  // Threads keep the buffer they were given first, and buffers of exited
+  // threads are handed to new threads, losing their events.
+  size_t events_per_thread;
+};
+
+// Starts recording. VTZ_CPP_TRACE_FILE=<path> does the same with default
+// options from the first trace macro on and writes the trace to <path> at
+// exit; WatchLogControlFile() also takes "trace=1" and "trace=0".
+// Returns false if tracing is already on.
+bool EnableTracing(const TraceOptions& options);
+
+// Stops recording. Recorded events stay available to WriteChromeTrace().
+void DisableTracing();
+
+bool TracingEnabled();
+
+// Writes every recorded event as Chrome trace-event JSON, which Perfetto
+// and chrome://tracing open. Timestamps are in microseconds on the clock
+// log lines use (see SetLogClock()). Events of threads that are tracing
+// meanwhile may be missing. Returns false on a write error.
+bool WriteChromeTrace(int fd);
+bool WriteChromeTraceFile(const std::string& path);
+
+namespace internal {
+
+// -1 until VTZ_CPP_TRACE_FILE has been read, then 0 (off) or 1 (on).
+extern std::atomic<int> trace_state;
+bool LoadTraceStateFromEnv();
+
+inline bool TraceIsOn() {
+  const int state = trace_state.load(std::memory_order_relaxed);
+  if (VTZ_PREDICT_TRUE(state == 0)) return false;
+  if (VTZ_PREDICT_TRUE(state > 0)) return true;
+  return LoadTraceStateFromEnv();
+}
+
+// Raw timestamp: the TSC on x86, else CLOCK_MONOTONIC nanoseconds. Never
+// returns 0.
+inline uint64 TraceClock() {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32 lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return (static_cast<uint64>(hi) << 32) | lo | 1;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (static_cast<uint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec) | 1;
+#endif
+}
+
+// Appends to the calling thread's buffer; "end" is 0 for an instant.
+void RecordTraceEvent(const char* name, uint64 begin, uint64 end);
+
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name)
+      : name_(name), begin_(TraceIsOn() ? TraceClock() : 0) {}
+  ~TraceScope() {
+    if (VTZ_PREDICT_FALSE(begin_ != 0)) {
+      RecordTraceEvent(name_, begin_, TraceClock());
+    }
+  }
+
+ private:
+  const char* const name_;
+  const uint64 begin_;  // 0 when tracing was off
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(TraceScope);
+};
+
+}  // namespace internal
+}  // namespace vtz
+
+#define _VTZ_TRACE_CONCAT_INNER(a, b) a##b
+#define _VTZ_TRACE_CONCAT(a, b) _VTZ_TRACE_CONCAT_INNER(a, b)
+
+#ifndef VTZ_DISABLE_TRACING
+
+#define VTZ_TRACE_SCOPE(name)                                          \
+  ::vtz::internal::TraceScope _VTZ_TRACE_CONCAT(_vtz_trace_scope_,     \
+                                                __LINE__)(name)
+
+#define VTZ_TRACE_EVENT(name)                                          \
+  do {                                                                 \
+    if (::vtz::internal::TraceIsOn()) {                                \
+      ::vtz::internal::RecordTraceEvent(                               \
+          name, ::vtz::internal::TraceClock(), 0);                     \
+    }                                                                  \
+  } while (0)
+
+#else
+
+#define VTZ_TRACE_SCOPE(name) static_cast<void>(0)
+#define VTZ_TRACE_EVENT(name) static_cast<void>(0)
+
+#endif  // VTZ_DISABLE_TRACING
+
+#endif  // VTZ_COMMON_TRACE_H_
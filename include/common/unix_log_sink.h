@@ -0,0 +1,130 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef VTZ_COMMON_UNIX_LOG_SINK_H_
+#define VTZ_COMMON_UNIX_LOG_SINK_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "integral_type.h"
+#include "log_sink.h"
+#include "macros.h"
+
+namespace vtz {
+
+enum UnixSocketType {
+  kUnixSocketDatagram = 0,  // SOCK_DGRAM
+  kUnixSocketSeqpacket = 1, // SOCK_SEQPACKET; the agent accept()s
+};
+
+struct UnixSocketLogSinkOptions {
+  UnixSocketLogSinkOptions()
+      : type(kUnixSocketDatagram),
+        spill_bytes(4 << 20),
+        max_batch(64),
+        reconnect_interval_millis(500) {}
+
+  // The agent's socket; a leading '@' names one in the abstract namespace.
+  std::string path;
+  UnixSocketType type;
+  // Records waiting to be sent, framing included, while the agent is slow
+  // or away. Records that do not fit are dropped and counted.
+  size_t spill_bytes;
+  // Records per sendmmsg().
+  int max_batch;
+  // How often to try the agent again while it is unreachable.
+  int64 reconnect_interval_millis;
+};
+
+// LogSink that sends each record as one message on an AF_UNIX datagram or
+// seqpacket socket, for a log agent on the same host. Send() only copies
+// the record into a bounded spill buffer; a background thread sends what
+// has collected with sendmmsg(), up to max_batch records per call, so a
+// busy process makes far fewer system calls than it logs records.
+//
+// When the agent is not there, or goes away, the background thread keeps
+// trying to reconnect and producers carry on: records wait in the spill
+// buffer and, once it is full, are dropped. After reconnecting the sink
+// first sends a WARNING record saying how many were dropped. Records the
+// agent had received but not read when it went away are lost with it.
+//
+//   vtz::UnixSocketLogSinkOptions options;
+//   options.path = "/run/log-agent.sock";
+//   vtz::UnixSocketLogSink* sink = vtz::UnixSocketLogSink::Create(options);
+//   vtz::AddLogSink(sink);
+//   vtz::SetStderrLogSeverity(vtz::NUM_SEVERITIES);
+class UnixSocketLogSink : public LogSink {
+ public:
+  // Returns nullptr if the path does not fit a sockaddr_un. The agent need
+  // not be running yet.
+  static UnixSocketLogSink* Create(const UnixSocketLogSinkOptions& options);
+
+  // Sends what is buffered, unless the agent is unreachable or takes
+  // nothing for reconnect_interval_millis; the rest is dropped. Remove the
+  // sink with RemoveLogSink() first.
+  ~UnixSocketLogSink() override;
+
+  void Send(int severity, const char* data, size_t size) override;
+
+  // Waits until the spill buffer is empty. Returns early while the agent
+  // is unreachable or has taken nothing for reconnect_interval_millis.
+  void Flush() override;
+
+  // Records handed to the socket and dropped, and sendmmsg() calls made.
+  uint64 sent();
+  uint64 dropped();
+  uint64 batches();
+  bool connected();
+
+ private:
+  explicit UnixSocketLogSink(const UnixSocketLogSinkOptions& options);
+
+  bool Connect();
+  void Disconnect();
+  // Sends the drop notice, if one is due, and up to max_batch records.
+  // Returns false if the socket failed.
+  bool SendBatch(std::unique_lock<std::mutex>* l);
+  void BackgroundLoop();
+
+  const UnixSocketLogSinkOptions options_;
+  int fd_;  // used by the background thread only
+
+  // The spill buffer: records framed by a uint32 size, 8-byte aligned,
+  // from "tail_" to "head_" (indexes into "buffer_" modulo its size). A
+  // frame that would run past the end is preceded by a padding frame.
+  std::vector<char> buffer_;
+  std::mutex mu_;
+  std::condition_variable work_cv_;   // background thread waits
+  std::condition_variable empty_cv_;  // Flush() waits
+  uint64 head_;                       // guarded by mu_
+  uint64 tail_;                       // guarded by mu_
+  uint64 records_;                    // guarded by mu_; in the buffer
+  uint64 sent_;                       // guarded by mu_
+  uint64 dropped_;                    // guarded by mu_
+  uint64 reported_dropped_;           // guarded by mu_
+  uint64 batches_;                    // guarded by mu_
+  bool connected_;                    // guarded by mu_
+  bool stop_;                         // guarded by mu_
+  std::thread background_;
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(UnixSocketLogSink);
+};
+
+}  // namespace vtz
+
+#endif  // VTZ_COMMON_UNIX_LOG_SINK_H_
@@ -0,0 +1,614 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/async_logging.h"
+#include "common/log_output_private.h"
+#include "common/logging.h"
+#include "common/macros.h"
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace vtz {
+namespace internal {
+
+namespace {
+
+// Every record in a ring starts with this header and is padded to 8 bytes.
+struct RecordHeader {
+  uint32 size;      // payload bytes, or kWrapMarker
+  uint16 kind;      // LogRecordKind
+  uint16 severity;
+};
+
+const uint32 kWrapMarker = 0xffffffffu;
+const size_t kRecordAlign = 8;
+
+inline size_t RoundUpRecord(size_t n) {
+  return (n + kRecordAlign - 1) & ~(kRecordAlign - 1);
+}
+
+size_t RoundUpPowerOfTwo(size_t n) {
+  size_t v = 4096;
+  while (v < n) v <<= 1;
+  return v;
+}
+
+// Single-producer single-consumer byte ring. The owning thread appends,
+// the writer thread consumes. head_ and tail_ are free-running byte
+// counters kept on separate cache lines.
+class ThreadRing {
+ public:
+  explicit ThreadRing(size_t capacity)
+      : buf_(new char[capacity]),
+        capacity_(capacity),
+        mask_(capacity - 1),
+        pending_head_(0),
+        head_(0),
+        tail_(0),
+        read_(0),
+        abandoned_(false),
+        next_(nullptr) {}
+  ~ThreadRing() { delete[] buf_; }
+
+  size_t capacity() const { return capacity_; }
+
+  // Producer side. Returns space for "size" payload bytes, or nullptr when
+  // the record does not fit right now. The record becomes visible to the
+  // writer on Commit().
+  char* TryReserve(int kind, int severity, size_t size) {
+    const size_t need = RoundUpRecord(sizeof(RecordHeader) + size);
+    uint64 head = head_.load(std::memory_order_relaxed);
+    const uint64 tail = tail_.load(std::memory_order_acquire);
+    size_t offset = head & mask_;
+    const size_t to_end = capacity_ - offset;
+    const size_t total = need <= to_end ? need : to_end + need;
+    if (head + total - tail > capacity_) return nullptr;
+    if (need > to_end) {
+      RecordHeader wrap = {kWrapMarker, 0, 0};
+      memcpy(buf_ + offset, &wrap, sizeof(wrap));
+      head += to_end;
+      offset = 0;
+    }
+    RecordHeader hdr = {static_cast<uint32>(size), static_cast<uint16>(kind),
+                        static_cast<uint16>(severity)};
+    memcpy(buf_ + offset, &hdr, sizeof(hdr));
+    pending_head_ = head + need;
+    return buf_ + offset + sizeof(hdr);
+  }
+
+  void Commit() { head_.store(pending_head_, std::memory_order_release); }
+
+  size_t Used() const {
+    return head_.load(std::memory_order_relaxed) -
+           tail_.load(std::memory_order_relaxed);
+  }
+
+  // Consumer side. Returns the next published record, skipping wrap
+  // markers, or false if there is none. Its space stays reserved until
+  // Release(), so "payload" remains valid until then.
+  bool Next(RecordHeader* hdr, const char** payload) {
+    const uint64 head = head_.load(std::memory_order_acquire);
+    while (read_ != head) {
+      const size_t offset = read_ & mask_;
+      memcpy(hdr, buf_ + offset, sizeof(*hdr));
+      if (hdr->size == kWrapMarker) {
+        read_ += capacity_ - offset;
+        continue;
+      }
+      *payload = buf_ + offset + sizeof(*hdr);
+      read_ += RoundUpRecord(sizeof(*hdr) + hdr->size);
+      return true;
+    }
+    return false;
+  }
+
+  // Hands the space of every record returned by Next() back to the
+  // producer.
+  void Release() { tail_.store(read_, std::memory_order_release); }
+
+  // Bytes returned by Next() but not released yet.
+  size_t Unreleased() const {
+    return read_ - tail_.load(std::memory_order_relaxed);
+  }
+
+  bool Empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_relaxed);
+  }
+
+  void Abandon() { abandoned_.store(true, std::memory_order_release); }
+  bool abandoned() const { return abandoned_.load(std::memory_order_acquire); }
+
+  ThreadRing* next() const { return next_; }
+  ThreadRing** next_link() { return &next_; }
+  void set_next(ThreadRing* next) { next_ = next; }
+
+ private:
+  char* const buf_;
+  const size_t capacity_;
+  const size_t mask_;
+  uint64 pending_head_;  // producer only
+  // Padding rather than alignas: plain operator new ignores over-alignment
+  // before C++17.
+  char pad0_[64];
+  std::atomic<uint64> head_;
+  char pad1_[64];
+  std::atomic<uint64> tail_;
+  uint64 read_;  // consumer only; >= tail_
+  char pad2_[64];
+  std::atomic<bool> abandoned_;
+  ThreadRing* next_;  // guarded by AsyncState::mu
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(ThreadRing);
+};
+
+// iovecs per writev(); UIO_MAXIOV on Linux.
+const int kMaxBatchRecords = 1024;
+
+// Where the text of a kPayloadLogRecord starts.
+const size_t kRingPayloadBytes = RoundUpRecord(sizeof(LogPayload));
+
+int64 MonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Stderr records waiting for one writev(). The iovecs point straight into
+// the rings, which hold on to the space until the batch has been written.
+// Used by the draining thread only.
+class StderrBatch {
+ public:
+  StderrBatch() : count_(0), bytes_(0), oldest_micros_(0) {}
+
+  bool empty() const { return count_ == 0; }
+  int count() const { return count_; }
+  size_t bytes() const { return bytes_; }
+  int64 oldest_micros() const { return oldest_micros_; }
+
+  // Returns true, with the reason, if the batch must be written now.
+  bool Add(const AsyncLoggingOptions& options, int severity,
+           const char* data, size_t size, int* reason) {
+    if (count_ == 0) oldest_micros_ = MonotonicMicros();
+    iov_[count_].iov_base = const_cast<char*>(data);
+    iov_[count_].iov_len = size;
+    ++count_;
+    bytes_ += size;
+    if (severity >= options.batch_flush_severity) {
+      *reason = kBatchFlushSeverity;
+      return true;
+    }
+    if (bytes_ >= options.batch_bytes || count_ == kMaxBatchRecords) {
+      *reason = kBatchFlushSize;
+      return true;
+    }
+    return false;
+  }
+
+  void Write() {
+    WriteStderrv(iov_, count_);
+    count_ = 0;
+    bytes_ = 0;
+  }
+
+ private:
+  struct iovec iov_[kMaxBatchRecords];
+  int count_;
+  size_t bytes_;
+  int64 oldest_micros_;
+};
+
+struct BatchCounters {
+  BatchCounters() : batches(0), records(0), bytes(0), max_batch_records(0) {
+    for (int i = 0; i < kNumBatchFlushReasons; ++i) by_reason[i] = 0;
+  }
+
+  // Written by the draining thread, read by GetAsyncBatchStats().
+  std::atomic<uint64> batches;
+  std::atomic<uint64> records;
+  std::atomic<uint64> bytes;
+  std::atomic<uint64> max_batch_records;
+  std::atomic<uint64> by_reason[kNumBatchFlushReasons];
+};
+
+struct AsyncState {
+  AsyncState()
+      : enabled(false),
+        writer_sleeping(false),
+        dropped(0),
+        rings(nullptr),
+        stop(false),
+        flush_requested(0),
+        flush_completed(0) {}
+
+  std::atomic<bool> enabled;
+  std::atomic<bool> writer_sleeping;
+  std::atomic<uint64> dropped;
+  AsyncLoggingOptions options;  // written only while !enabled
+
+  std::mutex mu;
+  std::condition_variable wake_cv;
+  std::condition_variable flushed_cv;
+  ThreadRing* rings;  // guarded by mu
+  bool stop;          // guarded by mu
+  uint64 flush_requested;  // guarded by mu
+  uint64 flush_completed;  // guarded by mu
+  std::thread writer;
+
+  StderrBatch batch;  // draining thread only
+  BatchCounters batch_counters;
+};
+
+// Leaked on purpose so that threads exiting during static destruction can
+// still hand their rings back.
+AsyncState* State() {
+  static AsyncState* state = new AsyncState;
+  return state;
+}
+
+// Set once the thread's ring has been handed back. Records logged from
+// later thread_local destructors are written synchronously: the writer may
+// already have freed the ring.
+thread_local bool thread_ring_released VTZ_ATTRIBUTE_INITIAL_EXEC = false;
+
+// Owns the calling thread's ring. On thread exit the ring is handed to the
+// writer, which frees it once it has been drained.
+class ThreadRingHolder {
+ public:
+  ThreadRingHolder() : ring_(nullptr) {}
+  ~ThreadRingHolder() {
+    thread_ring_released = true;
+    ThreadRing* ring = ring_;
+    ring_ = nullptr;
+    if (ring != nullptr) ring->Abandon();
+  }
+
+  ThreadRing* Get() {
+    if (VTZ_PREDICT_TRUE(ring_ != nullptr)) return ring_;
+    AsyncState* s = State();
+    ring_ = new ThreadRing(
+        RoundUpPowerOfTwo(s->options.ring_bytes_per_thread));
+    std::lock_guard<std::mutex> l(s->mu);
+    ring_->set_next(s->rings);
+    s->rings = ring_;
+    return ring_;
+  }
+
+ private:
+  ThreadRing* ring_;
+};
+
+thread_local ThreadRingHolder thread_ring;
+
+// Set on the writer thread. What it logs itself, from a LogSink or a CHECK
+// failure say, is written synchronously: it would otherwise wait on rings
+// only it drains.
+thread_local bool on_writer_thread VTZ_ATTRIBUTE_INITIAL_EXEC = false;
+
+void WakeWriter(AsyncState* s) {
+  if (s->writer_sleeping.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> l(s->mu);
+    s->wake_cv.notify_one();
+  }
+}
+
+// Writes out the pending batch and returns the space it used to every
+// ring.
+void FlushBatch(AsyncState* s, int reason) {
+  StderrBatch* batch = &s->batch;
+  if (!batch->empty()) {
+    BatchCounters* c = &s->batch_counters;
+    const uint64 count = static_cast<uint64>(batch->count());
+    c->batches.fetch_add(1, std::memory_order_relaxed);
+    c->records.fetch_add(count, std::memory_order_relaxed);
+    c->bytes.fetch_add(batch->bytes(), std::memory_order_relaxed);
+    c->by_reason[reason].fetch_add(1, std::memory_order_relaxed);
+    if (count > c->max_batch_records.load(std::memory_order_relaxed)) {
+      c->max_batch_records.store(count, std::memory_order_relaxed);
+    }
+    if (VTZ_PREDICT_FALSE(log_write_timing.load(std::memory_order_relaxed))) {
+      const int64 start = LogWriteClockNanos();
+      batch->Write();
+      NoteLogWriteNanos(LogWriteClockNanos() - start);
+    } else {
+      batch->Write();
+    }
+  }
+  ThreadRing* head;
+  {
+    std::lock_guard<std::mutex> l(s->mu);
+    head = s->rings;
+  }
+  for (ThreadRing* r = head; r != nullptr; r = r->next()) r->Release();
+}
+
+// Hands every published record of "r" to its output and returns how many
+// there were. Stderr records join the batch.
+size_t DrainRing(AsyncState* s, ThreadRing* r) {
+  size_t n = 0;
+  RecordHeader hdr;
+  const char* payload;
+  while (r->Next(&hdr, &payload)) {
+    ++n;
+    if (hdr.kind == kBinaryLogRecord) {
+      WriteBinaryLogRecord(payload, hdr.size);
+    } else if (hdr.kind == kPayloadLogRecord) {
+      // Written on its own, after what is batched, so that the attached
+      // bytes go out from where they are; then the owner is let go.
+      LogPayload* attached =
+          reinterpret_cast<LogPayload*>(const_cast<char*>(payload));
+      if (!s->batch.empty()) FlushBatch(s, kBatchFlushPayload);
+      WritePayloadLogRecord(hdr.severity, payload + kRingPayloadBytes,
+                            hdr.size - kRingPayloadBytes, *attached);
+      attached->~LogPayload();
+    } else {
+      SendToLogSinks(hdr.severity, payload, hdr.size);
+      int reason;
+      if (StderrLogIsOn(hdr.severity) &&
+          s->batch.Add(s->options, hdr.severity, payload, hdr.size,
+                       &reason)) {
+        FlushBatch(s, reason);
+        continue;
+      }
+    }
+    if (s->batch.empty()) {
+      // Release as we go so a blocked producer can make progress.
+      r->Release();
+    } else if (r->Unreleased() > r->capacity() / 4) {
+      FlushBatch(s, kBatchFlushRingSpace);
+    }
+  }
+  return n;
+}
+
+// Drains every ring once and frees the ones whose threads have exited.
+// Only one thread may drain at a time.
+size_t DrainAllRings(AsyncState* s) {
+  ThreadRing* head;
+  {
+    std::lock_guard<std::mutex> l(s->mu);
+    head = s->rings;
+  }
+  // Rings are only unlinked here, so walking the snapshot is safe; new
+  // rings are pushed at the front and picked up by the next pass.
+  size_t n = 0;
+  for (ThreadRing* r = head; r != nullptr;) {
+    const bool abandoned = r->abandoned();
+    n += DrainRing(s, r);
+    ThreadRing* next = r->next();
+    // Not empty while the batch still points into it.
+    if (abandoned && r->Empty()) {
+      std::lock_guard<std::mutex> l(s->mu);
+      ThreadRing** link = &s->rings;
+      while (*link != r) link = (*link)->next_link();
+      *link = next;
+      delete r;
+    }
+    r = next;
+  }
+  return n;
+}
+
+void WriterLoop(AsyncState* s) {
+  on_writer_thread = true;
+  const int64 idle_wait = s->options.idle_wait_micros;
+  const int64 batch_delay = s->options.batch_delay_micros;
+  for (;;) {
+    uint64 target;
+    bool flush_wanted;
+    bool stopping;
+    {
+      std::lock_guard<std::mutex> l(s->mu);
+      target = s->flush_requested;
+      stopping = s->stop;
+      flush_wanted = stopping || target != s->flush_completed;
+    }
+    const size_t drained = DrainAllRings(s);
+    int64 wait = idle_wait;
+    if (!s->batch.empty()) {
+      const int64 age = MonotonicMicros() - s->batch.oldest_micros();
+      if (flush_wanted) {
+        FlushBatch(s, kBatchFlushRequested);
+      } else if (drained == 0) {
+        FlushBatch(s, kBatchFlushIdle);
+      } else if (age >= batch_delay) {
+        FlushBatch(s, kBatchFlushDeadline);
+      } else {
+        wait = std::min(wait, batch_delay - age);
+      }
+    }
+    FlushLogOutput();
+    std::unique_lock<std::mutex> l(s->mu);
+    s->flush_completed = target;
+    s->flushed_cv.notify_all();
+    if (stopping) break;
+    if (s->flush_requested == target && !s->stop) {
+      s->writer_sleeping.store(true, std::memory_order_relaxed);
+      s->wake_cv.wait_for(l, std::chrono::microseconds(wait));
+      s->writer_sleeping.store(false, std::memory_order_relaxed);
+    }
+  }
+}
+
+}  // namespace
+
+char* AsyncLogReserve(int kind, int severity, size_t size, bool* dropped) {
+  *dropped = false;
+  AsyncState* s = State();
+  if (!s->enabled.load(std::memory_order_acquire)) return nullptr;
+  if (VTZ_PREDICT_FALSE(on_writer_thread || thread_ring_released)) {
+    return nullptr;
+  }
+  ThreadRing* ring = thread_ring.Get();
+  if (VTZ_PREDICT_FALSE(RoundUpRecord(sizeof(RecordHeader) + size) >
+                        ring->capacity() / 2)) {
+    // Too large to ever fit comfortably; keep this thread's order by
+    // draining first and let the caller write it directly.
+    FlushLogs();
+    return nullptr;
+  }
+  for (;;) {
+    char* p = ring->TryReserve(kind, severity, size);
+    if (VTZ_PREDICT_TRUE(p != nullptr)) return p;
+    switch (s->options.full_policy) {
+      case kAsyncDrop:
+        s->dropped.fetch_add(1, std::memory_order_relaxed);
+        *dropped = true;
+        return nullptr;
+      case kAsyncSyncFallback:
+        return nullptr;
+      case kAsyncBlock:
+      default:
+        WakeWriter(s);
+        if (!s->enabled.load(std::memory_order_acquire)) return nullptr;
+        std::this_thread::yield();
+        break;
+    }
+  }
+}
+
+void AsyncLogCommit() {
+  AsyncState* s = State();
+  ThreadRing* ring = thread_ring.Get();
+  ring->Commit();
+  const size_t used = ring->Used();
+  if (VTZ_PREDICT_FALSE(log_stats_on.load(std::memory_order_relaxed))) {
+    NoteLogQueueDepth(used);
+  }
+  if (VTZ_PREDICT_FALSE(used > ring->capacity() / 2)) WakeWriter(s);
+}
+
+double AsyncLogQueueFill() {
+  AsyncState* s = State();
+  if (!s->enabled.load(std::memory_order_acquire)) return 0;
+  std::lock_guard<std::mutex> l(s->mu);
+  double fill = 0;
+  for (ThreadRing* r = s->rings; r != nullptr; r = r->next()) {
+    fill = std::max(fill, static_cast<double>(r->Used()) /
+                              static_cast<double>(r->capacity()));
+  }
+  return fill;
+}
+
+bool AsyncLogAppend(int severity, const char* data, size_t size) {
+  bool dropped;
+  char* p = AsyncLogReserve(kTextLogRecord, severity, size, &dropped);
+  if (p == nullptr) return dropped;
+  memcpy(p, data, size);
+  AsyncLogCommit();
+  return true;
+}
+
+bool AsyncLogAppendPayload(int severity, const char* data, size_t size,
+                           const LogPayload& payload) {
+  bool dropped;
+  if (payload.owner) {
+    char* p = AsyncLogReserve(kPayloadLogRecord, severity,
+                              kRingPayloadBytes + size, &dropped);
+    if (p == nullptr) return dropped;
+    new (p) LogPayload(payload);
+    memcpy(p + kRingPayloadBytes, data, size);
+    AsyncLogCommit();
+    return true;
+  }
+  // The caller's bytes may be gone by the time the writer gets here.
+  const size_t text = LogPayloadTextSize(payload);
+  char* p = AsyncLogReserve(kTextLogRecord, severity, size + text, &dropped);
+  if (p == nullptr) return dropped;
+  memcpy(p, data, payload.offset);
+  char* end = AppendLogPayloadText(payload, p + payload.offset);
+  memcpy(end, data + payload.offset, size - payload.offset);
+  AsyncLogCommit();
+  return true;
+}
+
+}  // namespace internal
+
+bool StartAsyncLogging(const AsyncLoggingOptions& options) {
+  internal::AsyncState* s = internal::State();
+  std::lock_guard<std::mutex> l(s->mu);
+  if (s->enabled.load(std::memory_order_relaxed)) return false;
+  s->options = options;
+  s->stop = false;
+  s->writer = std::thread(internal::WriterLoop, s);
+  s->enabled.store(true, std::memory_order_release);
+  return true;
+}
+
+void StopAsyncLogging() {
+  // The writer thread cannot join itself.
+  if (internal::on_writer_thread) return;
+  internal::AsyncState* s = internal::State();
+  {
+    std::lock_guard<std::mutex> l(s->mu);
+    if (!s->enabled.load(std::memory_order_relaxed)) return;
+    s->enabled.store(false, std::memory_order_release);
+    s->stop = true;
+    s->wake_cv.notify_one();
+  }
+  s->writer.join();
+  // Pick up anything appended between the writer's last pass and the
+  // enabled flag flipping.
+  internal::DrainAllRings(s);
+  internal::FlushBatch(s, kBatchFlushRequested);
+  internal::FlushLogOutput();
+}
+
+void FlushLogs() {
+  internal::FlushCoalescedLogRecords();
+  // The writer thread would wait on itself; what it logs is not queued.
+  if (internal::on_writer_thread) return;
+  internal::AsyncState* s = internal::State();
+  std::unique_lock<std::mutex> l(s->mu);
+  if (!s->enabled.load(std::memory_order_relaxed)) return;
+  const uint64 ticket = ++s->flush_requested;
+  s->wake_cv.notify_one();
+  s->flushed_cv.wait(l, [s, ticket] {
+    return s->flush_completed >= ticket ||
+           !s->enabled.load(std::memory_order_relaxed);
+  });
+}
+
+bool AsyncLoggingEnabled() {
+  return internal::State()->enabled.load(std::memory_order_acquire);
+}
+
+uint64 AsyncLoggingDroppedCount() {
+  return internal::State()->dropped.load(std::memory_order_relaxed);
+}
+
+AsyncBatchStats GetAsyncBatchStats() {
+  const internal::BatchCounters& c = internal::State()->batch_counters;
+  AsyncBatchStats stats;
+  stats.batches = c.batches.load(std::memory_order_relaxed);
+  stats.records = c.records.load(std::memory_order_relaxed);
+  stats.bytes = c.bytes.load(std::memory_order_relaxed);
+  stats.max_batch_records = c.max_batch_records.load(std::memory_order_relaxed);
+  for (int i = 0; i < kNumBatchFlushReasons; ++i) {
+    stats.flushes_by_reason[i] =
+        c.by_reason[i].load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+}  // namespace vtz
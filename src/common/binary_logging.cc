@@ -0,0 +1,133 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/binary_logging.h"
+#include "common/async_logging.h"
+#include "common/log_output_private.h"
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace vtz {
+namespace internal {
+
+std::atomic<bool> binary_log_open(false);
+
+namespace {
+
+struct BinaryLogState {
+  BinaryLogState() : file(nullptr) {}
+
+  std::mutex mu;
+  FILE* file;  // guarded by mu
+  // Encoded 'S' records, indexed by id - 1, so that a newly opened log
+  // can be primed with every site registered so far. Guarded by mu.
+  std::vector<std::string> sites;
+};
+
+BinaryLogState* BinaryState() {
+  static BinaryLogState* state = new BinaryLogState;
+  return state;
+}
+
+template <typename T>
+void AppendRaw(std::string* out, const T& v) {
+  out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void AppendShortString(std::string* out, const char* s) {
+  size_t n = strlen(s);
+  if (n > 0xffff) n = 0xffff;
+  AppendRaw(out, static_cast<uint16>(n));
+  out->append(s, n);
+}
+
+}  // namespace
+
+uint32 RegisterBinaryLogSite(BinaryLogSite* site, const char* file, int line,
+                             int severity, const char* fmt,
+                             const char* types, int nargs) {
+  BinaryLogState* s = BinaryState();
+  std::lock_guard<std::mutex> l(s->mu);
+  uint32 id = site->id.load(std::memory_order_relaxed);
+  if (id != 0) return id;
+  id = static_cast<uint32>(s->sites.size() + 1);
+
+  std::string payload;
+  AppendRaw(&payload, id);
+  AppendRaw(&payload, static_cast<uint8>(severity));
+  AppendRaw(&payload, static_cast<uint32>(line));
+  AppendShortString(&payload, file);
+  AppendShortString(&payload, fmt);
+  AppendRaw(&payload, static_cast<uint8>(nargs));
+  payload.append(types, nargs);
+
+  std::string record(1, kBinaryLogSiteKind);
+  AppendRaw(&record, static_cast<uint32>(payload.size()));
+  record += payload;
+  // Written before any entry for this site can reach the file: entries
+  // either follow on this thread or sit in a ring until the writer runs.
+  if (s->file != nullptr) fwrite(record.data(), 1, record.size(), s->file);
+  s->sites.push_back(record);
+  site->id.store(id, std::memory_order_release);
+  return id;
+}
+
+void WriteBinaryLogEntrySync(const char* data, size_t size) {
+  WriteBinaryLogRecord(data, size);
+}
+
+void WriteBinaryLogRecord(const char* data, size_t size) {
+  BinaryLogState* s = BinaryState();
+  std::lock_guard<std::mutex> l(s->mu);
+  if (s->file != nullptr) fwrite(data, 1, size, s->file);
+}
+
+void FlushBinaryLog() {
+  BinaryLogState* s = BinaryState();
+  std::lock_guard<std::mutex> l(s->mu);
+  if (s->file != nullptr) fflush(s->file);
+}
+
+}  // namespace internal
+
+bool OpenBinaryLog(const char* path) {
+  internal::BinaryLogState* s = internal::BinaryState();
+  std::lock_guard<std::mutex> l(s->mu);
+  if (s->file != nullptr) return false;
+  FILE* f = fopen(path, "wb");
+  if (f == nullptr) return false;
+  fwrite(internal::kBinaryLogMagic, 1, sizeof(internal::kBinaryLogMagic), f);
+  for (size_t i = 0; i < s->sites.size(); ++i) {
+    fwrite(s->sites[i].data(), 1, s->sites[i].size(), f);
+  }
+  s->file = f;
+  internal::binary_log_open.store(true, std::memory_order_relaxed);
+  return true;
+}
+
+void CloseBinaryLog() {
+  internal::BinaryLogState* s = internal::BinaryState();
+  internal::binary_log_open.store(false, std::memory_order_relaxed);
+  // Entries still sitting in async rings go out before the file closes.
+  FlushLogs();
+  std::lock_guard<std::mutex> l(s->mu);
+  if (s->file == nullptr) return;
+  fclose(s->file);
+  s->file = nullptr;
+}
+
+}  // namespace vtz
@@ -0,0 +1,193 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/compressed_log_sink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include "common/log_compression_private.h"
+
+namespace vtz {
+
+namespace {
+
+CompressedLogSinkOptions Normalize(CompressedLogSinkOptions options) {
+  options.block_bytes = std::max<size_t>(options.block_bytes, 4096);
+  options.block_bytes =
+      std::min<size_t>(options.block_bytes, internal::kMaxLogBlockBytes / 2);
+  options.max_pending_blocks = std::max(options.max_pending_blocks, 1);
+  options.flush_interval_millis =
+      std::max<int64>(options.flush_interval_millis, 1);
+  return options;
+}
+
+int64 MonotonicMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+void WriteAll(int fd, const std::string& data) {
+  const char* p = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    const ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;  // a sink has nowhere to report this
+    }
+    p += n;
+    left -= n;
+  }
+}
+
+}  // namespace
+
+CompressedLogSink* CompressedLogSink::Create(
+    const CompressedLogSinkOptions& options) {
+  const int fd = open(options.path.c_str(),
+                      O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) return nullptr;
+  CompressedLogSink* sink = new CompressedLogSink(options, fd);
+  sink->background_ = std::thread(&CompressedLogSink::BackgroundLoop, sink);
+  return sink;
+}
+
+CompressedLogSink::CompressedLogSink(const CompressedLogSinkOptions& options,
+                                     int fd)
+    : options_(Normalize(options)),
+      fd_(fd),
+      filling_(nullptr),
+      filling_since_millis_(0),
+      sealed_(0),
+      written_(0),
+      raw_bytes_(0),
+      compressed_bytes_(0),
+      stop_(false) {
+  // One block filling while the rest wait for the background thread.
+  for (int i = 0; i <= options_.max_pending_blocks; ++i) {
+    free_.push_back(new std::string);
+    free_.back()->reserve(options_.block_bytes);
+  }
+}
+
+CompressedLogSink::~CompressedLogSink() {
+  {
+    std::lock_guard<std::mutex> l(mu_);
+    SealLocked();
+    stop_ = true;
+    work_cv_.notify_one();
+  }
+  background_.join();
+  close(fd_);
+  for (size_t i = 0; i < free_.size(); ++i) delete free_[i];
+}
+
+void CompressedLogSink::SealLocked() {
+  if (filling_ == nullptr || filling_->empty()) return;
+  pending_.push_back(filling_);
+  filling_ = nullptr;
+  ++sealed_;
+  work_cv_.notify_one();
+}
+
+void CompressedLogSink::Send(int severity, const char* data, size_t size) {
+  (void)severity;
+  std::unique_lock<std::mutex> l(mu_);
+  for (;;) {
+    if (filling_ != nullptr) {
+      // A record larger than a block gets a block of its own.
+      if (filling_->empty() ||
+          filling_->size() + size <= options_.block_bytes) {
+        break;
+      }
+      SealLocked();
+    }
+    if (!free_.empty()) {
+      filling_ = free_.back();
+      free_.pop_back();
+      filling_since_millis_ = MonotonicMillis();
+      break;
+    }
+    // Only when the background thread has fallen behind. Another thread
+    // may have started a block by the time this one wakes up.
+    space_cv_.wait(l);
+  }
+  filling_->append(data, size);
+  raw_bytes_ += size;
+  if (filling_->size() >= options_.block_bytes) SealLocked();
+}
+
+void CompressedLogSink::Flush() {
+  std::unique_lock<std::mutex> l(mu_);
+  SealLocked();
+  const uint64 target = sealed_;
+  while (written_ < target) space_cv_.wait(l);
+}
+
+uint64 CompressedLogSink::raw_bytes() {
+  std::lock_guard<std::mutex> l(mu_);
+  return raw_bytes_;
+}
+
+uint64 CompressedLogSink::compressed_bytes() {
+  std::lock_guard<std::mutex> l(mu_);
+  return compressed_bytes_;
+}
+
+void CompressedLogSink::BackgroundLoop() {
+  internal::LogBlockCompressor compressor(options_.compression,
+                                          options_.zstd_level);
+  std::string frame;
+  std::unique_lock<std::mutex> l(mu_);
+  for (;;) {
+    if (pending_.empty()) {
+      if (stop_) break;
+      std::chrono::milliseconds wait(options_.flush_interval_millis);
+      if (filling_ != nullptr && !filling_->empty()) {
+        const int64 age = MonotonicMillis() - filling_since_millis_;
+        if (age >= options_.flush_interval_millis) {
+          SealLocked();
+          continue;
+        }
+        wait = std::chrono::milliseconds(options_.flush_interval_millis - age);
+      }
+      work_cv_.wait_for(l, wait);
+      continue;
+    }
+
+    std::string* block = pending_.front();
+    pending_.erase(pending_.begin());
+    l.unlock();
+    compressor.Compress(block->data(), block->size(), &frame);
+    WriteAll(fd_, frame);
+    block->clear();
+    // Give back what an oversized record made the buffer grow to.
+    if (block->capacity() > 2 * options_.block_bytes) {
+      std::string().swap(*block);
+      block->reserve(options_.block_bytes);
+    }
+    l.lock();
+    free_.push_back(block);
+    ++written_;
+    compressed_bytes_ += frame.size();
+    space_cv_.notify_all();
+  }
+}
+
+}  // namespace vtz
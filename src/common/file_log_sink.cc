@@ -0,0 +1,412 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/file_log_sink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace vtz {
+
+struct RotatingFileSink::Segment {
+  Segment() : fd(-1), base(nullptr), capacity(0), used(0), writers(0),
+              sequence(0), index(nullptr), index_fd(-1) {}
+
+  int fd;
+  char* base;
+  size_t capacity;
+  size_t used;                // guarded by the sink's mu_
+  std::atomic<int> writers;   // copies and syncs in progress
+  uint64 sequence;
+  std::string path;
+  // With write_index; guarded by the sink's mu_ while the segment is live.
+  LogIndexBuilder* index;
+  int index_fd;
+};
+
+namespace {
+
+RotatingFileSinkOptions Normalize(RotatingFileSinkOptions options) {
+  options.segment_bytes =
+      std::max(options.segment_bytes,
+               2 * internal::LogStreamBuf::kMaxLogMessageBytes);
+  return options;
+}
+
+int64 MonotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec);
+}
+
+void WriteAll(int fd, const std::string& data) {
+  const char* p = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    const ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;  // a sink has nowhere to report this
+    }
+    p += n;
+    left -= n;
+  }
+}
+
+std::string Basename(const std::string& path) {
+  const size_t slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+}  // namespace
+
+RotatingFileSink* RotatingFileSink::Create(
+    const RotatingFileSinkOptions& options) {
+  RotatingFileSink* sink = new RotatingFileSink(options);
+  sink->current_ = sink->OpenSegment(sink->sequence_++);
+  if (sink->current_ == nullptr) {
+    delete sink;
+    return nullptr;
+  }
+  sink->background_ = std::thread(&RotatingFileSink::BackgroundLoop, sink);
+  return sink;
+}
+
+RotatingFileSink::RotatingFileSink(const RotatingFileSinkOptions& options)
+    : options_(Normalize(options)),
+      current_(nullptr),
+      spare_(nullptr),
+      stop_(false),
+      next_rotation_(0),
+      sequence_(0),
+      linked_sequence_(~0ull),
+      opening_(false),
+      dropped_(0) {
+  if (options_.rotate_interval_seconds > 0) {
+    next_rotation_ = MonotonicSeconds() + options_.rotate_interval_seconds;
+  }
+}
+
+RotatingFileSink::~RotatingFileSink() {
+  if (background_.joinable()) {
+    {
+      std::lock_guard<std::mutex> l(mu_);
+      stop_ = true;
+      cv_.notify_one();
+    }
+    background_.join();
+  }
+  for (size_t i = 0; i < retired_.size(); ++i) CloseSegment(retired_[i], true);
+  if (current_ != nullptr) CloseSegment(current_, true);
+  if (spare_ != nullptr) CloseSegment(spare_, false);
+}
+
+RotatingFileSink::Segment* RotatingFileSink::OpenSegment(uint64 sequence) {
+  const time_t now = time(nullptr);
+  struct tm tm_time;
+  localtime_r(&now, &tm_time);
+  char suffix[64];
+  const size_t n = strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &tm_time);
+  snprintf(suffix + n, sizeof(suffix) - n, ".%d.%llu",
+           static_cast<int>(getpid()),
+           static_cast<unsigned long long>(sequence));
+
+  Segment* s = new Segment;
+  s->path = options_.path + suffix;
+  s->capacity = options_.segment_bytes;
+  s->sequence = sequence;
+  s->fd = open(s->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (s->fd < 0) {
+    delete s;
+    return nullptr;
+  }
+  // Allocate the blocks now so that page faults on the mapping never have
+  // to, and a full disk shows up here rather than as SIGBUS in Send().
+  if (posix_fallocate(s->fd, 0, static_cast<off_t>(s->capacity)) != 0) {
+    CloseSegment(s, false);
+    return nullptr;
+  }
+  void* base = mmap(nullptr, s->capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    s->fd, 0);
+  if (base == MAP_FAILED) {
+    CloseSegment(s, false);
+    return nullptr;
+  }
+  s->base = static_cast<char*>(base);
+  if (options_.write_index) {
+    // A segment without its index is still a segment.
+    s->index_fd = open((s->path + ".idx").c_str(),
+                       O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (s->index_fd >= 0) {
+      WriteAll(s->index_fd, LogIndexBuilder::FileHeader());
+      s->index = new LogIndexBuilder;
+    }
+  }
+  return s;
+}
+
+void RotatingFileSink::CloseSegment(Segment* segment, bool keep) {
+  if (segment->base != nullptr) munmap(segment->base, segment->capacity);
+  if (segment->fd >= 0) {
+    if (keep) {
+      // Drop the preallocated tail. "used" is final: the segment is no
+      // longer live.
+      if (ftruncate(segment->fd, static_cast<off_t>(segment->used)) == 0 &&
+          options_.sync_policy != kFileSyncNever) {
+        fdatasync(segment->fd);
+      }
+    }
+    close(segment->fd);
+  }
+  if (segment->index_fd >= 0) {
+    if (keep && segment->index != nullptr) {
+      // Nothing is added to a segment that is no longer live.
+      std::string entries;
+      segment->index->Seal();
+      segment->index->TakeSealed(&entries);
+      WriteAll(segment->index_fd, entries);
+    }
+    close(segment->index_fd);
+    if (!keep) unlink((segment->path + ".idx").c_str());
+  }
+  delete segment->index;
+  if (!keep) unlink(segment->path.c_str());
+  delete segment;
+}
+
+void RotatingFileSink::SwitchToLocked(Segment* next) {
+  retired_.push_back(current_);
+  current_ = next;
+  if (options_.rotate_interval_seconds > 0) {
+    next_rotation_ = MonotonicSeconds() + options_.rotate_interval_seconds;
+  }
+  cv_.notify_one();
+}
+
+RotatingFileSink::Segment* RotatingFileSink::NextSegmentLocked(
+    std::unique_lock<std::mutex>* l, bool wait) {
+  Segment* next = spare_;
+  spare_ = nullptr;
+  if (VTZ_PREDICT_FALSE(next == nullptr)) {
+    // The background thread has fallen behind. One producer opens the
+    // segment outside the lock; the others drop their records meanwhile
+    // rather than wait, unless "wait" says the record must not be lost.
+    if (opening_) {
+      if (!wait) {
+        ++dropped_;
+        return nullptr;
+      }
+      opened_cv_.wait(*l, [this] { return !opening_; });
+      return current_;
+    }
+    opening_ = true;
+    const uint64 sequence = sequence_++;
+    l->unlock();
+    next = OpenSegment(sequence);
+    l->lock();
+    opening_ = false;
+    opened_cv_.notify_all();
+    if (next == nullptr) {
+      ++dropped_;
+      return nullptr;
+    }
+  }
+  SwitchToLocked(next);
+  return next;
+}
+
+void RotatingFileSink::Send(int severity, const char* data, size_t size) {
+  if (size == 0) return;
+  const bool keep = severity >= options_.sync_min_severity ||
+                    severity >= FATAL;
+  Segment* segment;
+  size_t offset;
+  {
+    std::unique_lock<std::mutex> l(mu_);
+    segment = current_;
+    while (VTZ_PREDICT_FALSE(segment->used + size > segment->capacity)) {
+      segment = NextSegmentLocked(&l, keep);
+      if (segment == nullptr) return;
+    }
+    size = std::min(size, segment->capacity);
+    offset = segment->used;
+    segment->used += size;
+    segment->writers.fetch_add(1, std::memory_order_relaxed);
+    if (segment->index != nullptr) {
+      segment->index->Add(offset, data, size);
+      if (segment->index->has_sealed()) cv_.notify_one();
+    }
+  }
+  memcpy(segment->base + offset, data, size);
+  if (severity >= options_.sync_min_severity) {
+    if (options_.sync_policy == kFileSyncInline) {
+      // fdatasync() also writes back pages dirtied through the mapping.
+      fdatasync(segment->fd);
+    } else if (options_.sync_policy == kFileSyncBackground) {
+      // The segment the record is in, which may no longer be live by the
+      // time the background thread gets to it; the pin keeps it open.
+      std::lock_guard<std::mutex> l(mu_);
+      if (std::find(sync_requested_.begin(), sync_requested_.end(),
+                    segment) == sync_requested_.end()) {
+        segment->writers.fetch_add(1, std::memory_order_relaxed);
+        sync_requested_.push_back(segment);
+      }
+      cv_.notify_one();
+    }
+  }
+  segment->writers.fetch_sub(1, std::memory_order_release);
+}
+
+RotatingFileSink::Segment* RotatingFileSink::PinCurrent() {
+  std::lock_guard<std::mutex> l(mu_);
+  current_->writers.fetch_add(1, std::memory_order_relaxed);
+  return current_;
+}
+
+void RotatingFileSink::Unpin(Segment* segment) {
+  segment->writers.fetch_sub(1, std::memory_order_release);
+}
+
+void RotatingFileSink::Sync() {
+  Segment* segment = PinCurrent();
+  fdatasync(segment->fd);
+  Unpin(segment);
+}
+
+void RotatingFileSink::Rotate() {
+  std::unique_lock<std::mutex> l(mu_);
+  Segment* next = spare_;
+  spare_ = nullptr;
+  if (next == nullptr) {
+    // Opened outside the lock so that producers carry on meanwhile.
+    const uint64 sequence = sequence_++;
+    l.unlock();
+    next = OpenSegment(sequence);
+    if (next == nullptr) return;
+    l.lock();
+  }
+  SwitchToLocked(next);
+}
+
+uint64 RotatingFileSink::dropped() {
+  std::lock_guard<std::mutex> l(mu_);
+  return dropped_;
+}
+
+std::string RotatingFileSink::current_path() {
+  std::lock_guard<std::mutex> l(mu_);
+  return current_->path;
+}
+
+void RotatingFileSink::BackgroundLoop() {
+  std::unique_lock<std::mutex> l(mu_);
+  for (;;) {
+    if (options_.rotate_interval_seconds > 0 &&
+        MonotonicSeconds() >= next_rotation_) {
+      if (current_->used == 0) {
+        // Nothing to rotate away from.
+        next_rotation_ = MonotonicSeconds() + options_.rotate_interval_seconds;
+      } else if (spare_ != nullptr) {
+        Segment* next = spare_;
+        spare_ = nullptr;
+        SwitchToLocked(next);
+      }
+    }
+
+    // Keep the symlink pointing at the live segment.
+    if (current_->sequence != linked_sequence_) {
+      linked_sequence_ = current_->sequence;
+      const std::string target = Basename(current_->path);
+      const std::string tmp = options_.path + ".tmp-link";
+      l.unlock();
+      unlink(tmp.c_str());
+      if (symlink(target.c_str(), tmp.c_str()) == 0) {
+        rename(tmp.c_str(), options_.path.c_str());
+      }
+      l.lock();
+    }
+
+    // Index entries for the chunks the live segment has filled.
+    if (current_->index != nullptr && current_->index->has_sealed()) {
+      std::string entries;
+      current_->index->TakeSealed(&entries);
+      // Only this thread closes segments, so the fd stays open.
+      const int fd = current_->index_fd;
+      l.unlock();
+      WriteAll(fd, entries);
+      l.lock();
+    }
+
+    if (!sync_requested_.empty()) {
+      // Pinned by Send().
+      std::vector<Segment*> sync;
+      sync.swap(sync_requested_);
+      l.unlock();
+      for (size_t i = 0; i < sync.size(); ++i) {
+        fdatasync(sync[i]->fd);
+        Unpin(sync[i]);
+      }
+      l.lock();
+    }
+
+    // Close retired segments nobody is copying into any more.
+    std::vector<Segment*> idle;
+    for (size_t i = 0; i < retired_.size();) {
+      if (retired_[i]->writers.load(std::memory_order_acquire) == 0) {
+        idle.push_back(retired_[i]);
+        retired_[i] = retired_.back();
+        retired_.pop_back();
+      } else {
+        ++i;
+      }
+    }
+    if (!idle.empty()) {
+      l.unlock();
+      for (size_t i = 0; i < idle.size(); ++i) CloseSegment(idle[i], true);
+      l.lock();
+    }
+
+    if (stop_) break;
+
+    if (spare_ == nullptr) {
+      const uint64 sequence = sequence_++;
+      l.unlock();
+      Segment* next = OpenSegment(sequence);
+      l.lock();
+      spare_ = next;
+      // Look at the state again before sleeping.
+      if (next != nullptr) continue;
+    }
+
+    // A retired segment with a copy in flight is re-checked shortly; the
+    // copy is a memcpy, so this is rare and brief.
+    std::chrono::milliseconds wait(retired_.empty() ? 1000 : 1);
+    if (options_.rotate_interval_seconds > 0 && spare_ != nullptr) {
+      const int64 until_rotation = next_rotation_ - MonotonicSeconds();
+      wait = std::min(wait, std::chrono::milliseconds(
+                                std::max<int64>(until_rotation * 1000, 1)));
+    }
+    cv_.wait_for(l, wait);
+  }
+}
+
+}  // namespace vtz
@@ -0,0 +1,305 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/flight_recorder.h"
+#include "common/log_output_private.h"
+#include "common/macros.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+
+namespace vtz {
+namespace internal {
+
+std::atomic<int> flight_recorder_min_severity(NUM_SEVERITIES);
+
+namespace {
+
+struct FlightRecordHeader {
+  uint32 size;  // text bytes that follow
+  uint32 severity;
+  int64 micros;
+};
+
+// Circular buffer of whole records, oldest overwritten first. Records may
+// wrap around the end of the buffer. One thread records; a dump may read
+// concurrently and validates what it reads.
+class FlightRing {
+ public:
+  explicit FlightRing(size_t capacity)
+      : buf_(new char[capacity]),
+        capacity_(capacity),
+        head_(0),
+        tail_(0),
+        in_use_(true),
+        next_(nullptr),
+        cursor_(0),
+        end_(0) {}
+
+  size_t capacity() const { return capacity_; }
+
+  void Record(int severity, int64 micros, const char* data, size_t size) {
+    // Leave room for at least one older record.
+    const size_t max_size = capacity_ / 2 - sizeof(FlightRecordHeader);
+    bool cut = false;
+    if (size > max_size) {
+      size = max_size;
+      cut = true;
+    }
+    const uint64 need = sizeof(FlightRecordHeader) + size;
+    const uint64 head = head_.load(std::memory_order_relaxed);
+    uint64 tail = tail_.load(std::memory_order_relaxed);
+    while (head + need - tail > capacity_) {
+      FlightRecordHeader old;
+      CopyOut(tail, &old, sizeof(old));
+      tail += sizeof(old) + old.size;
+    }
+    tail_.store(tail, std::memory_order_release);
+    FlightRecordHeader hdr = {static_cast<uint32>(size),
+                              static_cast<uint32>(severity), micros};
+    CopyIn(head, &hdr, sizeof(hdr));
+    CopyIn(head + sizeof(hdr), data, size);
+    // A cut record still ends its line.
+    if (cut) CopyIn(head + need - 1, "\n", 1);
+    head_.store(head + need, std::memory_order_release);
+  }
+
+  // Dump side. Positions the cursor on the oldest record.
+  void StartDump() {
+    cursor_ = tail_.load(std::memory_order_acquire);
+    end_ = head_.load(std::memory_order_acquire);
+  }
+
+  // Reads the header at the cursor. False when the ring is exhausted or
+  // what is there no longer looks like a record.
+  bool Peek(FlightRecordHeader* hdr) {
+    // Skip anything the owner has overwritten since StartDump().
+    const uint64 tail = tail_.load(std::memory_order_acquire);
+    if (cursor_ < tail) cursor_ = tail;
+    if (cursor_ + sizeof(*hdr) > end_) return false;
+    CopyOut(cursor_, hdr, sizeof(*hdr));
+    return hdr->size <= capacity_ &&
+           cursor_ + sizeof(*hdr) + hdr->size <= end_;
+  }
+
+  // Writes the record at the cursor to "fd" and moves past it.
+  void WriteNext(int fd, const FlightRecordHeader& hdr) {
+    const uint64 start = cursor_ + sizeof(hdr);
+    const size_t offset = static_cast<size_t>(start % capacity_);
+    const size_t first = std::min<size_t>(hdr.size, capacity_ - offset);
+    WriteAll(fd, buf_ + offset, first);
+    WriteAll(fd, buf_, hdr.size - first);
+    cursor_ = start + hdr.size;
+  }
+
+  bool TryClaim(size_t capacity) {
+    if (capacity != capacity_) return false;
+    bool expected = false;
+    return in_use_.compare_exchange_strong(expected, true);
+  }
+  void Release() { in_use_.store(false, std::memory_order_release); }
+
+  FlightRing* next() const { return next_; }
+  void set_next(FlightRing* next) { next_ = next; }
+
+  static void WriteAll(int fd, const char* p, size_t n) {
+    while (n > 0) {
+      const ssize_t w = write(fd, p, n);
+      if (w < 0) {
+        if (errno == EINTR) continue;
+        return;
+      }
+      p += w;
+      n -= static_cast<size_t>(w);
+    }
+  }
+
+ private:
+  void CopyIn(uint64 pos, const void* src, size_t n) {
+    const size_t offset = static_cast<size_t>(pos % capacity_);
+    const size_t first = std::min(n, capacity_ - offset);
+    memcpy(buf_ + offset, src, first);
+    memcpy(buf_, static_cast<const char*>(src) + first, n - first);
+  }
+
+  void CopyOut(uint64 pos, void* dst, size_t n) const {
+    const size_t offset = static_cast<size_t>(pos % capacity_);
+    const size_t first = std::min(n, capacity_ - offset);
+    memcpy(dst, buf_ + offset, first);
+    memcpy(static_cast<char*>(dst) + first, buf_, n - first);
+  }
+
+  char* const buf_;
+  const size_t capacity_;
+  std::atomic<uint64> head_;  // free-running end of the newest record
+  std::atomic<uint64> tail_;  // free-running start of the oldest record
+  std::atomic<bool> in_use_;  // owned by a live thread
+  FlightRing* next_;          // immutable once published
+  uint64 cursor_;             // dump only
+  uint64 end_;                // dump only
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(FlightRing);
+};
+
+// Rings are never freed: a dump may walk the list at any time, and a ring
+// left by an exited thread is handed to the next new thread, history and
+// all.
+std::atomic<FlightRing*> flight_rings(nullptr);
+std::atomic<size_t> flight_ring_bytes(64 * 1024);
+std::atomic<int> flight_dump_fd(STDERR_FILENO);
+std::atomic<bool> flight_recorder_used(false);
+std::atomic<bool> flight_dumped_for_fatal(false);
+std::atomic<bool> flight_dump_in_progress(false);
+
+FlightRing* ClaimFlightRing() {
+  const size_t capacity = flight_ring_bytes.load(std::memory_order_relaxed);
+  for (FlightRing* r = flight_rings.load(std::memory_order_acquire);
+       r != nullptr; r = r->next()) {
+    if (r->TryClaim(capacity)) return r;
+  }
+  FlightRing* ring = new FlightRing(capacity);
+  FlightRing* head = flight_rings.load(std::memory_order_relaxed);
+  do {
+    ring->set_next(head);
+  } while (!flight_rings.compare_exchange_weak(head, ring,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+  return ring;
+}
+
+// Set once the thread's ring has been released, possibly to a new thread
+// that now writes it. Records logged from later thread_local destructors
+// are left out of the flight recorder.
+thread_local bool flight_ring_released VTZ_ATTRIBUTE_INITIAL_EXEC = false;
+
+class FlightRingHolder {
+ public:
+  FlightRingHolder() : ring_(nullptr) {}
+  ~FlightRingHolder() {
+    flight_ring_released = true;
+    FlightRing* ring = ring_;
+    ring_ = nullptr;
+    if (ring != nullptr) ring->Release();
+  }
+
+  // nullptr once the ring has been released.
+  FlightRing* Get() {
+    if (VTZ_PREDICT_FALSE(ring_ == nullptr)) {
+      if (flight_ring_released) return nullptr;
+      ring_ = ClaimFlightRing();
+    }
+    return ring_;
+  }
+
+ private:
+  FlightRing* ring_;
+};
+
+thread_local FlightRingHolder flight_ring_holder;
+
+const int kFatalSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+
+void FatalSignalHandler(int sig) {
+  DumpFlightRecorderForFatal();
+  // SA_RESETHAND restored the default action; SA_NODEFER lets it run now.
+  raise(sig);
+}
+
+void InstallFatalSignalHandlers() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = FatalSignalHandler;
+  action.sa_flags = SA_RESETHAND | SA_NODEFER | SA_ONSTACK;
+  for (size_t i = 0; i < sizeof(kFatalSignals) / sizeof(kFatalSignals[0]);
+       ++i) {
+    sigaction(kFatalSignals[i], &action, nullptr);
+  }
+}
+
+}  // namespace
+
+void FlightRecorderCapture(int severity, int64 micros, const char* data,
+                           size_t size) {
+  FlightRing* ring = flight_ring_holder.Get();
+  if (VTZ_PREDICT_TRUE(ring != nullptr)) {
+    ring->Record(severity, micros, data, size);
+  }
+}
+
+void DumpFlightRecorderForFatal() {
+  if (!flight_recorder_used.load(std::memory_order_acquire)) return;
+  if (flight_dumped_for_fatal.exchange(true)) return;
+  DumpFlightRecorder(flight_dump_fd.load(std::memory_order_relaxed));
+}
+
+}  // namespace internal
+
+bool EnableFlightRecorder(const FlightRecorderOptions& options) {
+  using internal::flight_recorder_min_severity;
+  if (flight_recorder_min_severity.load() < NUM_SEVERITIES) return false;
+  internal::flight_ring_bytes.store(
+      std::max<size_t>(options.bytes_per_thread, 4096),
+      std::memory_order_relaxed);
+  internal::flight_dump_fd.store(options.dump_fd, std::memory_order_relaxed);
+  internal::flight_recorder_used.store(true, std::memory_order_release);
+  if (options.dump_on_fatal_signals) internal::InstallFatalSignalHandlers();
+  flight_recorder_min_severity.store(
+      std::max(INFO, std::min(options.min_severity, FATAL)));
+  internal::UpdateMinLogLevelForMacros();
+  return true;
+}
+
+void DisableFlightRecorder() {
+  internal::flight_recorder_min_severity.store(NUM_SEVERITIES);
+  internal::UpdateMinLogLevelForMacros();
+}
+
+void DumpFlightRecorder(int fd) {
+  using internal::FlightRing;
+  using internal::FlightRecordHeader;
+  // Concurrent dumps would fight over the cursors.
+  if (internal::flight_dump_in_progress.exchange(true)) return;
+  FlightRing* head =
+      internal::flight_rings.load(std::memory_order_acquire);
+  for (FlightRing* r = head; r != nullptr; r = r->next()) r->StartDump();
+
+  static const char kBegin[] =
+      "----- flight recorder: filtered records, oldest first -----\n";
+  static const char kEnd[] = "----- end of flight recorder -----\n";
+  FlightRing::WriteAll(fd, kBegin, sizeof(kBegin) - 1);
+  // Merge by timestamp; there are few rings, so a linear scan is fine.
+  for (;;) {
+    FlightRing* oldest = nullptr;
+    FlightRecordHeader oldest_hdr;
+    for (FlightRing* r = head; r != nullptr; r = r->next()) {
+      FlightRecordHeader hdr;
+      if (r->Peek(&hdr) &&
+          (oldest == nullptr || hdr.micros < oldest_hdr.micros)) {
+        oldest = r;
+        oldest_hdr = hdr;
+      }
+    }
+    if (oldest == nullptr) break;
+    oldest->WriteNext(fd, oldest_hdr);
+  }
+  FlightRing::WriteAll(fd, kEnd, sizeof(kEnd) - 1);
+  internal::flight_dump_in_progress.store(false);
+}
+
+}  // namespace vtz
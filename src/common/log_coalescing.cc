@@ -0,0 +1,315 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/log_coalescing.h"
+#include "common/log_format.h"
+#include "common/log_output_private.h"
+#include "common/logging.h"
+#include "common/macros.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace vtz {
+namespace internal {
+
+std::atomic<bool> log_coalescing_on(false);
+
+namespace {
+
+const int kWays = 4;
+const int64 kNoDeadline = std::numeric_limits<int64>::max();
+
+struct CoalescedRecord {
+  uint64 tag;  // 0 while the slot is free
+  const char* fname;
+  int line;
+  int severity;
+  int64 window_start;  // when the written occurrence was logged
+  int64 last_seen;     // for eviction
+  // Occurrences held back since window_start, and when the first and last
+  // of them were logged.
+  uint64 repeats;
+  int64 first_micros;
+  int64 last_micros;
+  uint32 text_size;
+  char text[kCoalescedTextBytes];
+};
+
+// The tags and the lock of a set share one cache line, so a record that is
+// not a repeat touches that line and the slot it takes over.
+struct CoalescingSet {
+  std::atomic<bool> locked;
+  uint64 tags[kWays];
+  char pad[64 - (kWays + 1) * sizeof(uint64)];
+};
+
+struct CoalescingTable {
+  size_t num_sets;  // a power of two
+  CoalescingSet* sets;
+  CoalescedRecord* records;  // kWays per set
+};
+
+std::mutex enable_mu;
+std::atomic<CoalescingTable*> coalescing_table(nullptr);
+std::atomic<int64> window_micros(0);
+std::atomic<int> max_severity(ERROR);
+// Earliest end of a window that has held-back repeats.
+std::atomic<int64> next_deadline(kNoDeadline);
+std::mutex sweep_mu;
+
+CoalescingTable* NewCoalescingTable(size_t num_sets) {
+  CoalescingTable* t = new CoalescingTable;
+  t->num_sets = num_sets;
+  void* sets = nullptr;
+  if (posix_memalign(&sets, 64, num_sets * sizeof(CoalescingSet)) != 0) {
+    abort();
+  }
+  t->sets = static_cast<CoalescingSet*>(sets);
+  for (size_t i = 0; i < num_sets; ++i) {
+    CoalescingSet* s = new (&t->sets[i]) CoalescingSet;
+    s->locked.store(false, std::memory_order_relaxed);
+    for (int w = 0; w < kWays; ++w) s->tags[w] = 0;
+  }
+  t->records = new CoalescedRecord[num_sets * kWays];
+  for (size_t i = 0; i < num_sets * kWays; ++i) {
+    t->records[i].tag = 0;
+    t->records[i].repeats = 0;
+  }
+  return t;
+}
+
+void LockSet(CoalescingSet* s) {
+  while (s->locked.exchange(true, std::memory_order_acquire)) {
+    while (s->locked.load(std::memory_order_relaxed)) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void UnlockSet(CoalescingSet* s) {
+  s->locked.store(false, std::memory_order_release);
+}
+
+inline uint64 HashMix(uint64 h, uint64 v) {
+  h ^= v;
+  h *= 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+// Never 0, which marks a free slot.
+uint64 HashRecord(const LogRecordMeta& meta, const char* text, size_t size) {
+  uint64 h = HashMix(reinterpret_cast<uintptr_t>(meta.fname),
+                     (static_cast<uint64>(static_cast<uint32>(meta.line))
+                      << 8) | static_cast<uint64>(meta.severity & 0xff));
+  h = HashMix(h, size);
+  for (; size >= 8; text += 8, size -= 8) {
+    uint64 v;
+    memcpy(&v, text, 8);
+    h = HashMix(h, v);
+  }
+  if (size > 0) {
+    uint64 v = 0;
+    memcpy(&v, text, size);
+    h = HashMix(h, v);
+  }
+  return h | 1;
+}
+
+void NoteDeadline(int64 deadline) {
+  int64 current = next_deadline.load(std::memory_order_relaxed);
+  while (deadline < current &&
+         !next_deadline.compare_exchange_weak(current, deadline,
+                                              std::memory_order_relaxed)) {
+  }
+}
+
+// Writes the summary of the repeats "r" held back.
+void WriteCoalescedSummary(const CoalescedRecord& r) {
+  LogFields fields;
+  fields.AddUInt("repeated", r.repeats);
+  char ts[kFastFormatBufferSize];
+  fields.AddString("first", ts, FormatLogTimestamp(ts, r.first_micros) - ts);
+  fields.AddString("last", ts, FormatLogTimestamp(ts, r.last_micros) - ts);
+  LogStreamBuf buf;
+  LogRecordMeta meta;
+  meta.fname = r.fname;
+  meta.line = r.line;
+  meta.severity = r.severity;
+  meta.fields = &fields;
+  BeginLogRecord(&buf, &meta);
+  buf.Append(r.text, r.text_size);
+  EncodeLogRecord(&buf, meta, false);
+}
+
+// Writes the summaries of the windows that closed by "now", or of every
+// record with repeats if "all".
+void WriteCoalescedSummaries(CoalescingTable* t, int64 now, bool all) {
+  const int64 window = window_micros.load(std::memory_order_relaxed);
+  CoalescedRecord closed[kWays];
+  for (size_t i = 0; i < t->num_sets; ++i) {
+    CoalescingSet* set = &t->sets[i];
+    CoalescedRecord* ways = &t->records[i * kWays];
+    int n = 0;
+    LockSet(set);
+    for (int w = 0; w < kWays; ++w) {
+      CoalescedRecord* r = &ways[w];
+      if (r->repeats == 0) continue;
+      if (all || now - r->window_start >= window) {
+        closed[n++] = *r;
+        r->repeats = 0;
+      } else {
+        NoteDeadline(r->window_start + window);
+      }
+    }
+    UnlockSet(set);
+    // Outside the lock: a LogSink may log.
+    for (int k = 0; k < n; ++k) WriteCoalescedSummary(closed[k]);
+  }
+}
+
+void SweepClosedWindows(CoalescingTable* t, int64 now) {
+  std::unique_lock<std::mutex> l(sweep_mu, std::try_to_lock);
+  if (!l.owns_lock()) return;
+  if (now < next_deadline.load(std::memory_order_relaxed)) return;
+  next_deadline.store(kNoDeadline, std::memory_order_relaxed);
+  WriteCoalescedSummaries(t, now, false);
+}
+
+}  // namespace
+
+bool CoalesceLogRecord(const LogRecordMeta& meta, const char* text,
+                       size_t size) {
+  if (meta.severity > max_severity.load(std::memory_order_relaxed) ||
+      meta.severity >= FATAL) {
+    return false;
+  }
+  CoalescingTable* t = coalescing_table.load(std::memory_order_acquire);
+  const int64 now = meta.micros;
+  if (VTZ_PREDICT_FALSE(now >= next_deadline.load(std::memory_order_relaxed))) {
+    SweepClosedWindows(t, now);
+  }
+  const int64 window = window_micros.load(std::memory_order_relaxed);
+  const uint64 tag = HashRecord(meta, text, size);
+  const size_t index = static_cast<size_t>(tag >> 32) & (t->num_sets - 1);
+  CoalescingSet* set = &t->sets[index];
+  CoalescedRecord* ways = &t->records[index * kWays];
+
+  bool held = false;
+  bool evicted = false;
+  CoalescedRecord summary;
+  LockSet(set);
+  int w = 0;
+  while (w < kWays &&
+         !(set->tags[w] == tag && ways[w].fname == meta.fname &&
+           ways[w].line == meta.line && ways[w].severity == meta.severity)) {
+    ++w;
+  }
+  if (w < kWays) {
+    CoalescedRecord* r = &ways[w];
+    r->last_seen = now;
+    if (now - r->window_start < window) {
+      if (r->repeats++ == 0) {
+        r->first_micros = now;
+        NoteDeadline(r->window_start + window);
+      }
+      r->last_micros = now;
+      held = true;
+    } else {
+      // Starts a new window with this occurrence.
+      if (r->repeats > 0) {
+        summary = *r;
+        evicted = true;
+        r->repeats = 0;
+      }
+      r->window_start = now;
+    }
+  } else {
+    // Take a free slot, or the least recently seen one.
+    w = 0;
+    for (int i = 0; i < kWays; ++i) {
+      if (set->tags[i] == 0) {
+        w = i;
+        break;
+      }
+      if (ways[i].last_seen < ways[w].last_seen) w = i;
+    }
+    CoalescedRecord* r = &ways[w];
+    if (set->tags[w] != 0 && r->repeats > 0) {
+      summary = *r;
+      evicted = true;
+    }
+    set->tags[w] = tag;
+    r->tag = tag;
+    r->fname = meta.fname;
+    r->line = meta.line;
+    r->severity = meta.severity;
+    r->window_start = now;
+    r->last_seen = now;
+    r->repeats = 0;
+    r->text_size = static_cast<uint32>(std::min(size, kCoalescedTextBytes));
+    memcpy(r->text, text, r->text_size);
+  }
+  UnlockSet(set);
+  if (evicted) WriteCoalescedSummary(summary);
+  return held;
+}
+
+void FlushCoalescedLogRecords() {
+  CoalescingTable* t = coalescing_table.load(std::memory_order_acquire);
+  if (t != nullptr) WriteCoalescedSummaries(t, 0, true);
+}
+
+}  // namespace internal
+
+bool EnableLogCoalescing(const LogCoalescingOptions& options) {
+  using internal::coalescing_table;
+  std::lock_guard<std::mutex> l(internal::enable_mu);
+  if (internal::log_coalescing_on.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  size_t slots = internal::kWays;
+  while (slots < options.table_slots) slots <<= 1;
+  const size_t num_sets = slots / internal::kWays;
+  internal::CoalescingTable* t =
+      coalescing_table.load(std::memory_order_relaxed);
+  if (t == nullptr || t->num_sets != num_sets) {
+    // A table of another size is left alone: threads that loaded it may
+    // still be using it.
+    coalescing_table.store(internal::NewCoalescingTable(num_sets),
+                           std::memory_order_release);
+  }
+  internal::window_micros.store(std::max<int64>(options.window_micros, 0),
+                                std::memory_order_relaxed);
+  internal::max_severity.store(options.max_severity,
+                               std::memory_order_relaxed);
+  internal::next_deadline.store(internal::kNoDeadline,
+                                std::memory_order_relaxed);
+  internal::log_coalescing_on.store(true, std::memory_order_release);
+  return true;
+}
+
+void DisableLogCoalescing() {
+  internal::log_coalescing_on.store(false, std::memory_order_release);
+  internal::FlushCoalescedLogRecords();
+}
+
+}  // namespace vtz
@@ -0,0 +1,366 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/log_compression_private.h"
+#include <string.h>
+#include <algorithm>
+#ifdef VTZ_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace vtz {
+
+bool ZstdLogCompressionAvailable() {
+#ifdef VTZ_HAVE_ZSTD
+  return true;
+#else
+  return false;
+#endif
+}
+
+namespace internal {
+
+namespace {
+
+// LZ4 block format limits: the last 5 bytes are always literals and no
+// match starts in the last 12.
+const size_t kLz4LastLiterals = 5;
+const size_t kLz4MatchFindLimit = 12;
+const size_t kLz4MinMatch = 4;
+const size_t kLz4MaxOffset = 65535;
+const int kLz4HashBits = 14;
+static_assert(kLz4TableSize == 1u << kLz4HashBits, "table matches the hash");
+
+inline uint32 Load32(const char* p) {
+  uint32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64 Load64(const char* p) {
+  uint64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Hashes the five bytes at "p", as LZ4 does on 64-bit hosts; four bytes
+// collide more on text.
+inline uint32 Lz4Hash(const char* p) {
+  return static_cast<uint32>(((Load64(p) << 24) * 889523592379ull) >>
+                             (64 - kLz4HashBits));
+}
+
+// Length of the common prefix of "a" and "b", reading no further than
+// "a_limit".
+inline size_t MatchLength(const char* a, const char* b, const char* a_limit) {
+  const char* start = a;
+  while (a + 8 <= a_limit) {
+    const uint64 diff = Load64(a) ^ Load64(b);
+    if (diff != 0) return (a - start) + (__builtin_ctzll(diff) >> 3);
+    a += 8;
+    b += 8;
+  }
+  while (a < a_limit && *a == *b) {
+    ++a;
+    ++b;
+  }
+  return a - start;
+}
+
+// Writes the 255-run continuation of a length that did not fit its nibble.
+inline char* PutLength(char* op, size_t n) {
+  while (n >= 255) {
+    *op++ = static_cast<char>(255);
+    n -= 255;
+  }
+  *op++ = static_cast<char>(n);
+  return op;
+}
+
+// Appends one sequence: "literals" literal bytes from "lit", then a match
+// of "match" bytes at "offset", or none when match is 0. Returns nullptr
+// if it does not fit before "op_end".
+inline char* PutSequence(char* op, char* op_end, const char* lit,
+                         size_t literals, size_t offset, size_t match) {
+  // Token, both length tails, the literals and the offset.
+  if (static_cast<size_t>(op_end - op) <
+      1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) {
+    return nullptr;
+  }
+  char* token = op++;
+  const size_t match_code = match == 0 ? 0 : match - kLz4MinMatch;
+  *token = static_cast<char>((std::min<size_t>(literals, 15) << 4) |
+                             std::min<size_t>(match_code, 15));
+  if (literals >= 15) op = PutLength(op, literals - 15);
+  memcpy(op, lit, literals);
+  op += literals;
+  if (match == 0) return op;
+  *op++ = static_cast<char>(offset & 0xff);
+  *op++ = static_cast<char>(offset >> 8);
+  if (match_code >= 15) op = PutLength(op, match_code - 15);
+  return op;
+}
+
+// Reads a 255-run length continuation; false past "end".
+inline bool GetLength(const unsigned char** ip, const unsigned char* end,
+                      size_t* n) {
+  unsigned char b;
+  do {
+    if (*ip >= end) return false;
+    b = *(*ip)++;
+    *n += b;
+  } while (b == 255);
+  return true;
+}
+
+}  // namespace
+
+size_t Lz4Compress(const char* src, size_t size, char* dst, size_t capacity,
+                   uint32* table) {
+  char* op = dst;
+  char* const op_end = dst + capacity;
+  size_t anchor = 0;
+  if (size > kLz4MatchFindLimit) {
+    memset(table, 0, kLz4TableSize * sizeof(*table));
+    const size_t limit = size - kLz4MatchFindLimit;
+    const char* const match_end = src + size - kLz4LastLiterals;
+    size_t ip = 1;
+    while (ip < limit) {
+      const uint32 seq = Load32(src + ip);
+      const uint32 h = Lz4Hash(src + ip);
+      size_t ref = table[h];
+      table[h] = static_cast<uint32>(ip);
+      if (ip - ref > kLz4MaxOffset || Load32(src + ref) != seq) {
+        // Step further the longer nothing matches, as LZ4 does, so that
+        // incompressible stretches go quickly.
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+      while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+        --ip;
+        --ref;
+      }
+      const size_t match =
+          kLz4MinMatch + MatchLength(src + ip + kLz4MinMatch,
+                                     src + ref + kLz4MinMatch, match_end);
+      op = PutSequence(op, op_end, src + anchor, ip - anchor, ip - ref, match);
+      if (op == nullptr) return 0;
+      ip += match;
+      anchor = ip;
+      if (ip < limit) {
+        table[Lz4Hash(src + ip - 2)] = static_cast<uint32>(ip - 2);
+      }
+    }
+  }
+  op = PutSequence(op, op_end, src + anchor, size - anchor, 0, 0);
+  return op == nullptr ? 0 : op - dst;
+}
+
+bool Lz4Decompress(const char* src, size_t size, char* dst, size_t raw_size) {
+  const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+  const unsigned char* const end = ip + size;
+  char* op = dst;
+  char* const op_end = dst + raw_size;
+  while (ip < end) {
+    const unsigned char token = *ip++;
+    size_t literals = token >> 4;
+    if (VTZ_PREDICT_TRUE(literals < 15 && end - ip >= 18 &&
+                         op_end - op >= 32)) {
+      // Most sequences in log text: a short run, copied with one fixed-size
+      // copy, and then at least the offset and more input.
+      memcpy(op, ip, 16);
+      ip += literals;
+      op += literals;
+    } else {
+      if (literals == 15 && !GetLength(&ip, end, &literals)) return false;
+      if (literals > static_cast<size_t>(end - ip) ||
+          literals > static_cast<size_t>(op_end - op)) {
+        return false;
+      }
+      memcpy(op, ip, literals);
+      ip += literals;
+      op += literals;
+      if (ip == end) break;  // the last sequence has no match
+      if (end - ip < 2) return false;
+    }
+
+    const size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+    ip += 2;
+    if (offset == 0 || offset > static_cast<size_t>(op - dst)) return false;
+    size_t match = token & 15;
+    const char* from = op - offset;
+    if (VTZ_PREDICT_TRUE(match < 15 && offset >= 18 && op_end - op >= 18)) {
+      // A short match that does not overlap: one fixed-size copy.
+      memcpy(op, from, 18);
+      op += match + kLz4MinMatch;
+      continue;
+    }
+    if (match == 15 && !GetLength(&ip, end, &match)) return false;
+    match += kLz4MinMatch;
+    if (match > static_cast<size_t>(op_end - op)) return false;
+    char* const copy_end = op + match;
+    if (offset >= 16 && op_end - copy_end >= 16) {
+      // Sixteen bytes at a time, possibly past copy_end; with offset >= 16
+      // each chunk's source is written before it is read.
+      do {
+        memcpy(op, from, 16);
+        op += 16;
+        from += 16;
+      } while (op < copy_end);
+    } else if (offset >= 8 && op_end - copy_end >= 8) {
+      do {
+        memcpy(op, from, 8);
+        op += 8;
+        from += 8;
+      } while (op < copy_end);
+    } else {
+      // Near the end, or overlapping by less than a word: the match
+      // repeats the last "offset" bytes.
+      while (op < copy_end) *op++ = *from++;
+    }
+    op = copy_end;
+  }
+  return op == op_end;
+}
+
+uint32 LogBlockChecksum(const char* data, size_t size) {
+  // Eight bytes per multiply; enough to tell damage from data.
+  const uint64 kMul = 0x9e3779b97f4a7c15ull;
+  uint64 h = size * kMul;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    h = (h ^ Load64(data + i)) * kMul;
+    h ^= h >> 29;
+  }
+  uint64 tail = 0;
+  memcpy(&tail, data + i, size - i);
+  h = (h ^ tail) * kMul;
+  h ^= h >> 32;
+  return static_cast<uint32>(h);
+}
+
+namespace {
+
+uint32 HeaderChecksum(const LogBlockHeader& header) {
+  return LogBlockChecksum(reinterpret_cast<const char*>(&header),
+                          offsetof(LogBlockHeader, header_checksum));
+}
+
+}  // namespace
+
+static_assert(sizeof(LogBlockHeader) == 24, "no padding in the header");
+
+LogBlockCompressor::LogBlockCompressor(LogCompression compression,
+                                       int zstd_level)
+    : compression_(ZstdLogCompressionAvailable() ? compression
+                                                 : kLogCompressionLz4),
+      zstd_level_(zstd_level),
+      zstd_context_(nullptr) {
+#ifdef VTZ_HAVE_ZSTD
+  if (compression_ == kLogCompressionZstd) zstd_context_ = ZSTD_createCCtx();
+#endif
+  if (zstd_context_ == nullptr) lz4_table_.resize(kLz4TableSize);
+}
+
+LogBlockCompressor::~LogBlockCompressor() {
+#ifdef VTZ_HAVE_ZSTD
+  ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(zstd_context_));
+#endif
+}
+
+void LogBlockCompressor::Compress(const char* data, size_t size,
+                                  std::string* out) {
+  LogBlockHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kLogBlockMagic;
+  header.raw_size = static_cast<uint32>(size);
+
+  // Room for the header and a payload no larger than the text; a block
+  // that does not get smaller is stored.
+  out->resize(sizeof(header) + size);
+  char* payload = &(*out)[0] + sizeof(header);
+  size_t n = 0;
+#ifdef VTZ_HAVE_ZSTD
+  if (zstd_context_ != nullptr) {
+    header.codec = kLogBlockZstd;
+    n = ZSTD_compressCCtx(static_cast<ZSTD_CCtx*>(zstd_context_), payload,
+                          size, data, size, zstd_level_);
+    if (ZSTD_isError(n)) n = 0;
+  }
+#endif
+  if (zstd_context_ == nullptr) {
+    header.codec = kLogBlockLz4;
+    n = Lz4Compress(data, size, payload, size, lz4_table_.data());
+  }
+  if (n == 0 || n >= size) {
+    header.codec = kLogBlockStored;
+    memcpy(payload, data, size);
+    n = size;
+  }
+  out->resize(sizeof(header) + n);
+  payload = &(*out)[0] + sizeof(header);
+  header.payload_size = static_cast<uint32>(n);
+  header.payload_checksum = LogBlockChecksum(payload, n);
+  header.header_checksum = HeaderChecksum(header);
+  memcpy(&(*out)[0], &header, sizeof(header));
+}
+
+bool ValidLogBlockHeader(const LogBlockHeader& header) {
+  return header.magic == kLogBlockMagic &&
+         header.header_checksum == HeaderChecksum(header) &&
+         header.payload_size <= header.raw_size &&
+         header.raw_size <= kMaxLogBlockBytes;
+}
+
+bool DecodeLogBlock(const LogBlockHeader& header, const char* payload,
+                    std::string* out, std::string* error) {
+  if (LogBlockChecksum(payload, header.payload_size) !=
+      header.payload_checksum) {
+    *error = "payload checksum mismatch";
+    return false;
+  }
+  out->resize(header.raw_size);
+  char* dst = header.raw_size == 0 ? nullptr : &(*out)[0];
+  switch (header.codec) {
+    case kLogBlockStored:
+      if (header.payload_size != header.raw_size) break;
+      memcpy(dst, payload, header.raw_size);
+      return true;
+    case kLogBlockLz4:
+      if (Lz4Decompress(payload, header.payload_size, dst, header.raw_size)) {
+        return true;
+      }
+      break;
+    case kLogBlockZstd:
+#ifdef VTZ_HAVE_ZSTD
+      if (ZSTD_decompress(dst, header.raw_size, payload,
+                          header.payload_size) == header.raw_size) {
+        return true;
+      }
+      break;
+#else
+      *error = "zstd block, but built without zstd";
+      return false;
+#endif
+    default:
+      *error = "unknown codec";
+      return false;
+  }
+  *error = "corrupt payload";
+  return false;
+}
+
+}  // namespace internal
+}  // namespace vtz
@@ -0,0 +1,304 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/log_encoder.h"
+#include "common/log_format.h"
+#include "common/log_output_private.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace vtz {
+namespace internal {
+
+std::atomic<LogEncoder*> log_encoder(nullptr);
+std::atomic<bool> log_encoder_loaded(false);
+
+namespace {
+
+std::mutex log_encoder_mu;
+
+inline void Put(std::streambuf* out, const char* s, size_t n) {
+  out->sputn(s, static_cast<std::streamsize>(n));
+}
+
+inline void Put(std::streambuf* out, const char* s) { Put(out, s, strlen(s)); }
+
+// Length of the longest prefix of s[0, n) with no byte <= "ctrl_max" and
+// none equal to "a", "b" or "c". Log text is mostly plain, so this scans
+// 16 bytes per step where SSE2 is available.
+size_t PlainPrefix(const char* s, size_t n, unsigned char ctrl_max, char a,
+                   char b, char c) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i max = _mm_set1_epi8(static_cast<char>(ctrl_max));
+  const __m128i va = _mm_set1_epi8(a);
+  const __m128i vb = _mm_set1_epi8(b);
+  const __m128i vc = _mm_set1_epi8(c);
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    // Unsigned v <= ctrl_max.
+    __m128i hit = _mm_cmpeq_epi8(_mm_min_epu8(v, max), v);
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, va));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, vb));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, vc));
+    const int mask = _mm_movemask_epi8(hit);
+    if (mask != 0) return i + static_cast<size_t>(__builtin_ctz(mask));
+  }
+#endif
+  for (; i < n; ++i) {
+    const unsigned char ch = static_cast<unsigned char>(s[i]);
+    if (ch <= ctrl_max || s[i] == a || s[i] == b || s[i] == c) break;
+  }
+  return i;
+}
+
+// JSON string escaping, without the quotes. Also used inside quoted logfmt
+// values, which follow the same rules.
+void AppendEscaped(std::streambuf* out, const char* s, size_t n) {
+  for (;;) {
+    const size_t plain = PlainPrefix(s, n, 0x1f, '"', '\\', '"');
+    Put(out, s, plain);
+    if (plain == n) return;
+    const unsigned char ch = static_cast<unsigned char>(s[plain]);
+    char esc[6] = {'\\', '\0', '\0', '\0', '\0', '\0'};
+    size_t len = 2;
+    switch (ch) {
+      case '"':
+      case '\\':
+        esc[1] = static_cast<char>(ch);
+        break;
+      case '\n':
+        esc[1] = 'n';
+        break;
+      case '\r':
+        esc[1] = 'r';
+        break;
+      case '\t':
+        esc[1] = 't';
+        break;
+      case '\b':
+        esc[1] = 'b';
+        break;
+      case '\f':
+        esc[1] = 'f';
+        break;
+      default:
+        esc[1] = 'u';
+        esc[2] = '0';
+        esc[3] = '0';
+        esc[4] = "0123456789abcdef"[ch >> 4];
+        esc[5] = "0123456789abcdef"[ch & 0xf];
+        len = 6;
+        break;
+    }
+    Put(out, esc, len);
+    s += plain + 1;
+    n -= plain + 1;
+  }
+}
+
+void AppendQuoted(std::streambuf* out, const char* s, size_t n) {
+  out->sputc('"');
+  AppendEscaped(out, s, n);
+  out->sputc('"');
+}
+
+void AppendLogfmtValue(std::streambuf* out, const char* s, size_t n) {
+  if (n > 0 && PlainPrefix(s, n, ' ', '"', '\\', '=') == n) {
+    Put(out, s, n);
+  } else {
+    AppendQuoted(out, s, n);
+  }
+}
+
+// logfmt has no quoting for keys, so a byte that would end one (a space,
+// a control character, '=', '"' or '\\') is written as '_', and an empty
+// key as "_".
+void AppendLogfmtKey(std::streambuf* out, const char* s) {
+  size_t n = strlen(s);
+  if (n == 0) {
+    out->sputc('_');
+    return;
+  }
+  for (;;) {
+    const size_t plain = PlainPrefix(s, n, ' ', '"', '\\', '=');
+    Put(out, s, plain);
+    if (plain == n) return;
+    out->sputc('_');
+    s += plain + 1;
+    n -= plain + 1;
+  }
+}
+
+void AppendUInt(std::streambuf* out, uint64 v) {
+  char digits[kFastFormatBufferSize];
+  Put(out, digits, FormatUInt64(digits, v) - digits);
+}
+
+void AppendInt(std::streambuf* out, int64 v) {
+  char digits[kFastFormatBufferSize];
+  Put(out, digits, FormatInt64(digits, v) - digits);
+}
+
+// Shortest text that reads back as "v".
+void AppendDouble(std::streambuf* out, double v, bool json) {
+  if (!isfinite(v)) {
+    const char* name = isnan(v) ? "NaN" : v > 0 ? "Infinity" : "-Infinity";
+    if (json) {
+      AppendQuoted(out, name, strlen(name));
+    } else {
+      Put(out, name);
+    }
+    return;
+  }
+  char digits[kFastFormatBufferSize];
+  Put(out, digits, FormatDouble(digits, v) - digits);
+}
+
+void AppendFieldValue(std::streambuf* out, const LogFields& fields,
+                      const LogFields::Field& f, bool json) {
+  switch (f.type) {
+    case LogFields::kInt:
+      AppendInt(out, f.value.i);
+      break;
+    case LogFields::kUInt:
+      AppendUInt(out, f.value.u);
+      break;
+    case LogFields::kDouble:
+      AppendDouble(out, f.value.d, json);
+      break;
+    case LogFields::kBool:
+      Put(out, f.value.b ? "true" : "false");
+      break;
+    case LogFields::kString:
+      if (json) {
+        AppendQuoted(out, fields.string_data(f), f.value.s.size);
+      } else {
+        AppendLogfmtValue(out, fields.string_data(f), f.value.s.size);
+      }
+      break;
+  }
+}
+
+const char* SeverityName(int severity) {
+  static const char* const kNames[] = {"INFO", "WARNING", "ERROR", "FATAL"};
+  if (severity < INFO) severity = INFO;
+  if (severity > FATAL) severity = FATAL;
+  return kNames[severity];
+}
+
+class JsonEncoder : public LogEncoder {
+ public:
+  void Encode(const LogRecord& record, std::streambuf* out) override {
+    Put(out, "{\"ts\":");
+    AppendQuoted(out, record.timestamp, record.timestamp_size);
+    Put(out, ",\"level\":\"");
+    Put(out, SeverityName(record.severity));
+    Put(out, "\",\"file\":");
+    AppendQuoted(out, record.file, strlen(record.file));
+    Put(out, ",\"line\":");
+    AppendInt(out, record.line);
+    Put(out, ",\"msg\":");
+    AppendQuoted(out, record.message, record.message_size);
+    const LogFields& fields = *record.fields;
+    for (int i = 0; i < fields.size(); ++i) {
+      const LogFields::Field& f = fields.field(i);
+      out->sputc(',');
+      AppendQuoted(out, f.key, strlen(f.key));
+      out->sputc(':');
+      AppendFieldValue(out, fields, f, true);
+    }
+    if (fields.dropped() > 0) {
+      Put(out, ",\"fields_dropped\":");
+      AppendInt(out, fields.dropped());
+    }
+    out->sputc('}');
+  }
+};
+
+class LogfmtEncoder : public LogEncoder {
+ public:
+  void Encode(const LogRecord& record, std::streambuf* out) override {
+    Put(out, "ts=");
+    AppendLogfmtValue(out, record.timestamp, record.timestamp_size);
+    Put(out, " level=");
+    Put(out, SeverityName(record.severity));
+    Put(out, " file=");
+    AppendLogfmtValue(out, record.file, strlen(record.file));
+    Put(out, " line=");
+    AppendInt(out, record.line);
+    Put(out, " msg=");
+    AppendLogfmtValue(out, record.message, record.message_size);
+    AppendTextLogFields(*record.fields, out);
+  }
+};
+
+}  // namespace
+
+void AppendTextLogFields(const LogFields& fields, std::streambuf* out) {
+  for (int i = 0; i < fields.size(); ++i) {
+    const LogFields::Field& f = fields.field(i);
+    out->sputc(' ');
+    AppendLogfmtKey(out, f.key);
+    out->sputc('=');
+    AppendFieldValue(out, fields, f, false);
+  }
+  if (fields.dropped() > 0) {
+    Put(out, " fields_dropped=");
+    AppendInt(out, fields.dropped());
+  }
+}
+
+LogEncoder* LoadLogEncoderFromEnv() {
+  std::lock_guard<std::mutex> l(log_encoder_mu);
+  // SetLogEncoder() may have run first.
+  if (!log_encoder_loaded.load(std::memory_order_relaxed)) {
+    LogEncoder* encoder = nullptr;
+    const char* val = getenv("VTZ_CPP_LOG_FORMAT");
+    if (val != nullptr) {
+      if (strcmp(val, "json") == 0) encoder = JsonLogEncoder();
+      if (strcmp(val, "logfmt") == 0) encoder = LogfmtLogEncoder();
+    }
+    log_encoder.store(encoder, std::memory_order_release);
+    log_encoder_loaded.store(true, std::memory_order_release);
+  }
+  return log_encoder.load(std::memory_order_acquire);
+}
+
+}  // namespace internal
+
+LogEncoder* JsonLogEncoder() {
+  static LogEncoder* encoder = new internal::JsonEncoder;
+  return encoder;
+}
+
+LogEncoder* LogfmtLogEncoder() {
+  static LogEncoder* encoder = new internal::LogfmtEncoder;
+  return encoder;
+}
+
+void SetLogEncoder(LogEncoder* encoder) {
+  std::lock_guard<std::mutex> l(internal::log_encoder_mu);
+  internal::log_encoder.store(encoder, std::memory_order_release);
+  internal::log_encoder_loaded.store(true, std::memory_order_release);
+}
+
+}  // namespace vtz
@@ -0,0 +1,340 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/log_format.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace vtz {
+
+namespace {
+
+const char kDigitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+const char kHexDigits[] = "0123456789abcdef";
+
+const uint64 kPowersOf10[20] = {1ull,
+                                10ull,
+                                100ull,
+                                1000ull,
+                                10000ull,
+                                100000ull,
+                                1000000ull,
+                                10000000ull,
+                                100000000ull,
+                                1000000000ull,
+                                10000000000ull,
+                                100000000000ull,
+                                1000000000000ull,
+                                10000000000000ull,
+                                100000000000000ull,
+                                1000000000000000ull,
+                                10000000000000000ull,
+                                100000000000000000ull,
+                                1000000000000000000ull,
+                                10000000000000000000ull};
+
+int DecimalDigits(uint64 v) {
+  // floor(log10(2) * bit length) is the digit count or one less. "v | 1"
+  // gives 0 one digit and never crosses a power of ten, which are even.
+  const int bits = 64 - __builtin_clzll(v | 1);
+  const int t = (bits * 1233) >> 12;
+  return t + ((v | 1) >= kPowersOf10[t] ? 1 : 0);
+}
+
+// Two digits per step from the end; "digits" must be DecimalDigits(v).
+char* WriteDecimal(char* p, uint64 v, int digits) {
+  char* const end = p + digits;
+  char* q = end;
+  while (v >= 100) {
+    const uint64 pair = v % 100;
+    v /= 100;
+    q -= 2;
+    memcpy(q, kDigitPairs + 2 * pair, 2);
+  }
+  if (v >= 10) {
+    memcpy(q - 2, kDigitPairs + 2 * v, 2);
+  } else {
+    q[-1] = static_cast<char>('0' + v);
+  }
+  return end;
+}
+
+// "m" with "k" of its digits after a decimal point, trailing zeros dropped.
+char* WriteFixed(char* p, uint64 m, int k) {
+  while (k > 0 && m % 10 == 0) {
+    m /= 10;
+    --k;
+  }
+  const int n = DecimalDigits(m);
+  if (k == 0) return WriteDecimal(p, m, n);
+  if (n <= k) {
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', k - n);
+    return WriteDecimal(p + (k - n), m, n);
+  }
+  char digits[20];
+  WriteDecimal(digits, m, n);
+  memcpy(p, digits, n - k);
+  p += n - k;
+  *p++ = '.';
+  memcpy(p, digits + n - k, k);
+  return p + k;
+}
+
+// Per-type parts of the shortest round-trip search.
+template <typename F>
+struct FloatTraits;
+
+template <>
+struct FloatTraits<double> {
+  static const int kMantissaBits = 53;
+  // Below 2^53 every integer is a double, so none prints shorter.
+  static double MaxFixed() { return 1e15; }
+  static const int kMinPrecision = 15;
+  static const int kMaxPrecision = 17;
+  static bool Parses(const char* s, double a) {
+    return strtod(s, nullptr) == a;
+  }
+};
+
+template <>
+struct FloatTraits<float> {
+  static const int kMantissaBits = 24;
+  // Past 2^24 a float's exact digits are not its shortest.
+  static double MaxFixed() { return 16777216.0; }
+  static const int kMinPrecision = 6;
+  static const int kMaxPrecision = 9;
+  static bool Parses(const char* s, float a) {
+    return strtof(s, nullptr) == a;
+  }
+};
+
+#if defined(__SIZEOF_INT128__)
+typedef unsigned __int128 uint128;
+
+// For 1e-4 <= a < MaxFixed(): tries 0, 1, 2, ... decimals and writes the
+// first fixed-notation text that reads back as "a". Exact: with a =
+// mantissa / 2^shift, a * 10^k fits in 128 bits for the k needed, so each
+// candidate is the correctly rounded decimal and is checked against the
+// half-ulp interval around "a" that strtod() maps back to it.
+template <typename F>
+char* FormatShortestFixed(char* p, F a) {
+  const int kBits = FloatTraits<F>::kMantissaBits;
+  int exponent;
+  const double fraction = frexp(static_cast<double>(a), &exponent);
+  const uint64 mantissa = static_cast<uint64>(ldexp(fraction, kBits));
+  const int shift = kBits - exponent;  // 0 to 66
+  if (shift == 0) return WriteFixed(p, mantissa, 0);
+  const uint128 one = 1;
+  const uint128 half = one << (shift - 1);
+  // At a power of two the next value down is half as far away.
+  const bool narrow_below = mantissa == (1ull << (kBits - 1));
+  uint128 scale = 1;  // 10^k
+  for (int k = 0; k <= 20; ++k, scale *= 10) {
+    const uint128 scaled = mantissa * scale;  // a * 10^k * 2^shift
+    uint128 m = scaled >> shift;
+    const uint128 rem = scaled - (m << shift);
+    if (rem > half || (rem == half && (m & 1) != 0)) ++m;
+    if (m == 0) continue;
+    // |m / 10^k - a| against half an ulp (a quarter below a power of
+    // two), all scaled by 10^k * 2^(shift + 2). Ties read back as the
+    // even mantissa.
+    const uint128 at = m << shift;
+    const bool below = at < scaled;
+    const uint128 diff = below ? scaled - at : at - scaled;
+    const uint128 bound = (below && narrow_below) ? scale : scale * 2;
+    if (diff * 4 < bound || (diff * 4 == bound && (mantissa & 1) == 0)) {
+      return WriteFixed(p, static_cast<uint64>(m), k);
+    }
+  }
+  return nullptr;
+}
+#else
+template <typename F>
+char* FormatShortestFixed(char* p, F a) {
+  return nullptr;
+}
+#endif
+
+template <typename F>
+char* FormatShortest(char* p, F v) {
+  if (!isfinite(v)) {
+    const char* name = isnan(v) ? (signbit(v) ? "-nan" : "nan")
+                                : (v > 0 ? "inf" : "-inf");
+    const size_t n = strlen(name);
+    memcpy(p, name, n);
+    return p + n;
+  }
+  if (signbit(v)) *p++ = '-';
+  const F a = fabs(v);
+  if (a == 0) {
+    *p = '0';
+    return p + 1;
+  }
+  if (a >= static_cast<F>(1e-4) && a < FloatTraits<F>::MaxFixed()) {
+    char* end = FormatShortestFixed(p, a);
+    if (end != nullptr) return end;
+  }
+  // Up to "-d.dddddddddddddddde-308" plus the NUL.
+  char digits[kFastFormatBufferSize];
+  int n = 0;
+  for (int precision = FloatTraits<F>::kMinPrecision;
+       precision <= FloatTraits<F>::kMaxPrecision; ++precision) {
+    n = snprintf(digits, sizeof(digits), "%.*g", precision,
+                 static_cast<double>(a));
+    if (FloatTraits<F>::Parses(digits, a)) break;
+  }
+  memcpy(p, digits, n);
+  return p + n;
+}
+
+const size_t kHexDumpLineBytes = 16;
+// "\n" "00000000: " 8 groups of 4 digits, 7 spaces, 2 spaces, 16 chars.
+const size_t kHexDumpLineChars = 1 + 10 + 8 * 4 + 7 + 2 + kHexDumpLineBytes;
+
+// Hex digits of in[0, 16) into out[0, 32), and their printable form
+// ('.' for anything outside 0x20..0x7e) into text[0, 16).
+void HexDumpBlock(const unsigned char* in, char* out, char* text) {
+#if defined(__SSE2__)
+  const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero_char = _mm_set1_epi8('0');
+  const __m128i letter_gap = _mm_set1_epi8('a' - '0' - 10);
+  const __m128i lo = _mm_and_si128(v, nibble);
+  const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+  const __m128i lo_char = _mm_add_epi8(
+      _mm_add_epi8(lo, zero_char),
+      _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letter_gap));
+  const __m128i hi_char = _mm_add_epi8(
+      _mm_add_epi8(hi, zero_char),
+      _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letter_gap));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                   _mm_unpacklo_epi8(hi_char, lo_char));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16),
+                   _mm_unpackhi_epi8(hi_char, lo_char));
+  // Signed compares: bytes >= 0x80 are negative, so not above 0x1f.
+  const __m128i printable =
+      _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)),
+                    _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i*>(text),
+      _mm_or_si128(_mm_and_si128(printable, v),
+                   _mm_andnot_si128(printable, _mm_set1_epi8('.'))));
+#else
+  for (size_t i = 0; i < kHexDumpLineBytes; ++i) {
+    out[2 * i] = kHexDigits[in[i] >> 4];
+    out[2 * i + 1] = kHexDigits[in[i] & 0xf];
+    text[i] = in[i] >= 0x20 && in[i] < 0x7f ? static_cast<char>(in[i]) : '.';
+  }
+#endif
+}
+
+// One dump line for the "n" (1 to 16) bytes at "in"; returns its end.
+char* HexDumpLine(char* p, size_t offset, const unsigned char* in, size_t n) {
+  unsigned char padded[kHexDumpLineBytes];
+  if (n < kHexDumpLineBytes) {
+    memset(padded, 0, sizeof(padded));
+    memcpy(padded, in, n);
+    in = padded;
+  }
+  char hex[2 * kHexDumpLineBytes];
+  char text[kHexDumpLineBytes];
+  HexDumpBlock(in, hex, text);
+
+  *p++ = '\n';
+  for (int shift = 28; shift >= 0; shift -= 4) {
+    *p++ = kHexDigits[(offset >> shift) & 0xf];
+  }
+  *p++ = ':';
+  *p++ = ' ';
+  for (size_t group = 0; group < 8; ++group) {
+    if (group > 0) *p++ = ' ';
+    memcpy(p, hex + 4 * group, 4);
+    // Short last line: blank out the missing bytes so the text lines up.
+    if (2 * group + 2 > n) {
+      const size_t keep = 2 * group >= n ? 0 : 2;
+      memset(p + keep, ' ', 4 - keep);
+    }
+    p += 4;
+  }
+  *p++ = ' ';
+  *p++ = ' ';
+  memcpy(p, text, n);
+  return p + n;
+}
+
+}  // namespace
+
+char* FormatUInt64(char* p, uint64 v) {
+  return WriteDecimal(p, v, DecimalDigits(v));
+}
+
+char* FormatInt64(char* p, int64 v) {
+  uint64 magnitude = static_cast<uint64>(v);
+  if (v < 0) {
+    *p++ = '-';
+    magnitude = 0 - magnitude;
+  }
+  return FormatUInt64(p, magnitude);
+}
+
+char* FormatHex64(char* p, uint64 v) {
+  const int digits = (64 - __builtin_clzll(v | 1) + 3) / 4;
+  char* const end = p + digits;
+  for (char* q = end; q != p; v >>= 4) *--q = kHexDigits[v & 0xf];
+  return end;
+}
+
+char* FormatDouble(char* p, double v) { return FormatShortest(p, v); }
+
+char* FormatFloat(char* p, float v) { return FormatShortest(p, v); }
+
+std::ostream& operator<<(std::ostream& os, const HexDump& dump) {
+  // Whole lines, a few at a time.
+  char chunk[32 * kHexDumpLineChars];
+  char* p = chunk;
+  for (size_t offset = 0; offset < dump.size();
+       offset += kHexDumpLineBytes) {
+    const size_t n = std::min(kHexDumpLineBytes, dump.size() - offset);
+    p = HexDumpLine(p, offset, dump.data() + offset, n);
+    if (p + kHexDumpLineChars > chunk + sizeof(chunk)) {
+      os.write(chunk, p - chunk);
+      p = chunk;
+    }
+  }
+  if (p != chunk) os.write(chunk, p - chunk);
+  return os;
+}
+
+}  // namespace vtz
@@ -0,0 +1,606 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/log_index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace vtz {
+
+// One chunk of the log file. Little-endian on disk, like the rest of the
+// library's file formats.
+struct LogIndexBuilder::Entry {
+  uint64 offset;
+  uint32 size;
+  uint32 records;
+  // INT64_MAX and INT64_MIN while no record in the chunk had a prefix.
+  int64 min_micros;
+  int64 max_micros;
+  // Of the chunk's first kStartHashBytes bytes, so a reader can tell that
+  // the index still belongs to the file.
+  uint32 start_hash;
+  uint8 severities;  // bit per severity
+  uint8 reserved[3];
+  uint64 sites[8];   // Bloom filter of files and file:line sites
+};
+
+namespace {
+
+typedef LogIndexBuilder::Entry Entry;
+
+static_assert(sizeof(LogIndexBuilder::Entry) == 104,
+              "index entries are a file format");
+
+// "VTZIDX" and a format version.
+const char kLogIndexMagic[8] = {'V', 'T', 'Z', 'I', 'D', 'X', '0', '1'};
+const size_t kLogIndexHeaderBytes = 16;
+const size_t kStartHashBytes = 32;
+const size_t kSiteBits = 512;
+// Longer "file:line" parts are not taken for a prefix.
+const size_t kMaxFileBytes = 1024;
+
+uint32 Fnv1a32(const char* p, size_t n) {
+  uint32 h = 2166136261u;
+  for (size_t i = 0; i < n; ++i) {
+    h ^= static_cast<unsigned char>(p[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+uint64 Fnv1a64(const char* p, size_t n, uint64 h = 14695981039346656037ull) {
+  for (size_t i = 0; i < n; ++i) {
+    h ^= static_cast<unsigned char>(p[i]);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// Two probes into the site filter for a file's basename and, if "line" is
+// not 0, its line.
+uint64 SiteHash(const char* base, size_t size, int line) {
+  uint64 h = Fnv1a64(base, size);
+  if (line != 0) {
+    const uint32 v = static_cast<uint32>(line);
+    h = Fnv1a64(reinterpret_cast<const char*>(&v), sizeof(v), h ^ 0xff);
+  }
+  return h ^ (h >> 29);
+}
+
+void SetSite(uint64* sites, uint64 h) {
+  const uint32 a = static_cast<uint32>(h) % kSiteBits;
+  const uint32 b = static_cast<uint32>(h >> 32) % kSiteBits;
+  sites[a / 64] |= 1ull << (a % 64);
+  sites[b / 64] |= 1ull << (b % 64);
+}
+
+bool HasSite(const uint64* sites, uint64 h) {
+  const uint32 a = static_cast<uint32>(h) % kSiteBits;
+  const uint32 b = static_cast<uint32>(h >> 32) % kSiteBits;
+  return (sites[a / 64] >> (a % 64) & 1) != 0 &&
+         (sites[b / 64] >> (b % 64) & 1) != 0;
+}
+
+// The part of "file" after its last '/'.
+void Basename(const char* file, size_t size, const char** base,
+              size_t* base_size) {
+  size_t i = size;
+  while (i > 0 && file[i - 1] != '/') --i;
+  *base = file + i;
+  *base_size = size - i;
+}
+
+inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// Reads "n" digits at "p" into "v"; false if any is not a digit.
+bool Digits(const char* p, size_t n, int64* v) {
+  int64 x = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (!IsDigit(p[i])) return false;
+    x = x * 10 + (p[i] - '0');
+  }
+  *v = x;
+  return true;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date.
+int64 DaysFromCivil(int64 y, int64 m, int64 d) {
+  y -= m <= 2;
+  const int64 era = (y >= 0 ? y : y - 399) / 400;
+  const int64 yoe = y - era * 400;
+  const int64 doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  const int64 doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+bool CivilMicros(int64 y, int64 mo, int64 d, int64 h, int64 mi, int64 s,
+                 int64 us, int64* micros) {
+  if (mo < 1 || mo > 12 || d < 1 || d > 31 || h > 23 || mi > 59 || s > 60) {
+    return false;
+  }
+  const int64 seconds = DaysFromCivil(y, mo, d) * 86400 + h * 3600 + mi * 60 +
+                        s;
+  *micros = seconds * 1000000 + us;
+  return true;
+}
+
+// "YYYY-MM-DD HH:MM:SS.uuuuuu", as the log writes it.
+bool ParseWallTimestamp(const char* p, int64* micros) {
+  if (p[4] != '-' || p[7] != '-' || p[10] != ' ' || p[13] != ':' ||
+      p[16] != ':' || p[19] != '.') {
+    return false;
+  }
+  int64 y, mo, d, h, mi, s, us;
+  if (!Digits(p, 4, &y) || !Digits(p + 5, 2, &mo) || !Digits(p + 8, 2, &d) ||
+      !Digits(p + 11, 2, &h) || !Digits(p + 14, 2, &mi) ||
+      !Digits(p + 17, 2, &s) || !Digits(p + 20, 6, &us)) {
+    return false;
+  }
+  return CivilMicros(y, mo, d, h, mi, s, us, micros);
+}
+
+// Up to 6 fraction digits at "p", as microseconds; false unless all of
+// [p, end) is digits.
+bool ParseFraction(const char* p, const char* end, int64* us) {
+  if (p == end || end - p > 6) return false;
+  int64 v;
+  if (!Digits(p, end - p, &v)) return false;
+  for (ptrdiff_t i = end - p; i < 6; ++i) v *= 10;
+  *us = v;
+  return true;
+}
+
+// Position of the first '\n' in [p, end), or "end".
+inline const char* FindNewline(const char* p, const char* end) {
+#if defined(__SSE2__)
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; end - p >= 16; p += 16) {
+    const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), nl));
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+#endif
+  const void* hit = memchr(p, '\n', end - p);
+  return hit != nullptr ? static_cast<const char*>(hit) : end;
+}
+
+// Start of the line after the one at "p", or "end".
+inline const char* NextLine(const char* p, const char* end) {
+  p = FindNewline(p, end);
+  return p == end ? end : p + 1;
+}
+
+// First occurrence of needle[0, m) in [p, end), or nullptr. Compares the
+// first and last needle bytes 16 positions at a time and checks only the
+// positions where both match.
+const char* FindText(const char* p, const char* end, const char* needle,
+                     size_t m) {
+  if (m == 0) return p;
+  if (static_cast<size_t>(end - p) < m) return nullptr;
+  // Candidates start before "limit".
+  const char* const limit = end - m + 1;
+#if defined(__SSE2__)
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  for (; limit - p >= 16; p += 16) {
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + m - 1));
+    int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      const int k = __builtin_ctz(mask);
+      if (memcmp(p + k, needle, m) == 0) return p + k;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; p < limit; ++p) {
+    if (*p == needle[0] && memcmp(p, needle, m) == 0) return p;
+  }
+  return nullptr;
+}
+
+// Where the last of "entries" ends in the log file.
+uint64 EntriesEnd(const std::string& entries) {
+  if (entries.empty()) return 0;
+  Entry last;
+  memcpy(&last, entries.data() + entries.size() - sizeof(last), sizeof(last));
+  return last.offset + last.size;
+}
+
+bool ReadFile(const std::string& path, std::string* out) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  char buf[64 * 1024];
+  for (;;) {
+    const ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    out->append(buf, n);
+  }
+  close(fd);
+  return true;
+}
+
+bool WriteAllAt(int fd, const char* p, size_t n, off_t offset) {
+  while (n > 0) {
+    const ssize_t w = pwrite(fd, p, n, offset);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    p += w;
+    n -= w;
+    offset += w;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool ParseLogRecordPrefix(const char* data, size_t size,
+                          LogRecordPrefix* prefix) {
+  // "<time> S file:line] "
+  size_t i;
+  if (size >= 26 && data[4] == '-') {
+    if (!ParseWallTimestamp(data, &prefix->micros)) return false;
+    i = 26;
+  } else {
+    int64 seconds = 0;
+    for (i = 0; i < size && i < 12 && IsDigit(data[i]); ++i) {
+      seconds = seconds * 10 + (data[i] - '0');
+    }
+    int64 us;
+    if (i == 0 || size < i + 7 || data[i] != '.' ||
+        !Digits(data + i + 1, 6, &us)) {
+      return false;
+    }
+    prefix->micros = seconds * 1000000 + us;
+    i += 7;
+  }
+  if (size < i + 6 || data[i] != ' ' || data[i + 2] != ' ') return false;
+  switch (data[i + 1]) {
+    case 'I': prefix->severity = INFO; break;
+    case 'W': prefix->severity = WARNING; break;
+    case 'E': prefix->severity = ERROR; break;
+    case 'F': prefix->severity = FATAL; break;
+    default: return false;
+  }
+  const char* file = data + i + 3;
+  const char* end = data + std::min(size, i + 3 + kMaxFileBytes);
+  const char* close = static_cast<const char*>(memchr(file, ']', end - file));
+  if (close == nullptr || close + 1 >= data + size || close[1] != ' ') {
+    return false;
+  }
+  const char* colon = close;
+  int64 line = 0;
+  int64 scale = 1;
+  while (colon > file && IsDigit(colon[-1]) && scale <= 1000000000) {
+    --colon;
+    line += (*colon - '0') * scale;
+    scale *= 10;
+  }
+  if (colon == close || colon == file || colon[-1] != ':') return false;
+  prefix->file = file;
+  prefix->file_size = static_cast<size_t>(colon - 1 - file);
+  prefix->line = static_cast<int>(line);
+  prefix->size = static_cast<size_t>(close + 2 - data);
+  return true;
+}
+
+bool ParseLogTime(const std::string& text, int64* micros) {
+  const char* p = text.data();
+  const char* const end = p + text.size();
+  if (text.size() >= 10 && p[4] == '-' && p[7] == '-') {
+    int64 y, mo, d, h = 0, mi = 0, s = 0, us = 0;
+    if (!Digits(p, 4, &y) || !Digits(p + 5, 2, &mo) ||
+        !Digits(p + 8, 2, &d)) {
+      return false;
+    }
+    p += 10;
+    if (p != end) {
+      if (end - p < 6 || (*p != ' ' && *p != 'T') || p[3] != ':' ||
+          !Digits(p + 1, 2, &h) || !Digits(p + 4, 2, &mi)) {
+        return false;
+      }
+      p += 6;
+    }
+    if (p != end) {
+      if (end - p < 3 || *p != ':' || !Digits(p + 1, 2, &s)) return false;
+      p += 3;
+    }
+    if (p != end && (*p != '.' || !ParseFraction(p + 1, end, &us))) {
+      return false;
+    }
+    return CivilMicros(y, mo, d, h, mi, s, us, micros);
+  }
+  int64 seconds = 0;
+  const char* q = p;
+  while (q != end && IsDigit(*q) && q - p < 12) {
+    seconds = seconds * 10 + (*q - '0');
+    ++q;
+  }
+  if (q == p) return false;
+  int64 us = 0;
+  if (q != end && (*q != '.' || !ParseFraction(q + 1, end, &us))) {
+    return false;
+  }
+  *micros = seconds * 1000000 + us;
+  return true;
+}
+
+LogIndexBuilder::LogIndexBuilder(size_t chunk_bytes)
+    : chunk_bytes_(std::max<size_t>(chunk_bytes, 4096)),
+      entry_(new Entry),
+      building_(false) {}
+
+LogIndexBuilder::~LogIndexBuilder() { delete entry_; }
+
+void LogIndexBuilder::Add(uint64 offset, const char* data, size_t size) {
+  Entry* e = entry_;
+  if (!building_) {
+    memset(e, 0, sizeof(*e));
+    e->offset = offset;
+    e->min_micros = INT64_MAX;
+    e->max_micros = INT64_MIN;
+    e->start_hash = Fnv1a32(data, std::min(size, kStartHashBytes));
+    building_ = true;
+  }
+  e->size = static_cast<uint32>(offset + size - e->offset);
+  ++e->records;
+  LogRecordPrefix prefix;
+  if (ParseLogRecordPrefix(data, size, &prefix)) {
+    e->min_micros = std::min(e->min_micros, prefix.micros);
+    e->max_micros = std::max(e->max_micros, prefix.micros);
+    e->severities |= static_cast<uint8>(1 << prefix.severity);
+    const char* base;
+    size_t base_size;
+    Basename(prefix.file, prefix.file_size, &base, &base_size);
+    SetSite(e->sites, SiteHash(base, base_size, 0));
+    SetSite(e->sites, SiteHash(base, base_size, prefix.line));
+  }
+  if (e->size >= chunk_bytes_) Seal();
+}
+
+void LogIndexBuilder::Seal() {
+  if (!building_) return;
+  sealed_.append(reinterpret_cast<const char*>(entry_), sizeof(*entry_));
+  building_ = false;
+}
+
+void LogIndexBuilder::TakeSealed(std::string* out) {
+  out->append(sealed_);
+  sealed_.clear();
+}
+
+std::string LogIndexBuilder::FileHeader() {
+  std::string header(kLogIndexMagic, sizeof(kLogIndexMagic));
+  const uint32 entry_bytes = sizeof(Entry);
+  header.append(reinterpret_cast<const char*>(&entry_bytes),
+                sizeof(entry_bytes));
+  header.append(kLogIndexHeaderBytes - header.size(), '\0');
+  return header;
+}
+
+IndexedLogFile::IndexedLogFile()
+    : fd_(-1), base_(nullptr), size_(0), loaded_(0), indexed_bytes_(0) {}
+
+IndexedLogFile::~IndexedLogFile() {
+  if (base_ != nullptr) munmap(const_cast<char*>(base_), size_);
+  if (fd_ >= 0) close(fd_);
+}
+
+IndexedLogFile* IndexedLogFile::Open(const std::string& path,
+                                     bool use_index, std::string* error) {
+  IndexedLogFile* f = new IndexedLogFile;
+  f->fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (f->fd_ < 0 || fstat(f->fd_, &st) != 0) {
+    *error = path + ": " + strerror(errno);
+    delete f;
+    return nullptr;
+  }
+  f->size_ = static_cast<size_t>(st.st_size);
+  if (f->size_ > 0) {
+    void* base = mmap(nullptr, f->size_, PROT_READ, MAP_SHARED, f->fd_, 0);
+    if (base == MAP_FAILED) {
+      *error = path + ": mmap: " + strerror(errno);
+      delete f;
+      return nullptr;
+    }
+    f->base_ = static_cast<const char*>(base);
+  }
+  // RotatingFileSink writes the index of the segment "<path>" links to.
+  char resolved[PATH_MAX];
+  f->index_path_ =
+      (realpath(path.c_str(), resolved) != nullptr ? resolved : path) +
+      std::string(".idx");
+
+  std::string index;
+  const std::string header = LogIndexBuilder::FileHeader();
+  if (use_index && ReadFile(f->index_path_, &index) &&
+      index.compare(0, header.size(), header) == 0) {
+    // A torn last entry is dropped, and overwritten by SaveIndex().
+    const size_t n = (index.size() - header.size()) / sizeof(Entry);
+    uint64 end = 0;
+    size_t valid = 0;
+    for (size_t i = 0; i < n; ++i) {
+      Entry e;
+      memcpy(&e, index.data() + header.size() + i * sizeof(e), sizeof(e));
+      if (e.offset != end || e.size == 0 || e.offset + e.size > f->size_) {
+        break;
+      }
+      // The first and every 64th chunk are checked against the file.
+      if (i % 64 == 0 || i == n - 1) {
+        const size_t k = std::min<size_t>(e.size, kStartHashBytes);
+        if (Fnv1a32(f->base_ + e.offset, k) != e.start_hash) break;
+      }
+      end = e.offset + e.size;
+      ++valid;
+    }
+    if (valid == n) {
+      f->entries_.assign(index, header.size(), n * sizeof(Entry));
+      f->loaded_ = f->entries_.size();
+      f->indexed_bytes_ = end;
+    }
+  }
+
+  // Index the rest, one record at a time.
+  LogIndexBuilder builder;
+  const char* p = f->base_ + f->indexed_bytes_;
+  const char* const end = f->base_ + f->size_;
+  const char* record = nullptr;
+  while (p < end && *p != '\0') {
+    const char* next = NextLine(p, end);
+    if (next == end && end[-1] != '\n') break;  // still being written
+    LogRecordPrefix prefix;
+    if (record != nullptr && ParseLogRecordPrefix(p, next - p, &prefix)) {
+      builder.Add(record - f->base_, record, p - record);
+      record = nullptr;
+    }
+    if (record == nullptr) record = p;
+    p = next;
+  }
+  if (record != nullptr) builder.Add(record - f->base_, record, p - record);
+  builder.Seal();
+  builder.TakeSealed(&f->entries_);
+
+  // Queries touch only the chunks they need; keep the kernel from reading
+  // ahead into the others.
+  if (f->base_ != nullptr) {
+    madvise(const_cast<char*>(f->base_), f->size_, MADV_RANDOM);
+  }
+  return f;
+}
+
+uint64 IndexedLogFile::Query(
+    const LogQuery& query,
+    const std::function<void(const char* data, size_t size)>& fn,
+    LogQueryStats* stats) {
+  LogQueryStats local;
+  if (stats == nullptr) stats = &local;
+  const uint8 severities =
+      static_cast<uint8>(0xff << std::max(query.min_severity, 0));
+  const char* base;
+  size_t base_size;
+  Basename(query.file.data(), query.file.size(), &base, &base_size);
+  const uint64 site =
+      SiteHash(base, base_size, query.file.empty() ? 0 : query.line);
+  const char* const data_end = base_ + EntriesEnd(entries_);
+  const long page = sysconf(_SC_PAGESIZE);
+
+  uint64 records = 0;
+  for (size_t i = 0; i < entries_.size(); i += sizeof(Entry)) {
+    Entry e;
+    memcpy(&e, entries_.data() + i, sizeof(e));
+    ++stats->chunks;
+    stats->bytes += e.size;
+    if ((e.severities & severities) == 0 ||
+        (query.begin_micros >= 0 && e.max_micros < query.begin_micros) ||
+        (query.end_micros >= 0 && e.min_micros >= query.end_micros) ||
+        (!query.file.empty() && !HasSite(e.sites, site))) {
+      continue;
+    }
+    ++stats->chunks_read;
+    stats->bytes_read += e.size;
+    const uint64 first_page = e.offset / page * page;
+    madvise(const_cast<char*>(base_) + first_page,
+            e.offset + e.size - first_page, MADV_WILLNEED);
+
+    // A record continued past the chunk's end (possible in files indexed
+    // while still being written) is followed to its last line.
+    const char* p = base_ + e.offset;
+    const char* const chunk_end = p + e.size;
+    LogRecordPrefix prefix;
+    bool have_prefix = ParseLogRecordPrefix(p, data_end - p, &prefix);
+    while (p < chunk_end) {
+      if (!have_prefix) {
+        // Continues a record of the chunk before.
+        p = NextLine(p, data_end);
+        have_prefix = ParseLogRecordPrefix(p, data_end - p, &prefix);
+        continue;
+      }
+      const LogRecordPrefix current = prefix;
+      const char* next = NextLine(p + current.size, data_end);
+      have_prefix = false;
+      while (next < data_end &&
+             !(have_prefix =
+                   ParseLogRecordPrefix(next, data_end - next, &prefix))) {
+        next = NextLine(next, data_end);
+      }
+      if (current.severity >= query.min_severity &&
+          (query.begin_micros < 0 || current.micros >= query.begin_micros) &&
+          (query.end_micros < 0 || current.micros < query.end_micros)) {
+        bool match = true;
+        if (!query.file.empty()) {
+          const size_t n = query.file.size();
+          match = (current.file_size == n ||
+                   (current.file_size > n &&
+                    current.file[current.file_size - n - 1] == '/')) &&
+                  memcmp(current.file + current.file_size - n,
+                         query.file.data(), n) == 0 &&
+                  (query.line == 0 || current.line == query.line);
+        }
+        if (match && !query.text.empty()) {
+          match = FindText(p + current.size, next, query.text.data(),
+                           query.text.size()) != nullptr;
+        }
+        if (match) {
+          fn(p, next - p);
+          ++records;
+        }
+      }
+      p = next;
+    }
+  }
+  stats->records += records;
+  return records;
+}
+
+bool IndexedLogFile::SaveIndex(std::string* error) {
+  if (loaded_ == entries_.size()) return true;
+  const std::string header = LogIndexBuilder::FileHeader();
+  const int fd = open(index_path_.c_str(),
+                      O_WRONLY | O_CREAT | O_CLOEXEC | (loaded_ == 0 ? O_TRUNC
+                                                                     : 0),
+                      0644);
+  bool ok = fd >= 0;
+  if (ok && loaded_ == 0) {
+    ok = WriteAllAt(fd, header.data(), header.size(), 0);
+  }
+  // Past the entries loaded, which drops a torn one.
+  const off_t at = static_cast<off_t>(header.size() + loaded_);
+  ok = ok && ftruncate(fd, at) == 0 &&
+       WriteAllAt(fd, entries_.data() + loaded_, entries_.size() - loaded_,
+                  at);
+  if (!ok) *error = index_path_ + ": " + strerror(errno);
+  if (fd >= 0) close(fd);
+  if (ok) loaded_ = entries_.size();
+  return ok;
+}
+
+}  // namespace vtz
@@ -0,0 +1,353 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/log_level_control.h"
+#include "common/log_output_private.h"
+#include "common/trace.h"
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace vtz {
+namespace internal {
+
+std::atomic<bool> log_write_timing(false);
+
+namespace {
+
+// Write timings since the last pressure check.
+std::atomic<int64> write_nanos_sum(0);
+std::atomic<int64> write_count(0);
+
+int64 MonotonicMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// What tells one version of the control file from the next.
+struct FileIdentity {
+  bool exists;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  int64 mtime_nanos;
+
+  bool operator==(const FileIdentity& o) const {
+    return exists == o.exists &&
+           (!exists || (dev == o.dev && ino == o.ino && size == o.size &&
+                        mtime_nanos == o.mtime_nanos));
+  }
+};
+
+FileIdentity StatControlFile(const std::string& path) {
+  FileIdentity id;
+  memset(&id, 0, sizeof(id));
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return id;
+  id.exists = true;
+  id.dev = st.st_dev;
+  id.ino = st.st_ino;
+  id.size = st.st_size;
+  id.mtime_nanos =
+      static_cast<int64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  return id;
+}
+
+// One thread polls the control file and checks output pressure, for
+// whichever of the two is enabled.
+struct ControlState {
+  ControlState()
+      : stop(false),
+        watching(false),
+        poll_interval_millis(1000),
+        adaptive(false),
+        next_poll(0),
+        next_check(0),
+        last_change(0),
+        last_pressure(0),
+        raises(0),
+        lowers(0) {
+    memset(&file, 0, sizeof(file));
+  }
+
+  std::mutex api_mu;  // serializes the public calls
+
+  std::mutex mu;
+  std::condition_variable cv;
+  std::thread thread;
+  bool stop;                        // guarded by mu
+  bool watching;                    // guarded by mu
+  std::string path;                 // guarded by mu
+  int64 poll_interval_millis;       // guarded by mu
+  bool adaptive;                    // guarded by mu
+  AdaptiveLogLevelOptions options;  // guarded by mu
+
+  // Control thread only.
+  FileIdentity file;
+  int64 next_poll;
+  int64 next_check;
+  int64 last_change;    // last time the shed level moved
+  int64 last_pressure;  // last check that did not find pressure clear
+
+  std::atomic<uint64> raises;
+  std::atomic<uint64> lowers;
+};
+
+ControlState* State() {
+  static ControlState* state = new ControlState;
+  return state;
+}
+
+std::string Trim(const std::string& s) {
+  const char* kSpace = " \t\r\n";
+  const size_t begin = s.find_first_not_of(kSpace);
+  if (begin == std::string::npos) return std::string();
+  return s.substr(begin, s.find_last_not_of(kSpace) + 1 - begin);
+}
+
+bool ParseInt(const std::string& s, int* value) {
+  if (s.empty()) return false;
+  char* end;
+  errno = 0;
+  const long v = strtol(s.c_str(), &end, 10);
+  if (*end != '\0' || errno != 0 || v < INT_MIN || v > INT_MAX) return false;
+  *value = static_cast<int>(v);
+  return true;
+}
+
+void ApplyControlFile(const std::string& contents) {
+  size_t pos = 0;
+  while (pos < contents.size()) {
+    size_t end = contents.find('\n', pos);
+    if (end == std::string::npos) end = contents.size();
+    std::string line = contents.substr(pos, end - pos);
+    pos = end + 1;
+    const size_t hash = line.find('#');
+    if (hash != std::string::npos) line.resize(hash);
+    const size_t eq = line.find('=');
+    if (eq == std::string::npos) continue;
+    const std::string key = Trim(line.substr(0, eq));
+    const std::string value = Trim(line.substr(eq + 1));
+    int level;
+    if (key == "min_log_level") {
+      if (ParseInt(value, &level)) SetMinLogLevel(level);
+    } else if (key == "min_vlog_level") {
+      if (ParseInt(value, &level)) SetMinVLogLevel(level);
+    } else if (key == "vmodule") {
+      SetVModule(value.c_str());
+    } else if (key == "trace") {
+      if (value == "1") EnableTracing(TraceOptions());
+      if (value == "0") DisableTracing();
+    }
+  }
+}
+
+void PollControlFile(ControlState* s, const std::string& path) {
+  const FileIdentity id = StatControlFile(path);
+  if (id == s->file) return;
+  s->file = id;
+  if (!id.exists) return;
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == nullptr) return;
+  std::string contents;
+  char chunk[4096];
+  size_t n;
+  // Anything past 64 KiB is not a control file.
+  while (contents.size() < 64 * 1024 &&
+         (n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    contents.append(chunk, n);
+  }
+  fclose(f);
+  ApplyControlFile(contents);
+}
+
+void CheckPressure(ControlState* s, const AdaptiveLogLevelOptions& options,
+                   int64 now) {
+  const double fill = AsyncLogQueueFill();
+  const int64 count = write_count.exchange(0, std::memory_order_relaxed);
+  const int64 sum = write_nanos_sum.exchange(0, std::memory_order_relaxed);
+  const int64 write_micros = count > 0 ? sum / count / 1000 : 0;
+  const bool high = fill >= options.high_water_queue_fill ||
+                    write_micros >= options.high_water_write_micros;
+  const bool clear = fill <= options.low_water_queue_fill &&
+                     write_micros <= options.low_water_write_micros;
+  if (!clear) s->last_pressure = now;
+
+  const int max_level = std::max(INFO, std::min(options.max_level, FATAL));
+  const int shed = shed_log_level.load(std::memory_order_relaxed);
+  if (high && shed < max_level) {
+    shed_log_level.store(shed + 1, std::memory_order_relaxed);
+    s->raises.fetch_add(1, std::memory_order_relaxed);
+    s->last_change = now;
+    UpdateMinLogLevelForMacros();
+  } else if (clear && shed > INFO &&
+             now - std::max(s->last_change, s->last_pressure) >=
+                 options.recovery_millis) {
+    shed_log_level.store(shed - 1, std::memory_order_relaxed);
+    s->lowers.fetch_add(1, std::memory_order_relaxed);
+    s->last_change = now;
+    UpdateMinLogLevelForMacros();
+  }
+}
+
+void ControlLoop(ControlState* s) {
+  std::unique_lock<std::mutex> l(s->mu);
+  while (!s->stop) {
+    int64 now = MonotonicMillis();
+    if (s->watching && now >= s->next_poll) {
+      s->next_poll = now + s->poll_interval_millis;
+      const std::string path = s->path;
+      l.unlock();
+      PollControlFile(s, path);
+      l.lock();
+    }
+    if (s->adaptive && now >= s->next_check) {
+      s->next_check = now + s->options.check_interval_millis;
+      CheckPressure(s, s->options, now);
+    }
+    int64 wake = std::numeric_limits<int64>::max();
+    if (s->watching) wake = std::min(wake, s->next_poll);
+    if (s->adaptive) wake = std::min(wake, s->next_check);
+    now = MonotonicMillis();
+    s->cv.wait_for(l, std::chrono::milliseconds(
+                          std::max<int64>(std::min<int64>(wake - now, 1000),
+                                          1)));
+  }
+}
+
+// Both with s->api_mu held.
+void StartControlThread(ControlState* s) {
+  if (s->thread.joinable()) return;
+  s->stop = false;
+  s->thread = std::thread(ControlLoop, s);
+}
+
+void StopControlThreadIfIdle(ControlState* s) {
+  {
+    std::lock_guard<std::mutex> l(s->mu);
+    if (s->watching || s->adaptive || !s->thread.joinable()) return;
+    s->stop = true;
+    s->cv.notify_one();
+  }
+  s->thread.join();
+}
+
+void LogLevelSignalHandler(int sig) {
+  StepLogVerbosity(sig == SIGUSR1 ? 1 : -1);
+}
+
+}  // namespace
+
+void NoteLogWriteNanos(int64 nanos) {
+  write_nanos_sum.fetch_add(nanos, std::memory_order_relaxed);
+  write_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace internal
+
+void InstallLogLevelSignalHandlers() {
+  // Read the environment now; the handlers must not.
+  internal::StepLogVerbosity(0);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = internal::LogLevelSignalHandler;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, nullptr);
+  sigaction(SIGUSR2, &action, nullptr);
+}
+
+bool WatchLogControlFile(const std::string& path,
+                         int64 poll_interval_millis) {
+  internal::ControlState* s = internal::State();
+  std::lock_guard<std::mutex> api(s->api_mu);
+  {
+    std::lock_guard<std::mutex> l(s->mu);
+    if (s->watching) return false;
+    s->watching = true;
+    s->path = path;
+    s->poll_interval_millis = std::max<int64>(poll_interval_millis, 1);
+    s->next_poll = 0;
+    s->cv.notify_one();
+  }
+  StartControlThread(s);
+  return true;
+}
+
+void StopWatchingLogControlFile() {
+  internal::ControlState* s = internal::State();
+  std::lock_guard<std::mutex> api(s->api_mu);
+  {
+    std::lock_guard<std::mutex> l(s->mu);
+    s->watching = false;
+  }
+  internal::StopControlThreadIfIdle(s);
+}
+
+bool EnableAdaptiveLogLevel(const AdaptiveLogLevelOptions& options) {
+  internal::ControlState* s = internal::State();
+  std::lock_guard<std::mutex> api(s->api_mu);
+  {
+    std::lock_guard<std::mutex> l(s->mu);
+    if (s->adaptive) return false;
+    s->adaptive = true;
+    s->options = options;
+    s->options.check_interval_millis =
+        std::max<int64>(options.check_interval_millis, 1);
+    s->next_check = 0;
+    internal::write_count.store(0, std::memory_order_relaxed);
+    internal::write_nanos_sum.store(0, std::memory_order_relaxed);
+    internal::log_write_timing.store(true, std::memory_order_relaxed);
+    s->cv.notify_one();
+  }
+  StartControlThread(s);
+  return true;
+}
+
+void DisableAdaptiveLogLevel() {
+  internal::ControlState* s = internal::State();
+  std::lock_guard<std::mutex> api(s->api_mu);
+  {
+    std::lock_guard<std::mutex> l(s->mu);
+    s->adaptive = false;
+    internal::log_write_timing.store(false, std::memory_order_relaxed);
+    internal::shed_log_level.store(INFO, std::memory_order_relaxed);
+    internal::UpdateMinLogLevelForMacros();
+  }
+  internal::StopControlThreadIfIdle(s);
+}
+
+AdaptiveLogLevelStats GetAdaptiveLogLevelStats() {
+  internal::ControlState* s = internal::State();
+  AdaptiveLogLevelStats stats;
+  stats.shed_level = internal::shed_log_level.load(std::memory_order_relaxed);
+  stats.raises = s->raises.load(std::memory_order_relaxed);
+  stats.lowers = s->lowers.load(std::memory_order_relaxed);
+  return stats;
+}
+
+}  // namespace vtz
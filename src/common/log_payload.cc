@@ -0,0 +1,202 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/log_payload.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "common/log_format.h"
+#include "common/log_output_private.h"
+
+namespace vtz {
+namespace internal {
+
+namespace {
+
+const char kHexDigits[] = "0123456789abcdef";
+const char kBase64Digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Source bytes encoded per piece when streaming; a multiple of 3 so that
+// base64 needs no padding between pieces.
+const size_t kStreamPieceBytes = 3 * 1024;
+
+// Joined records up to this size keep their buffer for the thread's next
+// one; larger ones give it back.
+const size_t kKeptScratchBytes = 256 * 1024;
+
+char* EncodeHex(const unsigned char* s, size_t n, char* out) {
+  for (size_t i = 0; i < n; ++i) {
+    out[0] = kHexDigits[s[i] >> 4];
+    out[1] = kHexDigits[s[i] & 0xf];
+    out += 2;
+  }
+  return out;
+}
+
+char* EncodeBase64(const unsigned char* s, size_t n, char* out) {
+  size_t i = 0;
+  for (; i + 3 <= n; i += 3) {
+    const uint32 v = (static_cast<uint32>(s[i]) << 16) |
+                     (static_cast<uint32>(s[i + 1]) << 8) | s[i + 2];
+    out[0] = kBase64Digits[v >> 18];
+    out[1] = kBase64Digits[(v >> 12) & 0x3f];
+    out[2] = kBase64Digits[(v >> 6) & 0x3f];
+    out[3] = kBase64Digits[v & 0x3f];
+    out += 4;
+  }
+  if (i < n) {
+    uint32 v = static_cast<uint32>(s[i]) << 16;
+    if (i + 1 < n) v |= static_cast<uint32>(s[i + 1]) << 8;
+    out[0] = kBase64Digits[v >> 18];
+    out[1] = kBase64Digits[(v >> 12) & 0x3f];
+    out[2] = i + 1 < n ? kBase64Digits[(v >> 6) & 0x3f] : '=';
+    out[3] = '=';
+    out += 4;
+  }
+  return out;
+}
+
+size_t EncodedBytes(int encoding, size_t n) {
+  switch (encoding) {
+    case Payload::kHex:
+      return 2 * n;
+    case Payload::kBase64:
+      return (n + 2) / 3 * 4;
+    default:
+      return n;
+  }
+}
+
+char* Encode(int encoding, const char* s, size_t n, char* out) {
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(s);
+  switch (encoding) {
+    case Payload::kHex:
+      return EncodeHex(u, n, out);
+    case Payload::kBase64:
+      return EncodeBase64(u, n, out);
+    default:
+      memcpy(out, s, n);
+      return out + n;
+  }
+}
+
+inline size_t ShownBytes(const LogPayload& payload) {
+  return std::min(payload.size, payload.limit);
+}
+
+// The buffer JoinLogPayload() returns. A plain pointer rather than a
+// std::string, so that a LOG from a later thread_local destructor still
+// finds it usable; it then starts over and is not freed.
+class PayloadScratch {
+ public:
+  PayloadScratch() : data_(nullptr), capacity_(0) {}
+  ~PayloadScratch() {
+    free(data_);
+    data_ = nullptr;
+    capacity_ = 0;
+  }
+
+  // Room for "n" bytes; nullptr if it cannot be had.
+  char* Get(size_t n) {
+    if (n > capacity_ || capacity_ > std::max(n, kKeptScratchBytes)) {
+      char* p = static_cast<char*>(realloc(data_, n));
+      if (p == nullptr) return nullptr;
+      data_ = p;
+      capacity_ = n;
+    }
+    return data_;
+  }
+
+ private:
+  char* data_;
+  size_t capacity_;
+};
+
+thread_local PayloadScratch payload_scratch;
+
+}  // namespace
+
+static_assert(kLogPayloadMarkerBytes >= 32 + 2 * kFastFormatBufferSize,
+              "room for the marker");
+
+// " [payload truncated, <limit> of <size> bytes]".
+char* AppendLogPayloadMarker(const LogPayload& payload, char* p) {
+  if (payload.size <= payload.limit) return p;
+  const char kStart[] = " [payload truncated, ";
+  memcpy(p, kStart, sizeof(kStart) - 1);
+  p = FormatUInt64(p + sizeof(kStart) - 1, payload.limit);
+  memcpy(p, " of ", 4);
+  p = FormatUInt64(p + 4, payload.size);
+  memcpy(p, " bytes]", 7);
+  return p + 7;
+}
+
+size_t LogPayloadTextSize(const LogPayload& payload) {
+  char marker[kLogPayloadMarkerBytes];
+  return EncodedBytes(payload.encoding, ShownBytes(payload)) +
+         (AppendLogPayloadMarker(payload, marker) - marker);
+}
+
+char* AppendLogPayloadText(const LogPayload& payload, char* out) {
+  out = Encode(payload.encoding, payload.data, ShownBytes(payload), out);
+  return AppendLogPayloadMarker(payload, out);
+}
+
+void WriteLogPayloadText(const LogPayload& payload, std::streambuf* out) {
+  const size_t shown = ShownBytes(payload);
+  if (payload.encoding == Payload::kRaw) {
+    out->sputn(payload.data, static_cast<std::streamsize>(shown));
+  } else {
+    char piece[2 * kStreamPieceBytes];
+    for (size_t i = 0; i < shown; i += kStreamPieceBytes) {
+      const size_t n = std::min(kStreamPieceBytes, shown - i);
+      const char* end = Encode(payload.encoding, payload.data + i, n, piece);
+      out->sputn(piece, end - piece);
+    }
+  }
+  char marker[kLogPayloadMarkerBytes];
+  out->sputn(marker, AppendLogPayloadMarker(payload, marker) - marker);
+}
+
+const char* JoinLogPayload(const char* data, size_t size,
+                           const LogPayload& payload, size_t* joined_size) {
+  const size_t text = LogPayloadTextSize(payload);
+  char* joined = payload_scratch.Get(size + text);
+  if (joined == nullptr) {
+    // Out of memory: the record without its payload.
+    *joined_size = size;
+    return data;
+  }
+  memcpy(joined, data, payload.offset);
+  char* p = AppendLogPayloadText(payload, joined + payload.offset);
+  memcpy(p, data + payload.offset, size - payload.offset);
+  *joined_size = size + text;
+  return joined;
+}
+
+}  // namespace internal
+
+std::ostream& operator<<(std::ostream& os, const Payload& payload) {
+  internal::LogPayload p;
+  p.data = payload.data();
+  p.size = payload.size();
+  p.limit = payload.limit();
+  p.encoding = payload.encoding();
+  internal::WriteLogPayloadText(p, os.rdbuf());
+  return os;
+}
+
+}  // namespace vtz
@@ -0,0 +1,151 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/log_sink.h"
+#include "common/log_output_private.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace vtz {
+namespace internal {
+
+std::atomic<int> stderr_log_severity(INFO);
+
+namespace {
+
+const int kMaxLogSinks = 16;
+// Threads count their calls into a sink on one of this many cache lines,
+// so that threads logging on different cores do not all bounce one line.
+const int kActiveStripes = 32;
+
+struct ActiveCount {
+  std::atomic<int> n;
+  char pad[64 - sizeof(std::atomic<int>)];
+};
+
+// A sink is only called between active[k].n.fetch_add() and fetch_sub(),
+// and RemoveLogSink() clears the slot before waiting for every stripe to
+// drain, so no call can start on a removed sink. Both sides use seq_cst so
+// the clear and the increment cannot pass each other.
+struct LogSinkSlot {
+  std::atomic<LogSink*> sink;
+  std::atomic<int> min_severity;
+  char pad[64 - sizeof(std::atomic<LogSink*>) - sizeof(std::atomic<int>)];
+  ActiveCount active[kActiveStripes];
+};
+
+// Static storage, so all zero without any dynamic initialization.
+LogSinkSlot log_sink_slots[kMaxLogSinks];
+// One past the highest slot ever used; readers scan no further.
+std::atomic<int> log_sink_slots_used(0);
+std::mutex log_sink_mu;  // serializes AddLogSink()/RemoveLogSink()
+
+std::atomic<int> next_active_stripe(0);
+thread_local int active_stripe VTZ_ATTRIBUTE_INITIAL_EXEC = -1;
+
+// This thread's stripe; threads are dealt out in the order they first log.
+inline std::atomic<int>* ActiveCounter(LogSinkSlot* slot) {
+  if (VTZ_PREDICT_FALSE(active_stripe < 0)) {
+    active_stripe = next_active_stripe.fetch_add(1, std::memory_order_relaxed) %
+                    kActiveStripes;
+  }
+  return &slot->active[active_stripe].n;
+}
+
+}  // namespace
+
+void SendToLogSinks(int severity, const char* data, size_t size) {
+  const int n = log_sink_slots_used.load(std::memory_order_acquire);
+  for (int i = 0; i < n; ++i) {
+    LogSinkSlot* slot = &log_sink_slots[i];
+    if (severity < slot->min_severity.load(std::memory_order_relaxed)) {
+      continue;
+    }
+    std::atomic<int>* active = ActiveCounter(slot);
+    active->fetch_add(1);
+    LogSink* sink = slot->sink.load();
+    if (sink != nullptr) sink->Send(severity, data, size);
+    active->fetch_sub(1, std::memory_order_release);
+  }
+}
+
+bool LogSinksWant(int severity) {
+  const int n = log_sink_slots_used.load(std::memory_order_acquire);
+  for (int i = 0; i < n; ++i) {
+    const LogSinkSlot* slot = &log_sink_slots[i];
+    if (severity >= slot->min_severity.load(std::memory_order_relaxed) &&
+        slot->sink.load(std::memory_order_relaxed) != nullptr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void FlushLogSinks() {
+  const int n = log_sink_slots_used.load(std::memory_order_acquire);
+  for (int i = 0; i < n; ++i) {
+    LogSinkSlot* slot = &log_sink_slots[i];
+    std::atomic<int>* active = ActiveCounter(slot);
+    active->fetch_add(1);
+    LogSink* sink = slot->sink.load();
+    if (sink != nullptr) sink->Flush();
+    active->fetch_sub(1, std::memory_order_release);
+  }
+}
+
+}  // namespace internal
+
+bool AddLogSink(LogSink* sink, int min_severity) {
+  if (sink == nullptr) return false;
+  std::lock_guard<std::mutex> l(internal::log_sink_mu);
+  int free_slot = -1;
+  for (int i = 0; i < internal::kMaxLogSinks; ++i) {
+    LogSink* s = internal::log_sink_slots[i].sink.load();
+    if (s == sink) return false;
+    if (s == nullptr && free_slot < 0) free_slot = i;
+  }
+  if (free_slot < 0) return false;
+  internal::LogSinkSlot* slot = &internal::log_sink_slots[free_slot];
+  slot->min_severity.store(min_severity, std::memory_order_relaxed);
+  slot->sink.store(sink);
+  if (free_slot >= internal::log_sink_slots_used.load()) {
+    internal::log_sink_slots_used.store(free_slot + 1,
+                                        std::memory_order_release);
+  }
+  return true;
+}
+
+void RemoveLogSink(LogSink* sink) {
+  std::lock_guard<std::mutex> l(internal::log_sink_mu);
+  for (int i = 0; i < internal::kMaxLogSinks; ++i) {
+    internal::LogSinkSlot* slot = &internal::log_sink_slots[i];
+    if (slot->sink.load() != sink) continue;
+    slot->sink.store(nullptr);
+    for (int k = 0; k < internal::kActiveStripes; ++k) {
+      while (slot->active[k].n.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+      }
+    }
+    return;
+  }
+}
+
+void SetStderrLogSeverity(int min_severity) {
+  internal::stderr_log_severity.store(min_severity,
+                                      std::memory_order_relaxed);
+}
+
+}  // namespace vtz
@@ -0,0 +1,310 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/log_stats.h"
+#include "common/async_logging.h"
+#include "common/log_output_private.h"
+#include "common/log_stats_private.h"
+#include "common/macros.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+namespace vtz {
+
+const int LogLatencyHistogram::kNumBuckets;
+
+namespace internal {
+
+std::atomic<bool> log_stats_on(false);
+std::atomic<int> latency_sample_every(0);
+
+namespace {
+
+std::atomic<uint64> flushes(0);
+
+int BucketIndex(uint64 v) {
+  if (v < 16) return static_cast<int>(v);
+  const int k = 63 - __builtin_clzll(v);  // >= 4
+  const int i = 16 + (k - 4) * 8 + static_cast<int>((v >> (k - 3)) & 7);
+  return std::min(i, LogLatencyHistogram::kNumBuckets - 1);
+}
+
+}  // namespace
+
+void ThreadHistogram::Clear() {
+  count.store(0, std::memory_order_relaxed);
+  sum_nanos.store(0, std::memory_order_relaxed);
+  max_nanos.store(0, std::memory_order_relaxed);
+  for (int i = 0; i < LogLatencyHistogram::kNumBuckets; ++i) {
+    buckets[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void ThreadHistogram::Record(uint64 v) {
+  Bump(&count, 1);
+  Bump(&sum_nanos, v);
+  if (v > max_nanos.load(std::memory_order_relaxed)) {
+    max_nanos.store(v, std::memory_order_relaxed);
+  }
+  Bump(&buckets[BucketIndex(v)], 1);
+}
+
+void ThreadHistogram::AddTo(LogLatencyHistogram* h) const {
+  h->count += count.load(std::memory_order_relaxed);
+  h->sum_nanos += sum_nanos.load(std::memory_order_relaxed);
+  h->max_nanos =
+      std::max(h->max_nanos, max_nanos.load(std::memory_order_relaxed));
+  for (int i = 0; i < LogLatencyHistogram::kNumBuckets; ++i) {
+    h->buckets[i] += buckets[i].load(std::memory_order_relaxed);
+  }
+}
+
+ThreadLogStats::ThreadLogStats()
+    : filtered_(0),
+      sampled_(0),
+      queue_high_water_(0),
+      sample_countdown_(0),
+      in_use_(true),
+      next_(nullptr) {
+  for (int i = 0; i < NUM_SEVERITIES; ++i) {
+    messages_[i].store(0, std::memory_order_relaxed);
+    bytes_[i].store(0, std::memory_order_relaxed);
+  }
+  for (int i = 0; i < kNumLogPhases; ++i) latency_[i].Clear();
+}
+
+void ThreadLogStats::AddTo(LogStats* s) const {
+  for (int i = 0; i < NUM_SEVERITIES; ++i) {
+    s->messages[i] += messages_[i].load(std::memory_order_relaxed);
+    s->bytes[i] += bytes_[i].load(std::memory_order_relaxed);
+  }
+  s->filtered += filtered_.load(std::memory_order_relaxed);
+  s->sampled += sampled_.load(std::memory_order_relaxed);
+  s->queue_high_water_bytes =
+      std::max(s->queue_high_water_bytes,
+               queue_high_water_.load(std::memory_order_relaxed));
+  for (int i = 0; i < kNumLogPhases; ++i) latency_[i].AddTo(&s->latency[i]);
+}
+
+// The hooks run on every record, so they read a plain pointer; the holder,
+// whose destructor makes thread_local access go through a wrapper call, is
+// only touched when the block is claimed.
+__thread ThreadLogStats* thread_stats VTZ_ATTRIBUTE_INITIAL_EXEC = nullptr;
+
+namespace {
+
+std::atomic<ThreadLogStats*> thread_stats_list(nullptr);
+
+ThreadLogStats* ClaimThreadLogStats() {
+  for (ThreadLogStats* t = thread_stats_list.load(std::memory_order_acquire);
+       t != nullptr; t = t->next()) {
+    if (t->TryClaim()) return t;
+  }
+  ThreadLogStats* stats = new ThreadLogStats;
+  ThreadLogStats* head = thread_stats_list.load(std::memory_order_relaxed);
+  do {
+    stats->set_next(head);
+  } while (!thread_stats_list.compare_exchange_weak(
+      head, stats, std::memory_order_release, std::memory_order_relaxed));
+  return stats;
+}
+
+thread_local bool thread_stats_released VTZ_ATTRIBUTE_INITIAL_EXEC = false;
+
+class ThreadLogStatsHolder {
+ public:
+  ThreadLogStatsHolder() : stats_(nullptr) {}
+  ~ThreadLogStatsHolder() {
+    if (stats_ == nullptr) return;
+    // Records logged from later thread_local destructors go uncounted.
+    thread_stats = nullptr;
+    thread_stats_released = true;
+    stats_->Release();
+  }
+
+  void set_stats(ThreadLogStats* stats) { stats_ = stats; }
+
+ private:
+  ThreadLogStats* stats_;
+};
+
+thread_local ThreadLogStatsHolder thread_stats_holder;
+
+void AppendF(std::string* out, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void AppendF(std::string* out, const char* format, ...) {
+  char line[256];
+  va_list ap;
+  va_start(ap, format);
+  const int n = vsnprintf(line, sizeof(line), format, ap);
+  va_end(ap);
+  if (n > 0) out->append(line, std::min<size_t>(n, sizeof(line) - 1));
+}
+
+const char* const kSeverityNames[NUM_SEVERITIES] = {"INFO", "WARNING",
+                                                    "ERROR", "FATAL"};
+const char* const kPhaseNames[kNumLogPhases] = {"construct", "format",
+                                                "write"};
+
+}  // namespace
+
+VTZ_ATTRIBUTE_NOINLINE ThreadLogStats* ClaimThisThreadLogStats() {
+  if (thread_stats_released) return nullptr;
+  thread_stats = ClaimThreadLogStats();
+  thread_stats_holder.set_stats(thread_stats);
+  return thread_stats;
+}
+
+void RecordLogLatency(int phase, int64 nanos) {
+  ThreadLogStats* stats = ThisThreadLogStats();
+  if (stats == nullptr) return;
+  stats->RecordLatency(phase, static_cast<uint64>(std::max<int64>(nanos, 0)));
+}
+
+void CountFilteredLogStatement() { CountFilteredLogRecord(); }
+
+void CountSampledLogRecords(uint64 n) {
+  ThreadLogStats* stats = ThisThreadLogStats();
+  if (stats != nullptr) stats->CountSampled(n);
+}
+
+void CountLogFlush() { flushes.fetch_add(1, std::memory_order_relaxed); }
+
+void NoteLogQueueDepth(size_t bytes) {
+  ThreadLogStats* stats = ThisThreadLogStats();
+  if (stats != nullptr) stats->NoteQueueDepth(bytes);
+}
+
+}  // namespace internal
+
+uint64 LogLatencyHistogram::BucketLowerBound(int i) {
+  if (i < 16) return static_cast<uint64>(i);
+  const int k = 4 + (i - 16) / 8;
+  return static_cast<uint64>(8 + (i - 16) % 8) << (k - 3);
+}
+
+double LogLatencyHistogram::Percentile(double q) const {
+  if (count == 0) return 0;
+  const uint64 rank = std::min<uint64>(
+      count - 1, static_cast<uint64>(q * static_cast<double>(count)));
+  uint64 seen = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    seen += buckets[i];
+    if (seen > rank) {
+      // Middle of the bucket, but never past the largest value seen.
+      const uint64 lo = BucketLowerBound(i);
+      const uint64 hi = i + 1 < kNumBuckets ? BucketLowerBound(i + 1) : lo;
+      return std::min(static_cast<double>(lo + hi) / 2,
+                      static_cast<double>(max_nanos));
+    }
+  }
+  return static_cast<double>(max_nanos);
+}
+
+bool EnableLogStats(const LogStatsOptions& options) {
+  if (internal::log_stats_on.load()) return false;
+  internal::latency_sample_every.store(
+      std::max(options.latency_sample_every, 0), std::memory_order_relaxed);
+  internal::log_stats_on.store(true);
+  return true;
+}
+
+void DisableLogStats() { internal::log_stats_on.store(false); }
+
+LogStats GetLogStats() {
+  LogStats stats;
+  memset(&stats, 0, sizeof(stats));
+  for (internal::ThreadLogStats* t =
+           internal::thread_stats_list.load(std::memory_order_acquire);
+       t != nullptr; t = t->next()) {
+    t->AddTo(&stats);
+  }
+  stats.dropped = AsyncLoggingDroppedCount();
+  stats.flushes = internal::flushes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+std::string LogStatsToText(const LogStats& stats) {
+  using internal::AppendF;
+  std::string out;
+  for (int i = 0; i < NUM_SEVERITIES; ++i) {
+    AppendF(&out, "%-8s messages %llu bytes %llu\n",
+            internal::kSeverityNames[i],
+            static_cast<unsigned long long>(stats.messages[i]),
+            static_cast<unsigned long long>(stats.bytes[i]));
+  }
+  AppendF(&out,
+          "filtered %llu dropped %llu sampled %llu flushes %llu "
+          "queue_high_water_bytes %llu\n",
+          static_cast<unsigned long long>(stats.filtered),
+          static_cast<unsigned long long>(stats.dropped),
+          static_cast<unsigned long long>(stats.sampled),
+          static_cast<unsigned long long>(stats.flushes),
+          static_cast<unsigned long long>(stats.queue_high_water_bytes));
+  for (int i = 0; i < kNumLogPhases; ++i) {
+    const LogLatencyHistogram& h = stats.latency[i];
+    AppendF(&out,
+            "%-9s samples %llu mean %.0f p50 %.0f p99 %.0f p999 %.0f "
+            "max %llu ns\n",
+            internal::kPhaseNames[i], static_cast<unsigned long long>(h.count),
+            h.count > 0 ? static_cast<double>(h.sum_nanos) / h.count : 0.0,
+            h.Percentile(0.5), h.Percentile(0.99), h.Percentile(0.999),
+            static_cast<unsigned long long>(h.max_nanos));
+  }
+  return out;
+}
+
+std::string LogStatsToJson(const LogStats& stats) {
+  using internal::AppendF;
+  std::string out = "{\"messages\":{";
+  for (int i = 0; i < NUM_SEVERITIES; ++i) {
+    AppendF(&out, "%s\"%s\":%llu", i > 0 ? "," : "",
+            internal::kSeverityNames[i],
+            static_cast<unsigned long long>(stats.messages[i]));
+  }
+  out += "},\"bytes\":{";
+  for (int i = 0; i < NUM_SEVERITIES; ++i) {
+    AppendF(&out, "%s\"%s\":%llu", i > 0 ? "," : "",
+            internal::kSeverityNames[i],
+            static_cast<unsigned long long>(stats.bytes[i]));
+  }
+  AppendF(&out,
+          "},\"filtered\":%llu,\"dropped\":%llu,\"sampled\":%llu,"
+          "\"flushes\":%llu,\"queue_high_water_bytes\":%llu,\"latency\":{",
+          static_cast<unsigned long long>(stats.filtered),
+          static_cast<unsigned long long>(stats.dropped),
+          static_cast<unsigned long long>(stats.sampled),
+          static_cast<unsigned long long>(stats.flushes),
+          static_cast<unsigned long long>(stats.queue_high_water_bytes));
+  for (int i = 0; i < kNumLogPhases; ++i) {
+    const LogLatencyHistogram& h = stats.latency[i];
+    AppendF(&out,
+            "%s\"%s\":{\"samples\":%llu,\"mean_ns\":%.1f,\"p50_ns\":%.0f,"
+            "\"p99_ns\":%.0f,\"p999_ns\":%.0f,\"max_ns\":%llu}",
+            i > 0 ? "," : "", internal::kPhaseNames[i],
+            static_cast<unsigned long long>(h.count),
+            h.count > 0 ? static_cast<double>(h.sum_nanos) / h.count : 0.0,
+            h.Percentile(0.5), h.Percentile(0.99), h.Percentile(0.999),
+            static_cast<unsigned long long>(h.max_nanos));
+  }
+  out += "}}";
+  return out;
+}
+
+}  // namespace vtz
@@ -14,41 +14,525 @@ limitations under the License.
 ==============================================================================*/
 
 #include "common/logging.h"
+#include "common/async_logging.h"
+#include "common/logf.h"
+#include "common/log_encoder.h"
+#include "common/log_format.h"
+#include "common/log_payload.h"
+#include "common/log_stats.h"
+#include "common/log_output_private.h"
+#include "common/log_stats_private.h"
 #include "common/macros.h"
-#include <sys/time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
 namespace vtz {
 namespace internal {
 
-LogMessage::LogMessage(const char* fname, int line, int severity)
-    : fname_(fname), line_(line), severity_(severity) {}
-
-void LogMessage::GenerateLogMessage() {
-  struct timeval timer_usec;
-  uint64 now_micros = 0;
-  if (!gettimeofday(&timer_usec, NULL)) {
-    now_micros = ((long long int) timer_usec.tv_sec) * 1000000ll +
-      (long long int) timer_usec.tv_usec;
+std::atomic<int> min_log_level_for_macros(0);
+
+namespace {
+
+// Room kept free at the end of every LogStreamBuf buffer for Finish().
+const char kTruncatedMarker[] = " [truncated]";
+const size_t kFinishReserve = sizeof(kTruncatedMarker);  // marker + '\n'
+
+const size_t kThreadLogBufferBytes = 4096;
+const int kThreadLogBuffers = 2;
+
+// Plain data so it needs no TLS destructor and stays usable while other
+// thread_local objects are being torn down.
+thread_local char thread_log_buffer[kThreadLogBuffers][kThreadLogBufferBytes];
+thread_local bool thread_log_buffer_in_use[kThreadLogBuffers];
+
+}  // namespace
+
+const size_t LogStreamBuf::kMaxLogMessageBytes;
+
+LogStreamBuf::LogStreamBuf() : thread_buffer_(-1), truncated_(false) {
+  for (int i = 0; i < kThreadLogBuffers; ++i) {
+    if (VTZ_PREDICT_TRUE(!thread_log_buffer_in_use[i])) {
+      thread_log_buffer_in_use[i] = true;
+      thread_buffer_ = i;
+      setp(thread_log_buffer[i],
+           thread_log_buffer[i] + kThreadLogBufferBytes - kFinishReserve);
+      break;
+    }
+  }
+}
+
+LogStreamBuf::~LogStreamBuf() {
+  if (thread_buffer_ >= 0) thread_log_buffer_in_use[thread_buffer_] = false;
+}
+
+size_t LogStreamBuf::Reserve(size_t extra) {
+  const size_t avail = static_cast<size_t>(epptr() - pptr());
+  if (VTZ_PREDICT_TRUE(extra <= avail) || truncated_) return avail;
+  const size_t used = size();
+  const size_t capacity =
+      (pbase() == nullptr ? 0 : static_cast<size_t>(epptr() - pbase())) +
+      kFinishReserve;
+  size_t new_capacity = std::max<size_t>(capacity * 2, 256);
+  while (new_capacity < used + extra + kFinishReserve) new_capacity *= 2;
+  new_capacity = std::min(new_capacity, kMaxLogMessageBytes);
+  if (new_capacity > capacity) {
+    if (spill_.empty()) {
+      spill_.resize(new_capacity);
+      if (used > 0) memcpy(&spill_[0], pbase(), used);
+      if (thread_buffer_ >= 0) {
+        thread_log_buffer_in_use[thread_buffer_] = false;
+        thread_buffer_ = -1;
+      }
+    } else {
+      spill_.resize(new_capacity);
+    }
+    setp(&spill_[0], &spill_[0] + new_capacity - kFinishReserve);
+    pbump(static_cast<int>(used));
+  }
+  const size_t now_avail = static_cast<size_t>(epptr() - pptr());
+  if (extra > now_avail) truncated_ = true;
+  return now_avail;
+}
+
+LogStreamBuf::int_type LogStreamBuf::overflow(int_type c) {
+  if (traits_type::eq_int_type(c, traits_type::eof())) {
+    return traits_type::not_eof(c);
+  }
+  if (Reserve(1) == 0) return c;  // truncated; drop quietly
+  *pptr() = traits_type::to_char_type(c);
+  pbump(1);
+  return c;
+}
+
+std::streamsize LogStreamBuf::xsputn(const char* s, std::streamsize n) {
+  const size_t want = static_cast<size_t>(n);
+  const size_t fit = std::min(want, Reserve(want));
+  memcpy(pptr(), s, fit);
+  pbump(static_cast<int>(fit));
+  // Report everything as written so the stream never sets badbit.
+  return n;
+}
+
+void LogStreamBuf::Finish() {
+  // kFinishReserve bytes past epptr() always belong to the buffer, except
+  // for a nested message that never wrote anything.
+  if (pbase() == nullptr) Reserve(1);
+  char* p = pptr();
+  if (truncated_) {
+    memcpy(p, kTruncatedMarker, sizeof(kTruncatedMarker) - 1);
+    p += sizeof(kTruncatedMarker) - 1;
+  }
+  *p++ = '\n';
+  setp(pbase(), p);
+  pbump(static_cast<int>(p - pbase()));
+}
+
+}  // namespace internal
+
+const int LogFields::kMaxFields;
+const size_t LogFields::kInlineStringBytes;
+
+LogFields::Field* LogFields::Add(const char* key, Type type) {
+  if (VTZ_PREDICT_FALSE(size_ == kMaxFields)) {
+    ++dropped_;
+    return nullptr;
+  }
+  Field* f = &fields_[size_++];
+  f->key = key;
+  f->type = type;
+  return f;
+}
+
+void LogFields::AddInt(const char* key, int64 v) {
+  Field* f = Add(key, kInt);
+  if (f != nullptr) f->value.i = v;
+}
+
+void LogFields::AddUInt(const char* key, uint64 v) {
+  Field* f = Add(key, kUInt);
+  if (f != nullptr) f->value.u = v;
+}
+
+void LogFields::AddDouble(const char* key, double v) {
+  Field* f = Add(key, kDouble);
+  if (f != nullptr) f->value.d = v;
+}
+
+void LogFields::AddBool(const char* key, bool v) {
+  Field* f = Add(key, kBool);
+  if (f != nullptr) f->value.b = v;
+}
+
+void LogFields::AddString(const char* key, const char* data, size_t size) {
+  // The record could not hold more anyway.
+  const size_t limit = internal::LogStreamBuf::kMaxLogMessageBytes;
+  size = std::min(size, limit - std::min(limit, string_bytes_));
+  Field* f = Add(key, kString);
+  if (f == nullptr) return;
+  f->value.s.offset = static_cast<uint32>(string_bytes_);
+  f->value.s.size = static_cast<uint32>(size);
+  if (VTZ_PREDICT_TRUE(spill_.empty() &&
+                       string_bytes_ + size <= kInlineStringBytes)) {
+    memcpy(inline_strings_ + string_bytes_, data, size);
   } else {
-    now_micros = -1;
-  }
-  
-  time_t now_seconds = static_cast<time_t>(now_micros / 1000000);
-  int32 micros_remainder = static_cast<int32>(now_micros % 1000000);
-  const size_t time_buffer_size = 30;
-  char time_buffer[time_buffer_size];
-  strftime(time_buffer, time_buffer_size, "%Y-%m-%d %H:%M:%S",
-           localtime(&now_seconds));
-
-  // TODO(vincent): Replace this with something that logs through the env.
-#if 0
-  fprintf(stderr, "%s.%06d: %c %s:%d] %s\n", time_buffer, micros_remainder,
-          "IWEF"[severity_], fname_, line_, str().c_str());
-#else
-  fprintf(stderr,  "%s\n", str().c_str());
+    if (spill_.empty()) spill_.assign(inline_strings_, string_bytes_);
+    spill_.append(data, size);
+  }
+  string_bytes_ += size;
+}
+
+namespace internal {
+
+namespace {
+
+std::atomic<int> log_clock(-1);
+
+int LogClockFromEnv() {
+  const char* val = getenv("VTZ_CPP_LOG_CLOCK");
+  if (val != nullptr) {
+    if (strcmp(val, "realtime_coarse") == 0) return kLogClockRealtimeCoarse;
+    if (strcmp(val, "monotonic") == 0) return kLogClockMonotonic;
+  }
+  return kLogClockRealtime;
+}
+
+inline int CurrentLogClock() {
+  int clock = log_clock.load(std::memory_order_relaxed);
+  if (VTZ_PREDICT_FALSE(clock < 0)) {
+    clock = LogClockFromEnv();
+    log_clock.store(clock, std::memory_order_relaxed);
+  }
+  return clock;
+}
+
+// "YYYY-MM-DD HH:MM:SS" for the last second this thread logged in, so
+// localtime_r() and strftime() run at most once per second per thread.
+const size_t kDateTimeChars = 19;
+thread_local int64 cached_datetime_second = -1;
+thread_local char cached_datetime[kDateTimeChars + 1];
+
+char* AppendZeroPadded(char* p, uint32 v, int width) {
+  for (int i = width - 1; i >= 0; --i) {
+    p[i] = static_cast<char>('0' + v % 10);
+    v /= 10;
+  }
+  return p + width;
+}
+
+// Writes "<time>.uuuuuu" for a time read from "clock".
+char* FormatTimestamp(char* p, int clock, int64 seconds, uint32 usec) {
+  if (clock == kLogClockMonotonic) {
+    p = FormatUInt64(p, static_cast<uint64>(seconds));
+  } else {
+    if (VTZ_PREDICT_FALSE(seconds != cached_datetime_second)) {
+      struct tm tm_time;
+      const time_t t = static_cast<time_t>(seconds);
+      localtime_r(&t, &tm_time);
+      strftime(cached_datetime, sizeof(cached_datetime), "%Y-%m-%d %H:%M:%S",
+               &tm_time);
+      cached_datetime_second = seconds;
+    }
+    memcpy(p, cached_datetime, kDateTimeChars);
+    p += kDateTimeChars;
+  }
+  *p++ = '.';
+  return AppendZeroPadded(p, usec, 6);
+}
+
+// Writes "<time>.uuuuuu" for the configured clock and returns the end.
+char* AppendTimestamp(char* p, int64* micros) {
+  const int clock = CurrentLogClock();
+  clockid_t id = CLOCK_REALTIME;
+  if (clock == kLogClockMonotonic) {
+    id = CLOCK_MONOTONIC;
+  } else if (clock == kLogClockRealtimeCoarse) {
+#ifdef CLOCK_REALTIME_COARSE
+    id = CLOCK_REALTIME_COARSE;
 #endif
+  }
+  struct timespec ts;
+  if (clock_gettime(id, &ts) != 0) {
+    ts.tv_sec = 0;
+    ts.tv_nsec = 0;
+  }
+  const uint32 usec = static_cast<uint32>(ts.tv_nsec / 1000);
+  *micros = static_cast<int64>(ts.tv_sec) * 1000000 + usec;
+  return FormatTimestamp(p, clock, ts.tv_sec, usec);
+}
+
+char SeverityChar(int severity) {
+  if (severity < INFO) severity = INFO;
+  if (severity > FATAL) severity = FATAL;
+  return "IWEF"[severity];
+}
+
+}  // namespace
+
+bool LogClockIsMonotonic() {
+  return CurrentLogClock() == kLogClockMonotonic;
+}
+
+char* FormatLogTimestamp(char* p, int64 micros) {
+  if (micros < 0) micros = 0;
+  return FormatTimestamp(p, CurrentLogClock(), micros / 1000000,
+                         static_cast<uint32>(micros % 1000000));
+}
+
+namespace {
+
+void AppendRecordStart(LogStreamBuf* buf, LogRecordMeta* meta) {
+  // "%Y-%m-%d %H:%M:%S.uuuuuu S file:line] "
+  char prefix[48];
+  char* p = AppendTimestamp(prefix, &meta->micros);
+  meta->encoder = CurrentLogEncoder();
+  if (VTZ_PREDICT_FALSE(meta->encoder != nullptr)) {
+    // The encoder lays out the rest itself.
+    meta->timestamp_size = static_cast<size_t>(p - prefix);
+    meta->prefix_size = meta->timestamp_size;
+    buf->Append(prefix, meta->timestamp_size);
+    return;
+  }
+  meta->timestamp_size = 0;
+  *p++ = ' ';
+  *p++ = SeverityChar(meta->severity);
+  *p++ = ' ';
+  buf->Append(prefix, p - prefix);
+  buf->Append(meta->fname, strlen(meta->fname));
+  p = prefix;
+  *p++ = ':';
+  p = FormatUInt64(p, static_cast<uint64>(meta->line < 0 ? 0 : meta->line));
+  *p++ = ']';
+  *p++ = ' ';
+  buf->Append(prefix, p - prefix);
+  meta->prefix_size = buf->size();
+}
+
+}  // namespace
+
+void BeginLogRecord(LogStreamBuf* buf, LogRecordMeta* meta) {
+  meta->stats_nanos = 0;
+  meta->payload = nullptr;
+  if (VTZ_PREDICT_FALSE(log_stats_on.load(std::memory_order_relaxed)) &&
+      LogStatsSampleNow()) {
+    const int64 start = LogWriteClockNanos();
+    AppendRecordStart(buf, meta);
+    meta->stats_nanos = LogWriteClockNanos();
+    RecordLogLatency(kLogPhaseConstruct, meta->stats_nanos - start);
+    return;
+  }
+  AppendRecordStart(buf, meta);
+}
+
+namespace {
+
+// Writes out a finished record, with its payload if it has one.
+void GenerateLogRecord(LogStreamBuf* buf, int severity,
+                       const LogPayload* payload) {
+  if (severity >= FATAL) {
+    // Nothing may be left queued behind a message we are about to abort on,
+    // nor buffered in a sink after it.
+    FlushLogs();
+    DumpFlightRecorderForFatal();
+    if (payload != nullptr) {
+      WritePayloadLogRecord(severity, buf->data(), buf->size(), *payload);
+    } else {
+      WriteLogRecord(severity, buf->data(), buf->size());
+    }
+    FlushLogOutput();
+    return;
+  }
+  if (VTZ_PREDICT_FALSE(payload != nullptr)) {
+    if (AsyncLogAppendPayload(severity, buf->data(), buf->size(), *payload)) {
+      return;
+    }
+    WritePayloadLogRecord(severity, buf->data(), buf->size(), *payload);
+    return;
+  }
+  if (AsyncLogAppend(severity, buf->data(), buf->size())) return;
+  WriteLogRecord(severity, buf->data(), buf->size());
+}
+
+// Finishes the record in "buf" and writes it out, or, if "filtered", hands
+// it to the flight recorder.
+void FinishLogRecord(LogStreamBuf* buf, const LogRecordMeta& meta,
+                     bool filtered) {
+  buf->Finish();
+  if (VTZ_PREDICT_FALSE(log_stats_on.load(std::memory_order_relaxed))) {
+    if (filtered) {
+      CountFilteredLogRecord();
+    } else {
+      CountLogRecord(meta.severity,
+                     buf->size() + (meta.payload != nullptr
+                                        ? LogPayloadTextSize(*meta.payload)
+                                        : 0));
+    }
+  }
+  if (VTZ_PREDICT_TRUE(!filtered)) {
+    GenerateLogRecord(buf, meta.severity, meta.payload);
+  } else if (meta.payload != nullptr) {
+    size_t size;
+    const char* data =
+        JoinLogPayload(buf->data(), buf->size(), *meta.payload, &size);
+    FlightRecorderCapture(meta.severity, meta.micros, data, size);
+  } else {
+    FlightRecorderCapture(meta.severity, meta.micros, buf->data(),
+                          buf->size());
+  }
+}
+
+}  // namespace
+
+void EncodeLogRecord(LogStreamBuf* buf, const LogRecordMeta& meta,
+                     bool filtered) {
+  if (VTZ_PREDICT_TRUE(meta.encoder == nullptr)) {
+    if (meta.fields != nullptr && !meta.fields->empty()) {
+      AppendTextLogFields(*meta.fields, buf);
+    }
+    FinishLogRecord(buf, meta, filtered);
+    return;
+  }
+  static const LogFields kNoFields;
+  LogRecord record;
+  record.severity = meta.severity;
+  record.file = meta.fname;
+  record.line = meta.line;
+  record.micros = meta.micros;
+  record.timestamp = buf->data();
+  record.timestamp_size = meta.timestamp_size;
+  record.message = buf->data() + meta.timestamp_size;
+  record.message_size = buf->size() - meta.timestamp_size;
+  record.fields = meta.fields != nullptr ? meta.fields : &kNoFields;
+  // Takes this thread's second log buffer.
+  LogStreamBuf encoded;
+  meta.encoder->Encode(record, &encoded);
+  FinishLogRecord(&encoded, meta, filtered);
+}
+
+LogMessage::LogMessage(const char* fname, int line, int severity)
+    : std::ostream(nullptr) {
+  rdbuf(&buf_);
+  meta_.fname = fname;
+  meta_.line = line;
+  meta_.severity = severity;
+  meta_.fields = &fields_;
+  BeginLogRecord(&buf_, &meta_);
+}
+
+void LogMessage::GenerateLogMessage() { EmitFatalLogRecord(&buf_, meta_); }
+
+void LogMessage::AttachPayload(const Payload& payload) {
+  LogPayload p;
+  p.data = payload.data();
+  p.size = payload.size();
+  p.limit = payload.limit();
+  p.encoding = payload.encoding();
+  if (meta_.payload != nullptr || meta_.encoder != nullptr) {
+    WriteLogPayloadText(p, &buf_);
+    return;
+  }
+  payload_ = p;
+  payload_.offset = buf_.size();
+  payload_.owner = payload.owner();
+  meta_.payload = &payload_;
+}
+
+namespace {
+
+void WriteToStderr(const char* data, size_t size) {
+  // Straight from the caller's buffer; stderr is unbuffered anyway.
+  while (size > 0) {
+    const ssize_t n = write(STDERR_FILENO, data, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+}
+
+}  // namespace
+
+void WriteStderrv(struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(STDERR_FILENO, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    // Skip what was written and retry the rest of a short write.
+    while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+      n -= static_cast<ssize_t>(iov->iov_len);
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+      iov->iov_len -= static_cast<size_t>(n);
+    }
+  }
+}
+
+void WriteLogRecord(int severity, const char* data, size_t size) {
+  if (VTZ_PREDICT_FALSE(log_write_timing.load(std::memory_order_relaxed))) {
+    const int64 start = LogWriteClockNanos();
+    if (StderrLogIsOn(severity)) WriteToStderr(data, size);
+    SendToLogSinks(severity, data, size);
+    NoteLogWriteNanos(LogWriteClockNanos() - start);
+    return;
+  }
+  if (StderrLogIsOn(severity)) WriteToStderr(data, size);
+  SendToLogSinks(severity, data, size);
+}
+
+void WritePayloadLogRecord(int severity, const char* data, size_t size,
+                           const LogPayload& payload) {
+  int64 start = 0;
+  if (VTZ_PREDICT_FALSE(log_write_timing.load(std::memory_order_relaxed))) {
+    start = LogWriteClockNanos();
+  }
+  const bool to_stderr = StderrLogIsOn(severity);
+  const bool to_sinks = LogSinksWant(severity);
+  if (payload.encoding == Payload::kRaw && !to_sinks) {
+    if (to_stderr) {
+      // Straight from the caller's memory.
+      char marker[kLogPayloadMarkerBytes];
+      struct iovec iov[4];
+      iov[0].iov_base = const_cast<char*>(data);
+      iov[0].iov_len = payload.offset;
+      iov[1].iov_base = const_cast<char*>(payload.data);
+      iov[1].iov_len = std::min(payload.size, payload.limit);
+      iov[2].iov_base = marker;
+      iov[2].iov_len = AppendLogPayloadMarker(payload, marker) - marker;
+      iov[3].iov_base = const_cast<char*>(data + payload.offset);
+      iov[3].iov_len = size - payload.offset;
+      WriteStderrv(iov, 4);
+    }
+  } else {
+    size_t joined_size;
+    const char* joined = JoinLogPayload(data, size, payload, &joined_size);
+    if (to_stderr) WriteToStderr(joined, joined_size);
+    if (to_sinks) SendToLogSinks(severity, joined, joined_size);
+  }
+  if (VTZ_PREDICT_FALSE(start != 0)) {
+    NoteLogWriteNanos(LogWriteClockNanos() - start);
+  }
+}
+
+void FlushLogOutput() {
+  if (log_stats_on.load(std::memory_order_relaxed)) CountLogFlush();
+  FlushBinaryLog();
+  FlushLogSinks();
 }
 
 namespace {
@@ -85,17 +569,247 @@ int64 MinVLogLevelFromEnv() {
   return LogLevelStrToInt(tf_env_var_val);
 }
 
-LogMessage::~LogMessage() {
-  // Read the min log level once during the first call to logging.
-  static int64 min_log_level = MinLogLevelFromEnv();
-  if (VTZ_PREDICT_TRUE(severity_ >= min_log_level)) GenerateLogMessage();
+std::atomic<int> shed_log_level(INFO);
+
+namespace {
+
+const int kLogLevelUnset = std::numeric_limits<int>::min();
+
+// VTZ_CPP_MIN_LOG_LEVEL until SetMinLogLevel() or a signal changes it.
+std::atomic<int> min_log_level(kLogLevelUnset);
+// VTZ_CPP_MIN_VLOG_LEVEL until SetMinVLogLevel() or a signal changes it.
+std::atomic<int> min_vlog_level(kLogLevelUnset);
+
+int ClampLogLevel(int64 level) {
+  return static_cast<int>(
+      std::max<int64>(INFO, std::min<int64>(level, NUM_SEVERITIES)));
+}
+
+int LoadMinLogLevel() {
+  int expected = kLogLevelUnset;
+  const int level = ClampLogLevel(MinLogLevelFromEnv());
+  if (!min_log_level.compare_exchange_strong(expected, level)) {
+    return expected;  // set concurrently
+  }
+  UpdateMinLogLevelForMacros();
+  return level;
+}
+
+inline int MinLogLevel() {
+  const int level = min_log_level.load(std::memory_order_relaxed);
+  if (VTZ_PREDICT_FALSE(level == kLogLevelUnset)) return LoadMinLogLevel();
+  return level;
+}
+
+// Reads VTZ_CPP_MIN_LOG_LEVEL at load time, so that the LOG() guard skips
+// the operands of filtered statements from the first one on.
+const int initial_min_log_level = MinLogLevel();
+
+int MinVLogLevel() {
+  int level = min_vlog_level.load(std::memory_order_relaxed);
+  if (VTZ_PREDICT_FALSE(level == kLogLevelUnset)) {
+    int expected = kLogLevelUnset;
+    level = static_cast<int>(MinVLogLevelFromEnv());
+    if (!min_vlog_level.compare_exchange_strong(expected, level)) {
+      level = expected;
+    }
+  }
+  return level;
+}
+
+int MacroLogLevel() {
+  const int level = std::max(
+      std::min(MinLogLevel(), flight_recorder_min_severity.load(
+                                  std::memory_order_relaxed)),
+      shed_log_level.load(std::memory_order_relaxed));
+  return std::min(level, FATAL);
+}
+
+// Bumped by every UpdateMinLogLevelForMacros(), after the caller changed
+// an input of MacroLogLevel().
+std::atomic<uint64> macro_log_level_updates(0);
+
+}  // namespace
+
+void UpdateMinLogLevelForMacros() {
+  // Lock-free so that signal handlers may call it. An update whose inputs
+  // were read before another one started may store a stale level after
+  // that one's; it then sees the counter moved and stores again. The last
+  // store is thus always from inputs no update has changed since. Both
+  // the counter and the store are sequentially consistent for that.
+  uint64 seen = macro_log_level_updates.fetch_add(1) + 1;
+  for (;;) {
+    min_log_level_for_macros.store(MacroLogLevel());
+    const uint64 now = macro_log_level_updates.load();
+    if (now == seen) return;
+    seen = now;
+  }
+}
+
+void StepLogVerbosity(int steps) {
+  // One ladder: ... FATAL, ERROR, WARNING, INFO, vlog 1, vlog 2, ...
+  MinLogLevel();
+  MinVLogLevel();
+  for (; steps > 0; --steps) {
+    const int level = min_log_level.load(std::memory_order_relaxed);
+    if (level > INFO) {
+      min_log_level.store(level - 1, std::memory_order_relaxed);
+    } else {
+      min_vlog_level.fetch_add(1, std::memory_order_relaxed);
+      vlog_generation.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  for (; steps < 0; ++steps) {
+    const int vlevel = min_vlog_level.load(std::memory_order_relaxed);
+    const int level = min_log_level.load(std::memory_order_relaxed);
+    if (vlevel > 0) {
+      min_vlog_level.store(vlevel - 1, std::memory_order_relaxed);
+      vlog_generation.fetch_add(1, std::memory_order_relaxed);
+    } else if (level < FATAL) {
+      min_log_level.store(level + 1, std::memory_order_relaxed);
+    }
+  }
+  UpdateMinLogLevelForMacros();
+}
+
+void EmitLogRecord(LogStreamBuf* buf, const LogRecordMeta& meta) {
+  int64 start = 0;
+  if (VTZ_PREDICT_FALSE(meta.stats_nanos != 0)) {
+    start = LogWriteClockNanos();
+    RecordLogLatency(kLogPhaseFormat, start - meta.stats_nanos);
+  }
+  const int shed = shed_log_level.load(std::memory_order_relaxed);
+  if (VTZ_PREDICT_TRUE(meta.severity >= MinLogLevel() &&
+                       meta.severity >= shed)) {
+    // Records with a payload are never held back as repeats: their text
+    // alone does not say whether they are.
+    if (VTZ_PREDICT_TRUE(
+            !log_coalescing_on.load(std::memory_order_relaxed)) ||
+        meta.payload != nullptr ||
+        !CoalesceLogRecord(meta, buf->data() + meta.prefix_size,
+                           buf->size() - meta.prefix_size)) {
+      EncodeLogRecord(buf, meta, false);
+    }
+  } else if (meta.severity >= shed &&
+             meta.severity >= flight_recorder_min_severity.load(
+                                  std::memory_order_relaxed)) {
+    EncodeLogRecord(buf, meta, true);
+  } else if (log_stats_on.load(std::memory_order_relaxed)) {
+    CountFilteredLogRecord();
+  }
+  if (VTZ_PREDICT_FALSE(start != 0)) {
+    RecordLogLatency(kLogPhaseWrite, LogWriteClockNanos() - start);
+  }
 }
 
-int64 LogMessage::MinVLogLevel() {
-  static int64 min_vlog_level = MinVLogLevelFromEnv();
-  return min_vlog_level;
+void EmitFatalLogRecord(LogStreamBuf* buf, const LogRecordMeta& meta) {
+  EncodeLogRecord(buf, meta, false);
 }
 
+LogMessage::~LogMessage() { EmitLogRecord(&buf_, meta_); }
+
+namespace {
+
+struct VModuleEntry {
+  std::string pattern;
+  bool match_path;  // pattern contains '/'
+  int level;
+};
+
+struct VLogConfig {
+  VLogConfig() : loaded(false) {}
+
+  std::mutex mu;
+  bool loaded;                        // guarded by mu
+  std::vector<VModuleEntry> modules;  // guarded by mu
+};
+
+VLogConfig* GetVLogConfig() {
+  static VLogConfig* config = new VLogConfig;
+  return config;
+}
+
+// Glob match supporting '*' and '?'.
+bool GlobMatch(const char* pat, const char* pat_end, const char* str,
+               const char* str_end) {
+  const char* star = nullptr;
+  const char* star_str = nullptr;
+  while (str != str_end) {
+    if (pat != pat_end && (*pat == '?' || *pat == *str)) {
+      ++pat;
+      ++str;
+    } else if (pat != pat_end && *pat == '*') {
+      star = pat++;
+      star_str = str;
+    } else if (star != nullptr) {
+      pat = star + 1;
+      str = ++star_str;
+    } else {
+      return false;
+    }
+  }
+  while (pat != pat_end && *pat == '*') ++pat;
+  return pat == pat_end;
+}
+
+void ParseVModule(const char* spec, std::vector<VModuleEntry>* modules) {
+  modules->clear();
+  if (spec == nullptr) return;
+  std::istringstream ss(spec);
+  string item;
+  while (std::getline(ss, item, ',')) {
+    const size_t eq = item.rfind('=');
+    if (eq == string::npos || eq == 0) continue;
+    VModuleEntry entry;
+    entry.pattern = item.substr(0, eq);
+    entry.match_path = entry.pattern.find('/') != string::npos;
+    entry.level =
+        static_cast<int>(LogLevelStrToInt(item.c_str() + eq + 1));
+    modules->push_back(entry);
+  }
+}
+
+void LoadVLogConfigLocked(VLogConfig* config) {
+  if (config->loaded) return;
+  ParseVModule(getenv("VTZ_CPP_VMODULE"), &config->modules);
+  config->loaded = true;
+}
+
+int ResolveVLogLevelLocked(VLogConfig* config, const char* file) {
+  const char* end = file + strlen(file);
+  const char* base = strrchr(file, '/');
+  base = base == nullptr ? file : base + 1;
+  const char* dot = strchr(base, '.');
+  if (dot != nullptr) end = dot;
+  for (size_t i = 0; i < config->modules.size(); ++i) {
+    const VModuleEntry& e = config->modules[i];
+    const char* p = e.pattern.data();
+    if (GlobMatch(p, p + e.pattern.size(), e.match_path ? file : base, end)) {
+      return e.level;
+    }
+  }
+  return MinVLogLevel();
+}
+
+}  // namespace
+
+std::atomic<uint32> vlog_generation(1);
+
+bool InitVLogSite(VLogSite* site, int level, const char* file) {
+  VLogConfig* config = GetVLogConfig();
+  std::lock_guard<std::mutex> l(config->mu);
+  LoadVLogConfigLocked(config);
+  // Before resolving: a level changed meanwhile must not be cached under
+  // the new generation.
+  const uint64 generation = vlog_generation.load(std::memory_order_acquire);
+  const int resolved = ResolveVLogLevelLocked(config, file);
+  site->state.store((generation << 32) | static_cast<uint32>(resolved),
+                    std::memory_order_relaxed);
+  return level <= resolved;
+}
+
+int64 LogMessage::MinVLogLevel() { return internal::MinVLogLevel(); }
+
 LogMessageFatal::LogMessageFatal(const char* file, int line)
     : LogMessage(file, line, FATAL) {}
 LogMessageFatal::~LogMessageFatal() {
@@ -105,36 +819,158 @@ LogMessageFatal::~LogMessageFatal() {
   abort();
 }
 
+std::ostream& operator<<(std::ostream& os, const LogSuppressed& s) {
+  if (s.count > 0) {
+    if (log_stats_on.load(std::memory_order_relaxed)) {
+      CountSampledLogRecords(s.count);
+    }
+    os << "[" << s.count << " suppressed] ";
+  }
+  return os;
+}
+
+int64 LogCoarseMonotonicNanos() {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+uint64 LogEveryNSecClaim(LogEveryNSecSite* site, uint64* local_suppressed,
+                         int64 now, double seconds) {
+  int64 next = site->next_nanos.load(std::memory_order_relaxed);
+  const int64 interval = static_cast<int64>(seconds * 1e9);
+  if (now < next ||
+      !site->next_nanos.compare_exchange_strong(next, now + interval,
+                                                std::memory_order_relaxed)) {
+    // Another thread claimed this interval.
+    ++*local_suppressed;
+    return 0;
+  }
+  const uint64 suppressed =
+      site->suppressed.exchange(0, std::memory_order_relaxed) +
+      *local_suppressed;
+  *local_suppressed = 0;
+  return suppressed + 1;
+}
+
+uint64 LogSampledSeed(LogSampledState* s) {
+  uint64 seed = static_cast<uint64>(LogCoarseMonotonicNanos()) ^
+                static_cast<uint64>(reinterpret_cast<uintptr_t>(s));
+  seed *= 0x9e3779b97f4a7c15ull;
+  if (seed == 0) seed = 1;
+  s->rng = seed;
+  return seed;
+}
+
+void LogfAppendInt(LogStreamBuf* buf, int64 v) {
+  char digits[kFastFormatBufferSize];
+  buf->Append(digits, FormatInt64(digits, v) - digits);
+}
+
+void LogfAppendUInt(LogStreamBuf* buf, uint64 v, const LogfSpec& spec) {
+  char digits[kFastFormatBufferSize];
+  char* end =
+      spec.type == 'x' ? FormatHex64(digits, v) : FormatUInt64(digits, v);
+  buf->Append(digits, end - digits);
+}
+
+void LogfAppendDouble(LogStreamBuf* buf, double v, const LogfSpec& spec) {
+  if (spec.type != 'f') {
+    char digits[kFastFormatBufferSize];
+    buf->Append(digits, FormatDouble(digits, v) - digits);
+    return;
+  }
+  // Wide enough for "%.9f" of DBL_MAX.
+  char digits[512];
+  const int n = snprintf(digits, sizeof(digits), "%.*f", spec.precision, v);
+  if (n > 0) {
+    buf->Append(digits, std::min(static_cast<size_t>(n),
+                                 sizeof(digits) - 1));
+  }
+}
+
+void LogfAppendFloat(LogStreamBuf* buf, float v, const LogfSpec& spec) {
+  if (spec.type == 'f') {
+    LogfAppendDouble(buf, v, spec);
+    return;
+  }
+  char digits[kFastFormatBufferSize];
+  buf->Append(digits, FormatFloat(digits, v) - digits);
+}
+
+void LogfAppendPointer(LogStreamBuf* buf, const void* v) {
+  // Same as std::ostream: "0" for null, otherwise "0x..." hex.
+  char digits[kFastFormatBufferSize];
+  char* p = digits;
+  *p++ = '0';
+  if (v != nullptr) {
+    *p++ = 'x';
+    p = FormatHex64(p, static_cast<uint64>(reinterpret_cast<uintptr_t>(v)));
+  }
+  buf->Append(digits, p - digits);
+}
+
+const char* LogfAppendLiteral(LogStreamBuf* buf, const char* f) {
+  const char* start = f;
+  for (; *f != '\0'; ++f) {
+    if (*f != '{' && *f != '}') continue;
+    if (f[1] == *f) {
+      // "{{" or "}}": keep one brace, drop the other.
+      buf->Append(start, f + 1 - start);
+      ++f;
+      start = f + 1;
+    } else if (*f == '{') {
+      break;
+    }
+  }
+  buf->Append(start, f - start);
+  return f;
+}
+
 void LogString(const char* fname, int line, int severity,
                const string& message) {
-  LogMessage(fname, line, severity) << message;
+  LogMessage(fname, line, severity).stream() << message;
 }
 
-template <>
-void MakeCheckOpValueString(std::ostream* os, const char& v) {
+namespace {
+
+// "'c'" for printable characters, else "<type> value <number>".
+void MakeCharValueString(std::ostream* os, int v, const char* type) {
+  char text[kFastFormatBufferSize + 32];
+  char* p = text;
   if (v >= 32 && v <= 126) {
-    (*os) << "'" << v << "'";
+    *p++ = '\'';
+    *p++ = static_cast<char>(v);
+    *p++ = '\'';
   } else {
-    (*os) << "char value " << static_cast<short>(v);
+    const size_t n = strlen(type);
+    memcpy(p, type, n);
+    p += n;
+    memcpy(p, " value ", 7);
+    p = FormatInt64(p + 7, v);
   }
+  os->write(text, p - text);
+}
+
+}  // namespace
+
+template <>
+void MakeCheckOpValueString(std::ostream* os, const char& v) {
+  MakeCharValueString(os, v, "char");
 }
 
 template <>
 void MakeCheckOpValueString(std::ostream* os, const signed char& v) {
-  if (v >= 32 && v <= 126) {
-    (*os) << "'" << v << "'";
-  } else {
-    (*os) << "signed char value " << static_cast<short>(v);
-  }
+  MakeCharValueString(os, v, "signed char");
 }
 
 template <>
 void MakeCheckOpValueString(std::ostream* os, const unsigned char& v) {
-  if (v >= 32 && v <= 126) {
-    (*os) << "'" << v << "'";
-  } else {
-    (*os) << "unsigned char value " << static_cast<unsigned short>(v);
-  }
+  MakeCharValueString(os, v, "unsigned char");
 }
 
 #if LANG_CXX11
@@ -144,22 +980,93 @@ void MakeCheckOpValueString(std::ostream* os, const std::nullptr_t& p) {
 }
 #endif
 
-CheckOpMessageBuilder::CheckOpMessageBuilder(const char* exprtext)
-    : stream_(new std::ostringstream) {
-  *stream_ << "Check failed: " << exprtext << " (";
+CheckOpMessageBuilder::StackStreamBuf::int_type
+CheckOpMessageBuilder::StackStreamBuf::overflow(int_type c) {
+  if (traits_type::eq_int_type(c, traits_type::eof())) {
+    return traits_type::not_eof(c);
+  }
+  const char ch = traits_type::to_char_type(c);
+  xsputn(&ch, 1);
+  return c;
+}
+
+std::streamsize CheckOpMessageBuilder::StackStreamBuf::xsputn(
+    const char* s, std::streamsize n) {
+  if (n <= epptr() - pptr()) {
+    memcpy(pptr(), s, static_cast<size_t>(n));
+    pbump(static_cast<int>(n));
+    return n;
+  }
+  if (!spilled_) {
+    spill_.assign(pbase(), pptr() - pbase());
+    spilled_ = true;
+    // No room left, so every further write lands here.
+    setp(stack_, stack_);
+  }
+  spill_.append(s, static_cast<size_t>(n));
+  return n;
 }
 
-CheckOpMessageBuilder::~CheckOpMessageBuilder() { delete stream_; }
+CheckOpMessageBuilder::CheckOpMessageBuilder(const char* exprtext)
+    : stream_(&buf_) {
+  stream_ << "Check failed: " << exprtext << " (";
+}
 
 std::ostream* CheckOpMessageBuilder::ForVar2() {
-  *stream_ << " vs. ";
-  return stream_;
+  stream_ << " vs. ";
+  return &stream_;
 }
 
 string* CheckOpMessageBuilder::NewString() {
-  *stream_ << ")";
-  return new string(stream_->str());
+  stream_ << ")";
+  return new string(buf_.data(), buf_.size());
+}
+
+LogMessageFatal* CheckOpMessageBuilder::NewLogMessage(const CheckSite& site) {
+  stream_ << ")";
+  LogMessageFatal* message = new LogMessageFatal(site.file, site.line);
+  message->AppendRaw(buf_.data(), buf_.size());
+  return message;
+}
+
+LogMessageFatal* CheckFailed(const CheckSite* site) {
+  LogMessageFatal* message = new LogMessageFatal(site->file, site->line);
+  message->stream() << "Check failed: " << site->exprtext << " ";
+  return message;
+}
+
+CheckFailure::~CheckFailure() {
+  // Writes the record and aborts, so the storage is never freed.
+  message_->LogMessageFatal::~LogMessageFatal();
 }
 
 }  // namespace internal
+
+void SetLogClock(LogClock clock) {
+  internal::log_clock.store(clock, std::memory_order_relaxed);
+}
+
+void SetVModule(const char* spec) {
+  internal::VLogConfig* config = internal::GetVLogConfig();
+  std::lock_guard<std::mutex> l(config->mu);
+  internal::LoadVLogConfigLocked(config);
+  internal::ParseVModule(spec, &config->modules);
+  internal::vlog_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SetMinVLogLevel(int level) {
+  internal::min_vlog_level.store(level, std::memory_order_relaxed);
+  internal::vlog_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+int GetMinVLogLevel() { return internal::MinVLogLevel(); }
+
+void SetMinLogLevel(int level) {
+  internal::min_log_level.store(internal::ClampLogLevel(level),
+                                std::memory_order_relaxed);
+  internal::UpdateMinLogLevelForMacros();
+}
+
+int GetMinLogLevel() { return internal::MinLogLevel(); }
+
 }  // namespace vtz
@@ -0,0 +1,353 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/sharded_log_sink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace vtz {
+
+namespace {
+
+// A shard file is a ShardFileHeader and then records, each a
+// ShardRecordHeader and the text, in host byte order.
+const char kShardFileMagic[8] = {'V', 'T', 'Z', 'S', 'H', 'R', 'D', '1'};
+const uint32 kShardFileVersion = 1;
+
+struct ShardFileHeader {
+  char magic[8];
+  uint32 version;
+  uint32 shard;
+  uint32 num_shards;
+  uint32 reserved;
+};
+
+struct ShardRecordHeader {
+  uint32 size;
+  uint32 severity;
+  uint64 nanos;
+  uint64 sequence;
+};
+
+static_assert(sizeof(ShardFileHeader) == 24, "no padding");
+static_assert(sizeof(ShardRecordHeader) == 24, "no padding");
+
+const int kMaxShards = 4096;
+
+// Threads in the order they first logged to a kLogShardByThread sink.
+std::atomic<int> next_thread_index(0);
+thread_local int thread_index VTZ_ATTRIBUTE_INITIAL_EXEC = -1;
+
+uint64 MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+bool WriteAll(int fd, const char* p, size_t left) {
+  while (left > 0) {
+    const ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    p += n;
+    left -= n;
+  }
+  return true;
+}
+
+ShardedLogSinkOptions Normalize(ShardedLogSinkOptions options) {
+  if (options.num_shards <= 0) {
+    options.num_shards = static_cast<int>(sysconf(_SC_NPROCESSORS_CONF));
+  }
+  options.num_shards = std::min(std::max(options.num_shards, 1), kMaxShards);
+  options.buffer_bytes = std::max<size_t>(options.buffer_bytes, 4096);
+  options.flush_interval_millis =
+      std::max<int64>(options.flush_interval_millis, 1);
+  return options;
+}
+
+std::string ShardPath(const std::string& path, int shard) {
+  return path + ".shard-" + std::to_string(shard);
+}
+
+}  // namespace
+
+// Padded so that no two shards share a cache line.
+struct ShardedLogSink::Shard {
+  Shard() : fd(-1), sequence(0), buffered(0), dropped(0) {}
+
+  char pad0[64];
+  std::mutex mu;
+  int fd;
+  uint64 sequence;     // guarded by mu
+  std::string buffer;  // guarded by mu
+  uint64 buffered;     // guarded by mu; records in "buffer"
+  uint64 dropped;      // guarded by mu
+  char pad1[64];
+
+  // Writes out "buffer"; its records are lost if that fails.
+  void WriteLocked() {
+    if (buffer.empty()) return;
+    if (!WriteAll(fd, buffer.data(), buffer.size())) dropped += buffered;
+    buffer.clear();
+    buffered = 0;
+  }
+};
+
+ShardedLogSink* ShardedLogSink::Create(const ShardedLogSinkOptions& options) {
+  ShardedLogSink* sink = new ShardedLogSink(options);
+  for (int i = 0; i < sink->num_shards_; ++i) {
+    Shard* s = &sink->shards_[i];
+    s->fd = open(ShardPath(sink->options_.path, i).c_str(),
+                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    ShardFileHeader h;
+    memcpy(h.magic, kShardFileMagic, sizeof(h.magic));
+    h.version = kShardFileVersion;
+    h.shard = static_cast<uint32>(i);
+    h.num_shards = static_cast<uint32>(sink->num_shards_);
+    h.reserved = 0;
+    if (s->fd < 0 ||
+        !WriteAll(s->fd, reinterpret_cast<const char*>(&h), sizeof(h))) {
+      delete sink;
+      return nullptr;
+    }
+    s->buffer.reserve(sink->options_.buffer_bytes);
+  }
+  sink->background_ = std::thread(&ShardedLogSink::BackgroundLoop, sink);
+  return sink;
+}
+
+ShardedLogSink::ShardedLogSink(const ShardedLogSinkOptions& options)
+    : options_(Normalize(options)),
+      num_shards_(options_.num_shards),
+      shards_(new Shard[num_shards_]),
+      stop_(false) {}
+
+ShardedLogSink::~ShardedLogSink() {
+  if (background_.joinable()) {
+    {
+      std::lock_guard<std::mutex> l(mu_);
+      stop_ = true;
+      stop_cv_.notify_one();
+    }
+    background_.join();
+  }
+  for (int i = 0; i < num_shards_; ++i) {
+    Shard* s = &shards_[i];
+    if (s->fd < 0) continue;
+    s->WriteLocked();
+    close(s->fd);
+  }
+}
+
+ShardedLogSink::Shard* ShardedLogSink::ShardForThisThread() {
+  int i;
+  if (options_.shard_by == kLogShardByCpu) {
+    i = sched_getcpu();
+    if (VTZ_PREDICT_FALSE(i < 0)) i = 0;
+  } else {
+    if (VTZ_PREDICT_FALSE(thread_index < 0)) {
+      thread_index = next_thread_index.fetch_add(1, std::memory_order_relaxed);
+    }
+    i = thread_index;
+  }
+  return &shards_[i % num_shards_];
+}
+
+void ShardedLogSink::Send(int severity, const char* data, size_t size) {
+  Shard* s = ShardForThisThread();
+  std::lock_guard<std::mutex> l(s->mu);
+  // Stamped under the lock, so a shard's records are in time order.
+  ShardRecordHeader h;
+  h.size = static_cast<uint32>(size);
+  h.severity = static_cast<uint32>(severity);
+  h.nanos = MonotonicNanos();
+  h.sequence = s->sequence++;
+  s->buffer.append(reinterpret_cast<const char*>(&h), sizeof(h));
+  s->buffer.append(data, size);
+  ++s->buffered;
+  if (VTZ_PREDICT_FALSE(s->buffer.size() >= options_.buffer_bytes)) {
+    s->WriteLocked();
+  }
+}
+
+void ShardedLogSink::Flush() {
+  for (int i = 0; i < num_shards_; ++i) {
+    Shard* s = &shards_[i];
+    std::lock_guard<std::mutex> l(s->mu);
+    s->WriteLocked();
+  }
+}
+
+uint64 ShardedLogSink::dropped() {
+  uint64 n = 0;
+  for (int i = 0; i < num_shards_; ++i) {
+    Shard* s = &shards_[i];
+    std::lock_guard<std::mutex> l(s->mu);
+    n += s->dropped;
+  }
+  return n;
+}
+
+void ShardedLogSink::BackgroundLoop() {
+  const std::chrono::milliseconds interval(options_.flush_interval_millis);
+  std::unique_lock<std::mutex> l(mu_);
+  while (!stop_) {
+    stop_cv_.wait_for(l, interval);
+    if (stop_) break;
+    l.unlock();
+    Flush();
+    l.lock();
+  }
+}
+
+struct ShardedLogReader::File {
+  File() : fd(-1), base(nullptr), size(0), next(0), next_sequence(0) {}
+
+  std::string path;
+  int fd;
+  const char* base;
+  size_t size;
+  size_t next;  // offset of the record after "current"
+  uint64 next_sequence;
+  ShardedLogRecord current;
+};
+
+ShardedLogReader::ShardedLogReader() : last_(nullptr), missing_(0) {}
+
+ShardedLogReader::~ShardedLogReader() {
+  for (size_t i = 0; i < files_.size(); ++i) {
+    File* f = files_[i];
+    if (f->base != nullptr) munmap(const_cast<char*>(f->base), f->size);
+    if (f->fd >= 0) close(f->fd);
+    delete f;
+  }
+}
+
+ShardedLogReader* ShardedLogReader::Open(const std::string& path,
+                                         std::string* error) {
+  const std::string first = ShardPath(path, 0);
+  const int fd = open(first.c_str(), O_RDONLY | O_CLOEXEC);
+  ShardFileHeader h;
+  if (fd < 0) {
+    *error = first + ": " + strerror(errno);
+    return nullptr;
+  }
+  const bool ok = read(fd, &h, sizeof(h)) == sizeof(h);
+  close(fd);
+  if (!ok || memcmp(h.magic, kShardFileMagic, sizeof(h.magic)) != 0) {
+    *error = first + ": not a shard file";
+    return nullptr;
+  }
+  std::vector<std::string> files;
+  for (uint32 i = 0; i < h.num_shards; ++i) {
+    files.push_back(ShardPath(path, static_cast<int>(i)));
+  }
+  return OpenFiles(files, error);
+}
+
+ShardedLogReader* ShardedLogReader::OpenFiles(
+    const std::vector<std::string>& files, std::string* error) {
+  ShardedLogReader* reader = new ShardedLogReader;
+  for (size_t i = 0; i < files.size(); ++i) {
+    File* f = new File;
+    reader->files_.push_back(f);
+    f->path = files[i];
+    f->fd = open(f->path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (f->fd < 0 || fstat(f->fd, &st) != 0) {
+      *error = f->path + ": " + strerror(errno);
+      delete reader;
+      return nullptr;
+    }
+    f->size = static_cast<size_t>(st.st_size);
+    if (f->size >= sizeof(ShardFileHeader)) {
+      void* base = mmap(nullptr, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+      if (base == MAP_FAILED) {
+        *error = f->path + ": mmap: " + strerror(errno);
+        delete reader;
+        return nullptr;
+      }
+      f->base = static_cast<const char*>(base);
+      madvise(base, f->size, MADV_SEQUENTIAL);
+    }
+    ShardFileHeader h;
+    memset(&h, 0, sizeof(h));
+    if (f->base != nullptr) memcpy(&h, f->base, sizeof(h));
+    if (memcmp(h.magic, kShardFileMagic, sizeof(h.magic)) != 0 ||
+        h.version != kShardFileVersion) {
+      *error = f->path + ": not a shard file";
+      delete reader;
+      return nullptr;
+    }
+    f->current.shard = static_cast<int>(h.shard);
+    f->next = sizeof(h);
+    if (reader->Advance(f)) reader->heap_.push_back(f);
+  }
+  std::make_heap(reader->heap_.begin(), reader->heap_.end(), After);
+  return reader;
+}
+
+bool ShardedLogReader::Advance(File* f) {
+  ShardRecordHeader h;
+  if (f->size - f->next < sizeof(h)) return false;
+  memcpy(&h, f->base + f->next, sizeof(h));
+  if (f->size - f->next - sizeof(h) < h.size) return false;  // torn
+  ShardedLogRecord* r = &f->current;
+  r->nanos = h.nanos;
+  r->sequence = h.sequence;
+  r->severity = static_cast<int>(h.severity);
+  r->data = f->base + f->next + sizeof(h);
+  r->size = h.size;
+  f->next += sizeof(h) + h.size;
+  if (h.sequence > f->next_sequence) missing_ += h.sequence - f->next_sequence;
+  f->next_sequence = h.sequence + 1;
+  return true;
+}
+
+bool ShardedLogReader::Next(ShardedLogRecord* record) {
+  if (last_ != nullptr && Advance(last_)) {
+    heap_.push_back(last_);
+    std::push_heap(heap_.begin(), heap_.end(), After);
+  }
+  last_ = nullptr;
+  if (heap_.empty()) return false;
+  std::pop_heap(heap_.begin(), heap_.end(), After);
+  last_ = heap_.back();
+  heap_.pop_back();
+  *record = last_->current;
+  return true;
+}
+
+bool ShardedLogReader::After(const File* a, const File* b) {
+  const ShardedLogRecord& x = a->current;
+  const ShardedLogRecord& y = b->current;
+  if (x.nanos != y.nanos) return x.nanos > y.nanos;
+  if (x.shard != y.shard) return x.shard > y.shard;
+  return x.sequence > y.sequence;
+}
+
+}  // namespace vtz
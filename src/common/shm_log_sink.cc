@@ -0,0 +1,261 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/shm_log_sink.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <mutex>
+#include "common/shm_log_private.h"
+
+namespace vtz {
+
+namespace internal {
+
+static_assert(sizeof(ShmLogHeader) == 64, "header is one cache line");
+static_assert(sizeof(ShmLogRing) % 64 == 0, "ring data is line aligned");
+static_assert(sizeof(ShmLogRecordHeader) % kShmRecordAlign == 0,
+              "record text is aligned");
+
+bool ReadProcessStartTime(int pid, uint64* start_time) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  char buf[1024];
+  const ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return false;
+  buf[n] = '\0';
+  // The command name in field 2 may hold spaces and parentheses; the
+  // fields after it start past the last ')'.
+  const char* p = strrchr(buf, ')');
+  if (p == nullptr || p[1] != ' ') return false;
+  p += 2;
+  if (*p == 'Z' || *p == 'X') return false;  // exited, not yet reaped
+  // p is at field 3; starttime is field 22.
+  for (int field = 3; field < 22; ++field) {
+    p = strchr(p, ' ');
+    if (p == nullptr) return false;
+    ++p;
+  }
+  *start_time = strtoull(p, nullptr, 10);
+  return true;
+}
+
+}  // namespace internal
+
+namespace {
+
+using internal::ShmLogHeader;
+using internal::ShmLogRecordHeader;
+using internal::ShmLogRing;
+
+// Bumped in every child fork() creates, so that sinks inherited from the
+// parent notice that its ring is not theirs. claim_mu is held across
+// fork() so that a child never starts with it locked.
+std::atomic<uint64> fork_generation(1);
+std::mutex claim_mu;
+std::once_flag atfork_once;
+
+void LockForFork() { claim_mu.lock(); }
+void UnlockInParent() { claim_mu.unlock(); }
+void UnlockInChild() {
+  fork_generation.fetch_add(1, std::memory_order_relaxed);
+  claim_mu.unlock();
+}
+
+void InstallForkHandlers() {
+  pthread_atfork(LockForFork, UnlockInParent, UnlockInChild);
+}
+
+uint64 MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+}  // namespace
+
+SharedMemoryLogSink* SharedMemoryLogSink::Create(
+    const SharedMemoryLogSinkOptions& options) {
+  const int fd = shm_open(options.name.c_str(), O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<uint64>(st.st_size) < sizeof(ShmLogHeader)) {
+    close(fd);
+    return nullptr;
+  }
+  const size_t size = static_cast<size_t>(st.st_size);
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return nullptr;
+  ShmLogHeader* header = static_cast<ShmLogHeader*>(base);
+  const uint64 ring_bytes = header->ring_bytes;
+  if (header->magic.load(std::memory_order_acquire) !=
+          internal::ShmLogMagicWord() ||
+      header->version != internal::kShmLogVersion || ring_bytes == 0 ||
+      (ring_bytes & (ring_bytes - 1)) != 0 ||
+      header->ring_stride != sizeof(ShmLogRing) + ring_bytes ||
+      internal::ShmLogSegmentBytes(header->num_rings, ring_bytes) > size) {
+    munmap(base, size);
+    return nullptr;
+  }
+  std::call_once(atfork_once, InstallForkHandlers);
+  return new SharedMemoryLogSink(header, size);
+}
+
+SharedMemoryLogSink::SharedMemoryLogSink(internal::ShmLogHeader* header,
+                                         size_t mapped_bytes)
+    : header_(header),
+      mapped_bytes_(mapped_bytes),
+      ring_(nullptr),
+      ring_generation_(0),
+      unclaimed_drops_(0),
+      next_claim_nanos_(0) {}
+
+SharedMemoryLogSink::~SharedMemoryLogSink() {
+  {
+    std::lock_guard<std::mutex> l(claim_mu);
+    ShmLogRing* ring = ring_.load(std::memory_order_relaxed);
+    if (ring != nullptr &&
+        ring_generation_.load(std::memory_order_relaxed) ==
+            fork_generation.load(std::memory_order_relaxed)) {
+      ring->state.store(internal::kShmRingClosed, std::memory_order_release);
+    }
+  }
+  munmap(header_, mapped_bytes_);
+}
+
+ShmLogRing* SharedMemoryLogSink::Ring() {
+  // ClaimRing() stores ring_ before the generation, so a generation that
+  // matches comes with the ring claimed for it.
+  if (VTZ_PREDICT_TRUE(ring_generation_.load(std::memory_order_acquire) ==
+                       fork_generation.load(std::memory_order_relaxed))) {
+    ShmLogRing* ring = ring_.load(std::memory_order_relaxed);
+    if (VTZ_PREDICT_TRUE(ring != nullptr)) return ring;
+    // Every ring was taken; look again now and then.
+    if (MonotonicNanos() < next_claim_nanos_.load(std::memory_order_relaxed)) {
+      return nullptr;
+    }
+  }
+  return ClaimRing();
+}
+
+ShmLogRing* SharedMemoryLogSink::ClaimRing() {
+  std::lock_guard<std::mutex> l(claim_mu);
+  const uint64 generation = fork_generation.load(std::memory_order_relaxed);
+  ShmLogRing* ring = ring_.load(std::memory_order_relaxed);
+  if (ring != nullptr &&
+      ring_generation_.load(std::memory_order_relaxed) == generation) {
+    return ring;  // another thread got here first
+  }
+  // Anything inherited across fork() is the parent's.
+  ring = nullptr;
+  const int pid = getpid();
+  uint64 start_time = 0;
+  internal::ReadProcessStartTime(pid, &start_time);
+  for (uint32 i = 0; i < header_->num_rings; ++i) {
+    ShmLogRing* candidate = internal::ShmLogRingAt(header_, i);
+    int32 expected = 0;
+    if (candidate->owner_pid.load(std::memory_order_relaxed) == 0 &&
+        candidate->owner_pid.compare_exchange_strong(
+            expected, pid, std::memory_order_acquire)) {
+      candidate->state.store(internal::kShmRingClaiming,
+                             std::memory_order_relaxed);
+      candidate->owner_start_time.store(start_time,
+                                        std::memory_order_relaxed);
+      candidate->state.store(internal::kShmRingActive,
+                             std::memory_order_release);
+      ring = candidate;
+      break;
+    }
+  }
+  if (ring == nullptr) {
+    next_claim_nanos_.store(MonotonicNanos() + 1000000000,
+                            std::memory_order_relaxed);
+  }
+  ring_.store(ring, std::memory_order_relaxed);
+  ring_generation_.store(generation, std::memory_order_release);
+  return ring;
+}
+
+void SharedMemoryLogSink::Send(int severity, const char* data, size_t size) {
+  (void)severity;
+  ShmLogRing* ring = Ring();
+  if (VTZ_PREDICT_FALSE(ring == nullptr)) {
+    unclaimed_drops_.fetch_add(1, std::memory_order_relaxed);
+    header_->unclaimed_drops.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  const uint64 capacity = header_->ring_bytes;
+  const uint64 need = internal::ShmRecordBytes(size);
+  const uint64 nanos = MonotonicNanos();
+  uint64 head = ring->head.load(std::memory_order_relaxed);
+  uint64 pad;
+  for (;;) {
+    const uint64 to_end = capacity - (head & (capacity - 1));
+    // Records never wrap; the end of the ring is filled instead.
+    pad = to_end < need ? to_end : 0;
+    // Acquire: the collector zeroed the space before giving it back.
+    const uint64 tail = ring->tail.load(std::memory_order_acquire);
+    if (VTZ_PREDICT_FALSE(head + pad + need - tail > capacity)) {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (ring->head.compare_exchange_weak(head, head + pad + need,
+                                         std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  char* base = ring->data();
+  if (pad != 0) {
+    ShmLogRecordHeader* filler = reinterpret_cast<ShmLogRecordHeader*>(
+        base + (head & (capacity - 1)));
+    filler->word.store(static_cast<uint32>(pad) |
+                           internal::kShmRecordPadding |
+                           internal::kShmRecordCommitted,
+                       std::memory_order_release);
+    head += pad;
+  }
+  ShmLogRecordHeader* record =
+      reinterpret_cast<ShmLogRecordHeader*>(base + (head & (capacity - 1)));
+  record->text_size = static_cast<uint32>(size);
+  record->nanos = nanos;
+  memcpy(reinterpret_cast<char*>(record) + sizeof(*record), data, size);
+  ring->written.fetch_add(1, std::memory_order_relaxed);
+  record->word.store(static_cast<uint32>(need) | internal::kShmRecordCommitted,
+                     std::memory_order_release);
+}
+
+uint64 SharedMemoryLogSink::dropped() const {
+  uint64 n = unclaimed_drops_.load(std::memory_order_relaxed);
+  ShmLogRing* ring = ring_.load(std::memory_order_relaxed);
+  if (ring != nullptr &&
+      ring_generation_.load(std::memory_order_relaxed) ==
+          fork_generation.load(std::memory_order_relaxed)) {
+    n += ring->dropped.load(std::memory_order_relaxed);
+  }
+  return n;
+}
+
+}  // namespace vtz
@@ -0,0 +1,391 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/trace.h"
+#include "common/log_format.h"
+#include "common/log_output_private.h"
+#include "common/macros.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace vtz {
+namespace internal {
+
+std::atomic<int> trace_state(-1);
+
+namespace {
+
+struct TraceEvent {
+  const char* name;
+  uint64 begin;
+  uint64 end;  // 0 for an instant
+};
+
+// One thread's events, oldest overwritten first. Its thread appends;
+// WriteChromeTrace() copies concurrently and drops what may have been
+// overwritten while it copied.
+class TraceBuffer {
+ public:
+  explicit TraceBuffer(size_t capacity)
+      : events_(new TraceEvent[capacity]),
+        capacity_(capacity),
+        head_(0),
+        tid_(0),
+        in_use_(true),
+        next_(nullptr) {}
+
+  void Add(const char* name, uint64 begin, uint64 end) {
+    const uint64 head = head_.load(std::memory_order_relaxed);
+    TraceEvent* e = &events_[head & (capacity_ - 1)];
+    e->name = name;
+    e->begin = begin;
+    e->end = end;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Appends the events still in the buffer to "out", oldest first.
+  void Snapshot(std::vector<TraceEvent>* out) const {
+    const uint64 head = head_.load(std::memory_order_acquire);
+    const uint64 begin = head > capacity_ ? head - capacity_ : 0;
+    const size_t start = out->size();
+    for (uint64 i = begin; i < head; ++i) {
+      out->push_back(events_[i & (capacity_ - 1)]);
+    }
+    // The owner may have lapped the oldest events meanwhile.
+    const uint64 now = head_.load(std::memory_order_acquire);
+    const uint64 valid = now > capacity_ ? now - capacity_ : 0;
+    if (valid > begin) {
+      const size_t lost = static_cast<size_t>(std::min(valid, head) - begin);
+      out->erase(out->begin() + start, out->begin() + start + lost);
+    }
+  }
+
+  // Hands the buffer to the calling thread, dropping its old events.
+  bool TryClaim(pid_t tid) {
+    bool expected = false;
+    if (!in_use_.compare_exchange_strong(expected, true,
+                                         std::memory_order_acquire)) {
+      return false;
+    }
+    head_.store(0, std::memory_order_release);
+    tid_ = tid;
+    return true;
+  }
+  void Release() { in_use_.store(false, std::memory_order_release); }
+
+  pid_t tid() const { return tid_; }
+  void set_tid(pid_t tid) { tid_ = tid; }
+  TraceBuffer* next() const { return next_; }
+  void set_next(TraceBuffer* next) { next_ = next; }
+
+ private:
+  TraceEvent* const events_;
+  const size_t capacity_;  // a power of two
+  std::atomic<uint64> head_;
+  pid_t tid_;
+  std::atomic<bool> in_use_;  // owned by a live thread
+  TraceBuffer* next_;         // immutable once published
+
+  VTZ_DISALLOW_COPY_AND_ASSIGN(TraceBuffer);
+};
+
+std::atomic<TraceBuffer*> trace_buffers(nullptr);
+std::atomic<size_t> trace_buffer_events(16 * 1024);
+std::mutex trace_mu;
+
+TraceBuffer* ClaimTraceBuffer() {
+  const pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+  for (TraceBuffer* b = trace_buffers.load(std::memory_order_acquire);
+       b != nullptr; b = b->next()) {
+    if (b->TryClaim(tid)) return b;
+  }
+  TraceBuffer* buffer =
+      new TraceBuffer(trace_buffer_events.load(std::memory_order_relaxed));
+  buffer->set_tid(tid);
+  TraceBuffer* head = trace_buffers.load(std::memory_order_relaxed);
+  do {
+    buffer->set_next(head);
+  } while (!trace_buffers.compare_exchange_weak(
+      head, buffer, std::memory_order_release, std::memory_order_relaxed));
+  return buffer;
+}
+
+// As in log_stats.cc, the hot path reads a plain initial-exec pointer and
+// only the claim touches the holder.
+thread_local TraceBuffer* thread_trace VTZ_ATTRIBUTE_INITIAL_EXEC = nullptr;
+thread_local bool thread_trace_released VTZ_ATTRIBUTE_INITIAL_EXEC = false;
+
+class TraceBufferHolder {
+ public:
+  TraceBufferHolder() : buffer_(nullptr) {}
+  ~TraceBufferHolder() {
+    if (buffer_ == nullptr) return;
+    // Scopes closed by later thread_local destructors go unrecorded.
+    thread_trace = nullptr;
+    thread_trace_released = true;
+    buffer_->Release();
+  }
+
+  void set_buffer(TraceBuffer* buffer) { buffer_ = buffer; }
+
+ private:
+  TraceBuffer* buffer_;
+};
+
+thread_local TraceBufferHolder thread_trace_holder;
+
+VTZ_ATTRIBUTE_NOINLINE TraceBuffer* ClaimThisThreadTraceBuffer() {
+  if (thread_trace_released) return nullptr;
+  thread_trace = ClaimTraceBuffer();
+  thread_trace_holder.set_buffer(thread_trace);
+  return thread_trace;
+}
+
+int64 ReadClockNanos(clockid_t id) {
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Ties TraceClock() to CLOCK_MONOTONIC.
+struct TraceCalibration {
+  uint64 ticks;
+  int64 mono_nanos;
+  double ticks_per_nano;
+};
+
+TraceCalibration Calibrate() {
+  TraceCalibration c;
+  c.ticks = TraceClock();
+  c.mono_nanos = ReadClockNanos(CLOCK_MONOTONIC);
+#if defined(__x86_64__) || defined(__i386__)
+  // A first estimate for traces written soon after tracing starts; later
+  // ones measure over the whole time since.
+  int64 mono;
+  uint64 ticks;
+  do {
+    ticks = TraceClock();
+    mono = ReadClockNanos(CLOCK_MONOTONIC);
+  } while (mono - c.mono_nanos < 2000000);
+  c.ticks_per_nano = static_cast<double>(ticks - c.ticks) /
+                     static_cast<double>(mono - c.mono_nanos);
+#else
+  c.ticks_per_nano = 1;
+#endif
+  return c;
+}
+
+const TraceCalibration& StartupCalibration() {
+  static const TraceCalibration calibration = Calibrate();
+  return calibration;
+}
+
+void StartTracingLocked(const TraceOptions& options) {
+  StartupCalibration();
+  size_t events = 64;
+  while (events < options.events_per_thread) events <<= 1;
+  trace_buffer_events.store(events, std::memory_order_relaxed);
+  trace_state.store(1, std::memory_order_release);
+}
+
+std::string trace_file_at_exit;  // guarded by trace_mu
+
+void WriteTraceAtExit() {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> l(trace_mu);
+    path = trace_file_at_exit;
+  }
+  WriteChromeTraceFile(path);
+}
+
+void LoadTraceStateFromEnvLocked() {
+  if (trace_state.load(std::memory_order_relaxed) >= 0) return;
+  const char* path = getenv("VTZ_CPP_TRACE_FILE");
+  if (path == nullptr || *path == '\0') {
+    trace_state.store(0, std::memory_order_release);
+    return;
+  }
+  trace_file_at_exit = path;
+  atexit(WriteTraceAtExit);
+  StartTracingLocked(TraceOptions());
+}
+
+void AppendJsonString(std::string* out, const char* s) {
+  out->push_back('"');
+  for (; *s != '\0'; ++s) {
+    const unsigned char c = static_cast<unsigned char>(*s);
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(static_cast<char>(c));
+    } else if (c < 0x20) {
+      static const char kHex[] = "0123456789abcdef";
+      out->append("\\u00");
+      out->push_back(kHex[c >> 4]);
+      out->push_back(kHex[c & 15]);
+    } else {
+      out->push_back(static_cast<char>(c));
+    }
+  }
+  out->push_back('"');
+}
+
+void AppendUInt(std::string* out, uint64 v) {
+  char buf[kFastFormatBufferSize];
+  out->append(buf, FormatUInt64(buf, v) - buf);
+}
+
+// Chrome wants microseconds; keep the nanoseconds as three decimals.
+void AppendMicros(std::string* out, int64 nanos) {
+  if (nanos < 0) nanos = 0;
+  AppendUInt(out, static_cast<uint64>(nanos / 1000));
+  char frac[4] = {'.', static_cast<char>('0' + nanos / 100 % 10),
+                  static_cast<char>('0' + nanos / 10 % 10),
+                  static_cast<char>('0' + nanos % 10)};
+  out->append(frac, 4);
+}
+
+bool WriteAll(int fd, const std::string& data) {
+  const char* p = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    const ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    p += n;
+    left -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+}  // namespace
+
+bool LoadTraceStateFromEnv() {
+  std::lock_guard<std::mutex> l(trace_mu);
+  LoadTraceStateFromEnvLocked();
+  return trace_state.load(std::memory_order_relaxed) > 0;
+}
+
+void RecordTraceEvent(const char* name, uint64 begin, uint64 end) {
+  TraceBuffer* buffer = thread_trace;
+  if (VTZ_PREDICT_FALSE(buffer == nullptr)) {
+    buffer = ClaimThisThreadTraceBuffer();
+    if (buffer == nullptr) return;
+  }
+  buffer->Add(name, begin, end);
+}
+
+}  // namespace internal
+
+bool EnableTracing(const TraceOptions& options) {
+  std::lock_guard<std::mutex> l(internal::trace_mu);
+  internal::LoadTraceStateFromEnvLocked();
+  if (internal::trace_state.load(std::memory_order_relaxed) > 0) return false;
+  internal::StartTracingLocked(options);
+  return true;
+}
+
+void DisableTracing() {
+  std::lock_guard<std::mutex> l(internal::trace_mu);
+  internal::LoadTraceStateFromEnvLocked();
+  internal::trace_state.store(0, std::memory_order_release);
+}
+
+bool TracingEnabled() { return internal::TraceIsOn(); }
+
+bool WriteChromeTrace(int fd) {
+  using internal::TraceBuffer;
+  using internal::TraceEvent;
+  // Map ticks to CLOCK_MONOTONIC through the longest span available, then
+  // shift to the log clock.
+  const internal::TraceCalibration& start = internal::StartupCalibration();
+  const uint64 now_ticks = internal::TraceClock();
+  const int64 now_mono = internal::ReadClockNanos(CLOCK_MONOTONIC);
+  double ticks_per_nano = start.ticks_per_nano;
+  if (now_mono - start.mono_nanos > 100000000 && now_ticks > start.ticks) {
+    ticks_per_nano = static_cast<double>(now_ticks - start.ticks) /
+                     static_cast<double>(now_mono - start.mono_nanos);
+  }
+  int64 offset = start.mono_nanos;
+  if (!internal::LogClockIsMonotonic()) {
+    offset += internal::ReadClockNanos(CLOCK_REALTIME) - now_mono;
+  }
+
+  const pid_t pid = getpid();
+  std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  std::vector<TraceEvent> events;
+  for (TraceBuffer* b =
+           internal::trace_buffers.load(std::memory_order_acquire);
+       b != nullptr; b = b->next()) {
+    events.clear();
+    b->Snapshot(&events);
+    for (size_t i = 0; i < events.size(); ++i) {
+      const TraceEvent& e = events[i];
+      const int64 begin =
+          offset + static_cast<int64>(
+                       static_cast<double>(static_cast<int64>(
+                           e.begin - start.ticks)) / ticks_per_nano);
+      out.append(first ? "\n{\"name\":" : ",\n{\"name\":");
+      first = false;
+      internal::AppendJsonString(&out, e.name);
+      if (e.end != 0) {
+        const int64 duration = static_cast<int64>(
+            static_cast<double>(static_cast<int64>(e.end - e.begin)) /
+            ticks_per_nano);
+        out.append(",\"ph\":\"X\",\"ts\":");
+        internal::AppendMicros(&out, begin);
+        out.append(",\"dur\":");
+        internal::AppendMicros(&out, duration);
+      } else {
+        out.append(",\"ph\":\"i\",\"s\":\"t\",\"ts\":");
+        internal::AppendMicros(&out, begin);
+      }
+      out.append(",\"pid\":");
+      internal::AppendUInt(&out, static_cast<uint64>(pid));
+      out.append(",\"tid\":");
+      internal::AppendUInt(&out, static_cast<uint64>(b->tid()));
+      out.push_back('}');
+      if (out.size() >= 64 * 1024) {
+        if (!internal::WriteAll(fd, out)) return false;
+        out.clear();
+      }
+    }
+  }
+  out.append("\n]}\n");
+  return internal::WriteAll(fd, out);
+}
+
+bool WriteChromeTraceFile(const std::string& path) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+  if (fd < 0) return false;
+  const bool ok = WriteChromeTrace(fd);
+  return close(fd) == 0 && ok;
+}
+
+}  // namespace vtz
@@ -0,0 +1,330 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "common/unix_log_sink.h"
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include "common/log_format.h"
+#include "common/log_output_private.h"
+
+namespace vtz {
+
+namespace {
+
+const uint32 kPaddingFrame = 0xffffffffu;
+const size_t kFrameHeaderBytes = sizeof(uint32);
+// sendmmsg() takes at most UIO_MAXIOV messages.
+const int kMaxBatch = 1024;
+
+inline uint64 FrameBytes(size_t size) {
+  return (kFrameHeaderBytes + size + 7) & ~static_cast<uint64>(7);
+}
+
+int64 MonotonicMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+UnixSocketLogSinkOptions Normalize(UnixSocketLogSinkOptions options) {
+  options.spill_bytes =
+      std::max<size_t>((options.spill_bytes + 7) & ~static_cast<size_t>(7),
+                       64 * 1024);
+  options.max_batch = std::min(std::max(options.max_batch, 1), kMaxBatch);
+  options.reconnect_interval_millis =
+      std::max<int64>(options.reconnect_interval_millis, 1);
+  return options;
+}
+
+// Fills "addr" for "path"; false if it does not fit.
+bool SocketAddress(const std::string& path, struct sockaddr_un* addr,
+                   socklen_t* len) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr->sun_path)) return false;
+  memcpy(addr->sun_path, path.data(), path.size());
+  if (path[0] == '@') {
+    // Abstract: a leading NUL and no terminator.
+    addr->sun_path[0] = '\0';
+    *len = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) +
+                                  path.size());
+  } else {
+    *len = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) +
+                                  path.size() + 1);
+  }
+  return true;
+}
+
+// The record the agent gets in place of "n" dropped ones.
+std::string DropNotice(uint64 n) {
+  char buf[256];
+  struct timespec ts;
+  clock_gettime(internal::LogClockIsMonotonic() ? CLOCK_MONOTONIC
+                                                : CLOCK_REALTIME,
+                &ts);
+  char* p = internal::FormatLogTimestamp(
+      buf, static_cast<int64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+  const char kSite[] = " W unix_log_sink.cc:0] dropped ";
+  memcpy(p, kSite, sizeof(kSite) - 1);
+  p = FormatUInt64(p + sizeof(kSite) - 1, n);
+  const char kWhy[] =
+      " log records while the agent was unreachable or not keeping up\n";
+  memcpy(p, kWhy, sizeof(kWhy) - 1);
+  p += sizeof(kWhy) - 1;
+  return std::string(buf, p - buf);
+}
+
+}  // namespace
+
+UnixSocketLogSink* UnixSocketLogSink::Create(
+    const UnixSocketLogSinkOptions& options) {
+  struct sockaddr_un addr;
+  socklen_t len;
+  if (!SocketAddress(options.path, &addr, &len)) return nullptr;
+  UnixSocketLogSink* sink = new UnixSocketLogSink(options);
+  sink->background_ = std::thread(&UnixSocketLogSink::BackgroundLoop, sink);
+  return sink;
+}
+
+UnixSocketLogSink::UnixSocketLogSink(const UnixSocketLogSinkOptions& options)
+    : options_(Normalize(options)),
+      fd_(-1),
+      buffer_(options_.spill_bytes),
+      head_(0),
+      tail_(0),
+      records_(0),
+      sent_(0),
+      dropped_(0),
+      reported_dropped_(0),
+      batches_(0),
+      connected_(false),
+      stop_(false) {}
+
+UnixSocketLogSink::~UnixSocketLogSink() {
+  {
+    std::lock_guard<std::mutex> l(mu_);
+    stop_ = true;
+    work_cv_.notify_one();
+  }
+  background_.join();
+  Disconnect();
+}
+
+void UnixSocketLogSink::Send(int severity, const char* data, size_t size) {
+  (void)severity;
+  const uint64 capacity = buffer_.size();
+  const uint64 need = FrameBytes(size);
+  std::lock_guard<std::mutex> l(mu_);
+  uint64 pos = head_ % capacity;
+  const uint64 to_end = capacity - pos;
+  const uint64 total = need + (need > to_end ? to_end : 0);
+  if (VTZ_PREDICT_FALSE(head_ - tail_ + total > capacity)) {
+    ++dropped_;
+    return;
+  }
+  if (need > to_end) {
+    memcpy(&buffer_[pos], &kPaddingFrame, kFrameHeaderBytes);
+    head_ += to_end;
+    pos = 0;
+  }
+  const uint32 frame_size = static_cast<uint32>(size);
+  memcpy(&buffer_[pos], &frame_size, kFrameHeaderBytes);
+  memcpy(&buffer_[pos + kFrameHeaderBytes], data, size);
+  head_ += need;
+  // The background thread only waits when the buffer is empty.
+  if (++records_ == 1) work_cv_.notify_one();
+}
+
+void UnixSocketLogSink::Flush() {
+  std::unique_lock<std::mutex> l(mu_);
+  const std::chrono::milliseconds patience(options_.reconnect_interval_millis);
+  while (records_ > 0 && connected_ && !stop_) {
+    // Give up on an agent that stopped taking records.
+    const uint64 tail = tail_;
+    if (empty_cv_.wait_for(l, patience) == std::cv_status::timeout &&
+        tail_ == tail) {
+      return;
+    }
+  }
+}
+
+uint64 UnixSocketLogSink::sent() {
+  std::lock_guard<std::mutex> l(mu_);
+  return sent_;
+}
+
+uint64 UnixSocketLogSink::dropped() {
+  std::lock_guard<std::mutex> l(mu_);
+  return dropped_;
+}
+
+uint64 UnixSocketLogSink::batches() {
+  std::lock_guard<std::mutex> l(mu_);
+  return batches_;
+}
+
+bool UnixSocketLogSink::connected() {
+  std::lock_guard<std::mutex> l(mu_);
+  return connected_;
+}
+
+bool UnixSocketLogSink::Connect() {
+  struct sockaddr_un addr;
+  socklen_t len;
+  // Create() checked the path already; this keeps "len" from being used
+  // unset should that ever change.
+  if (!SocketAddress(options_.path, &addr, &len)) return false;
+  const int type = options_.type == kUnixSocketSeqpacket ? SOCK_SEQPACKET
+                                                         : SOCK_DGRAM;
+  fd_ = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) return false;
+  if (connect(fd_, reinterpret_cast<struct sockaddr*>(&addr), len) != 0) {
+    Disconnect();
+    return false;
+  }
+  // A full agent queue blocks sendmmsg() only this long, so the thread
+  // still notices shutdown.
+  struct timeval tv;
+  tv.tv_sec = options_.reconnect_interval_millis / 1000;
+  tv.tv_usec = (options_.reconnect_interval_millis % 1000) * 1000;
+  setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  return true;
+}
+
+void UnixSocketLogSink::Disconnect() {
+  if (fd_ >= 0) close(fd_);
+  fd_ = -1;
+}
+
+bool UnixSocketLogSink::SendBatch(std::unique_lock<std::mutex>* l) {
+  struct mmsghdr msgs[kMaxBatch + 1];
+  struct iovec iov[kMaxBatch + 1];
+  // Where the tail moves once message i is sent.
+  uint64 ends[kMaxBatch + 1];
+  const uint64 capacity = buffer_.size();
+  int n = 0;
+  std::string notice;
+  const uint64 unreported = dropped_ - reported_dropped_;
+  if (unreported > 0) {
+    notice = DropNotice(unreported);
+    iov[0].iov_base = const_cast<char*>(notice.data());
+    iov[0].iov_len = notice.size();
+    ends[0] = tail_;
+    n = 1;
+  }
+  const int first_record = n;
+  uint64 t = tail_;
+  while (t != head_ && n - first_record < options_.max_batch) {
+    const uint64 pos = t % capacity;
+    uint32 size;
+    memcpy(&size, &buffer_[pos], kFrameHeaderBytes);
+    if (size == kPaddingFrame) {
+      t += capacity - pos;
+      continue;
+    }
+    iov[n].iov_base = &buffer_[pos + kFrameHeaderBytes];
+    iov[n].iov_len = size;
+    t += FrameBytes(size);
+    ends[n] = t;
+    ++n;
+  }
+  for (int i = 0; i < n; ++i) {
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // Producers only write past head_, so the frames stay put meanwhile.
+  l->unlock();
+  const int sent = sendmmsg(fd_, msgs, n, MSG_NOSIGNAL);
+  const int error = errno;
+  l->lock();
+
+  if (sent > 0) {
+    ++batches_;
+    if (first_record == 1) reported_dropped_ += unreported;
+    const int records = sent - first_record;
+    if (records > 0) {
+      tail_ = ends[sent - 1];
+      records_ -= records;
+      sent_ += records;
+    }
+  } else if (error == EMSGSIZE) {
+    // The first message is one the socket can never carry. A later one
+    // fails on the next call, which then starts with it.
+    if (first_record == 0) {
+      tail_ = ends[0];
+      --records_;
+      ++dropped_;
+    } else {
+      reported_dropped_ += unreported;
+    }
+  } else if (error != EINTR && (error != EAGAIN || stop_)) {
+    // EAGAIN is an agent that is slow rather than gone; keep trying, unless
+    // shutting down.
+    return false;
+  }
+  if (records_ == 0) {
+    // Nothing is in flight; start over at the front of the buffer.
+    head_ = tail_ = 0;
+    empty_cv_.notify_all();
+  }
+  return true;
+}
+
+void UnixSocketLogSink::BackgroundLoop() {
+  std::unique_lock<std::mutex> l(mu_);
+  int64 next_attempt = 0;
+  for (;;) {
+    if (!connected_) {
+      if (stop_) break;
+      const int64 now = MonotonicMillis();
+      if (now >= next_attempt) {
+        l.unlock();
+        const bool ok = Connect();
+        l.lock();
+        connected_ = ok;
+        next_attempt = now + options_.reconnect_interval_millis;
+        if (ok) continue;
+      }
+      work_cv_.wait_for(l, std::chrono::milliseconds(next_attempt - now));
+      continue;
+    }
+    if (records_ == 0 && dropped_ == reported_dropped_) {
+      if (stop_) break;
+      work_cv_.wait(l);
+      continue;
+    }
+    if (!SendBatch(&l)) {
+      l.unlock();
+      Disconnect();
+      l.lock();
+      connected_ = false;
+      // An agent that restarts is usually back at once.
+      next_attempt = 0;
+      empty_cv_.notify_all();
+    }
+  }
+}
+
+}  // namespace vtz
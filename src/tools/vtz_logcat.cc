@@ -0,0 +1,153 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Prints logs written by CompressedLogSink as plain text.
+//
+//   vtz_logcat [compressed_log...]   (reads stdin when no file is given)
+//
+// A block cut off at the end of a file, as a crash leaves it, ends that
+// file with a note on stderr. Damaged blocks elsewhere are reported and
+// skipped up to the next intact block, and make the exit status 1.
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "common/log_compression_private.h"
+
+namespace {
+
+using vtz::uint64;
+using vtz::internal::LogBlockHeader;
+
+// Sliding window over a stream, so blocks of any size can be looked at
+// whole without reading the file into memory.
+class Reader {
+ public:
+  explicit Reader(FILE* in) : in_(in), pos_(0), end_(0), offset_(0) {}
+
+  // Makes "n" bytes available at data(); false if the stream ends first.
+  bool Ensure(size_t n) {
+    if (end_ - pos_ >= n) return true;
+    if (pos_ > 0) {
+      memmove(buf_.data(), buf_.data() + pos_, end_ - pos_);
+      end_ -= pos_;
+      pos_ = 0;
+    }
+    if (buf_.size() < n) buf_.resize(std::max<size_t>(n, 1 << 20));
+    while (end_ < n) {
+      const size_t got = fread(buf_.data() + end_, 1, buf_.size() - end_, in_);
+      if (got == 0) return false;
+      end_ += got;
+    }
+    return true;
+  }
+
+  const char* data() const { return buf_.data() + pos_; }
+  size_t available() const { return end_ - pos_; }
+  // Position of data() in the stream.
+  uint64 offset() const { return offset_; }
+
+  void Skip(size_t n) {
+    pos_ += n;
+    offset_ += n;
+  }
+
+ private:
+  FILE* in_;
+  std::vector<char> buf_;
+  size_t pos_;
+  size_t end_;
+  uint64 offset_;
+};
+
+// Prints every intact block of "in". Returns false if any was damaged.
+bool Cat(FILE* in, const char* name) {
+  Reader reader(in);
+  std::string text;
+  std::string error;
+  bool clean = true;
+  uint64 damaged_from = 0;
+  uint64 damaged = 0;
+  for (;;) {
+    if (!reader.Ensure(sizeof(LogBlockHeader))) {
+      if (reader.available() > 0) {
+        fprintf(stderr, "vtz_logcat: %s: %zu bytes of a block header at the "
+                "end, ignored\n", name, reader.available());
+      }
+      break;
+    }
+    LogBlockHeader header;
+    memcpy(&header, reader.data(), sizeof(header));
+    if (!vtz::internal::ValidLogBlockHeader(header)) {
+      if (damaged == 0) damaged_from = reader.offset();
+      ++damaged;
+      reader.Skip(1);
+      continue;
+    }
+    if (damaged != 0) {
+      fprintf(stderr, "vtz_logcat: %s: skipped %llu damaged bytes at "
+              "offset %llu\n", name, static_cast<unsigned long long>(damaged),
+              static_cast<unsigned long long>(damaged_from));
+      damaged = 0;
+      clean = false;
+    }
+    const size_t block_size = sizeof(header) + header.payload_size;
+    if (!reader.Ensure(block_size)) {
+      fprintf(stderr, "vtz_logcat: %s: last block at offset %llu is cut "
+              "off (%zu of %zu bytes), ignored\n", name,
+              static_cast<unsigned long long>(reader.offset()),
+              reader.available(), block_size);
+      break;
+    }
+    if (!vtz::internal::DecodeLogBlock(header, reader.data() + sizeof(header),
+                                       &text, &error)) {
+      fprintf(stderr, "vtz_logcat: %s: block at offset %llu: %s\n", name,
+              static_cast<unsigned long long>(reader.offset()), error.c_str());
+      clean = false;
+      // Look for the next block from just past this header.
+      reader.Skip(1);
+      continue;
+    }
+    fwrite(text.data(), 1, text.size(), stdout);
+    reader.Skip(block_size);
+  }
+  if (damaged != 0) {
+    fprintf(stderr, "vtz_logcat: %s: skipped %llu damaged bytes at "
+            "offset %llu\n", name, static_cast<unsigned long long>(damaged),
+            static_cast<unsigned long long>(damaged_from));
+    clean = false;
+  }
+  return clean;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc == 1) return Cat(stdin, "<stdin>") ? 0 : 1;
+  int status = 0;
+  for (int i = 1; i < argc; ++i) {
+    FILE* in = fopen(argv[i], "rb");
+    if (in == nullptr) {
+      fprintf(stderr, "vtz_logcat: cannot open %s\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    if (!Cat(in, argv[i])) status = 1;
+    fclose(in);
+  }
+  return status;
+}
@@ -0,0 +1,433 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Collector for SharedMemoryLogSink. Creates the shared-memory segment,
+// drains every process's ring, merges the records by time and writes them
+// to one file, so that worker processes never share a descriptor.
+//
+//   vtz_logd [--name=/vtz_logd] [--output=FILE] [--rings=64]
+//            [--ring_bytes=1048576] [--merge_window_ms=10]
+//            [--stats_seconds=10] [--mode=0600]
+//
+// Records are written once they are merge_window_ms old, so that a record
+// from a process the collector drains later still lands in order. Drops
+// are reported on stderr per process: every stats_seconds while they grow,
+// and when the process goes away. A process that dies in the middle of a
+// record leaves the rest of its ring unreadable; that is discarded and
+// reported too, and the ring goes to the next process.
+//
+// The segment outlives the collector, so a restarted vtz_logd picks up
+// where the last one stopped and running processes keep their rings.
+// SIGINT and SIGTERM drain everything committed so far and exit.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "common/shm_log_private.h"
+
+namespace {
+
+using vtz::uint32;
+using vtz::uint64;
+using vtz::internal::ShmLogHeader;
+using vtz::internal::ShmLogRecordHeader;
+using vtz::internal::ShmLogRing;
+
+// iovecs per writev(); UIO_MAXIOV on Linux.
+const size_t kMaxBatchRecords = 1024;
+// How often an owner's liveness is looked up in /proc.
+const uint64 kLivenessCheckNanos = 100 * 1000000ull;
+
+volatile sig_atomic_t stop_requested = 0;
+
+void RequestStop(int) { stop_requested = 1; }
+
+struct Flags {
+  Flags()
+      : name("/vtz_logd"),
+        rings(64),
+        ring_bytes(1 << 20),
+        merge_window_ms(10),
+        stats_seconds(10),
+        mode(0600) {}
+
+  std::string name;
+  std::string output;
+  uint32 rings;
+  uint64 ring_bytes;
+  uint64 merge_window_ms;
+  uint64 stats_seconds;
+  int mode;
+};
+
+// What the collector remembers about a ring's current owner.
+struct Owner {
+  Owner() : pid(0), written(0), reported_dropped(0), next_check(0) {}
+
+  int pid;
+  uint64 written;           // records the collector has written out
+  uint64 reported_dropped;
+  uint64 next_check;
+};
+
+struct Entry {
+  uint64 nanos;
+  const char* text;
+  uint32 size;
+};
+
+bool EntryBefore(const Entry& a, const Entry& b) { return a.nanos < b.nanos; }
+
+uint64 MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  const size_t n = strlen(name);
+  if (strncmp(arg, name, n) != 0 || arg[n] != '=') return false;
+  *value = arg + n + 1;
+  return true;
+}
+
+bool ParseFlags(int argc, char** argv, Flags* flags) {
+  for (int i = 1; i < argc; ++i) {
+    std::string v;
+    if (ParseFlag(argv[i], "--name", &v)) {
+      flags->name = v;
+    } else if (ParseFlag(argv[i], "--output", &v)) {
+      flags->output = v;
+    } else if (ParseFlag(argv[i], "--rings", &v)) {
+      flags->rings = static_cast<uint32>(strtoul(v.c_str(), nullptr, 10));
+    } else if (ParseFlag(argv[i], "--ring_bytes", &v)) {
+      flags->ring_bytes = strtoull(v.c_str(), nullptr, 10);
+    } else if (ParseFlag(argv[i], "--merge_window_ms", &v)) {
+      flags->merge_window_ms = strtoull(v.c_str(), nullptr, 10);
+    } else if (ParseFlag(argv[i], "--stats_seconds", &v)) {
+      flags->stats_seconds = strtoull(v.c_str(), nullptr, 10);
+    } else if (ParseFlag(argv[i], "--mode", &v)) {
+      flags->mode = static_cast<int>(strtol(v.c_str(), nullptr, 8));
+    } else {
+      fprintf(stderr, "vtz_logd: unknown argument %s\n", argv[i]);
+      return false;
+    }
+  }
+  if (flags->rings == 0 || flags->ring_bytes > (1u << 30)) {
+    fprintf(stderr, "vtz_logd: need 1 or more rings of at most 1 GiB\n");
+    return false;
+  }
+  // A power of two, and at least a page.
+  uint64 ring_bytes = 4096;
+  while (ring_bytes < flags->ring_bytes) ring_bytes <<= 1;
+  flags->ring_bytes = ring_bytes;
+  return true;
+}
+
+// Maps the segment "flags.name", reusing one a previous collector left if
+// it is intact, otherwise creating it.
+ShmLogHeader* OpenSegment(const Flags& flags) {
+  const int fd = shm_open(flags.name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+                          flags.mode);
+  if (fd < 0) {
+    fprintf(stderr, "vtz_logd: shm_open %s: %s\n", flags.name.c_str(),
+            strerror(errno));
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 &&
+      static_cast<uint64>(st.st_size) >= sizeof(ShmLogHeader)) {
+    void* base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if (base != MAP_FAILED) {
+      ShmLogHeader* header = static_cast<ShmLogHeader*>(base);
+      if (header->magic.load(std::memory_order_acquire) ==
+              vtz::internal::ShmLogMagicWord() &&
+          header->version == vtz::internal::kShmLogVersion &&
+          vtz::internal::ShmLogSegmentBytes(header->num_rings,
+                                            header->ring_bytes) <=
+              static_cast<uint64>(st.st_size)) {
+        close(fd);
+        fprintf(stderr, "vtz_logd: reusing %s with %u rings of %llu bytes\n",
+                flags.name.c_str(), header->num_rings,
+                static_cast<unsigned long long>(header->ring_bytes));
+        return header;
+      }
+      munmap(base, st.st_size);
+    }
+  }
+
+  // Start from zeroes: shrinking to 0 discards whatever was there.
+  const uint64 size =
+      vtz::internal::ShmLogSegmentBytes(flags.rings, flags.ring_bytes);
+  if (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    fprintf(stderr, "vtz_logd: cannot size %s: %s\n", flags.name.c_str(),
+            strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "vtz_logd: mmap: %s\n", strerror(errno));
+    return nullptr;
+  }
+  ShmLogHeader* header = static_cast<ShmLogHeader*>(base);
+  header->version = vtz::internal::kShmLogVersion;
+  header->num_rings = flags.rings;
+  header->ring_bytes = flags.ring_bytes;
+  header->ring_stride = sizeof(ShmLogRing) + flags.ring_bytes;
+  header->magic.store(vtz::internal::ShmLogMagicWord(),
+                      std::memory_order_release);
+  return header;
+}
+
+// Collects the records of "ring" from its tail that are complete and no
+// newer than "cutoff". Returns where the scan stopped.
+uint64 ScanRing(ShmLogRing* ring, uint64 capacity, uint64 cutoff,
+                std::vector<Entry>* entries) {
+  char* base = ring->data();
+  const uint64 head = ring->head.load(std::memory_order_acquire);
+  uint64 pos = ring->tail.load(std::memory_order_relaxed);
+  while (pos < head) {
+    const ShmLogRecordHeader* record =
+        reinterpret_cast<const ShmLogRecordHeader*>(base +
+                                                    (pos & (capacity - 1)));
+    const uint32 word = record->word.load(std::memory_order_acquire);
+    if (word == 0) break;  // still being written
+    const uint32 size = word & ~(vtz::internal::kShmRecordAlign - 1);
+    if ((word & vtz::internal::kShmRecordPadding) == 0) {
+      if (record->nanos > cutoff) break;
+      Entry e;
+      e.nanos = record->nanos;
+      e.text = reinterpret_cast<const char*>(record + 1);
+      e.size = record->text_size;
+      entries->push_back(e);
+    }
+    pos += size;
+  }
+  return pos;
+}
+
+// Zeroes ring bytes [tail, end) for the next reservations and gives them
+// back to the producers.
+void ReleaseRing(ShmLogRing* ring, uint64 capacity, uint64 end) {
+  char* base = ring->data();
+  uint64 pos = ring->tail.load(std::memory_order_relaxed);
+  while (pos < end) {
+    const uint64 offset = pos & (capacity - 1);
+    const uint64 n = std::min(end - pos, capacity - offset);
+    memset(base + offset, 0, n);
+    pos += n;
+  }
+  ring->tail.store(end, std::memory_order_release);
+}
+
+// Writes all of "entries" to "fd", retrying short writes.
+void WriteEntries(int fd, const std::vector<Entry>& entries) {
+  struct iovec iov[kMaxBatchRecords];
+  for (size_t first = 0; first < entries.size();
+       first += kMaxBatchRecords) {
+    const size_t count = std::min(kMaxBatchRecords, entries.size() - first);
+    for (size_t i = 0; i < count; ++i) {
+      iov[i].iov_base = const_cast<char*>(entries[first + i].text);
+      iov[i].iov_len = entries[first + i].size;
+    }
+    struct iovec* next = iov;
+    int left = static_cast<int>(count);
+    while (left > 0) {
+      ssize_t n = writev(fd, next, left);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return;  // nowhere to report it
+      }
+      while (left > 0 && static_cast<size_t>(n) >= next->iov_len) {
+        n -= next->iov_len;
+        ++next;
+        --left;
+      }
+      if (left > 0) {
+        next->iov_base = static_cast<char*>(next->iov_base) + n;
+        next->iov_len -= n;
+      }
+    }
+  }
+}
+
+void ReportDrops(ShmLogRing* ring, Owner* owner) {
+  const uint64 dropped = ring->dropped.load(std::memory_order_relaxed);
+  if (dropped == owner->reported_dropped) return;
+  fprintf(stderr, "vtz_logd: pid %d: %llu records dropped, %llu written\n",
+          owner->pid, static_cast<unsigned long long>(dropped),
+          static_cast<unsigned long long>(owner->written));
+  owner->reported_dropped = dropped;
+}
+
+// Hands a ring whose owner is gone to the next process. "lost" is how
+// many bytes could not be read.
+void FreeRing(ShmLogRing* ring, uint64 capacity, Owner* owner, bool exited,
+              uint64 lost) {
+  const uint64 dropped = ring->dropped.load(std::memory_order_relaxed);
+  fprintf(stderr, "vtz_logd: pid %d %s: %llu records written, %llu dropped",
+          owner->pid, exited ? "exited" : "detached",
+          static_cast<unsigned long long>(owner->written),
+          static_cast<unsigned long long>(dropped));
+  if (lost != 0) {
+    fprintf(stderr, ", %llu bytes discarded after an unfinished record",
+            static_cast<unsigned long long>(lost));
+  }
+  fputc('\n', stderr);
+  memset(ring->data(), 0, capacity);
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->tail.store(0, std::memory_order_relaxed);
+  ring->written.store(0, std::memory_order_relaxed);
+  ring->dropped.store(0, std::memory_order_relaxed);
+  ring->owner_start_time.store(0, std::memory_order_relaxed);
+  ring->state.store(vtz::internal::kShmRingFree, std::memory_order_relaxed);
+  ring->owner_pid.store(0, std::memory_order_release);
+  *owner = Owner();
+}
+
+// Whether the process that claimed "ring" is gone: exited, or its pid now
+// belongs to another process.
+bool OwnerIsGone(ShmLogRing* ring, int pid) {
+  uint64 start_time;
+  if (!vtz::internal::ReadProcessStartTime(pid, &start_time)) return true;
+  const uint64 claimed = ring->owner_start_time.load(std::memory_order_relaxed);
+  return claimed != 0 && claimed != start_time;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) return 2;
+
+  int out = STDOUT_FILENO;
+  if (!flags.output.empty()) {
+    out = open(flags.output.c_str(),
+               O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (out < 0) {
+      fprintf(stderr, "vtz_logd: cannot open %s: %s\n", flags.output.c_str(),
+              strerror(errno));
+      return 1;
+    }
+  }
+  ShmLogHeader* header = OpenSegment(flags);
+  if (header == nullptr) return 1;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = RequestStop;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  const uint32 num_rings = header->num_rings;
+  const uint64 capacity = header->ring_bytes;
+  const uint64 window = flags.merge_window_ms * 1000000;
+  std::vector<Owner> owners(num_rings);
+  std::vector<uint64> scan_end(num_rings);
+  std::vector<char> gone(num_rings);
+  std::vector<Entry> entries;
+  uint64 reported_unclaimed = 0;
+  uint64 next_stats = MonotonicNanos() + flags.stats_seconds * 1000000000;
+
+  for (;;) {
+    const bool stopping = stop_requested != 0;
+    const uint64 now = MonotonicNanos();
+    // When stopping, everything committed goes out.
+    const uint64 cutoff = stopping || now < window ? ~0ull : now - window;
+    entries.clear();
+    for (uint32 i = 0; i < num_rings; ++i) {
+      ShmLogRing* ring = vtz::internal::ShmLogRingAt(header, i);
+      Owner* owner = &owners[i];
+      const int pid = ring->owner_pid.load(std::memory_order_acquire);
+      scan_end[i] = ring->tail.load(std::memory_order_relaxed);
+      gone[i] = 0;
+      if (pid == 0) continue;
+      if (owner->pid != pid) {
+        *owner = Owner();
+        owner->pid = pid;
+      }
+      const uint32 state = ring->state.load(std::memory_order_acquire);
+      if (state == vtz::internal::kShmRingClosed) gone[i] = 1;
+      if (now >= owner->next_check) {
+        owner->next_check = now + kLivenessCheckNanos;
+        if (OwnerIsGone(ring, pid)) gone[i] = 2;
+      }
+      // Nothing more is coming from a ring whose owner is gone.
+      const size_t before = entries.size();
+      scan_end[i] = ScanRing(ring, capacity, gone[i] != 0 ? ~0ull : cutoff,
+                             &entries);
+      owner->written += entries.size() - before;
+    }
+
+    std::stable_sort(entries.begin(), entries.end(), EntryBefore);
+    WriteEntries(out, entries);
+
+    for (uint32 i = 0; i < num_rings; ++i) {
+      ShmLogRing* ring = vtz::internal::ShmLogRingAt(header, i);
+      if (scan_end[i] != ring->tail.load(std::memory_order_relaxed)) {
+        ReleaseRing(ring, capacity, scan_end[i]);
+      }
+      if (gone[i] == 0) continue;
+      const uint64 head = ring->head.load(std::memory_order_acquire);
+      if (gone[i] == 2) {
+        FreeRing(ring, capacity, &owners[i], true, head - scan_end[i]);
+      } else if (scan_end[i] == head) {
+        // Closed by its owner, which may still be finishing a record.
+        FreeRing(ring, capacity, &owners[i], false, 0);
+      }
+    }
+
+    if (stopping || (flags.stats_seconds != 0 && now >= next_stats)) {
+      next_stats = now + flags.stats_seconds * 1000000000;
+      for (uint32 i = 0; i < num_rings; ++i) {
+        if (owners[i].pid != 0) {
+          ReportDrops(vtz::internal::ShmLogRingAt(header, i), &owners[i]);
+        }
+      }
+      const uint64 unclaimed =
+          header->unclaimed_drops.load(std::memory_order_relaxed);
+      if (unclaimed != reported_unclaimed) {
+        fprintf(stderr, "vtz_logd: %llu records dropped by processes "
+                "that found no free ring\n",
+                static_cast<unsigned long long>(unclaimed));
+        reported_unclaimed = unclaimed;
+      }
+    }
+    if (stopping) break;
+
+    // Poll; producers never make a system call to wake the collector.
+    if (entries.empty()) {
+      struct timespec ts = {0, 1000000};
+      nanosleep(&ts, nullptr);
+    }
+  }
+  if (out != STDOUT_FILENO) close(out);
+  return 0;
+}
@@ -0,0 +1,255 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Turns a binary log written by LOG_BIN back into text lines in the same
+// format LogMessage produces.
+//
+//   vtz_logdecode [binary_log]   (reads stdin when no file is given)
+//
+// Exits 1 on a record whose length cannot be right, since the records after
+// it cannot be found; a record cut short at the end is reported and the
+// exit status is 0.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "common/binary_logging.h"
+#include "common/log_format.h"
+#include "common/logging.h"
+
+namespace {
+
+// Ids are handed out from 1 in the order sites first log; a larger one is
+// a corrupt record rather than a program with that many LOG_BIN statements.
+const uint32_t kMaxSiteId = 1 << 20;
+// Likewise for a record longer than this: the length is corrupt, and the
+// records after it cannot be found.
+const uint32_t kMaxRecordBytes = 1u << 30;
+
+struct Site {
+  Site() : severity(0), line(0) {}
+  int severity;
+  uint32_t line;
+  std::string file;
+  std::string fmt;
+  std::string types;
+};
+
+// Bounds-checked reader over one record payload.
+class Reader {
+ public:
+  Reader(const char* p, size_t n) : p_(p), end_(p + n), ok_(true) {}
+
+  template <typename T>
+  T Get() {
+    T v = T();
+    if (static_cast<size_t>(end_ - p_) < sizeof(T)) {
+      ok_ = false;
+      return v;
+    }
+    memcpy(&v, p_, sizeof(T));
+    p_ += sizeof(T);
+    return v;
+  }
+
+  std::string GetBytes(size_t n) {
+    if (static_cast<size_t>(end_ - p_) < n) {
+      ok_ = false;
+      return std::string();
+    }
+    std::string s(p_, n);
+    p_ += n;
+    return s;
+  }
+
+  bool ok() const { return ok_; }
+
+ private:
+  const char* p_;
+  const char* end_;
+  bool ok_;
+};
+
+void AppendArg(char type, Reader* r, std::string* out) {
+  char buf[64];
+  switch (type) {
+    case 'i':
+      snprintf(buf, sizeof(buf), "%" PRId64, r->Get<int64_t>());
+      break;
+    case 'u':
+      snprintf(buf, sizeof(buf), "%" PRIu64, r->Get<uint64_t>());
+      break;
+    case 'b':
+      snprintf(buf, sizeof(buf), "%s", r->Get<uint8_t>() ? "true" : "false");
+      break;
+    case 'c':
+      buf[0] = r->Get<char>();
+      buf[1] = '\0';
+      break;
+    case 'f':
+      out->append(buf, vtz::FormatFloat(buf, r->Get<float>()) - buf);
+      return;
+    case 'd':
+      out->append(buf, vtz::FormatDouble(buf, r->Get<double>()) - buf);
+      return;
+    case 'p':
+      snprintf(buf, sizeof(buf), "0x%" PRIx64, r->Get<uint64_t>());
+      break;
+    case 's':
+      out->append(r->GetBytes(r->Get<uint32_t>()));
+      return;
+    default:
+      snprintf(buf, sizeof(buf), "<bad type '%c'>", type);
+      break;
+  }
+  out->append(buf);
+}
+
+std::string FormatEntry(const Site& site, Reader* r) {
+  std::string out;
+  size_t arg = 0;
+  const std::string& fmt = site.fmt;
+  for (size_t i = 0; i < fmt.size(); ++i) {
+    const char c = fmt[i];
+    if ((c == '{' || c == '}') && i + 1 < fmt.size() && fmt[i + 1] == c) {
+      out.push_back(c);
+      ++i;
+    } else if (c == '{' && i + 1 < fmt.size() && fmt[i + 1] == '}') {
+      if (arg < site.types.size()) {
+        AppendArg(site.types[arg++], r, &out);
+      } else {
+        out.append("{}");
+      }
+      ++i;
+    } else {
+      out.push_back(c);
+    }
+  }
+  // Arguments without a placeholder are appended rather than lost.
+  while (arg < site.types.size()) {
+    out.push_back(' ');
+    AppendArg(site.types[arg++], r, &out);
+  }
+  return out;
+}
+
+// Reads "length" bytes into "payload". It grows only as data arrives, so a
+// length past the end of the input costs no more memory than the input
+// holds. False if the input ends first.
+bool ReadPayload(FILE* in, uint32_t length, std::vector<char>* payload) {
+  const size_t kStep = 1 << 20;
+  payload->clear();
+  while (payload->size() < length) {
+    const size_t have = payload->size();
+    const size_t want = std::min<size_t>(length - have, kStep);
+    payload->resize(have + want);
+    if (fread(payload->data() + have, 1, want, in) != want) return false;
+  }
+  return true;
+}
+
+void PrintPrefix(uint64_t nanos, const Site& site) {
+  const time_t seconds = static_cast<time_t>(nanos / 1000000000ull);
+  const unsigned micros = static_cast<unsigned>(nanos % 1000000000ull / 1000);
+  struct tm tm_time;
+  localtime_r(&seconds, &tm_time);
+  char datetime[32];
+  strftime(datetime, sizeof(datetime), "%Y-%m-%d %H:%M:%S", &tm_time);
+  printf("%s.%06u %c %s:%u] ", datetime, micros, "IWEF"[site.severity],
+         site.file.c_str(), site.line);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  FILE* in = stdin;
+  if (argc > 1) {
+    in = fopen(argv[1], "rb");
+    if (in == nullptr) {
+      fprintf(stderr, "vtz_logdecode: cannot open %s\n", argv[1]);
+      return 1;
+    }
+  }
+  char magic[sizeof(vtz::internal::kBinaryLogMagic)];
+  if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+      memcmp(magic, vtz::internal::kBinaryLogMagic, sizeof(magic)) != 0) {
+    fprintf(stderr, "vtz_logdecode: not a vtz binary log\n");
+    return 1;
+  }
+
+  std::unordered_map<uint32_t, Site> sites;
+  std::vector<char> payload;
+  uint64_t offset = sizeof(magic);
+  int status = 0;
+  for (;;) {
+    char kind;
+    uint32_t length;
+    if (fread(&kind, 1, 1, in) != 1) break;
+    if (fread(&length, sizeof(length), 1, in) != 1) break;
+    if (length > kMaxRecordBytes) {
+      fprintf(stderr,
+              "vtz_logdecode: corrupt record at offset %llu: length %u\n",
+              static_cast<unsigned long long>(offset), length);
+      status = 1;
+      break;
+    }
+    if (!ReadPayload(in, length, &payload)) {
+      fprintf(stderr,
+              "vtz_logdecode: record at offset %llu runs past the end of "
+              "input\n", static_cast<unsigned long long>(offset));
+      break;
+    }
+    offset += 1 + sizeof(length) + length;
+    Reader r(payload.data(), payload.size());
+    if (kind == vtz::internal::kBinaryLogSiteKind) {
+      const uint32_t id = r.Get<uint32_t>();
+      Site site;
+      site.severity = r.Get<uint8_t>();
+      site.line = r.Get<uint32_t>();
+      site.file = r.GetBytes(r.Get<uint16_t>());
+      site.fmt = r.GetBytes(r.Get<uint16_t>());
+      site.types = r.GetBytes(r.Get<uint8_t>());
+      if (!r.ok() || id == 0 || id > kMaxSiteId) {
+        fprintf(stderr, "vtz_logdecode: bad site record, id %u\n", id);
+        continue;
+      }
+      if (site.severity >= vtz::NUM_SEVERITIES) {
+        fprintf(stderr, "vtz_logdecode: site %u has unknown severity %d\n",
+                id, site.severity);
+        continue;
+      }
+      sites[id] = site;
+    } else if (kind == vtz::internal::kBinaryLogEntryKind) {
+      const uint32_t id = r.Get<uint32_t>();
+      const uint64_t nanos = r.Get<uint64_t>();
+      std::unordered_map<uint32_t, Site>::const_iterator it = sites.find(id);
+      if (it == sites.end()) {
+        fprintf(stderr, "vtz_logdecode: entry for unknown site %u\n", id);
+        continue;
+      }
+      const std::string text = FormatEntry(it->second, &r);
+      PrintPrefix(nanos, it->second);
+      printf("%s%s\n", text.c_str(), r.ok() ? "" : " [corrupt entry]");
+    }
+    // Unknown kinds are skipped; the length prefix makes that safe.
+  }
+  if (in != stdin) fclose(in);
+  return status;
+}
@@ -0,0 +1,109 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Merges the shard files of a ShardedLogSink into one log, in the order
+// the records reached the sink, and writes it to stdout.
+//
+//   vtz_logmerge [--keys] [--stats] PATH
+//   vtz_logmerge [--keys] [--stats] PATH.shard-0 PATH.shard-3 ...
+//
+// Given the sink's path, reads every shard it wrote; given shard files,
+// reads only those. --keys starts each line with the record's monotonic
+// time in nanoseconds, its shard and its sequence number within the shard.
+// --stats reports on stderr how many records were merged and how many are
+// missing because the sink failed to write them.
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "common/sharded_log_sink.h"
+
+namespace {
+
+using vtz::uint64;
+
+struct Flags {
+  Flags() : keys(false), stats(false) {}
+
+  bool keys;
+  bool stats;
+  std::vector<std::string> files;
+};
+
+bool ParseFlags(int argc, char** argv, Flags* flags) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (arg[0] != '-') {
+      flags->files.push_back(arg);
+    } else if (strcmp(arg, "--keys") == 0) {
+      flags->keys = true;
+    } else if (strcmp(arg, "--stats") == 0) {
+      flags->stats = true;
+    } else {
+      fprintf(stderr, "vtz_logmerge: unknown argument %s\n", arg);
+      return false;
+    }
+  }
+  if (flags->files.empty()) {
+    fprintf(stderr, "vtz_logmerge: no log given\n");
+    return false;
+  }
+  return true;
+}
+
+bool IsShardFile(const std::string& path) {
+  const size_t dot = path.rfind(".shard-");
+  return dot != std::string::npos &&
+         path.find_first_not_of("0123456789", dot + 7) == std::string::npos &&
+         dot + 7 < path.size();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) return 2;
+  static char out_buf[1 << 16];
+  setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+  std::string error;
+  vtz::ShardedLogReader* reader =
+      flags.files.size() == 1 && !IsShardFile(flags.files[0])
+          ? vtz::ShardedLogReader::Open(flags.files[0], &error)
+          : vtz::ShardedLogReader::OpenFiles(flags.files, &error);
+  if (reader == nullptr) {
+    fprintf(stderr, "vtz_logmerge: %s\n", error.c_str());
+    return 1;
+  }
+  uint64 records = 0;
+  vtz::ShardedLogRecord r;
+  while (reader->Next(&r)) {
+    if (flags.keys) {
+      printf("%llu %d %llu ", static_cast<unsigned long long>(r.nanos),
+             r.shard, static_cast<unsigned long long>(r.sequence));
+    }
+    fwrite(r.data, 1, r.size, stdout);
+    ++records;
+  }
+  fflush(stdout);
+  if (flags.stats) {
+    fprintf(stderr, "vtz_logmerge: %llu records, %llu missing\n",
+            static_cast<unsigned long long>(records),
+            static_cast<unsigned long long>(reader->missing()));
+  }
+  delete reader;
+  return 0;
+}
@@ -0,0 +1,175 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Prints the records of text log files that match a query.
+//
+//   vtz_logq [--since=TIME] [--until=TIME] [--severity=ERROR]
+//            [--file=foo.cc[:LINE]] [--grep=TEXT] [--count] [--stats]
+//            [--write_index] [--no_index] log_file...
+//
+// TIME is "YYYY-MM-DD[ HH:MM[:SS[.ffffff]]]" in the log's local time, or
+// seconds for logs written with the monotonic clock; --until is exclusive.
+// --severity keeps that severity and above. --file matches the logged path
+// or its trailing components. --grep looks for TEXT after the prefix.
+//
+// A file is queried through "<file>.idx" where one exists: the index that
+// RotatingFileSink writes with write_index, or that an earlier
+// --write_index left. Only the chunks the index cannot rule out are read.
+// Whatever the index does not cover, such as a plain stderr capture, is
+// indexed in memory first; --write_index saves that for the next query.
+// --stats reports on stderr how much of each file was read.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "common/log_index.h"
+
+namespace {
+
+using vtz::uint64;
+
+struct Flags {
+  Flags() : count(false), stats(false), write_index(false), no_index(false) {}
+
+  vtz::LogQuery query;
+  bool count;
+  bool stats;
+  bool write_index;
+  bool no_index;
+  std::vector<std::string> files;
+};
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  const size_t n = strlen(name);
+  if (strncmp(arg, name, n) != 0 || arg[n] != '=') return false;
+  *value = arg + n + 1;
+  return true;
+}
+
+// "INFO", "WARNING", "ERROR" or "FATAL", or their first letter, with an
+// optional '+'.
+bool ParseSeverity(std::string v, int* severity) {
+  if (!v.empty() && v[v.size() - 1] == '+') v.erase(v.size() - 1);
+  static const char* const kNames[] = {"INFO", "WARNING", "ERROR", "FATAL"};
+  for (int i = 0; i < 4; ++i) {
+    if (v == kNames[i] || v == std::string(1, kNames[i][0])) {
+      *severity = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ParseFlags(int argc, char** argv, Flags* flags) {
+  vtz::LogQuery* q = &flags->query;
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    std::string v;
+    if (arg[0] != '-') {
+      flags->files.push_back(arg);
+    } else if (ParseFlag(arg, "--since", &v)) {
+      if (!vtz::ParseLogTime(v, &q->begin_micros)) {
+        fprintf(stderr, "vtz_logq: bad time %s\n", v.c_str());
+        return false;
+      }
+    } else if (ParseFlag(arg, "--until", &v)) {
+      if (!vtz::ParseLogTime(v, &q->end_micros)) {
+        fprintf(stderr, "vtz_logq: bad time %s\n", v.c_str());
+        return false;
+      }
+    } else if (ParseFlag(arg, "--severity", &v)) {
+      if (!ParseSeverity(v, &q->min_severity)) {
+        fprintf(stderr, "vtz_logq: bad severity %s\n", v.c_str());
+        return false;
+      }
+    } else if (ParseFlag(arg, "--file", &v)) {
+      const size_t colon = v.rfind(':');
+      if (colon != std::string::npos) {
+        q->line = atoi(v.c_str() + colon + 1);
+        v.erase(colon);
+      }
+      q->file = v;
+    } else if (ParseFlag(arg, "--grep", &v)) {
+      q->text = v;
+    } else if (strcmp(arg, "--count") == 0) {
+      flags->count = true;
+    } else if (strcmp(arg, "--stats") == 0) {
+      flags->stats = true;
+    } else if (strcmp(arg, "--write_index") == 0) {
+      flags->write_index = true;
+    } else if (strcmp(arg, "--no_index") == 0) {
+      flags->no_index = true;
+    } else {
+      fprintf(stderr, "vtz_logq: unknown argument %s\n", arg);
+      return false;
+    }
+  }
+  if (flags->files.empty()) {
+    fprintf(stderr, "vtz_logq: no log file given\n");
+    return false;
+  }
+  return true;
+}
+
+void Print(const char* data, size_t size) { fwrite(data, 1, size, stdout); }
+
+void Ignore(const char*, size_t) {}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) return 2;
+  static char out_buf[1 << 16];
+  setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+  int status = 0;
+  uint64 total = 0;
+  for (size_t i = 0; i < flags.files.size(); ++i) {
+    const std::string& path = flags.files[i];
+    std::string error;
+    vtz::IndexedLogFile* file =
+        vtz::IndexedLogFile::Open(path, !flags.no_index, &error);
+    if (file == nullptr) {
+      fprintf(stderr, "vtz_logq: %s\n", error.c_str());
+      status = 1;
+      continue;
+    }
+    vtz::LogQueryStats stats;
+    total += file->Query(flags.query, flags.count ? Ignore : Print, &stats);
+    if (flags.stats) {
+      fprintf(stderr,
+              "vtz_logq: %s: %llu records; read %llu of %llu chunks, "
+              "%llu of %llu bytes; %llu bytes were indexed\n",
+              path.c_str(), static_cast<unsigned long long>(stats.records),
+              static_cast<unsigned long long>(stats.chunks_read),
+              static_cast<unsigned long long>(stats.chunks),
+              static_cast<unsigned long long>(stats.bytes_read),
+              static_cast<unsigned long long>(stats.bytes),
+              static_cast<unsigned long long>(file->indexed_bytes()));
+    }
+    if (flags.write_index && !file->SaveIndex(&error)) {
+      fprintf(stderr, "vtz_logq: %s\n", error.c_str());
+      status = 1;
+    }
+    delete file;
+  }
+  if (flags.count) {
+    printf("%llu\n", static_cast<unsigned long long>(total));
+  }
+  return status;
+}
@@ -0,0 +1,85 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A record logged from a thread_local destructor that runs after the
+// thread's ring was handed back must still be written, and not into the
+// ring the writer thread has freed by then.
+
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "common/async_logging.h"
+#include "common/logging.h"
+
+namespace {
+
+// Constructed before the thread's first LOG, so destroyed after its ring.
+struct LateLogger {
+  ~LateLogger() {
+    // Long enough for the writer to drain and free the abandoned ring.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    LOG(INFO) << "late record";
+  }
+  void Touch() {}
+};
+
+thread_local LateLogger late_logger;
+
+void Child() {
+  vtz::AsyncLoggingOptions options;
+  CHECK(vtz::StartAsyncLogging(options));
+  std::thread t([] {
+    late_logger.Touch();
+    LOG(INFO) << "early record";
+  });
+  t.join();
+  vtz::StopAsyncLogging();
+}
+
+}  // namespace
+
+int main() {
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  fflush(stdout);
+  const pid_t child = fork();
+  CHECK(child >= 0);
+  if (child == 0) {
+    close(fds[0]);
+    dup2(fds[1], 2);
+    close(fds[1]);
+    Child();
+    _exit(0);
+  }
+  close(fds[1]);
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) out.append(buf, n);
+  close(fds[0]);
+  int status;
+  CHECK(waitpid(child, &status, 0) == child);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "status " << status;
+  const size_t early = out.find("] early record\n");
+  const size_t late = out.find("] late record\n");
+  CHECK(early != std::string::npos) << out;
+  CHECK(late != std::string::npos) << out;
+  CHECK_LT(early, late) << out;
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,133 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Decodes LOG_BIN output with vtz_logdecode, whose path is the first
+// argument, also after a record with a corrupt length; and checks that
+// LOG_BIN(FATAL) writes a text record and aborts.
+//
+//   vtz_logger_binary_logging_test path/to/vtz_logdecode
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include "common/binary_logging.h"
+#include "common/logging.h"
+
+namespace {
+
+std::string logdecode;
+
+// vtz_logdecode's stdout for "path", run with at most 256MB of address
+// space; "*status" is its exit status.
+std::string Decode(const std::string& path, int* status) {
+  const std::string command =
+      "ulimit -v 262144; " + logdecode + " " + path + " 2>/dev/null";
+  FILE* p = popen(command.c_str(), "r");
+  CHECK(p != nullptr);
+  std::string out;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), p)) > 0) out.append(buf, n);
+  const int wait_status = pclose(p);
+  CHECK(WIFEXITED(wait_status)) << command;
+  *status = WEXITSTATUS(wait_status);
+  return out;
+}
+
+// Appends a record header claiming "length" bytes, and a few of them.
+void AppendRecordHeader(const std::string& path, vtz::uint32 length) {
+  FILE* f = fopen(path.c_str(), "ab");
+  CHECK(f != nullptr);
+  fputc(vtz::internal::kBinaryLogEntryKind, f);
+  fwrite(&length, sizeof(length), 1, f);
+  fputs("garbage", f);
+  fclose(f);
+}
+
+size_t CountLines(const std::string& s) {
+  size_t n = 0;
+  for (size_t i = 0; i < s.size(); ++i) n += s[i] == '\n';
+  return n;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  CHECK_EQ(argc, 2) << "usage: " << argv[0] << " path/to/vtz_logdecode";
+  logdecode = argv[1];
+  const std::string path =
+      "/tmp/vtz_binary_logging_test." + std::to_string(getpid());
+
+  CHECK(vtz::OpenBinaryLog(path.c_str()));
+  for (int i = 0; i < 3; ++i) {
+    LOG_BIN(INFO, "user {} took {} us", std::string("bob"), 1.5 * i);
+  }
+  LOG_BIN(WARNING, "slow {}", 7);
+  vtz::CloseBinaryLog();
+
+  int status;
+  const std::string decoded = Decode(path, &status);
+  CHECK_EQ(status, 0);
+  CHECK_EQ(CountLines(decoded), 4u) << decoded;
+  CHECK(decoded.find(" I ") != std::string::npos) << decoded;
+  CHECK(decoded.find("] user bob took 1.5 us\n") != std::string::npos)
+      << decoded;
+  CHECK(decoded.find(" W ") != std::string::npos) << decoded;
+  CHECK(decoded.find("] slow 7\n") != std::string::npos) << decoded;
+
+  // A length past the end of the input, under the limit: reported as cut
+  // short, without allocating it.
+  AppendRecordHeader(path, 900u << 20);
+  CHECK_EQ(Decode(path, &status), decoded);
+  CHECK_EQ(status, 0);
+  unlink(path.c_str());
+
+  // A length over the limit: corrupt.
+  CHECK(vtz::OpenBinaryLog(path.c_str()));
+  LOG_BIN(INFO, "slow {}", 7);
+  vtz::CloseBinaryLog();
+  AppendRecordHeader(path, 0xfffffff0u);
+  CHECK_EQ(CountLines(Decode(path, &status)), 1u);
+  CHECK_EQ(status, 1);
+  unlink(path.c_str());
+
+  // LOG_BIN(FATAL) is not binary: it writes text to stderr and aborts.
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  fflush(stdout);
+  const pid_t child = fork();
+  CHECK(child >= 0);
+  if (child == 0) {
+    close(fds[0]);
+    dup2(fds[1], 2);
+    close(fds[1]);
+    LOG_BIN(FATAL, "boom {}", 42);
+    _exit(0);
+  }
+  close(fds[1]);
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) out.append(buf, n);
+  close(fds[0]);
+  CHECK(waitpid(child, &status, 0) == child);
+  CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT)
+      << "status " << status;
+  CHECK(out.find("] boom 42\n") != std::string::npos) << out;
+  printf("PASS\n");
+  return 0;
+}
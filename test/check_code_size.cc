@@ -0,0 +1,112 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// CHECK_XX call sites for the check_code_size report; compiled, never run.
+// VTZ_CHECK_SIZE_MODE picks what each site expands to:
+//   0  nothing, the baseline the other two are measured against
+//   1  the former expansion, which built the LogMessageFatal and streamed
+//      the message inline at every site
+//   2  CHECK_XX as it is now
+// check_code_size.cmake divides the difference in .text by kSites.
+
+#include <stddef.h>
+#include <string>
+#include "common/logging.h"
+
+#ifndef VTZ_CHECK_SIZE_MODE
+#define VTZ_CHECK_SIZE_MODE 2
+#endif
+
+#if VTZ_CHECK_SIZE_MODE == 0
+
+// The operands are still named, so that no parameter goes unused, but
+// discarding them generates no code.
+#define SIZE_CHECK_EQ(val1, val2) \
+  (static_cast<void>(val1), static_cast<void>(val2))
+#define SIZE_CHECK_NE(val1, val2) \
+  (static_cast<void>(val1), static_cast<void>(val2))
+#define SIZE_CHECK_LT(val1, val2) \
+  (static_cast<void>(val1), static_cast<void>(val2))
+
+#elif VTZ_CHECK_SIZE_MODE == 1
+
+namespace {
+
+#define LEGACY_CHECK_OP_IMPL(name, op)                                  \
+  template <typename T1, typename T2>                                   \
+  inline std::string* name##Impl(const T1& v1, const T2& v2,            \
+                                 const char* exprtext) {                \
+    if (VTZ_PREDICT_TRUE(v1 op v2))                                      \
+      return NULL;                                                      \
+    else                                                                \
+      return ::vtz::internal::MakeCheckOpString(v1, v2, exprtext);      \
+  }
+
+LEGACY_CHECK_OP_IMPL(LegacyCheck_EQ, ==)
+LEGACY_CHECK_OP_IMPL(LegacyCheck_NE, !=)
+LEGACY_CHECK_OP_IMPL(LegacyCheck_LT, <)
+#undef LEGACY_CHECK_OP_IMPL
+
+}  // namespace
+
+#define LEGACY_CHECK_OP(name, op, val1, val2)                     \
+  while (::vtz::internal::CheckOpString _result =                 \
+             name##Impl(val1, val2, #val1 " " #op " " #val2))     \
+  ::vtz::internal::LogMessageFatal(__FILE__, __LINE__).stream()   \
+      << *(_result.str_)
+
+#define SIZE_CHECK_EQ(val1, val2) LEGACY_CHECK_OP(LegacyCheck_EQ, ==, val1, val2)
+#define SIZE_CHECK_NE(val1, val2) LEGACY_CHECK_OP(LegacyCheck_NE, !=, val1, val2)
+#define SIZE_CHECK_LT(val1, val2) LEGACY_CHECK_OP(LegacyCheck_LT, <, val1, val2)
+
+#else
+
+#define SIZE_CHECK_EQ(val1, val2) CHECK_EQ(val1, val2)
+#define SIZE_CHECK_NE(val1, val2) CHECK_NE(val1, val2)
+#define SIZE_CHECK_LT(val1, val2) CHECK_LT(val1, val2)
+
+#endif
+
+// Four checks over different operand types per function.
+#define CHECK_SIZE_FUNCTION(n)                                           \
+  VTZ_ATTRIBUTE_NOINLINE int CheckSizeSite##n(int a, size_t b,           \
+                                              const char* p,             \
+                                              const std::string& s) {    \
+    SIZE_CHECK_EQ(a, n);                                                 \
+    SIZE_CHECK_LT(b, static_cast<size_t>(n + 100));                      \
+    SIZE_CHECK_NE(p, static_cast<const char*>(NULL));                    \
+    SIZE_CHECK_EQ(s.size(), static_cast<size_t>(n));                     \
+    return a + static_cast<int>(b) + p[0];                               \
+  }
+
+CHECK_SIZE_FUNCTION(0)
+CHECK_SIZE_FUNCTION(1)
+CHECK_SIZE_FUNCTION(2)
+CHECK_SIZE_FUNCTION(3)
+CHECK_SIZE_FUNCTION(4)
+CHECK_SIZE_FUNCTION(5)
+CHECK_SIZE_FUNCTION(6)
+CHECK_SIZE_FUNCTION(7)
+CHECK_SIZE_FUNCTION(8)
+CHECK_SIZE_FUNCTION(9)
+CHECK_SIZE_FUNCTION(10)
+CHECK_SIZE_FUNCTION(11)
+CHECK_SIZE_FUNCTION(12)
+CHECK_SIZE_FUNCTION(13)
+CHECK_SIZE_FUNCTION(14)
+CHECK_SIZE_FUNCTION(15)
+
+// Referenced so that the report's kSites stays in step with the above.
+extern const int kSites = 16 * 4;
@@ -0,0 +1,48 @@
+# Prints the code size per CHECK_XX from the three builds of
+# check_code_size.cc; run through the check_code_size target.
+#
+#   cmake -DOBJDUMP=... -DSITES=N -DNONE_OBJECT=... -DINLINE_OBJECT=...
+#         -DCOLD_OBJECT=... -P check_code_size.cmake
+#
+# "hot" is every .text section except .text.unlikely ones, which GCC fills
+# with cold functions and the cold parts of split functions.
+
+function(text_bytes object hot_var cold_var)
+  execute_process(COMMAND ${OBJDUMP} -h ${object}
+                  OUTPUT_VARIABLE headers RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "objdump -h ${object} failed")
+  endif()
+  set(hot 0)
+  set(cold 0)
+  string(REPLACE "\n" ";" lines "${headers}")
+  foreach(line ${lines})
+    if(line MATCHES "^ *[0-9]+ (\\.text[^ ]*) +([0-9a-f]+) ")
+      set(name ${CMAKE_MATCH_1})
+      math(EXPR size "0x${CMAKE_MATCH_2}")
+      if(name MATCHES "^\\.text\\.unlikely")
+        math(EXPR cold "${cold} + ${size}")
+      else()
+        math(EXPR hot "${hot} + ${size}")
+      endif()
+    endif()
+  endforeach()
+  set(${hot_var} ${hot} PARENT_SCOPE)
+  set(${cold_var} ${cold} PARENT_SCOPE)
+endfunction()
+
+text_bytes(${NONE_OBJECT} none_hot none_cold)
+text_bytes(${INLINE_OBJECT} inline_hot inline_cold)
+text_bytes(${COLD_OBJECT} cold_hot cold_cold)
+
+function(report label hot cold)
+  math(EXPR hot_per_site "(${hot} - ${none_hot}) / ${SITES}")
+  math(EXPR cold_per_site "(${cold} - ${none_cold}) / ${SITES}")
+  math(EXPR total_per_site "${hot_per_site} + ${cold_per_site}")
+  message("  ${label}: ${hot_per_site} hot + ${cold_per_site} cold = "
+          "${total_per_site} bytes")
+endfunction()
+
+message("CHECK_XX .text bytes per site, over ${SITES} sites:")
+report("inline failure path (before)" ${inline_hot} ${inline_cold})
+report("out-of-line failure path    " ${cold_hot} ${cold_cold})
@@ -0,0 +1,184 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Writes records through CompressedLogSink and reads them back with
+// vtz_logcat, whose path is the first argument: intact, with the last block
+// cut off, and with a block damaged in the middle.
+//
+//   vtz_logger_compressed_log_sink_test path/to/vtz_logcat
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "common/compressed_log_sink.h"
+#include "common/log_compression_private.h"
+#include "common/logging.h"
+
+namespace {
+
+using vtz::internal::LogBlockHeader;
+
+std::string logcat;
+
+std::string ReadFile(const std::string& path) {
+  std::string data;
+  FILE* f = fopen(path.c_str(), "rb");
+  CHECK(f != nullptr) << path;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+  fclose(f);
+  return data;
+}
+
+void WriteFile(const std::string& path, const std::string& data) {
+  FILE* f = fopen(path.c_str(), "wb");
+  CHECK(f != nullptr) << path;
+  CHECK_EQ(fwrite(data.data(), 1, data.size(), f), data.size());
+  fclose(f);
+}
+
+// vtz_logcat's stdout for "path"; "*status" is its exit status.
+std::string Cat(const std::string& path, int* status) {
+  const std::string command = logcat + " " + path + " 2>/dev/null";
+  FILE* p = popen(command.c_str(), "r");
+  CHECK(p != nullptr);
+  std::string out;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), p)) > 0) out.append(buf, n);
+  const int wait_status = pclose(p);
+  CHECK(WIFEXITED(wait_status)) << command;
+  *status = WEXITSTATUS(wait_status);
+  return out;
+}
+
+// Offsets of the blocks in "file", and the end of the last one.
+std::vector<size_t> Blocks(const std::string& file) {
+  std::vector<size_t> offsets;
+  size_t offset = 0;
+  while (offset < file.size()) {
+    offsets.push_back(offset);
+    LogBlockHeader header;
+    CHECK_GE(file.size() - offset, sizeof(header));
+    memcpy(&header, file.data() + offset, sizeof(header));
+    CHECK(vtz::internal::ValidLogBlockHeader(header)) << offset;
+    offset += sizeof(header) + header.payload_size;
+  }
+  CHECK_EQ(offset, file.size());
+  offsets.push_back(offset);
+  return offsets;
+}
+
+// The text of the block at "offset" in "file".
+std::string BlockText(const std::string& file, size_t offset) {
+  LogBlockHeader header;
+  memcpy(&header, file.data() + offset, sizeof(header));
+  std::string text;
+  std::string error;
+  CHECK(vtz::internal::DecodeLogBlock(
+      header, file.data() + offset + sizeof(header), &text, &error))
+      << error;
+  return text;
+}
+
+void RoundTrip(vtz::LogCompression compression, const std::string& path) {
+  unlink(path.c_str());
+  vtz::CompressedLogSinkOptions options;
+  options.path = path;
+  options.compression = compression;
+  options.block_bytes = 16 * 1024;
+  vtz::CompressedLogSink* sink = vtz::CompressedLogSink::Create(options);
+  CHECK(sink != nullptr) << path;
+  std::string sent;
+  char record[256];
+  for (int i = 0; i < 5000; ++i) {
+    const int n = snprintf(record, sizeof(record),
+                           "2018-01-01 00:00:%02d.%06d I server.cc:%d] "
+                           "request %d user=u%d latency_us=%d\n",
+                           i % 60, i * 37 % 1000000, 100 + i % 7, i, i % 13,
+                           i * 7919 % 100000);
+    sink->Send(vtz::INFO, record, n);
+    sent.append(record, n);
+  }
+  sink->Flush();
+  delete sink;
+
+  int status;
+  const std::string file = ReadFile(path);
+  CHECK_EQ(Cat(path, &status), sent);
+  CHECK_EQ(status, 0);
+  const std::vector<size_t> blocks = Blocks(file);
+  const size_t num_blocks = blocks.size() - 1;
+  CHECK_GE(num_blocks, 4u);
+
+  // Cut off in the middle of the last block: the blocks before it, and
+  // not an error.
+  const std::string cut_path = path + ".cut";
+  const size_t last = blocks[num_blocks - 1];
+  WriteFile(cut_path, file.substr(0, last + (file.size() - last) / 2));
+  std::string expected;
+  for (size_t i = 0; i + 1 < num_blocks; ++i) {
+    expected += BlockText(file, blocks[i]);
+  }
+  CHECK_EQ(Cat(cut_path, &status), expected);
+  CHECK_EQ(status, 0);
+
+  // One byte of the second block's payload flipped: every other block,
+  // and an error.
+  const std::string bad_path = path + ".bad";
+  std::string bad = file;
+  bad[blocks[1] + sizeof(LogBlockHeader) + 10] ^= 0x5a;
+  WriteFile(bad_path, bad);
+  expected.clear();
+  for (size_t i = 0; i < num_blocks; ++i) {
+    if (i != 1) expected += BlockText(file, blocks[i]);
+  }
+  CHECK_EQ(Cat(bad_path, &status), expected);
+  CHECK_EQ(status, 1);
+
+  // A damaged header: skipped up to the next block.
+  bad = file;
+  bad[blocks[2]] ^= 0x5a;
+  WriteFile(bad_path, bad);
+  expected.clear();
+  for (size_t i = 0; i < num_blocks; ++i) {
+    if (i != 2) expected += BlockText(file, blocks[i]);
+  }
+  CHECK_EQ(Cat(bad_path, &status), expected);
+  CHECK_EQ(status, 1);
+
+  unlink(path.c_str());
+  unlink(cut_path.c_str());
+  unlink(bad_path.c_str());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  CHECK_EQ(argc, 2) << "usage: " << argv[0] << " path/to/vtz_logcat";
+  logcat = argv[1];
+  const std::string path =
+      "/tmp/vtz_compressed_log_sink_test." + std::to_string(getpid());
+  RoundTrip(vtz::kLogCompressionLz4, path);
+  if (vtz::ZstdLogCompressionAvailable()) {
+    RoundTrip(vtz::kLogCompressionZstd, path);
+  }
+  printf("PASS\n");
+  return 0;
+}
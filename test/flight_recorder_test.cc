@@ -0,0 +1,87 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A thread's flight ring goes to the next new thread once it exits. A
+// record the exiting thread logs from a later thread_local destructor must
+// not land in the ring another thread now writes.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "common/flight_recorder.h"
+#include "common/logging.h"
+
+namespace {
+
+std::atomic<bool> a_released(false);
+std::atomic<bool> b_recorded(false);
+std::atomic<bool> a_done(false);
+
+void WaitFor(const std::atomic<bool>& flag) {
+  while (!flag.load()) std::this_thread::yield();
+}
+
+// Constructed before the thread's first LOG, so destroyed after its ring
+// holder.
+struct LateLogger {
+  ~LateLogger() {
+    a_released = true;
+    WaitFor(b_recorded);
+    LOG(INFO) << "late record";
+  }
+  void Touch() {}
+};
+
+thread_local LateLogger late_logger;
+
+}  // namespace
+
+int main() {
+  vtz::SetMinLogLevel(vtz::WARNING);
+  vtz::FlightRecorderOptions options;
+  CHECK(vtz::EnableFlightRecorder(options));
+
+  std::thread a([] {
+    late_logger.Touch();
+    LOG(INFO) << "a record";
+  });
+  WaitFor(a_released);
+  // Claims the ring "a" released.
+  std::thread b([] {
+    LOG(INFO) << "b record";
+    b_recorded = true;
+    WaitFor(a_done);
+  });
+  a.join();
+  a_done = true;
+  b.join();
+
+  FILE* f = tmpfile();
+  CHECK(f != nullptr);
+  vtz::DumpFlightRecorder(fileno(f));
+  rewind(f);
+  std::string dump;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) dump.append(buf, n);
+  fclose(f);
+  CHECK(dump.find("] a record\n") != std::string::npos) << dump;
+  CHECK(dump.find("] b record\n") != std::string::npos) << dump;
+  CHECK(dump.find("late record") == std::string::npos) << dump;
+  printf("PASS\n");
+  return 0;
+}
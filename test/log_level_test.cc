@@ -0,0 +1,85 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Runs with VTZ_CPP_MIN_LOG_LEVEL=1 (see CMakeLists.txt): LOG() statements
+// below WARNING must not evaluate their operands, not even the first one
+// the process runs. The LOG() guard must also end up at the right level
+// when the minimum level and the flight recorder change concurrently.
+
+#include <stdio.h>
+#include <thread>
+#include "common/flight_recorder.h"
+#include "common/logging.h"
+
+namespace {
+
+int evaluated = 0;
+
+int Expensive() {
+  ++evaluated;
+  return 42;
+}
+
+// Flips the minimum level and the flight recorder from two threads, then
+// checks that the guard filters exactly below "final_level".
+void RaceLevelUpdates(int final_level) {
+  const int kRounds = 20000;
+  std::thread levels([final_level] {
+    for (int i = 0; i < kRounds; ++i) {
+      vtz::SetMinLogLevel(i % 2 == 0 ? vtz::INFO : vtz::FATAL);
+    }
+    vtz::SetMinLogLevel(final_level);
+  });
+  std::thread recorder([] {
+    vtz::FlightRecorderOptions options;
+    options.min_severity = vtz::WARNING;
+    for (int i = 0; i < kRounds; ++i) {
+      vtz::EnableFlightRecorder(options);
+      vtz::DisableFlightRecorder();
+    }
+  });
+  levels.join();
+  recorder.join();
+  for (int severity = vtz::INFO; severity < vtz::FATAL; ++severity) {
+    CHECK_EQ(vtz::internal::LogSeverityIsOn(severity),
+             severity >= final_level)
+        << "severity " << severity << ", level " << final_level;
+  }
+}
+
+}  // namespace
+
+int main() {
+  LOG(INFO) << "filtered " << Expensive();
+  CHECK_EQ(evaluated, 0);
+  LOG(INFO) << "filtered " << Expensive();
+  CHECK_EQ(evaluated, 0);
+  LOG(WARNING) << "kept " << Expensive();
+  CHECK_EQ(evaluated, 1);
+
+  vtz::SetMinLogLevel(vtz::INFO);
+  LOG(INFO) << "kept " << Expensive();
+  CHECK_EQ(evaluated, 2);
+  vtz::SetMinLogLevel(vtz::ERROR);
+  LOG(WARNING) << "filtered " << Expensive();
+  CHECK_EQ(evaluated, 2);
+
+  for (int i = 0; i < 10; ++i) {
+    RaceLevelUpdates(vtz::ERROR);
+    RaceLevelUpdates(vtz::INFO);
+  }
+  printf("PASS\n");
+  return 0;
+}
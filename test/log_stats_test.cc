@@ -0,0 +1,45 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Statements the LOG(), VLOG() and LOGF() guards filter are counted in
+// LogStats::filtered while stats are on, and only then.
+
+#include <stdio.h>
+#include "common/logf.h"
+#include "common/log_stats.h"
+#include "common/logging.h"
+
+int main() {
+  CHECK(vtz::EnableLogStats(vtz::LogStatsOptions()));
+  vtz::SetMinLogLevel(vtz::WARNING);
+  for (int i = 0; i < 3; ++i) LOG(INFO) << "filtered " << i;
+  LOGF(INFO, "filtered {}", 1);
+  VLOG(1) << "filtered by the log level";
+  CHECK_EQ(vtz::GetLogStats().filtered, 5u);
+
+  vtz::SetMinLogLevel(vtz::INFO);
+  VLOG(1) << "filtered by the verbose level";
+  LOG(INFO) << "written";
+  vtz::LogStats stats = vtz::GetLogStats();
+  CHECK_EQ(stats.filtered, 6u);
+  CHECK_EQ(stats.messages[vtz::INFO], 1u);
+
+  vtz::DisableLogStats();
+  vtz::SetMinLogLevel(vtz::WARNING);
+  LOG(INFO) << "not counted";
+  CHECK_EQ(vtz::GetLogStats().filtered, 6u);
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,79 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Runs with VTZ_CPP_MIN_LOG_LEVEL=4 (see CMakeLists.txt), which filters
+// every severity, and is also built with -DVTZ_MIN_LOG_LEVEL=4, which
+// compiles them out: LOGF(FATAL) must still print its record before
+// aborting, as LOG(FATAL) does.
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <functional>
+#include <string>
+#include "common/logf.h"
+#include "common/logging.h"
+
+namespace {
+
+// Runs "body" in a child process and returns what it wrote to stderr;
+// "*status" is its wait status.
+std::string RunChild(const std::function<void()>& body, int* status) {
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  fflush(stdout);
+  const pid_t child = fork();
+  CHECK(child >= 0);
+  if (child == 0) {
+    close(fds[0]);
+    dup2(fds[1], 2);
+    close(fds[1]);
+    body();
+    _exit(0);
+  }
+  close(fds[1]);
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) out.append(buf, n);
+  close(fds[0]);
+  CHECK(waitpid(child, status, 0) == child);
+  return out;
+}
+
+bool Aborted(int status) {
+  return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+}  // namespace
+
+int main() {
+  int status;
+  std::string out = RunChild([] { LOGF(FATAL, "boom {}", 42); }, &status);
+  CHECK(Aborted(status)) << "status " << status;
+  CHECK(out.find(" F ") != std::string::npos) << out;
+  CHECK(out.find("] boom 42\n") != std::string::npos) << out;
+
+  out = RunChild([] { LOG(FATAL) << "boom " << 42; }, &status);
+  CHECK(Aborted(status)) << "status " << status;
+  CHECK(out.find("] boom 42\n") != std::string::npos) << out;
+
+  out = RunChild([] { LOGF(ERROR, "filtered {}", 1); }, &status);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK_EQ(out, "");
+  printf("PASS\n");
+  return 0;
+}
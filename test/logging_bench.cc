@@ -0,0 +1,826 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Microbenchmarks for the logging and CHECK hot paths.
+//
+//   vtz_logger_bench [--text] [--filter=SUBSTR] [--threads=N]
+//                    [--iters=N] [--out_file=PATH]
+//
+// Prints one JSON object per benchmark on stdout:
+//   {"name": ..., "threads": T, "iters": N, "ns_per_op": ...,
+//    "allocs_per_op": ..., "p50_ns": ..., "p99_ns": ..., "p999_ns": ...,
+//    "latency_threads": 1}
+// ns_per_op is wall time per operation per thread. The percentiles come
+// from timing single operations on the main thread alone after the timed
+// run, whatever "threads" says; latency_threads records that. The
+// "compress" lines give the ratio and MB/s of each CompressedLogSink codec
+// on generated server log text instead, and the "query" lines the time of
+// an IndexedLogFile query on such text with and without its index. --text
+// prints a table instead.
+//
+// The "throughput" cases run on 1, 2, 4, ... up to --threads threads
+// (default 64) to show how logging scales: through the one stderr
+// descriptor, to /dev/null and to a file, through the async writer, and
+// through a ShardedLogSink with a file per CPU.
+//
+// Log output goes to /dev/null unless a benchmark says otherwise; the
+// "file" cases write to --out_file (default /tmp/vtz_logger_bench.log).
+// The filtered cases run with SetMinLogLevel(WARNING), the rest with INFO.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <new>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common/async_logging.h"
+#include "common/binary_logging.h"
+#include "common/compressed_log_sink.h"
+#include "common/logf.h"
+#include "common/log_coalescing.h"
+#include "common/log_compression_private.h"
+#include "common/log_encoder.h"
+#include "common/log_format.h"
+#include "common/log_index.h"
+#include "common/log_payload.h"
+#include "common/log_sink.h"
+#include "common/log_stats.h"
+#include "common/logging.h"
+#include "common/sharded_log_sink.h"
+#include "common/trace.h"
+
+namespace {
+
+std::atomic<unsigned long long> allocations(0);
+
+}  // namespace
+
+// Every replaceable form goes to malloc() and free(), so that each delete
+// pairs with the new that made its pointer. Out of line so that GCC does
+// not see free() inlined against a pointer from operator new and warn.
+VTZ_ATTRIBUTE_NOINLINE void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+VTZ_ATTRIBUTE_NOINLINE void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+VTZ_ATTRIBUTE_NOINLINE void operator delete(void* p) noexcept { free(p); }
+VTZ_ATTRIBUTE_NOINLINE void operator delete[](void* p) noexcept { free(p); }
+VTZ_ATTRIBUTE_NOINLINE void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+VTZ_ATTRIBUTE_NOINLINE void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Flags {
+  Flags()
+      : text(false),
+        threads(0),
+        iters(0),
+        out_file("/tmp/vtz_logger_bench.log") {}
+  bool text;
+  std::string filter;
+  int threads;  // 0: 64
+  long iters;   // 0: per-benchmark default
+  std::string out_file;
+};
+
+Flags flags;
+
+// Where a benchmark's log output goes.
+enum Output { kDevNull, kFile };
+
+struct Benchmark {
+  Benchmark()
+      : iters(0),
+        output(kDevNull),
+        encoder(nullptr),
+        stats(false),
+        coalescing(false),
+        tracing(false),
+        compressed(false),
+        sharded(false) {}
+  std::string name;
+  long iters;
+  Output output;
+  vtz::LogEncoder* encoder;  // nullptr: text format
+  bool stats;                // run with EnableLogStats()
+  bool coalescing;           // run with EnableLogCoalescing()
+  bool tracing;              // run with EnableTracing()
+  bool compressed;           // write through a CompressedLogSink only
+  bool sharded;              // write through a ShardedLogSink only
+  // Runs one operation; "i" is the iteration number.
+  std::function<void(long i)> op;
+};
+
+struct Result {
+  double ns_per_op;
+  double allocs_per_op;
+  double p50_ns;
+  double p99_ns;
+  double p999_ns;
+};
+
+// Points fd 2 at "path" for the lifetime of the object.
+class StderrRedirect {
+ public:
+  explicit StderrRedirect(const std::string& path) : saved_(dup(2)) {
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      dup2(fd, 2);
+      close(fd);
+    }
+  }
+  ~StderrRedirect() {
+    dup2(saved_, 2);
+    close(saved_);
+  }
+
+ private:
+  int saved_;
+};
+
+double Percentile(std::vector<double>* samples, double q) {
+  if (samples->empty()) return 0;
+  const size_t k = std::min(samples->size() - 1,
+                            static_cast<size_t>(q * samples->size()));
+  std::nth_element(samples->begin(), samples->begin() + k, samples->end());
+  return (*samples)[k];
+}
+
+Result Run(const Benchmark& b, int threads) {
+  const long iters = flags.iters > 0 ? flags.iters : b.iters;
+  StderrRedirect redirect(b.output == kFile ? flags.out_file : "/dev/null");
+  vtz::SetLogEncoder(b.encoder);
+  if (b.stats) vtz::EnableLogStats(vtz::LogStatsOptions());
+  if (b.coalescing) vtz::EnableLogCoalescing(vtz::LogCoalescingOptions());
+  if (b.tracing) vtz::EnableTracing(vtz::TraceOptions());
+  vtz::CompressedLogSink* sink = nullptr;
+  if (b.compressed) {
+    vtz::CompressedLogSinkOptions options;
+    options.path = flags.out_file + ".vtz";
+    unlink(options.path.c_str());
+    sink = vtz::CompressedLogSink::Create(options);
+    vtz::AddLogSink(sink);
+    vtz::SetStderrLogSeverity(vtz::NUM_SEVERITIES);
+  }
+  vtz::ShardedLogSink* sharded_sink = nullptr;
+  if (b.sharded) {
+    vtz::ShardedLogSinkOptions options;
+    options.path = flags.out_file;
+    sharded_sink = vtz::ShardedLogSink::Create(options);
+    vtz::AddLogSink(sharded_sink);
+    vtz::SetStderrLogSeverity(vtz::NUM_SEVERITIES);
+  }
+
+  // Warm up thread-local buffers, call sites and the page cache.
+  for (long i = 0; i < 1000; ++i) b.op(i);
+
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.push_back(std::thread([&, t] {
+      ready.fetch_add(1);
+      while (!go.load()) std::this_thread::yield();
+      for (long i = 0; i < iters; ++i) b.op(i + t * iters);
+    }));
+  }
+  while (ready.load() != threads) std::this_thread::yield();
+  const unsigned long long allocs_before = allocations.load();
+  const Clock::time_point start = Clock::now();
+  go.store(true);
+  for (size_t t = 0; t < workers.size(); ++t) workers[t].join();
+  vtz::FlushLogs();
+  const Clock::time_point end = Clock::now();
+  const unsigned long long allocs_after = allocations.load();
+
+  // Per-operation latency on this thread, clock overhead included.
+  const long samples = std::min<long>(iters, 200000);
+  std::vector<double> latencies;
+  latencies.reserve(samples);
+  for (long i = 0; i < samples; ++i) {
+    const Clock::time_point t0 = Clock::now();
+    b.op(i);
+    const Clock::time_point t1 = Clock::now();
+    latencies.push_back(
+        std::chrono::duration<double, std::nano>(t1 - t0).count());
+  }
+  vtz::FlushLogs();
+  vtz::SetLogEncoder(nullptr);
+  vtz::DisableLogStats();
+  vtz::DisableLogCoalescing();
+  vtz::DisableTracing();
+  if (sink != nullptr) {
+    vtz::RemoveLogSink(sink);
+    delete sink;
+    vtz::SetStderrLogSeverity(vtz::INFO);
+  }
+  if (sharded_sink != nullptr) {
+    vtz::RemoveLogSink(sharded_sink);
+    delete sharded_sink;
+    vtz::SetStderrLogSeverity(vtz::INFO);
+  }
+
+  Result r;
+  r.ns_per_op =
+      std::chrono::duration<double, std::nano>(end - start).count() / iters;
+  r.allocs_per_op = static_cast<double>(allocs_after - allocs_before) /
+                    (static_cast<double>(iters) * threads);
+  r.p50_ns = Percentile(&latencies, 0.50);
+  r.p99_ns = Percentile(&latencies, 0.99);
+  r.p999_ns = Percentile(&latencies, 0.999);
+  return r;
+}
+
+void Report(const Benchmark& b, int threads, const Result& r) {
+  const long iters = flags.iters > 0 ? flags.iters : b.iters;
+  if (flags.text) {
+    printf("%-42s %3d thr %9.2f ns/op %5.2f allocs/op  1 thr: p50 %7.0f  "
+           "p99 %7.0f  p999 %7.0f ns\n",
+           b.name.c_str(), threads, r.ns_per_op, r.allocs_per_op, r.p50_ns,
+           r.p99_ns, r.p999_ns);
+  } else {
+    printf("{\"name\": \"%s\", \"threads\": %d, \"iters\": %ld, "
+           "\"ns_per_op\": %.3f, \"allocs_per_op\": %.4f, \"p50_ns\": %.1f, "
+           "\"p99_ns\": %.1f, \"p999_ns\": %.1f, \"latency_threads\": 1}\n",
+           b.name.c_str(), threads, iters, r.ns_per_op, r.allocs_per_op,
+           r.p50_ns, r.p99_ns, r.p999_ns);
+  }
+  fflush(stdout);
+}
+
+bool Selected(const std::string& name) {
+  return name.find(flags.filter) != std::string::npos;
+}
+
+void RunAll(const std::vector<Benchmark>& benchmarks) {
+  for (size_t i = 0; i < benchmarks.size(); ++i) {
+    const Benchmark& b = benchmarks[i];
+    if (Selected(b.name)) Report(b, 1, Run(b, 1));
+  }
+}
+
+std::atomic<long> expensive_calls(0);
+
+std::string ExpensiveDump() {
+  expensive_calls.fetch_add(1, std::memory_order_relaxed);
+  return std::string(256, 'x');
+}
+
+std::vector<Benchmark> FilteredBenchmarks() {
+  std::vector<Benchmark> v;
+  Benchmark b;
+  b.output = kDevNull;
+  b.iters = 20 * 1000 * 1000;
+
+  b.name = "LOG(INFO) filtered";
+  b.op = [](long i) { LOG(INFO) << "value " << i << ExpensiveDump(); };
+  v.push_back(b);
+
+  b.name = "VLOG(2) filtered";
+  b.op = [](long i) { VLOG(2) << "value " << i << ExpensiveDump(); };
+  v.push_back(b);
+
+  b.name = "LOG_EVERY_N(WARNING, 1<<30) suppressed";
+  b.op = [](long i) { LOG_EVERY_N(WARNING, 1 << 30) << "value " << i; };
+  v.push_back(b);
+
+  b.name = "LOG_SAMPLED(WARNING, 1e-9) suppressed";
+  b.op = [](long i) { LOG_SAMPLED(WARNING, 1e-9) << "value " << i; };
+  v.push_back(b);
+
+  // The pre-guard behaviour: the message is built and then discarded in
+  // ~LogMessage(). The only case that may call ExpensiveDump().
+  b.name = "LogMessage(INFO) filtered in destructor";
+  b.iters = 1000 * 1000;
+  b.op = [](long i) {
+    ::vtz::internal::LogMessage(__FILE__, __LINE__, ::vtz::INFO).stream()
+        << "value " << i << ExpensiveDump();
+  };
+  v.push_back(b);
+  return v;
+}
+
+std::vector<Benchmark> EnabledBenchmarks() {
+  std::vector<Benchmark> v;
+  Benchmark b;
+  b.output = kDevNull;
+  b.iters = 1000 * 1000;
+
+  b.name = "LOG(INFO) literal /dev/null";
+  b.op = [](long) { LOG(INFO) << "request served"; };
+  v.push_back(b);
+
+  b.name = "LOG(INFO) literal /dev/null stats";
+  b.stats = true;
+  v.push_back(b);
+  b.stats = false;
+
+  b.name = "LOG(INFO) literal /dev/null coalesced";
+  b.coalescing = true;
+  v.push_back(b);
+  b.coalescing = false;
+
+  b.name = "LOG(INFO) literal file";
+  b.output = kFile;
+  v.push_back(b);
+  b.output = kDevNull;
+
+  b.name = "LOG(INFO) int /dev/null";
+  b.op = [](long i) { LOG(INFO) << "id " << i; };
+  v.push_back(b);
+
+  b.name = "LOG(INFO) int /dev/null coalescing";
+  b.coalescing = true;
+  v.push_back(b);
+  b.coalescing = false;
+
+  // Producer cost only; compression runs on the sink's own thread.
+  b.name = "LOG(INFO) int compressed file";
+  b.compressed = true;
+  v.push_back(b);
+  b.compressed = false;
+
+  b.name = "LOG(INFO) double /dev/null";
+  b.op = [](long i) { LOG(INFO) << "latency " << i * 0.001; };
+  v.push_back(b);
+
+  b.name = "LOG(INFO) string /dev/null";
+  b.op = [](long) {
+    static const std::string user = "someone@example.com";
+    LOG(INFO) << "user " << user;
+  };
+  v.push_back(b);
+
+  b.name = "LOG(INFO) int+double+string /dev/null";
+  b.op = [](long i) {
+    static const std::string user = "someone@example.com";
+    LOG(INFO) << "user " << user << " id " << i << " latency " << i * 0.001;
+  };
+  v.push_back(b);
+
+  b.name = "LOGF(INFO) int /dev/null";
+  b.op = [](long i) { LOGF(INFO, "id {}", i); };
+  v.push_back(b);
+
+  b.name = "LOGF(INFO) int+double+string /dev/null";
+  b.op = [](long i) {
+    static const std::string user = "someone@example.com";
+    LOGF(INFO, "user {} id {} latency {}", user, i, i * 0.001);
+  };
+  v.push_back(b);
+
+  b.name = "LOG(INFO).With() int+double+string text /dev/null";
+  b.op = [](long i) {
+    static const std::string user = "someone@example.com";
+    LOG(INFO).With("user", user).With("id", i).With("latency", i * 0.001)
+        << "served";
+  };
+  v.push_back(b);
+
+  b.name = "LOG(INFO).With() int+double+string json /dev/null";
+  b.encoder = vtz::JsonLogEncoder();
+  v.push_back(b);
+
+  b.name = "LOG(INFO).With() int+double+string logfmt /dev/null";
+  b.encoder = vtz::LogfmtLogEncoder();
+  v.push_back(b);
+  b.encoder = nullptr;
+
+  b.name = "LOG_BIN(INFO) int+double+string /dev/null";
+  b.op = [](long i) {
+    static const std::string user = "someone@example.com";
+    LOG_BIN(INFO, "user {} id {} latency {}", user, i, i * 0.001);
+  };
+  v.push_back(b);
+
+  b.iters = 100 * 1000;
+  b.name = "LOG(INFO) 32KB body string /dev/null";
+  b.op = [](long i) {
+    static const std::string body(32 * 1024, 'x');
+    LOG(INFO) << "request " << i << " body " << body;
+  };
+  v.push_back(b);
+
+  b.name = "LOG(INFO) 32KB body Payload /dev/null";
+  b.op = [](long i) {
+    static const std::string body(32 * 1024, 'x');
+    LOG(INFO) << "request " << i << " body "
+              << vtz::Payload(body.data(), body.size());
+  };
+  v.push_back(b);
+
+  b.name = "LOG(INFO) 32KB body Payload base64 /dev/null";
+  b.op = [](long i) {
+    static const std::string body(32 * 1024, 'x');
+    LOG(INFO) << "request " << i << " body "
+              << vtz::Payload(body.data(), body.size()).Base64();
+  };
+  v.push_back(b);
+
+  b.iters = 50 * 1000 * 1000;
+  b.name = "CHECK_EQ passing";
+  b.op = [](long i) {
+    volatile long a = i;
+    CHECK_EQ(a, i);
+  };
+  v.push_back(b);
+
+  b.name = "CHECK_NE passing";
+  b.op = [](long i) {
+    volatile long a = i;
+    CHECK_NE(a, i + 1);
+  };
+  v.push_back(b);
+
+  b.iters = 10 * 1000 * 1000;
+  b.name = "VTZ_TRACE_SCOPE off";
+  b.op = [](long) { VTZ_TRACE_SCOPE("bench"); };
+  v.push_back(b);
+
+  b.name = "VTZ_TRACE_SCOPE on";
+  b.tracing = true;
+  v.push_back(b);
+
+  b.name = "VTZ_TRACE_EVENT on";
+  b.op = [](long) { VTZ_TRACE_EVENT("bench"); };
+  v.push_back(b);
+  b.tracing = false;
+
+  // ~LogMessageFatal() aborts, so only the LogMessage base is torn down:
+  // this times construction plus emitting, flushing and writing an empty
+  // FATAL line, everything LOG(FATAL) does but abort().
+  b.iters = 1000 * 1000;
+  b.name = "LogMessageFatal empty record, no abort";
+  b.op = [](long) {
+    typedef ::vtz::internal::LogMessage Base;
+    typedef ::vtz::internal::LogMessageFatal Fatal;
+    alignas(Fatal) char storage[sizeof(Fatal)];
+    Fatal* msg = new (storage) Fatal(__FILE__, __LINE__);
+    msg->Base::~Base();
+  };
+  v.push_back(b);
+  return v;
+}
+
+// Discards its input, so that the std::ostream cases time formatting only.
+class NullStreamBuf : public std::streambuf {
+ protected:
+  int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+  std::streamsize xsputn(const char*, std::streamsize n) override {
+    return n;
+  }
+};
+
+// The formatting kernels of log_format.h against the std::ostream path
+// that LOG() << used before them.
+std::vector<Benchmark> FormatBenchmarks() {
+  static NullStreamBuf null_buf;
+  static std::ostream null_stream(&null_buf);
+  static char out[4096];
+  static unsigned char packet[256];
+  for (size_t i = 0; i < sizeof(packet); ++i) {
+    packet[i] = static_cast<unsigned char>(i * 37);
+  }
+
+  std::vector<Benchmark> v;
+  Benchmark b;
+  b.iters = 10 * 1000 * 1000;
+
+  b.name = "format int std::ostream";
+  b.op = [](long i) { null_stream << i * 7919; };
+  v.push_back(b);
+
+  b.name = "format int FormatInt64";
+  b.op = [](long i) { vtz::FormatInt64(out, i * 7919); };
+  v.push_back(b);
+
+  b.name = "format double std::ostream";
+  b.op = [](long i) { null_stream << i * 0.001; };
+  v.push_back(b);
+
+  b.name = "format double FormatDouble";
+  b.op = [](long i) { vtz::FormatDouble(out, i * 0.001); };
+  v.push_back(b);
+
+  b.name = "format pointer std::ostream";
+  b.op = [](long i) { null_stream << reinterpret_cast<void*>(i << 4); };
+  v.push_back(b);
+
+  b.name = "format pointer FormatHex64";
+  b.op = [](long i) {
+    vtz::FormatHex64(out, static_cast<vtz::uint64>(i << 4));
+  };
+  v.push_back(b);
+
+  b.iters = 200 * 1000;
+  b.name = "format 256B dump std::ostream hex";
+  b.op = [](long) {
+    null_stream << std::hex << std::setfill('0');
+    for (size_t i = 0; i < sizeof(packet); ++i) {
+      null_stream << std::setw(2) << static_cast<int>(packet[i]);
+    }
+    null_stream << std::dec;
+  };
+  v.push_back(b);
+
+  b.name = "format 256B dump HexDump";
+  b.op = [](long) { null_stream << vtz::HexDump(packet, sizeof(packet)); };
+  v.push_back(b);
+  return v;
+}
+
+void RunScaling(const Benchmark& b, int max_threads) {
+  for (int t = 1;; t *= 2) {
+    if (t > max_threads) t = max_threads;
+    Report(b, t, Run(b, t));
+    if (t == max_threads) break;
+  }
+}
+
+void RunThroughput() {
+  const int max_threads = flags.threads > 0 ? flags.threads : 64;
+  Benchmark b;
+  b.output = kDevNull;
+  b.iters = 200 * 1000;
+  b.op = [](long i) { LOG(INFO) << "id " << i << " payload " << i * 0.5; };
+
+  b.name = "throughput LOG(INFO) sync";
+  if (Selected(b.name)) RunScaling(b, max_threads);
+
+  b.name = "throughput LOG(INFO) async";
+  if (Selected(b.name)) {
+    vtz::StartAsyncLogging(vtz::AsyncLoggingOptions());
+    RunScaling(b, max_threads);
+    vtz::StopAsyncLogging();
+  }
+
+  b.name = "throughput LOG(INFO) sync file";
+  b.output = kFile;
+  if (Selected(b.name)) RunScaling(b, max_threads);
+
+  b.name = "throughput LOG(INFO) sharded file";
+  b.output = kDevNull;
+  b.sharded = true;
+  if (Selected(b.name)) RunScaling(b, max_threads);
+}
+
+// Collects records instead of writing them.
+class CaptureSink : public vtz::LogSink {
+ public:
+  void Send(int, const char* data, size_t size) override {
+    text.append(data, size);
+  }
+  std::string text;
+};
+
+// About "bytes" of log text from a mix of statements a server makes, with
+// ids, latencies and addresses that vary the way they do in real logs.
+std::string LogCorpus(size_t bytes) {
+  static const char* const kPaths[] = {"/api/v1/users", "/api/v1/orders",
+                                       "/api/v2/search", "/healthz",
+                                       "/static/app.js"};
+  static const char* const kHosts[] = {"db-17.internal", "cache-3.internal",
+                                       "auth.internal"};
+  CaptureSink capture;
+  capture.text.reserve(bytes + 4096);
+  vtz::AddLogSink(&capture);
+  vtz::SetStderrLogSeverity(vtz::NUM_SEVERITIES);
+  vtz::uint64 x = 88172645463325252ull;
+  for (long i = 0; capture.text.size() < bytes; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    const int kind = static_cast<int>(x % 100);
+    if (kind < 70) {
+      LOG(INFO) << "GET " << kPaths[x % 5] << "/" << (x >> 20) % 1000000
+                << " status=" << (kind < 67 ? 200 : 404)
+                << " latency_ms=" << ((x >> 8) % 4000) * 0.01
+                << " bytes=" << (x >> 12) % 50000 << " client=10.0."
+                << (x >> 24) % 256 << "." << (x >> 32) % 256;
+    } else if (kind < 85) {
+      LOGF(INFO, "cache {} hit_ratio={:.3} evictions={}",
+           kHosts[x % 3], ((x >> 16) % 1000) / 1000.0,
+           static_cast<int>((x >> 40) % 100));
+    } else if (kind < 97) {
+      LOG(WARNING) << "slow query on shard " << (x >> 10) % 64 << ": "
+                   << (x >> 20) % 5000 << " ms, rows=" << (x >> 30) % 100000
+                   << " request_id=" << std::hex << (x >> 4) << std::dec;
+    } else {
+      LOG(ERROR) << "upstream " << kHosts[x % 3]
+                 << " connect failed: Connection refused (errno 111), retry "
+                 << i % 5 + 1 << "/5";
+    }
+  }
+  vtz::RemoveLogSink(&capture);
+  vtz::SetStderrLogSeverity(vtz::INFO);
+  return capture.text;
+}
+
+// Ratio and speed of the CompressedLogSink codecs on LogCorpus(), one
+// line per codec.
+void RunCompression() {
+  const char* const kName[] = {nullptr, "compress lz4 256KiB blocks",
+                               "compress zstd 256KiB blocks"};
+  std::vector<vtz::LogCompression> codecs(1, vtz::kLogCompressionLz4);
+  if (vtz::ZstdLogCompressionAvailable()) {
+    codecs.push_back(vtz::kLogCompressionZstd);
+  }
+  bool corpus_built = false;
+  std::string corpus;
+  const size_t kBlock = 256 * 1024;
+  for (size_t c = 0; c < codecs.size(); ++c) {
+    if (!Selected(kName[codecs[c]])) continue;
+    if (!corpus_built) {
+      corpus = LogCorpus(32 << 20);
+      corpus_built = true;
+    }
+    vtz::internal::LogBlockCompressor compressor(codecs[c], 3);
+    std::vector<std::string> blocks((corpus.size() + kBlock - 1) / kBlock);
+    // Best of three passes each way.
+    double compress_s = 1e9;
+    double decompress_s = 1e9;
+    size_t compressed = 0;
+    bool ok = true;
+    std::string text;
+    std::string error;
+    for (int pass = 0; pass < 3; ++pass) {
+      Clock::time_point t0 = Clock::now();
+      compressed = 0;
+      for (size_t i = 0; i < blocks.size(); ++i) {
+        const size_t n = std::min(kBlock, corpus.size() - i * kBlock);
+        compressor.Compress(corpus.data() + i * kBlock, n, &blocks[i]);
+        compressed += blocks[i].size();
+      }
+      Clock::time_point t1 = Clock::now();
+      for (size_t i = 0; i < blocks.size(); ++i) {
+        vtz::internal::LogBlockHeader header;
+        memcpy(&header, blocks[i].data(), sizeof(header));
+        ok = vtz::internal::DecodeLogBlock(
+                 header, blocks[i].data() + sizeof(header), &text, &error) &&
+             ok;
+        if (pass == 0) {
+          ok = ok && text.compare(0, text.size(), corpus, i * kBlock,
+                                  text.size()) == 0;
+        }
+      }
+      Clock::time_point t2 = Clock::now();
+      compress_s = std::min(
+          compress_s, std::chrono::duration<double>(t1 - t0).count());
+      decompress_s = std::min(
+          decompress_s, std::chrono::duration<double>(t2 - t1).count());
+    }
+    const double mb = corpus.size() / 1e6;
+    const double ratio = static_cast<double>(corpus.size()) / compressed;
+    if (flags.text) {
+      printf("%-42s %6.2fx  compress %7.1f MB/s  decompress %7.1f MB/s%s\n",
+             kName[codecs[c]], ratio, mb / compress_s, mb / decompress_s,
+             ok ? "" : "  ROUND TRIP FAILED");
+    } else {
+      printf("{\"name\": \"%s\", \"raw_bytes\": %zu, "
+             "\"compressed_bytes\": %zu, \"ratio\": %.3f, "
+             "\"compress_mb_per_s\": %.1f, \"decompress_mb_per_s\": %.1f, "
+             "\"round_trip_ok\": %s}\n",
+             kName[codecs[c]], corpus.size(), compressed, ratio,
+             mb / compress_s, mb / decompress_s, ok ? "true" : "false");
+    }
+    fflush(stdout);
+  }
+}
+
+// An IndexedLogFile query for ERROR and above from this file in the middle
+// tenth of a LogCorpus() file, first on the file alone, which indexes it in
+// memory, and then through its saved index.
+void RunQuery() {
+  const char* const kNames[] = {"query ERROR+ file 10% window full scan",
+                                "query ERROR+ file 10% window indexed"};
+  if (!Selected(kNames[0]) && !Selected(kNames[1])) return;
+  const std::string path = flags.out_file + ".q";
+  vtz::LogQuery query;
+  query.min_severity = vtz::ERROR;
+  query.file = "logging_bench.cc";
+  {
+    const std::string corpus = LogCorpus(64 << 20);
+    unlink((path + ".idx").c_str());
+    FILE* out = fopen(path.c_str(), "wb");
+    if (out == nullptr) return;
+    fwrite(corpus.data(), 1, corpus.size(), out);
+    fclose(out);
+    vtz::LogRecordPrefix first, last;
+    const size_t last_line = corpus.rfind('\n', corpus.size() - 2) + 1;
+    vtz::ParseLogRecordPrefix(corpus.data(), corpus.size(), &first);
+    vtz::ParseLogRecordPrefix(corpus.data() + last_line,
+                              corpus.size() - last_line, &last);
+    const vtz::int64 span = last.micros - first.micros;
+    query.begin_micros = first.micros + span * 45 / 100;
+    query.end_micros = first.micros + span * 55 / 100;
+  }
+  for (int indexed = 0; indexed < 2; ++indexed) {
+    if (indexed == 1) {
+      std::string error;
+      vtz::IndexedLogFile* file =
+          vtz::IndexedLogFile::Open(path, false, &error);
+      if (file == nullptr || !file->SaveIndex(&error)) return;
+      delete file;
+    }
+    if (!Selected(kNames[indexed])) continue;
+    double best_ms = 1e9;
+    vtz::LogQueryStats stats;
+    for (int pass = 0; pass < 3; ++pass) {
+      const Clock::time_point t0 = Clock::now();
+      std::string error;
+      vtz::IndexedLogFile* file =
+          vtz::IndexedLogFile::Open(path, indexed == 1, &error);
+      if (file == nullptr) return;
+      stats = vtz::LogQueryStats();
+      file->Query(query, [](const char*, size_t) {}, &stats);
+      delete file;
+      best_ms = std::min(best_ms, std::chrono::duration<double, std::milli>(
+                                      Clock::now() - t0).count());
+    }
+    if (flags.text) {
+      printf("%-42s %9.2f ms  read %6.2f of %6.2f MB  %llu records\n",
+             kNames[indexed], best_ms, stats.bytes_read / 1e6,
+             stats.bytes / 1e6, static_cast<unsigned long long>(stats.records));
+    } else {
+      printf("{\"name\": \"%s\", \"ms\": %.3f, \"bytes\": %llu, "
+             "\"bytes_read\": %llu, \"records\": %llu}\n",
+             kNames[indexed], best_ms,
+             static_cast<unsigned long long>(stats.bytes),
+             static_cast<unsigned long long>(stats.bytes_read),
+             static_cast<unsigned long long>(stats.records));
+    }
+    fflush(stdout);
+  }
+}
+
+void ParseFlags(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--text") {
+      flags.text = true;
+    } else if (arg.compare(0, 9, "--filter=") == 0) {
+      flags.filter = arg.substr(9);
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      flags.threads = atoi(arg.c_str() + 10);
+    } else if (arg.compare(0, 8, "--iters=") == 0) {
+      flags.iters = atol(arg.c_str() + 8);
+    } else if (arg.compare(0, 11, "--out_file=") == 0) {
+      flags.out_file = arg.substr(11);
+    } else {
+      fprintf(stderr, "unknown flag %s\n", arg.c_str());
+      exit(2);
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  ParseFlags(argc, argv);
+
+  vtz::SetMinLogLevel(vtz::WARNING);
+  RunAll(FilteredBenchmarks());
+
+  vtz::SetMinLogLevel(vtz::INFO);
+  vtz::OpenBinaryLog("/dev/null");
+  RunAll(EnabledBenchmarks());
+  RunAll(FormatBenchmarks());
+  RunThroughput();
+  RunCompression();
+  RunQuery();
+  vtz::CloseBinaryLog();
+  return 0;
+}
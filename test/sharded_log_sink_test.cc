@@ -0,0 +1,164 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Merges hand-written shard files whose timestamps interleave, tie, run
+// backwards within a shard, skip a sequence number and end in a torn
+// record, with ShardedLogReader and with vtz_logmerge, whose path is the
+// first argument.
+//
+//   vtz_logger_sharded_log_sink_test path/to/vtz_logmerge
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "common/logging.h"
+#include "common/sharded_log_sink.h"
+
+namespace {
+
+using vtz::uint32;
+using vtz::uint64;
+
+// The layout sharded_log_sink.cc writes.
+struct ShardFileHeader {
+  char magic[8];
+  uint32 version;
+  uint32 shard;
+  uint32 num_shards;
+  uint32 reserved;
+};
+
+struct ShardRecordHeader {
+  uint32 size;
+  uint32 severity;
+  uint64 nanos;
+  uint64 sequence;
+};
+
+struct Record {
+  uint64 nanos;
+  uint64 sequence;
+  const char* text;
+};
+
+const int kNumShards = 3;
+
+// Writes shard "shard" of "path" with "records", then "tail" as is.
+void WriteShard(const std::string& path, int shard,
+                const std::vector<Record>& records, const std::string& tail) {
+  std::string data;
+  ShardFileHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "VTZSHRD1", sizeof(h.magic));
+  h.version = 1;
+  h.shard = shard;
+  h.num_shards = kNumShards;
+  data.append(reinterpret_cast<const char*>(&h), sizeof(h));
+  for (size_t i = 0; i < records.size(); ++i) {
+    ShardRecordHeader r;
+    r.size = static_cast<uint32>(strlen(records[i].text));
+    r.severity = vtz::INFO;
+    r.nanos = records[i].nanos;
+    r.sequence = records[i].sequence;
+    data.append(reinterpret_cast<const char*>(&r), sizeof(r));
+    data.append(records[i].text);
+  }
+  data += tail;
+  const std::string shard_path = path + ".shard-" + std::to_string(shard);
+  FILE* f = fopen(shard_path.c_str(), "wb");
+  CHECK(f != nullptr) << shard_path;
+  CHECK_EQ(fwrite(data.data(), 1, data.size(), f), data.size());
+  fclose(f);
+}
+
+// A record header promising more text than follows it.
+std::string TornRecord() {
+  ShardRecordHeader r;
+  r.size = 100;
+  r.severity = vtz::INFO;
+  r.nanos = 1;
+  r.sequence = 9;
+  return std::string(reinterpret_cast<const char*>(&r), sizeof(r)) +
+         "torn";
+}
+
+// vtz_logmerge's stdout and stderr for "args"; it must exit 0.
+std::string Merge(const std::string& logmerge, const std::string& args) {
+  const std::string command = logmerge + " " + args + " 2>&1";
+  FILE* p = popen(command.c_str(), "r");
+  CHECK(p != nullptr);
+  std::string out;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), p)) > 0) out.append(buf, n);
+  const int status = pclose(p);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0) << command;
+  return out;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  CHECK_EQ(argc, 2) << "usage: " << argv[0] << " path/to/vtz_logmerge";
+  const std::string path =
+      "/tmp/vtz_sharded_log_sink_test." + std::to_string(getpid());
+
+  // Shard 0 skips sequence 2 and ends inside a record's text; a1 and b1
+  // tie, so the lower shard goes first. Shard 1 goes back in time at b2,
+  // which still follows b1, and ends inside a record header.
+  WriteShard(path, 0,
+             {{10, 0, "a0\n"}, {40, 1, "a1\n"}, {50, 3, "a3\n"}},
+             TornRecord());
+  WriteShard(path, 1,
+             {{20, 0, "b0\n"}, {40, 1, "b1\n"}, {35, 2, "b2\n"},
+              {60, 3, "b3\n"}},
+             TornRecord().substr(0, 10));
+  WriteShard(path, 2, {{5, 0, "c0\n"}, {45, 1, "c1\n"}}, "");
+  const char* const kMerged = "c0\na0\nb0\na1\nb1\nb2\nc1\na3\nb3\n";
+
+  std::string error;
+  vtz::ShardedLogReader* reader = vtz::ShardedLogReader::Open(path, &error);
+  CHECK(reader != nullptr) << error;
+  std::string merged;
+  std::vector<int> shards;
+  vtz::ShardedLogRecord r;
+  while (reader->Next(&r)) {
+    merged.append(r.data, r.size);
+    shards.push_back(r.shard);
+  }
+  CHECK_EQ(merged, kMerged);
+  CHECK(shards == std::vector<int>({2, 0, 1, 0, 1, 1, 2, 0, 1}));
+  CHECK_EQ(reader->missing(), 1u);
+  delete reader;
+
+  const std::string logmerge = argv[1];
+  CHECK_EQ(Merge(logmerge, path), kMerged);
+  CHECK_EQ(Merge(logmerge, "--keys --stats " + path),
+           "5 2 0 c0\n10 0 0 a0\n20 1 0 b0\n40 0 1 a1\n40 1 1 b1\n"
+           "35 1 2 b2\n45 2 1 c1\n50 0 3 a3\n60 1 3 b3\n"
+           "vtz_logmerge: 9 records, 1 missing\n");
+  // Some of the shards only.
+  CHECK_EQ(Merge(logmerge, path + ".shard-2 " + path + ".shard-0"),
+           "c0\na0\na1\nc1\na3\n");
+
+  for (int i = 0; i < kNumShards; ++i) {
+    unlink((path + ".shard-" + std::to_string(i)).c_str());
+  }
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,295 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Runs vtz_logd, whose path is the first argument, with four rings and
+// forks writers through one SharedMemoryLogSink created before the forks.
+// The collector is stopped while they write, so that what lands in each
+// ring is exact: two writers exit normally, one overfills its ring, one is
+// killed with a record reserved but not committed, and one more finds
+// every ring taken. Once the collector runs again, the merged output, the
+// per-process reports and the reclaimed rings are checked, and a last
+// writer must get a ring.
+//
+//   vtz_logger_shm_log_sink_test path/to/vtz_logd
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include "common/logging.h"
+#include "common/shm_log_private.h"
+#include "common/shm_log_sink.h"
+
+namespace {
+
+using vtz::uint32;
+using vtz::uint64;
+using vtz::internal::ShmLogHeader;
+using vtz::internal::ShmLogRecordHeader;
+using vtz::internal::ShmLogRing;
+
+const int kNumRings = 4;
+const int kRingBytes = 65536;
+// Every line is kLineBytes long, so that a record takes kRecordBytes and
+// the ring holds exactly kRingBytes / kRecordBytes of them.
+const size_t kLineBytes = 48;
+const uint64 kRecordBytes = 64;
+const int kRingRecords = kRingBytes / kRecordBytes;
+
+std::string Line(char writer, int seq) {
+  char buf[kLineBytes + 1];
+  snprintf(buf, sizeof(buf), "%c %05d %-*s\n", writer, seq,
+           static_cast<int>(kLineBytes) - 9, "shm_log_sink_test");
+  return std::string(buf, kLineBytes);
+}
+
+void Write(vtz::SharedMemoryLogSink* sink, char writer, int first, int n) {
+  for (int i = first; i < first + n; ++i) {
+    const std::string line = Line(writer, i);
+    sink->Send(vtz::INFO, line.data(), line.size());
+  }
+}
+
+std::string ReadFile(const std::string& path) {
+  std::string out;
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == nullptr) return out;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) out.append(buf, n);
+  fclose(f);
+  return out;
+}
+
+void SleepMillis(int ms) {
+  struct timespec ts = {0, ms * 1000000L};
+  nanosleep(&ts, nullptr);
+}
+
+// Reaps "pid", which must exit 0.
+void ExpectSuccess(pid_t pid) {
+  int status;
+  CHECK_EQ(waitpid(pid, &status, 0), pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "status " << status;
+}
+
+// Forks a writer that sends "n" lines tagged "writer" and exits without
+// closing the sink, and reaps it. Returns its pid.
+pid_t RunWriter(vtz::SharedMemoryLogSink* sink, char writer, int n,
+                uint64 expect_dropped) {
+  const pid_t pid = fork();
+  CHECK_GE(pid, 0);
+  if (pid == 0) {
+    Write(sink, writer, 0, n);
+    CHECK_EQ(sink->dropped(), expect_dropped);
+    _exit(0);
+  }
+  ExpectSuccess(pid);
+  return pid;
+}
+
+// The ring "pid" owns in "header"; nullptr if none.
+ShmLogRing* RingOf(ShmLogHeader* header, pid_t pid) {
+  for (uint32 i = 0; i < header->num_rings; ++i) {
+    ShmLogRing* ring = vtz::internal::ShmLogRingAt(header, i);
+    if (ring->owner_pid.load() == pid) return ring;
+  }
+  return nullptr;
+}
+
+// Forks a writer that commits "n" lines, reserves one more record and
+// fills in all but its header word, the state a process killed inside
+// Send() leaves, then sends "after" more lines, which can never be read,
+// and waits to be killed. Returns its pid once it has been.
+pid_t RunKilledWriter(vtz::SharedMemoryLogSink* sink, ShmLogHeader* header,
+                      int n, int after) {
+  int fds[2];
+  CHECK_EQ(pipe(fds), 0);
+  const pid_t pid = fork();
+  CHECK_GE(pid, 0);
+  if (pid == 0) {
+    close(fds[0]);
+    Write(sink, 'D', 0, n);
+    ShmLogRing* ring = RingOf(header, getpid());
+    CHECK(ring != nullptr);
+    const uint64 head = ring->head.load();
+    ring->head.store(head + kRecordBytes);
+    ShmLogRecordHeader* record = reinterpret_cast<ShmLogRecordHeader*>(
+        ring->data() + (head & (kRingBytes - 1)));
+    const std::string line = Line('D', n);
+    record->text_size = static_cast<uint32>(line.size());
+    memcpy(reinterpret_cast<char*>(record) + sizeof(*record), line.data(),
+           line.size());
+    Write(sink, 'D', n + 1, after);
+    CHECK_EQ(write(fds[1], "k", 1), 1);
+    for (;;) pause();
+  }
+  close(fds[1]);
+  char c;
+  CHECK_EQ(read(fds[0], &c, 1), 1);
+  close(fds[0]);
+  CHECK_EQ(kill(pid, SIGKILL), 0);
+  int status;
+  CHECK_EQ(waitpid(pid, &status, 0), pid);
+  CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+  return pid;
+}
+
+bool Contains(const std::string& s, const std::string& part) {
+  return s.find(part) != std::string::npos;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  CHECK_EQ(argc, 2) << "usage: " << argv[0] << " path/to/vtz_logd";
+  const std::string name =
+      "/vtz_shm_log_sink_test." + std::to_string(getpid());
+  const std::string path = "/tmp" + name;
+  const std::string output = path + ".log";
+  const std::string errors = path + ".err";
+  shm_unlink(name.c_str());
+  unlink(output.c_str());
+
+  const pid_t logd = fork();
+  CHECK_GE(logd, 0);
+  if (logd == 0) {
+    // A failed CHECK must not leave the collector running, holding on to
+    // ctest's output.
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    const int fd = open(errors.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) {
+      _exit(127);
+    }
+    const std::string name_flag = "--name=" + name;
+    const std::string output_flag = "--output=" + output;
+    const std::string rings_flag = "--rings=" + std::to_string(kNumRings);
+    const std::string bytes_flag =
+        "--ring_bytes=" + std::to_string(kRingBytes);
+    execl(argv[1], argv[1], name_flag.c_str(), output_flag.c_str(),
+          rings_flag.c_str(), bytes_flag.c_str(), "--stats_seconds=0",
+          static_cast<char*>(nullptr));
+    _exit(127);
+  }
+
+  // The segment is usable once vtz_logd has written its magic.
+  vtz::SharedMemoryLogSinkOptions options;
+  options.name = name;
+  vtz::SharedMemoryLogSink* sink = nullptr;
+  for (int i = 0; i < 1000 && sink == nullptr; ++i) {
+    sink = vtz::SharedMemoryLogSink::Create(options);
+    if (sink == nullptr) SleepMillis(10);
+  }
+  CHECK(sink != nullptr) << "vtz_logd did not create " << name;
+  const int fd = shm_open(name.c_str(), O_RDWR, 0);
+  CHECK_GE(fd, 0);
+  const size_t size = vtz::internal::ShmLogSegmentBytes(kNumRings, kRingBytes);
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  CHECK(base != MAP_FAILED);
+  close(fd);
+  ShmLogHeader* header = static_cast<ShmLogHeader*>(base);
+  CHECK_EQ(header->num_rings, static_cast<uint32>(kNumRings));
+  CHECK_EQ(header->ring_bytes, static_cast<uint64>(kRingBytes));
+  CHECK_EQ(vtz::internal::ShmRecordBytes(kLineBytes), kRecordBytes);
+
+  // Nothing is drained or reclaimed until the collector continues.
+  CHECK_EQ(kill(logd, SIGSTOP), 0);
+  int status;
+  CHECK_EQ(waitpid(logd, &status, WUNTRACED), logd);
+  CHECK(WIFSTOPPED(status));
+
+  const pid_t a = RunWriter(sink, 'A', 500, 0);
+  const pid_t b = RunWriter(sink, 'B', 500, 0);
+  const int overfill = 476;
+  const pid_t c = RunWriter(sink, 'C', kRingRecords + overfill, overfill);
+  const pid_t d = RunKilledWriter(sink, header, 100, 3);
+  // Every ring still belongs to a, b, c or d.
+  RunWriter(sink, 'E', 1, 1);
+  CHECK_EQ(header->unclaimed_drops.load(), 1u);
+
+  CHECK_EQ(kill(logd, SIGCONT), 0);
+  bool reclaimed = false;
+  for (int i = 0; i < 1000 && !reclaimed; ++i) {
+    reclaimed = true;
+    for (int r = 0; r < kNumRings; ++r) {
+      ShmLogRing* ring = vtz::internal::ShmLogRingAt(header, r);
+      if (ring->owner_pid.load() != 0) reclaimed = false;
+    }
+    if (!reclaimed) SleepMillis(10);
+  }
+  CHECK(reclaimed) << "rings of exited processes were not freed";
+  for (int r = 0; r < kNumRings; ++r) {
+    ShmLogRing* ring = vtz::internal::ShmLogRingAt(header, r);
+    CHECK_EQ(ring->head.load(), 0u);
+    CHECK_EQ(ring->tail.load(), 0u);
+    CHECK_EQ(ring->dropped.load(), 0u);
+  }
+  // A freed ring goes to the next process.
+  RunWriter(sink, 'F', 10, 0);
+
+  CHECK_EQ(kill(logd, SIGTERM), 0);
+  CHECK_EQ(waitpid(logd, &status, 0), logd);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "status " << status;
+
+  // The writers ran one after another, so merging by time puts each
+  // writer's lines after the previous writer's; d's end at the unfinished
+  // record.
+  std::string expected;
+  for (int i = 0; i < 500; ++i) expected += Line('A', i);
+  for (int i = 0; i < 500; ++i) expected += Line('B', i);
+  for (int i = 0; i < kRingRecords; ++i) expected += Line('C', i);
+  for (int i = 0; i < 100; ++i) expected += Line('D', i);
+  for (int i = 0; i < 10; ++i) expected += Line('F', i);
+  const std::string merged = ReadFile(output);
+  CHECK_EQ(merged.size(), expected.size());
+  CHECK(merged == expected) << "merged output is out of order";
+
+  const std::string report = ReadFile(errors);
+  const std::string prefix = "vtz_logd: pid ";
+  CHECK(Contains(report, prefix + std::to_string(a) +
+                             " exited: 500 records written, 0 dropped\n"))
+      << report;
+  CHECK(Contains(report, prefix + std::to_string(b) +
+                             " exited: 500 records written, 0 dropped\n"))
+      << report;
+  CHECK(Contains(report, prefix + std::to_string(c) + " exited: " +
+                             std::to_string(kRingRecords) +
+                             " records written, " + std::to_string(overfill) +
+                             " dropped\n"))
+      << report;
+  CHECK(Contains(report, prefix + std::to_string(d) +
+                             " exited: 100 records written, 0 dropped, " +
+                             std::to_string(4 * kRecordBytes) +
+                             " bytes discarded after an unfinished record\n"))
+      << report;
+  CHECK(Contains(report, "vtz_logd: 1 records dropped by processes that "
+                         "found no free ring\n"))
+      << report;
+
+  delete sink;
+  munmap(base, size);
+  shm_unlink(name.c_str());
+  unlink(output.c_str());
+  unlink(errors.c_str());
+  printf("PASS\n");
+  return 0;
+}
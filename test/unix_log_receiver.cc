@@ -0,0 +1,182 @@
+/* Copyright 2018 Hobum (Vincent) Kwon. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A stand-in for a log agent, to try UnixSocketLogSink against:
+//
+//   vtz_unix_log_receiver --path=PATH [--type=dgram|seqpacket] [--count]
+//                         [--exit_after=N]
+//
+// Binds PATH ("@name" for the abstract namespace), receives records with
+// recvmmsg() and writes them to stdout, or with --count only counts them.
+// Exits after N records, or on SIGINT or SIGTERM, and then reports on
+// stderr how many records and recvmmsg() calls there were.
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+const int kBatch = 64;
+const size_t kMaxRecordBytes = 256 * 1024;
+
+volatile sig_atomic_t stop_requested = 0;
+
+void RequestStop(int) { stop_requested = 1; }
+
+struct Flags {
+  Flags() : seqpacket(false), count(false), exit_after(0) {}
+  std::string path;
+  bool seqpacket;
+  bool count;
+  unsigned long long exit_after;
+};
+
+bool ParseFlags(int argc, char** argv, Flags* flags) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg.compare(0, 7, "--path=") == 0) {
+      flags->path = arg.substr(7);
+    } else if (arg == "--type=dgram") {
+      flags->seqpacket = false;
+    } else if (arg == "--type=seqpacket") {
+      flags->seqpacket = true;
+    } else if (arg == "--count") {
+      flags->count = true;
+    } else if (arg.compare(0, 13, "--exit_after=") == 0) {
+      flags->exit_after = strtoull(arg.c_str() + 13, nullptr, 10);
+    } else {
+      fprintf(stderr, "vtz_unix_log_receiver: unknown argument %s\n",
+              arg.c_str());
+      return false;
+    }
+  }
+  return !flags->path.empty() && flags->path.size() < 100;
+}
+
+int Bind(const Flags& flags) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, flags.path.data(), flags.path.size());
+  socklen_t len = offsetof(struct sockaddr_un, sun_path) + flags.path.size();
+  if (flags.path[0] == '@') {
+    addr.sun_path[0] = '\0';
+  } else {
+    ++len;
+    unlink(flags.path.c_str());
+  }
+  const int fd = socket(
+      AF_UNIX, (flags.seqpacket ? SOCK_SEQPACKET : SOCK_DGRAM) | SOCK_CLOEXEC,
+      0);
+  if (fd < 0 ||
+      bind(fd, reinterpret_cast<struct sockaddr*>(&addr), len) != 0 ||
+      (flags.seqpacket && listen(fd, 64) != 0)) {
+    fprintf(stderr, "vtz_unix_log_receiver: %s: %s\n", flags.path.c_str(),
+            strerror(errno));
+    return -1;
+  }
+  return fd;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) {
+    fprintf(stderr, "usage: vtz_unix_log_receiver --path=PATH "
+            "[--type=dgram|seqpacket] [--count] [--exit_after=N]\n");
+    return 2;
+  }
+  const int listen_fd = Bind(flags);
+  if (listen_fd < 0) return 1;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = RequestStop;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  std::vector<char> buf(kBatch * kMaxRecordBytes);
+  struct mmsghdr msgs[kBatch];
+  struct iovec iov[kBatch];
+  // A datagram socket receives on the bound fd; a seqpacket one on each
+  // accepted connection.
+  std::vector<struct pollfd> fds(1);
+  fds[0].fd = listen_fd;
+  fds[0].events = POLLIN;
+  unsigned long long records = 0;
+  unsigned long long calls = 0;
+  while (!stop_requested &&
+         (flags.exit_after == 0 || records < flags.exit_after)) {
+    if (poll(fds.data(), fds.size(), 200) <= 0) continue;
+    for (size_t i = 0; i < fds.size(); ++i) {
+      if (fds[i].revents == 0) continue;
+      if (flags.seqpacket && i == 0) {
+        const int c = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (c >= 0) {
+          struct pollfd p;
+          p.fd = c;
+          p.events = POLLIN;
+          p.revents = 0;
+          fds.push_back(p);
+        }
+        continue;
+      }
+      for (int k = 0; k < kBatch; ++k) {
+        iov[k].iov_base = &buf[k * kMaxRecordBytes];
+        iov[k].iov_len = kMaxRecordBytes;
+        memset(&msgs[k], 0, sizeof(msgs[k]));
+        msgs[k].msg_hdr.msg_iov = &iov[k];
+        msgs[k].msg_hdr.msg_iovlen = 1;
+      }
+      int n = recvmmsg(fds[i].fd, msgs, kBatch, MSG_DONTWAIT, nullptr);
+      // A seqpacket peer that went away reads as an empty message.
+      bool closed = n < 0 && errno != EAGAIN && errno != EINTR;
+      for (int k = 0; k < n; ++k) {
+        if (msgs[k].msg_len == 0) {
+          n = k;
+          closed = true;
+        }
+      }
+      if (closed && i > 0) {
+        close(fds[i].fd);
+        fds.erase(fds.begin() + i);
+        --i;
+      }
+      if (n <= 0) continue;
+      ++calls;
+      records += n;
+      if (!flags.count) {
+        for (int k = 0; k < n; ++k) {
+          fwrite(iov[k].iov_base, 1, msgs[k].msg_len, stdout);
+        }
+      }
+    }
+  }
+  fflush(stdout);
+  fprintf(stderr, "vtz_unix_log_receiver: %llu records in %llu recvmmsg "
+          "calls\n", records, calls);
+  if (flags.path[0] != '@') unlink(flags.path.c_str());
+  return 0;
+}